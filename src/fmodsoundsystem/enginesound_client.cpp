@@ -22,10 +22,17 @@
 #include "mouthinfo.h"
 #include <utllinkedlist.h>
 #include "autodsp.h"
+#include "fmod_outputstream.h"
+#include "sound_metadata.h"
+#include "sound_codecpolicy.h"
+#include <networkstringtabledefs.h>
+#include <utldict.h>
+#include <utlmap.h>
 
 constexpr float SourceUnitsPerMeter = 52.49344f;
 
 ConVar channel_steal_max( "nsnd_channel_steal_max", "1", FCVAR_NONE, "Number of channels that are longer than nsnd_channel_steal_length that we allow." );
+ConVar precache_wait_time( "nsnd_precache_wait_time", "10", FCVAR_NONE, "How long to hold the loading screen for sounds precached during level load to finish decoding." );
 ConVar channel_steal_length( "nsnd_channel_steal_length", "0.8", FCVAR_NONE, "Is a sound is longer than this it will be stolen." );
 
 struct SoundChannel
@@ -44,8 +51,9 @@ struct SoundChannel
 class CEngineSoundClient : public IFMODEngineSound, public ISoundMessageHandler
 {
 public:
-	CEngineSoundClient()
+	CEngineSoundClient() : m_channelLookup( DefLessFunc( int ) )
 	{
+		m_bLevelPrecachePending = false;
 	}
 
 	// ISoundMessageHandler
@@ -77,6 +85,7 @@ public:
 		m_engineClient = (IVEngineClient *) appSystemFactory( VENGINE_CLIENT_INTERFACE_VERSION, NULL );
 		m_oldEngineSound = (IEngineSound *) appSystemFactory( IENGINESOUND_CLIENT_INTERFACE_VERSION, NULL );
 		m_entitylist = (IClientEntityList *) gameFactory( VCLIENTENTITYLIST_INTERFACE_VERSION, NULL );
+		m_networkStringTables = (INetworkStringTableContainer *) appSystemFactory( INTERFACENAME_NETWORKSTRINGTABLECLIENT, NULL );
 		m_pGlobals = globals;
 		m_autoDSP.Init( appSystemFactory, physicsFactory );
 
@@ -97,9 +106,14 @@ public:
 			ConMsg,
 			soundBankPaths, ARRAYSIZE( soundBankPaths )
 		);
+
+		g_SoundMetadata.Load();
+		g_SoundCodecPolicy.Init();
 	}
 	virtual void Shutdown()
 	{
+		m_outputStreams.PurgeAndDeleteElements();
+		g_SoundCodecPolicy.Shutdown();
 		g_pFMODAudioEngine->Shutdown();
 
 		ConVar_Unregister();
@@ -111,7 +125,7 @@ public:
 	// Client only
 	virtual void Update( float frametime )
 	{
-		CUtlVector<int> vecRemoveChannels;
+		m_removeChannels.RemoveAll();
 		FOR_EACH_LL( m_activeChannels, i )
 		{
 			SoundChannel &channel = m_activeChannels.Element( i );
@@ -122,17 +136,11 @@ public:
 				if ( !pSpeaker )
 				{
 					g_pFMODAudioEngine->StopChannel( channel.id );
-					vecRemoveChannels.AddToTail( i );
+					m_removeChannels.AddToTail( i );
 					continue;
 				}
 			}
 
-			if ( !g_pFMODAudioEngine->IsChannelPlaying( channel.id ) )
-			{
-				vecRemoveChannels.AddToTail( i );
-				continue;
-			}
-
 			// don't spatialize world sounds
 			if ( channel.entityIndex == SOUND_FROM_WORLD )
 				continue;
@@ -160,16 +168,12 @@ public:
 			else if ( channel.sourceChannelType != CHAN_STATIC )
 			{
 				g_pFMODAudioEngine->StopChannel( channel.id );
-				vecRemoveChannels.AddToTail( i );
+				m_removeChannels.AddToTail( i );
 			}
 		}
 
-		FOR_EACH_VEC( vecRemoveChannels, i )
-		{
-			// TODO perform clean-up
-			m_activeChannels.Remove( vecRemoveChannels[i] );
-			continue;
-		}
+		FOR_EACH_VEC( m_removeChannels, i )
+			RemoveChannel( m_removeChannels[i] );
 
 		if ( m_engineClient->IsConnected() )
 		{
@@ -181,7 +185,24 @@ public:
 			g_pFMODAudioEngine->UpdateDynamicReverb( roomType, reflectivity, spaceSize );
 		}
 
+		FOR_EACH_VEC( m_outputStreams, i )
+			m_outputStreams[i]->Update();
+
 		g_pFMODAudioEngine->Update( frametime );
+
+		// FMOD tells us which channels ended, so we don't have to ask every channel every frame
+		int nFinished = 0;
+		const int *pFinished = g_pFMODAudioEngine->GetFinishedChannels( nFinished );
+		for ( int i = 0; i < nFinished; ++i )
+		{
+			unsigned short lookup = m_channelLookup.Find( pFinished[i] );
+			if ( m_channelLookup.IsValidIndex( lookup ) )
+				RemoveChannel( m_channelLookup[lookup] );
+		}
+
+		// anything that didn't finish during the loading screen reports once it's done
+		if ( m_bLevelPrecachePending && g_pFMODAudioEngine->UpdatePendingLoads() == 0 )
+			FinishLevelPrecache();
 	}
 
 	virtual void OnConnectedToServer()
@@ -189,6 +210,22 @@ public:
 		INetChannelInfo *ni = m_engineClient->GetNetChannelInfo();
 		INetChannel *chan = (INetChannel *) ni;
 		REGISTER_NET_MSG( SoundMessage );
+
+		BeginLevelPrecache();
+	}
+
+	virtual void OnLevelInitPostEntity()
+	{
+		if ( !m_bLevelPrecachePending )
+			return;
+
+		// hold the loading screen so the decode cost doesn't land on first play
+		const float flWaitEnd = Plat_FloatTime() + precache_wait_time.GetFloat();
+		while ( g_pFMODAudioEngine->UpdatePendingLoads() > 0 && Plat_FloatTime() < flWaitEnd )
+			ThreadSleep( 1 );
+
+		if ( g_pFMODAudioEngine->UpdatePendingLoads() == 0 )
+			FinishLevelPrecache();
 	}
 
 	virtual void OnDisconnectedFromServer()
@@ -241,6 +278,44 @@ public:
 	}
 
 private:
+	void RemoveChannel( unsigned short index )
+	{
+		m_channelLookup.Remove( m_activeChannels[index].id );
+		m_activeChannels.Remove( index );
+	}
+
+	// The server's precache table already includes everything pulled in through
+	// the model sounds and scene caches, so queue all of it up front and let
+	// FMOD decode on its async thread while the rest of the map loads.
+	void BeginLevelPrecache()
+	{
+		m_flLevelPrecacheStart = Plat_FloatTime();
+		g_pFMODAudioEngine->GetLoadStats( m_nLevelPrecacheStartCount, m_nLevelPrecacheStartBytes );
+		m_bLevelPrecachePending = true;
+
+		INetworkStringTable *pTable = m_networkStringTables ? m_networkStringTables->FindTable( "soundprecache" ) : nullptr;
+		if ( pTable )
+		{
+			for ( int i = 0; i < pTable->GetNumStrings(); ++i )
+			{
+				const char *pSample = pTable->GetString( i );
+				if ( pSample && pSample[0] )
+					PrecacheSound( pSample );
+			}
+		}
+	}
+
+	void FinishLevelPrecache()
+	{
+		m_bLevelPrecachePending = false;
+
+		int nLoaded;
+		unsigned long long nBytes;
+		g_pFMODAudioEngine->GetLoadStats( nLoaded, nBytes );
+		ConMsg( "Precached %d sounds (%.2f MB) in %.2f seconds\n", nLoaded - m_nLevelPrecacheStartCount,
+			( nBytes - m_nLevelPrecacheStartBytes ) / ( 1024.f * 1024.f ), Plat_FloatTime() - m_flLevelPrecacheStart );
+	}
+
 	void EmitSoundInternal( int iEntIndex, int iChannel, const char *pSample,
 		float flVolume, soundlevel_t iSoundlevel, int iFlags = 0, int iPitch = PITCH_NORM, int iSpecialDSP = 0,
 		const Vector *pOrigin = NULL, const Vector *pDirection = NULL, CUtlVector< Vector > *pUtlVecOrigins = NULL,
@@ -321,6 +396,11 @@ private:
 		bool dryMix = TestSoundChar( pSample, CHAR_DRYMIX );
 		bool ui = iEntity == SOUND_FROM_UI_PANEL;
 
+		// sounds that weren't precached get loaded here
+		g_SoundCodecPolicy.RecordPlay( szSampleFull );
+		SoundLoadType loadType = g_SoundCodecPolicy.GetLoadType( szSampleFull, TestSoundChar( pSample, CHAR_STREAM ) );
+		g_pFMODAudioEngine->LoadSound( szSampleFull, loadType, true );
+
 		int channelId = g_pFMODAudioEngine->PlaySound( szSampleFull, fVol, pos, ang, true, dryMix, ui );
 		if ( channelId == -1 )
 			return;
@@ -333,6 +413,7 @@ private:
 		channel.sourceChannelType = iChannel;
 		channel.speakerEntityIndex = speakerentity > 0 ? speakerentity : -1;
 		channel.fromServer = fromServer;
+		m_channelLookup.Insert( channelId, i );
 
 		float maxDist = dbToGainDist( iSoundlevel );
 		g_pFMODAudioEngine->SetChannelMinMaxDist( channel.id, SourceUnitsPerMeter, maxDist );
@@ -381,6 +462,20 @@ private:
 public:
 	virtual bool PrecacheSound( const char *pSample, bool bPreload = false, bool bIsUISound = false )
 	{
+		if ( !pSample || !pSample[0] || TestSoundChar( pSample, CHAR_SENTENCE ) )
+			return false;
+
+		char szSampleFull[MAX_PATH];
+		V_sprintf_safe( szSampleFull, "sound\\%s", PSkipSoundChars( pSample ) );
+		V_FixSlashes( szSampleFull );
+
+		// the same sound comes in from several caches, only queue it once
+		if ( m_precachedSounds.Find( szSampleFull ) != m_precachedSounds.InvalidIndex() )
+			return true;
+		m_precachedSounds.Insert( szSampleFull, true );
+
+		SoundLoadType loadType = g_SoundCodecPolicy.GetLoadType( szSampleFull, TestSoundChar( pSample, CHAR_STREAM ) );
+		g_pFMODAudioEngine->LoadSound( szSampleFull, loadType, true, true );
 		return true;
 	}
 
@@ -395,7 +490,7 @@ public:
 
 	virtual float GetSoundDuration( const char *pSample )
 	{
-		return 0.f;
+		return g_SoundMetadata.GetDuration( pSample );
 	}
 
 	// NOTE: setting iEntIndex to -1 will cause the sound to be emitted from the local
@@ -522,11 +617,41 @@ public:
 	// create/destroy an audio stream
 	virtual IAudioOutputStream *CreateOutputStream( uint nSampleRate, uint nChannels, uint nBits )
 	{
-		return nullptr;
+		// WriteAudioData only ever hands us 16-bit samples
+		if ( nBits != 16 )
+		{
+			ConMsg( "Unable to create output stream with %u bit samples\n", nBits );
+			return nullptr;
+		}
+
+		CFMODAudioOutputStream *pStream = new CFMODAudioOutputStream( nSampleRate, nChannels );
+		if ( !pStream->Init() )
+		{
+			delete pStream;
+			return nullptr;
+		}
+
+		m_outputStreams.AddToTail( pStream );
+		return pStream;
 	}
 
 	virtual void DestroyOutputStream( IAudioOutputStream *pStream )
 	{
+		CFMODAudioOutputStream *pFMODStream = static_cast<CFMODAudioOutputStream *>( pStream );
+		if ( m_outputStreams.FindAndRemove( pFMODStream ) )
+			delete pFMODStream;
+	}
+
+	void PrintOutputStreamStats()
+	{
+		ConMsg( "%d output streams\n", m_outputStreams.Count() );
+		FOR_EACH_VEC( m_outputStreams, i )
+		{
+			CFMODAudioOutputStream *pStream = m_outputStreams[i];
+			ConMsg( "  %d: %uHz %uch queued %u latency %u underruns %u overruns %u\n", i,
+				pStream->GetSampleRate(), pStream->GetChannelCount(), pStream->QueuedSampleCount(),
+				pStream->LatencySamplesCount(), pStream->GetUnderrunCount(), pStream->GetOverrunCount() );
+		}
 	}
 
 	// Force an update, for instances where we are otherwise deadlocked from the main loop.
@@ -545,6 +670,17 @@ private:
 	IClientEntityList *m_entitylist;
 	CGlobalVarsBase *m_pGlobals;
 	CUtlLinkedList< SoundChannel > m_activeChannels;
+	// FMOD channel id to m_activeChannels index
+	CUtlMap< int, unsigned short > m_channelLookup;
+	CUtlVector< unsigned short > m_removeChannels;
+	CUtlVector< CFMODAudioOutputStream * > m_outputStreams;
+	INetworkStringTableContainer *m_networkStringTables;
+	CUtlDict< bool, int > m_precachedSounds;
+
+	bool m_bLevelPrecachePending;
+	float m_flLevelPrecacheStart;
+	int m_nLevelPrecacheStartCount;
+	unsigned long long m_nLevelPrecacheStartBytes;
 
 	AudioState_t m_oldAudioState;
 	bool m_needADSPUpdate;
@@ -555,6 +691,11 @@ CEngineSoundClient g_EngineSoundClient;
 EXPOSE_SINGLE_INTERFACE_GLOBALVAR( CEngineSoundClient, IEngineSound,
 	IFMODENGINESOUND_CLIENT_INTERFACE_VERSION, g_EngineSoundClient );
 
+CON_COMMAND( nsnd_stream_stats, "Print buffer statistics for active output streams" )
+{
+	g_EngineSoundClient.PrintOutputStreamStats();
+}
+
 // figure out when the gain is basically 0
 CON_COMMAND( nsnd_get_min_dist, "" )
 {
@@ -5,8 +5,10 @@
 //====================================================================
 #include <fmodsoundsystem/ifmodenginesound.h>
 #include <tier1/tier1.h>
+#include <tier2/tier2.h>
 #include "sound_netmessages.h"
 #include <iserver.h>
+#include "sound_metadata.h"
 
 class CEngineSoundServer : public IFMODEngineSound
 {
@@ -21,18 +23,26 @@ public:
 	{
 		MathLib_Init();
 		ConnectTier1Libraries( &appSystemFactory, 1 );
+		ConnectTier2Libraries( &appSystemFactory, 1 );
 		m_engineServer = (IVEngineServer *) appSystemFactory( INTERFACEVERSION_VENGINESERVER, NULL );
-		m_oldEngineSound = (IEngineSound *) appSystemFactory( IENGINESOUND_CLIENT_INTERFACE_VERSION, NULL );
+		// the server side engine sound is the one that fills the networked precache table,
+		// and the only one a dedicated server has
+		m_oldEngineSound = (IEngineSound *) appSystemFactory( IENGINESOUND_SERVER_INTERFACE_VERSION, NULL );
 		m_pGlobals = globals;
 
 		m_server = m_engineServer->GetIServer();
+
+		g_SoundMetadata.Load();
 	}
 
 	virtual void Shutdown()
 	{
+		DisconnectTier2Libraries();
 		DisconnectTier1Libraries();
 	}
 
+	virtual void OnLevelInitPostEntity() {}
+
 	// Client only
 	virtual void Update( float frametime ) {}
 	virtual void OnConnectedToServer() {}
@@ -59,7 +69,8 @@ public:
 public:
 	virtual bool PrecacheSound( const char *pSample, bool bPreload = false, bool bIsUISound = false )
 	{
-		return true;
+		// the engine's precache table is networked, clients use it to load the level's sounds up front
+		return m_oldEngineSound->PrecacheSound( pSample, false, bIsUISound );
 	}
 
 	virtual bool IsSoundPrecached( const char *pSample )
@@ -73,7 +84,7 @@ public:
 
 	virtual float GetSoundDuration( const char *pSample )
 	{
-		return 0.f;
+		return g_SoundMetadata.GetDuration( pSample );
 	}
 
 	// NOTE: setting iEntIndex to -1 will cause the sound to be emitted from the local
@@ -12,6 +12,9 @@
 #include <fmod/fmod_errors.h>
 #include <fmod_studio/fmod_studio.hpp>
 #include <stdarg.h>
+#include <thread>
+#include <chrono>
+#include <mutex>
 
 using namespace FMOD;
 
@@ -66,6 +69,18 @@ class CFMODAudioEngine : public IFMODAudioEngine
 	std::map<std::string, FMOD::Sound *> m_loadedSounds;
 	std::map<std::string, FMOD::Studio::Bank *> m_loadedBanks;
 	std::map<int, FMOD::Channel *> m_channels;
+	std::map<int, FMOD::Sound *> m_userStreams;
+	// non-blocking loads that haven't been finalised yet
+	std::map<std::string, FMOD::Sound *> m_pendingSounds;
+	int m_loadedSoundCount;
+	unsigned long long m_loadedSoundBytes;
+
+	// Channel end callbacks come from whichever thread runs the core update, so
+	// they're queued here and drained on the main thread. The two vectors are
+	// swapped each frame so their storage gets reused.
+	std::mutex m_finishedMutex;
+	std::vector<int> m_finishedQueue;
+	std::vector<int> m_finishedChannels;
 
 	int m_lastGUID;
 
@@ -83,6 +98,10 @@ class CFMODAudioEngine : public IFMODAudioEngine
 public:
 	CFMODAudioEngine()
 	{
+		m_loadedSoundCount = 0;
+		m_loadedSoundBytes = 0;
+		m_finishedQueue.reserve( 256 );
+		m_finishedChannels.reserve( 256 );
 		m_reverbTarget.space = DynamicReverbSpace::ReverbRoom;
 		m_reverbTarget.reflectivity = 0.f;
 		m_reverbTarget.size = 10.f;
@@ -182,23 +201,36 @@ public:
 
 	virtual void Update( float dt )
 	{
-		std::vector< std::map<int, FMOD::Channel *>::iterator > vecStoppedChannels;
-		for ( auto it = m_channels.begin(), itEnd = m_channels.end(); it != itEnd; ++it )
-		{
-			bool isPlaying = false;
-			it->second->isPlaying( &isPlaying );
-			if ( !isPlaying )
-				vecStoppedChannels.push_back( it );
-		}
+		UpdateDynamicReverb( dt );
+
+		UpdatePendingLoads();
+
+		m_pStudioSystem->update();
 
-		for ( auto &it : vecStoppedChannels )
+		m_finishedChannels.clear();
 		{
-			m_channels.erase( it );
+			std::lock_guard<std::mutex> lock( m_finishedMutex );
+			m_finishedChannels.swap( m_finishedQueue );
 		}
 
-		UpdateDynamicReverb( dt );
+		// only channels that actually ended get touched
+		for ( int channelId : m_finishedChannels )
+			m_channels.erase( channelId );
+	}
 
-		m_pStudioSystem->update();
+	virtual const int *GetFinishedChannels( int &count ) const
+	{
+		count = (int) m_finishedChannels.size();
+		return m_finishedChannels.data();
+	}
+
+	static FMOD_RESULT F_CALL ChannelCallback( FMOD_CHANNELCONTROL *channelcontrol, FMOD_CHANNELCONTROL_TYPE controltype,
+		FMOD_CHANNELCONTROL_CALLBACK_TYPE callbacktype, void *commanddata1, void *commanddata2 );
+
+	void OnChannelEnd( int channelId )
+	{
+		std::lock_guard<std::mutex> lock( m_finishedMutex );
+		m_finishedQueue.push_back( channelId );
 	}
 
 	void UpdateDynamicReverb( float dt )
@@ -225,15 +257,17 @@ public:
 		}
 	}
 
-	virtual void LoadSound( const char *soundName, bool isStream, bool is3d )
+	virtual void LoadSound( const char *soundName, SoundLoadType loadType, bool is3d, bool nonBlocking )
 	{
 		auto soundIt = m_loadedSounds.find( soundName );
 		if ( soundIt != m_loadedSounds.end() )
 			return;
 
 		FMOD_MODE mode = FMOD_IGNORETAGS;
-		mode |= ( isStream ? FMOD_CREATESTREAM : FMOD_CREATESAMPLE );
+		mode |= loadType == SoundLoadStream ? FMOD_CREATESTREAM :
+			loadType == SoundLoadCompressed ? FMOD_CREATECOMPRESSEDSAMPLE : FMOD_CREATESAMPLE;
 		mode |= is3d * ( FMOD_3D | FMOD_3D_INVERSEROLLOFF );
+		mode |= nonBlocking * FMOD_NONBLOCKING;
 
 		FMOD::Sound *pSound = nullptr;
 		if ( FMOD_RESULT result = m_pSystem->createSound( soundName, mode, nullptr, &pSound ) )
@@ -246,6 +280,24 @@ public:
 
 		m_loadedSounds[soundName] = pSound;
 
+		// loop points can't be touched until the async open has finished
+		if ( nonBlocking )
+			m_pendingSounds[soundName] = pSound;
+		else
+			FinishLoadingSound( pSound );
+	}
+
+	void FinishLoadingSound( FMOD::Sound *pSound )
+	{
+		FMOD_MODE mode;
+		pSound->getMode( &mode );
+
+		// only fully decoded samples take up their PCM size
+		unsigned int uBytes = 0;
+		pSound->getLength( &uBytes, ( mode & ( FMOD_CREATESTREAM | FMOD_CREATECOMPRESSEDSAMPLE ) ) ? FMOD_TIMEUNIT_RAWBYTES : FMOD_TIMEUNIT_PCMBYTES );
+		m_loadedSoundBytes += uBytes;
+		++m_loadedSoundCount;
+
 		if ( IsSoundSDK )
 		{
 			// Source uses markers to indicate if a sound is loopable
@@ -263,7 +315,7 @@ public:
 				pSound->getLength( &uLength, FMOD_TIMEUNIT_MS );
 
 				// mark sound as loopable
-				mode &= ~FMOD_LOOP_OFF;
+				mode &= ~( FMOD_LOOP_OFF | FMOD_NONBLOCKING );
 				pSound->setMode( mode | FMOD_LOOP_NORMAL );
 				pSound->setLoopPoints( syncPointOffset, FMOD_TIMEUNIT_MS, uLength, FMOD_TIMEUNIT_MS );
 				pSound->setLoopCount( -1 );
@@ -271,10 +323,92 @@ public:
 		}
 	}
 
+	// returns false if the sound failed to open
+	bool FinishPendingSound( std::map<std::string, FMOD::Sound *>::iterator pendingIt, bool wait )
+	{
+		FMOD::Sound *pSound = pendingIt->second;
+		FMOD_OPENSTATE openState = FMOD_OPENSTATE_LOADING;
+		FMOD_RESULT result = pSound->getOpenState( &openState, nullptr, nullptr, nullptr );
+		while ( wait && result == FMOD_OK && openState == FMOD_OPENSTATE_LOADING )
+		{
+			std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+			result = pSound->getOpenState( &openState, nullptr, nullptr, nullptr );
+		}
+
+		if ( result == FMOD_OK && openState == FMOD_OPENSTATE_LOADING )
+			return true;
+
+		if ( result != FMOD_OK || openState == FMOD_OPENSTATE_ERROR )
+		{
+			Log( "FMOD Error: async load failed: %s %s\n", FMOD_ErrorString( result ), pendingIt->first.c_str() );
+			pSound->release();
+			m_loadedSounds[pendingIt->first] = nullptr;
+			m_pendingSounds.erase( pendingIt );
+			return false;
+		}
+
+		FinishLoadingSound( pSound );
+		m_pendingSounds.erase( pendingIt );
+		return true;
+	}
+
+	virtual int UpdatePendingLoads()
+	{
+		for ( auto it = m_pendingSounds.begin(); it != m_pendingSounds.end(); )
+		{
+			auto next = std::next( it );
+			FinishPendingSound( it, false );
+			it = next;
+		}
+		return (int) m_pendingSounds.size();
+	}
+
+	virtual void GetLoadStats( int &loadedCount, unsigned long long &loadedBytes ) const
+	{
+		loadedCount = m_loadedSoundCount;
+		loadedBytes = m_loadedSoundBytes;
+	}
+
 	virtual void UnloadSound( const char *soundName ) 
 	{
 	}
 
+	virtual bool ReadSoundInfo( const char *soundName, SoundFileInfo &info )
+	{
+		FMOD::Sound *pSound = nullptr;
+		if ( FMOD_RESULT result = m_pSystem->createSound( soundName, FMOD_OPENONLY | FMOD_IGNORETAGS, nullptr, &pSound ) )
+		{
+			Log( "FMOD Error: System::createSound failed: %s %s\n", FMOD_ErrorString( result ), soundName );
+			return false;
+		}
+
+		unsigned int uLength = 0;
+		pSound->getLength( &uLength, FMOD_TIMEUNIT_MS );
+		info.duration = uLength / 1000.f;
+
+		FMOD_SOUND_FORMAT format;
+		float frequency = 0.f;
+		pSound->getFormat( &info.type, &format, &info.channels, &info.bits );
+		pSound->getDefaults( &frequency, nullptr );
+		info.sampleRate = (int) frequency;
+
+		// same loop marker convention as LoadSound
+		info.loopStartMs = -1;
+		int syncPointCount = 0;
+		pSound->getNumSyncPoints( &syncPointCount );
+		if ( syncPointCount > 0 )
+		{
+			FMOD_SYNCPOINT *pSyncPoint;
+			pSound->getSyncPoint( 0, &pSyncPoint );
+			unsigned int syncPointOffset;
+			pSound->getSyncPointInfo( pSyncPoint, nullptr, 0, &syncPointOffset, FMOD_TIMEUNIT_MS );
+			info.loopStartMs = (int) syncPointOffset;
+		}
+
+		pSound->release();
+		return true;
+	}
+
 	virtual void SetVolume( float volume ) 
 	{
 		m_pMasterChannelGroup->setVolume( volume );
@@ -304,7 +438,7 @@ public:
 		if ( soundIt == m_loadedSounds.end() )
 		{
 			Log( "Late load of \"%s\". Sound may not have correct attributes\n", soundName );
-			LoadSound( soundName, false, true );
+			LoadSound( soundName, SoundLoadPCM, true, false );
 			soundIt = m_loadedSounds.find( soundName );
 			if ( soundIt == m_loadedSounds.end() )
 			{
@@ -312,6 +446,11 @@ public:
 				return -1;
 			}
 		}
+
+		// precached but the async load hasn't caught up yet
+		auto pendingIt = m_pendingSounds.find( soundName );
+		if ( pendingIt != m_pendingSounds.end() && !FinishPendingSound( pendingIt, true ) )
+			return -1;
 		
 		ChanGroup channelGroup = uiSound ? ChanGroup::ChanGroupUI :
 			dryMix ? ChanGroup::ChanGroupDry : ChanGroup::ChanGroupSFX;
@@ -324,6 +463,8 @@ public:
 		}
 
 		const int channelId = ++m_lastGUID;
+		channel->setUserData( (void *) (intptr_t) channelId );
+		channel->setCallback( ChannelCallback );
 		channel->setVolume( volume );
 		FMOD_VECTOR vec = *( static_cast<FMOD_VECTOR *>( (void *) &position ) );
 		channel->set3DAttributes( &vec, nullptr );
@@ -523,7 +664,86 @@ public:
 			channelIt->second->set3DMinMaxDistance( min, max );
 		}
 	}
+
+	virtual void SetChannelPaused( int channelId, bool paused )
+	{
+		auto channelIt = m_channels.find( channelId );
+		if ( channelIt != m_channels.end() )
+		{
+			channelIt->second->setPaused( paused );
+		}
+	}
+
+	virtual int PlayUserStream( int sampleRate, int channels, unsigned int decodeBufferSamples,
+		FMOD_SOUND_PCMREAD_CALLBACK readCallback, void *userData, bool startPaused )
+	{
+		FMOD_CREATESOUNDEXINFO exinfo = {};
+		exinfo.cbsize = sizeof( FMOD_CREATESOUNDEXINFO );
+		exinfo.numchannels = channels;
+		exinfo.defaultfrequency = sampleRate;
+		exinfo.format = FMOD_SOUND_FORMAT_PCM16;
+		exinfo.decodebuffersize = decodeBufferSamples;
+		// length only matters for looping, the callback is the real source of data
+		exinfo.length = sampleRate * channels * sizeof( short );
+		exinfo.pcmreadcallback = readCallback;
+		exinfo.userdata = userData;
+
+		FMOD_MODE mode = FMOD_OPENUSER | FMOD_CREATESTREAM | FMOD_LOOP_NORMAL | FMOD_2D;
+
+		FMOD::Sound *pSound = nullptr;
+		if ( FMOD_RESULT result = m_pSystem->createSound( nullptr, mode, &exinfo, &pSound ) )
+		{
+			Log( "FMOD Error: System::createSound failed for user stream: %s\n", FMOD_ErrorString( result ) );
+			return -1;
+		}
+
+		FMOD::Channel *channel = nullptr;
+		if ( FMOD_RESULT result = m_pSystem->playSound( pSound, m_channelGroupMapping[ChanGroup::ChanGroupUI], startPaused, &channel ) )
+		{
+			Log( "FMOD Error: System::playSound failed for user stream: %s\n", FMOD_ErrorString( result ) );
+			pSound->release();
+			return -1;
+		}
+
+		const int channelId = ++m_lastGUID;
+		channel->setUserData( (void *) (intptr_t) channelId );
+		channel->setCallback( ChannelCallback );
+		m_channels[channelId] = channel;
+		m_userStreams[channelId] = pSound;
+
+		return channelId;
+	}
+
+	virtual void ReleaseUserStream( int channelId )
+	{
+		auto channelIt = m_channels.find( channelId );
+		if ( channelIt != m_channels.end() )
+		{
+			channelIt->second->stop();
+			m_channels.erase( channelIt );
+		}
+
+		auto streamIt = m_userStreams.find( channelId );
+		if ( streamIt != m_userStreams.end() )
+		{
+			// blocks until FMOD's stream thread is finished with the read callback
+			streamIt->second->release();
+			m_userStreams.erase( streamIt );
+		}
+	}
 };
 
 CFMODAudioEngine g_FMODAudioEngine;
-IFMODAudioEngine *g_pFMODAudioEngine = &g_FMODAudioEngine;
\ No newline at end of file
+IFMODAudioEngine *g_pFMODAudioEngine = &g_FMODAudioEngine;
+
+FMOD_RESULT F_CALL CFMODAudioEngine::ChannelCallback( FMOD_CHANNELCONTROL *channelcontrol, FMOD_CHANNELCONTROL_TYPE controltype,
+	FMOD_CHANNELCONTROL_CALLBACK_TYPE callbacktype, void *commanddata1, void *commanddata2 )
+{
+	if ( controltype != FMOD_CHANNELCONTROL_CHANNEL || callbacktype != FMOD_CHANNELCONTROL_CALLBACK_END )
+		return FMOD_OK;
+
+	void *userData = nullptr;
+	( (FMOD::Channel *) channelcontrol )->getUserData( &userData );
+	g_FMODAudioEngine.OnChannelEnd( (int) (intptr_t) userData );
+	return FMOD_OK;
+}
\ No newline at end of file
@@ -24,6 +24,23 @@ enum DynamicReverbSpace
 	ReverbSpaceCount,
 };
 
+enum SoundLoadType
+{
+	SoundLoadPCM, // decoded up front
+	SoundLoadCompressed, // kept in its original format and decoded per channel
+	SoundLoadStream, // read from disk as it plays
+};
+
+struct SoundFileInfo
+{
+	float duration;
+	int loopStartMs; // -1 if the sound has no loop marker
+	int sampleRate;
+	int channels;
+	int bits;
+	FMOD_SOUND_TYPE type;
+};
+
 class IFMODAudioEngine
 {
 public:
@@ -34,9 +51,17 @@ public:
 		LOG_FUNCTION logfunc = nullptr, const char **bankList = nullptr, int bankCount = 0 ) = 0;
 	virtual void Shutdown() = 0;
 	virtual void Update( float dt ) = 0;
+	// channels that finished or were stopped since the last Update, valid until the next Update
+	virtual const int *GetFinishedChannels( int &count ) const = 0;
 
-	virtual void LoadSound( const char *soundName, bool isStream, bool is3d ) = 0;
+	// non-blocking loads are opened on FMOD's async loader thread, see UpdatePendingLoads
+	virtual void LoadSound( const char *soundName, SoundLoadType loadType, bool is3d, bool nonBlocking = false ) = 0;
+	// finishes any async loads that are ready, returns the number still loading
+	virtual int UpdatePendingLoads() = 0;
+	virtual void GetLoadStats( int &loadedCount, unsigned long long &loadedBytes ) const = 0;
 	virtual void UnloadSound( const char *soundName ) = 0;
+	// opens the file header only, nothing is decoded
+	virtual bool ReadSoundInfo( const char *soundName, SoundFileInfo &info ) = 0;
 	virtual void SetVolume( float volume ) = 0;
 	virtual void StopAllChannels() = 0;
 	virtual int GetLastGUID() const = 0;
@@ -66,6 +91,12 @@ public:
 	virtual float GetChannelPlaybackPosition( int channelId ) = 0;
 	virtual void SetChannelPlaybackPosition( int channelId, float flTime ) = 0;
 	virtual void SetChannelMinMaxDist( int channelId, float min, float max ) = 0;
+	virtual void SetChannelPaused( int channelId, bool paused ) = 0;
+
+	// User streams are fed 16-bit PCM through readCallback on FMOD's stream thread
+	virtual int PlayUserStream( int sampleRate, int channels, unsigned int decodeBufferSamples,
+		FMOD_SOUND_PCMREAD_CALLBACK readCallback, void *userData, bool startPaused ) = 0;
+	virtual void ReleaseUserStream( int channelId ) = 0;
 };
 
 extern IFMODAudioEngine *g_pFMODAudioEngine;
\ No newline at end of file
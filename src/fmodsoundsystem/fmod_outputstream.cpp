@@ -0,0 +1,211 @@
+//====================================================================
+// Purpose: Low latency PCM output streams fed into the FMOD mixer
+//====================================================================
+#include <tier1.h>
+#include <convar.h>
+#include "fmod_outputstream.h"
+#include "fmod_impl.h"
+
+ConVar stream_buffer_ms( "nsnd_stream_buffer_ms", "250", FCVAR_NONE, "Size of the ring buffer for output streams in milliseconds. Only affects newly created streams." );
+ConVar stream_decode_ms( "nsnd_stream_decode_ms", "20", FCVAR_NONE, "How much audio FMOD pulls from an output stream per read. Lower values reduce latency but risk underruns." );
+
+static uint32 NextPowerOfTwo( uint32 n )
+{
+	uint32 result = 1;
+	while ( result < n )
+		result <<= 1;
+	return result;
+}
+
+CFMODAudioOutputStream::CFMODAudioOutputStream( uint nSampleRate, uint nChannels ) :
+	m_nSampleRate( nSampleRate ),
+	m_nChannels( nChannels ),
+	m_nDecodeFrames( 0 ),
+	m_pBuffer( nullptr ),
+	m_nCapacityFrames( 0 ),
+	m_nWriteFrame( 0 ),
+	m_nReadFrame( 0 ),
+	m_bPrimed( false ),
+	m_nUnderruns( 0 ),
+	m_nOverruns( 0 ),
+	m_flVolume( 1.f ),
+	m_bVolumeDirty( false ),
+	m_bPaused( false ),
+	m_bPauseDirty( false ),
+	m_channelId( -1 )
+{
+}
+
+CFMODAudioOutputStream::~CFMODAudioOutputStream()
+{
+	Shutdown();
+}
+
+bool CFMODAudioOutputStream::Init()
+{
+	if ( m_nSampleRate == 0 || m_nChannels == 0 )
+		return false;
+
+	// the whole buffer is allocated up front so the read callback never has to
+	m_nCapacityFrames = NextPowerOfTwo( Max( 1u, m_nSampleRate * stream_buffer_ms.GetInt() / 1000 ) );
+	m_pBuffer = new int16[m_nCapacityFrames * m_nChannels];
+	m_nDecodeFrames = Clamp( m_nSampleRate * stream_decode_ms.GetInt() / 1000, 64u, m_nCapacityFrames );
+
+	m_channelId = g_pFMODAudioEngine->PlayUserStream( m_nSampleRate, m_nChannels, m_nDecodeFrames,
+		PCMReadCallback, this, false );
+
+	return m_channelId != -1;
+}
+
+void CFMODAudioOutputStream::Shutdown()
+{
+	if ( m_channelId != -1 )
+	{
+		// once this returns FMOD will no longer call into us
+		g_pFMODAudioEngine->ReleaseUserStream( m_channelId );
+		m_channelId = -1;
+	}
+
+	delete[] m_pBuffer;
+	m_pBuffer = nullptr;
+}
+
+// Pushes state changed by the producer to FMOD, main thread only
+void CFMODAudioOutputStream::Update()
+{
+	if ( m_channelId == -1 )
+		return;
+
+	if ( m_bVolumeDirty.exchange( false, std::memory_order_acquire ) )
+		g_pFMODAudioEngine->SetChannelVolume( m_channelId, m_flVolume.load( std::memory_order_relaxed ) );
+
+	if ( m_bPauseDirty.exchange( false, std::memory_order_acquire ) )
+		g_pFMODAudioEngine->SetChannelPaused( m_channelId, m_bPaused.load( std::memory_order_relaxed ) );
+}
+
+void CFMODAudioOutputStream::WriteAudioData( const int16 *pData, uint nSampleCount, uint nChannels )
+{
+	if ( !m_pBuffer || !pData || nSampleCount == 0 || nChannels == 0 )
+		return;
+
+	const uint32 writeFrame = m_nWriteFrame.load( std::memory_order_relaxed );
+	const uint32 readFrame = m_nReadFrame.load( std::memory_order_acquire );
+	const uint32 freeFrames = m_nCapacityFrames - ( writeFrame - readFrame );
+
+	uint32 nFrames = nSampleCount;
+	if ( nFrames > freeFrames )
+	{
+		// drop the tail rather than block the producer
+		m_nOverruns.fetch_add( 1, std::memory_order_relaxed );
+		nFrames = freeFrames;
+	}
+
+	const uint32 mask = m_nCapacityFrames - 1;
+	if ( nChannels == m_nChannels )
+	{
+		// at most two copies, one up to the end of the buffer and one from the start
+		const uint32 start = writeFrame & mask;
+		const uint32 firstFrames = Min( nFrames, m_nCapacityFrames - start );
+		V_memcpy( m_pBuffer + start * m_nChannels, pData, firstFrames * m_nChannels * sizeof( int16 ) );
+		V_memcpy( m_pBuffer, pData + firstFrames * m_nChannels, ( nFrames - firstFrames ) * m_nChannels * sizeof( int16 ) );
+	}
+	else
+	{
+		for ( uint32 i = 0; i < nFrames; ++i )
+		{
+			const int16 *pSrc = pData + i * nChannels;
+			int16 *pDest = m_pBuffer + ( ( writeFrame + i ) & mask ) * m_nChannels;
+
+			if ( m_nChannels == 1 )
+			{
+				// downmix to mono
+				int sum = 0;
+				for ( uint c = 0; c < nChannels; ++c )
+					sum += pSrc[c];
+				pDest[0] = (int16) ( sum / (int) nChannels );
+			}
+			else
+			{
+				// spread mono to every channel, otherwise drop or repeat the last channel
+				for ( uint c = 0; c < m_nChannels; ++c )
+					pDest[c] = pSrc[Min( c, nChannels - 1 )];
+			}
+		}
+	}
+
+	m_nWriteFrame.store( writeFrame + nFrames, std::memory_order_release );
+	m_bPrimed.store( true, std::memory_order_relaxed );
+}
+
+void CFMODAudioOutputStream::ReadAudioData( int16 *pOut, uint32 nFrames )
+{
+	const uint32 readFrame = m_nReadFrame.load( std::memory_order_relaxed );
+	const uint32 writeFrame = m_nWriteFrame.load( std::memory_order_acquire );
+	const uint32 availFrames = Min( nFrames, writeFrame - readFrame );
+
+	const uint32 mask = m_nCapacityFrames - 1;
+	const uint32 start = readFrame & mask;
+	const uint32 firstFrames = Min( availFrames, m_nCapacityFrames - start );
+	V_memcpy( pOut, m_pBuffer + start * m_nChannels, firstFrames * m_nChannels * sizeof( int16 ) );
+	V_memcpy( pOut + firstFrames * m_nChannels, m_pBuffer, ( availFrames - firstFrames ) * m_nChannels * sizeof( int16 ) );
+
+	if ( availFrames < nFrames )
+	{
+		// pad with silence, FMOD expects the whole request to be filled
+		V_memset( pOut + availFrames * m_nChannels, 0, ( nFrames - availFrames ) * m_nChannels * sizeof( int16 ) );
+		if ( m_bPrimed.load( std::memory_order_relaxed ) )
+			m_nUnderruns.fetch_add( 1, std::memory_order_relaxed );
+	}
+
+	m_nReadFrame.store( readFrame + availFrames, std::memory_order_release );
+}
+
+FMOD_RESULT F_CALL CFMODAudioOutputStream::PCMReadCallback( FMOD_SOUND *sound, void *data, unsigned int datalen )
+{
+	void *userData = nullptr;
+	( (FMOD::Sound *) sound )->getUserData( &userData );
+
+	CFMODAudioOutputStream *pStream = static_cast<CFMODAudioOutputStream *>( userData );
+	if ( !pStream || !pStream->m_pBuffer )
+	{
+		V_memset( data, 0, datalen );
+		return FMOD_OK;
+	}
+
+	pStream->ReadAudioData( static_cast<int16 *>( data ), datalen / ( pStream->m_nChannels * sizeof( int16 ) ) );
+	return FMOD_OK;
+}
+
+void CFMODAudioOutputStream::SetVolume( float flVolume )
+{
+	m_flVolume.store( flVolume, std::memory_order_relaxed );
+	m_bVolumeDirty.store( true, std::memory_order_release );
+}
+
+uint32 CFMODAudioOutputStream::QueuedSampleCount()
+{
+	return m_nWriteFrame.load( std::memory_order_acquire ) - m_nReadFrame.load( std::memory_order_acquire );
+}
+
+uint32 CFMODAudioOutputStream::MaxWriteSampleCount()
+{
+	return m_nCapacityFrames - QueuedSampleCount();
+}
+
+uint32 CFMODAudioOutputStream::LatencySamplesCount()
+{
+	// anything queued plus what FMOD has already pulled into its decode buffer
+	return QueuedSampleCount() + m_nDecodeFrames;
+}
+
+void CFMODAudioOutputStream::Pause()
+{
+	m_bPaused.store( true, std::memory_order_relaxed );
+	m_bPauseDirty.store( true, std::memory_order_release );
+}
+
+void CFMODAudioOutputStream::Resume()
+{
+	m_bPaused.store( false, std::memory_order_relaxed );
+	m_bPauseDirty.store( true, std::memory_order_release );
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <engine/IEngineSound.h>
+#include <fmod/fmod.hpp>
+#include <atomic>
+
+//-----------------------------------------------------------------------------
+// IAudioOutputStream backed by an FMOD user stream.
+// A single producer (voice, video, replay) writes PCM into a fixed size ring
+// buffer, FMOD's stream thread drains it from the pcm read callback.
+//-----------------------------------------------------------------------------
+class CFMODAudioOutputStream : public IAudioOutputStream
+{
+public:
+	CFMODAudioOutputStream( uint nSampleRate, uint nChannels );
+	virtual ~CFMODAudioOutputStream();
+
+	bool Init();
+	void Shutdown();
+	void Update();
+
+	// IAudioOutputStream
+public:
+	virtual void WriteAudioData( const int16 *pData, uint nSampleCount, uint nChannels );
+	virtual void SetVolume( float flVolume );
+	virtual uint32 QueuedSampleCount();
+	virtual uint32 MaxWriteSampleCount();
+	virtual uint32 LatencySamplesCount();
+	virtual void Pause();
+	virtual void Resume();
+
+public:
+	uint GetSampleRate() const { return m_nSampleRate; }
+	uint GetChannelCount() const { return m_nChannels; }
+	uint32 GetUnderrunCount() const { return m_nUnderruns.load( std::memory_order_relaxed ); }
+	uint32 GetOverrunCount() const { return m_nOverruns.load( std::memory_order_relaxed ); }
+
+private:
+	static FMOD_RESULT F_CALL PCMReadCallback( FMOD_SOUND *sound, void *data, unsigned int datalen );
+	void ReadAudioData( int16 *pOut, uint32 nFrames );
+
+	uint m_nSampleRate;
+	uint m_nChannels;
+	uint m_nDecodeFrames;
+
+	// ring buffer storage in frames, capacity is a power of two so indices can wrap freely
+	int16 *m_pBuffer;
+	uint32 m_nCapacityFrames;
+	std::atomic<uint32> m_nWriteFrame;
+	std::atomic<uint32> m_nReadFrame;
+
+	// only count underruns once the producer has started feeding us
+	std::atomic<bool> m_bPrimed;
+	std::atomic<uint32> m_nUnderruns;
+	std::atomic<uint32> m_nOverruns;
+
+	// may be changed from the producer thread, applied to the channel in Update
+	std::atomic<float> m_flVolume;
+	std::atomic<bool> m_bVolumeDirty;
+	std::atomic<bool> m_bPaused;
+	std::atomic<bool> m_bPauseDirty;
+
+	int m_channelId;
+};
@@ -0,0 +1,125 @@
+//====================================================================
+// Purpose: Per sound choice between PCM, compressed and streamed
+//====================================================================
+#include <tier1.h>
+#include <tier1/KeyValues.h>
+#include <tier2/tier2.h>
+#include <filesystem.h>
+#include "sound_codecpolicy.h"
+#include "sound_metadata.h"
+
+#define SOUND_USAGE_FILENAME "cfg/sound_usage.txt"
+
+ConVar codec_policy( "nsnd_codec_policy", "1", FCVAR_ARCHIVE, "Choose between PCM, compressed and streamed sounds based on folder, length and play frequency. 0 decodes everything to PCM." );
+ConVar codec_pcm_length( "nsnd_codec_pcm_length", "1.5", FCVAR_ARCHIVE, "Sounds up to this many seconds may be decoded to PCM." );
+ConVar codec_stream_length( "nsnd_codec_stream_length", "10", FCVAR_ARCHIVE, "Music longer than this many seconds is streamed from disk." );
+ConVar codec_hot_plays( "nsnd_codec_hot_plays", "8", FCVAR_ARCHIVE, "Number of recorded plays before a short sound is considered hot and decoded to PCM." );
+
+CSoundCodecPolicy g_SoundCodecPolicy;
+
+// Each name gets one FMOD sound, and a stream can only play on one channel at a time,
+// so only music, which never plays over itself, is streamed
+static const char *s_pStreamFolders[] = { "sound/music/" };
+
+// weapons and impacts have to start instantly
+static const char *s_pEffectFolders[] = { "sound/weapons/", "sound/physics/", "sound/player/", "sound/items/" };
+
+static bool IsInFolder( const char *pKey, const char **ppFolders, int nFolders )
+{
+	for ( int i = 0; i < nFolders; i++ )
+	{
+		if ( !V_strncmp( pKey, ppFolders[i], V_strlen( ppFolders[i] ) ) )
+			return true;
+	}
+	return false;
+}
+
+static void GetUsageKey( const char *pSample, char *pKey, int nKeySize )
+{
+	V_strncpy( pKey, pSample, nKeySize );
+	V_FixSlashes( pKey, '/' );
+	V_strlower( pKey );
+}
+
+void CSoundCodecPolicy::Init()
+{
+	KeyValues *pUsage = new KeyValues( "SoundUsage" );
+	if ( pUsage->LoadFromFile( g_pFullFileSystem, SOUND_USAGE_FILENAME, "MOD" ) )
+	{
+		// old counts are halved each run, so sounds that stop being played cool off
+		for ( KeyValues *pSound = pUsage->GetFirstTrueSubKey(); pSound; pSound = pSound->GetNextTrueSubKey() )
+		{
+			const char *pName = pSound->GetString( "name" );
+			float flPlays = pSound->GetFloat( "count" ) * 0.5f;
+			if ( *pName && flPlays >= 1.f )
+				m_playCounts.Insert( pName, flPlays );
+		}
+	}
+	pUsage->deleteThis();
+}
+
+void CSoundCodecPolicy::Shutdown()
+{
+	KeyValues *pUsage = new KeyValues( "SoundUsage" );
+	// sample names have '/' in them, which KeyValues would treat as nested keys,
+	// so each sound gets a subkey of its own holding its name and count
+	FOR_EACH_DICT_FAST( m_playCounts, i )
+	{
+		KeyValues *pSound = new KeyValues( "sound" );
+		pSound->SetString( "name", m_playCounts.GetElementName( i ) );
+		pSound->SetFloat( "count", m_playCounts[i] );
+		pUsage->AddSubKey( pSound );
+	}
+	pUsage->SaveToFile( g_pFullFileSystem, SOUND_USAGE_FILENAME, "MOD" );
+	pUsage->deleteThis();
+
+	m_playCounts.Purge();
+}
+
+void CSoundCodecPolicy::RecordPlay( const char *pSample )
+{
+	char szKey[MAX_PATH];
+	GetUsageKey( pSample, szKey, sizeof( szKey ) );
+
+	int i = m_playCounts.Find( szKey );
+	if ( i == m_playCounts.InvalidIndex() )
+		m_playCounts.Insert( szKey, 1.f );
+	else
+		m_playCounts[i] += 1.f;
+}
+
+SoundLoadType CSoundCodecPolicy::GetLoadType( const char *pSample, bool bStreamChar )
+{
+	// an explicit stream marker always wins
+	if ( bStreamChar )
+		return SoundLoadStream;
+
+	if ( !codec_policy.GetBool() )
+		return SoundLoadPCM;
+
+	// without the metadata index we'd have to open the file to know its length
+	const SoundMetadataEntry_t *pMetadata = g_SoundMetadata.Find( pSample );
+	if ( !pMetadata )
+		return SoundLoadPCM;
+
+	// decided from the name alone, sounds are usually loaded at precache time before
+	// anything says what channel they'll play on
+	char szKey[MAX_PATH];
+	GetUsageKey( pSample, szKey, sizeof( szKey ) );
+
+	if ( pMetadata->duration > codec_stream_length.GetFloat() && IsInFolder( szKey, s_pStreamFolders, ARRAYSIZE( s_pStreamFolders ) ) )
+		return SoundLoadStream;
+
+	if ( pMetadata->duration <= codec_pcm_length.GetFloat() )
+	{
+		// effects are always decoded up front, anything else needs to have earned it
+		if ( IsInFolder( szKey, s_pEffectFolders, ARRAYSIZE( s_pEffectFolders ) ) )
+			return SoundLoadPCM;
+
+		int i = m_playCounts.Find( szKey );
+		if ( i != m_playCounts.InvalidIndex() && m_playCounts[i] >= codec_hot_plays.GetFloat() )
+			return SoundLoadPCM;
+	}
+
+	return SoundLoadCompressed;
+}
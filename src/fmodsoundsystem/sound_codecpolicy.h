@@ -0,0 +1,25 @@
+#pragma once
+#include <tier1/utldict.h>
+#include "fmod_impl.h"
+
+//-----------------------------------------------------------------------------
+// Decides how a sound is held in memory. Short effects and frequently played
+// sounds are decoded to PCM, long music is streamed, everything else stays
+// compressed in memory and is decoded as it plays.
+//-----------------------------------------------------------------------------
+class CSoundCodecPolicy
+{
+public:
+	void Init();
+	void Shutdown();
+
+	// pSample is the full path handed to the FMOD engine
+	SoundLoadType GetLoadType( const char *pSample, bool bStreamChar );
+	void RecordPlay( const char *pSample );
+
+private:
+	// play counts carried over between sessions, decayed on load so they follow current content
+	CUtlDict< float, int > m_playCounts;
+};
+
+extern CSoundCodecPolicy g_SoundCodecPolicy;
@@ -0,0 +1,245 @@
+//====================================================================
+// Purpose: Precomputed sound duration and format index so duration
+// queries never have to open or decode the sound file
+//====================================================================
+#include <tier1.h>
+#include <tier1/generichash.h>
+#include <tier1/utlbuffer.h>
+#include <tier1/utlmap.h>
+#include <tier1/utlstring.h>
+#include <tier2/tier2.h>
+#include <filesystem.h>
+#include <soundchars.h>
+#include "sound_metadata.h"
+#include "fmod_impl.h"
+
+CSoundMetadataIndex g_SoundMetadata;
+
+CSoundMetadataIndex::CSoundMetadataIndex() :
+	m_pFileData( nullptr ),
+	m_pEntries( nullptr ),
+	m_nEntries( 0 )
+{
+}
+
+CSoundMetadataIndex::~CSoundMetadataIndex()
+{
+	Unload();
+}
+
+bool CSoundMetadataIndex::Load( const char *pFileName, const char *pPathID )
+{
+	// client and server share the index when running in the same process
+	if ( IsLoaded() )
+		return true;
+
+	if ( !g_pFullFileSystem )
+		return false;
+
+	void *pData = nullptr;
+	int nSize = g_pFullFileSystem->ReadFileEx( pFileName, pPathID, &pData );
+	if ( nSize <= 0 || !pData )
+	{
+		ConMsg( "No sound metadata index found at %s, sound durations will be unavailable\n", pFileName );
+		return false;
+	}
+
+	const SoundMetadataHeader_t *pHeader = static_cast<const SoundMetadataHeader_t *>( pData );
+	if ( nSize < (int) sizeof( SoundMetadataHeader_t ) ||
+		pHeader->id != SOUNDMETADATA_ID ||
+		pHeader->version != SOUNDMETADATA_VERSION ||
+		pHeader->entryCount < 0 ||
+		nSize < (int) ( sizeof( SoundMetadataHeader_t ) + pHeader->entryCount * sizeof( SoundMetadataEntry_t ) ) )
+	{
+		ConMsg( "Sound metadata index %s is invalid or out of date, rebuild it with nsnd_build_sound_metadata\n", pFileName );
+		free( pData );
+		return false;
+	}
+
+	m_pFileData = pData;
+	m_pEntries = reinterpret_cast<const SoundMetadataEntry_t *>( pHeader + 1 );
+	m_nEntries = pHeader->entryCount;
+	return true;
+}
+
+void CSoundMetadataIndex::Unload()
+{
+	free( m_pFileData );
+	m_pFileData = nullptr;
+	m_pEntries = nullptr;
+	m_nEntries = 0;
+}
+
+uint64 CSoundMetadataIndex::HashSoundName( const char *pSample )
+{
+	char szName[MAX_PATH];
+	V_strncpy( szName, PSkipSoundChars( pSample ), sizeof( szName ) );
+	V_FixSlashes( szName, '/' );
+	V_strlower( szName );
+
+	const char *pName = szName;
+	if ( !V_strnicmp( pName, "sound/", 6 ) )
+		pName += 6;
+
+	return MurmurHash64( pName, V_strlen( pName ), 0 );
+}
+
+const SoundMetadataEntry_t *CSoundMetadataIndex::Find( const char *pSample ) const
+{
+	if ( !m_pEntries || !pSample )
+		return nullptr;
+
+	const uint64 hash = HashSoundName( pSample );
+	int lo = 0;
+	int hi = m_nEntries - 1;
+	while ( lo <= hi )
+	{
+		const int mid = ( lo + hi ) / 2;
+		const uint64 midHash = m_pEntries[mid].hash;
+		if ( midHash == hash )
+			return &m_pEntries[mid];
+
+		if ( midHash < hash )
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+
+	return nullptr;
+}
+
+float CSoundMetadataIndex::GetDuration( const char *pSample ) const
+{
+	const SoundMetadataEntry_t *pEntry = Find( pSample );
+	return pEntry ? pEntry->duration : 0.f;
+}
+
+//-----------------------------------------------------------------------------
+// Building the index
+//-----------------------------------------------------------------------------
+static SoundMetadataFormat_t MetadataFormatFromFMOD( FMOD_SOUND_TYPE type )
+{
+	switch ( type )
+	{
+	case FMOD_SOUND_TYPE_WAV:		return SOUNDMETADATA_FORMAT_WAV;
+	case FMOD_SOUND_TYPE_MPEG:		return SOUNDMETADATA_FORMAT_MP3;
+	case FMOD_SOUND_TYPE_OGGVORBIS:	return SOUNDMETADATA_FORMAT_OGG;
+	case FMOD_SOUND_TYPE_FLAC:		return SOUNDMETADATA_FORMAT_FLAC;
+	default:						return SOUNDMETADATA_FORMAT_UNKNOWN;
+	}
+}
+
+static bool IsSoundFile( const char *pFileName )
+{
+	const char *pExt = V_GetFileExtension( pFileName );
+	return pExt && ( !V_stricmp( pExt, "wav" ) || !V_stricmp( pExt, "mp3" ) ||
+		!V_stricmp( pExt, "ogg" ) || !V_stricmp( pExt, "flac" ) );
+}
+
+struct SoundMetadataBuildEntry_t
+{
+	SoundMetadataEntry_t entry;
+	CUtlString name;
+};
+
+// FindFirstEx on the GAME path also walks mounted VPKs
+static void CollectSoundMetadata( const char *pDirectory, CUtlMap<uint64, SoundMetadataBuildEntry_t, int> &entries, int &nFailed )
+{
+	char szSearch[MAX_PATH];
+	V_sprintf_safe( szSearch, "%s/*", pDirectory );
+
+	CUtlVector<CUtlString> subDirectories;
+
+	FileFindHandle_t findHandle;
+	for ( const char *pFileName = g_pFullFileSystem->FindFirstEx( szSearch, "GAME", &findHandle );
+		pFileName; pFileName = g_pFullFileSystem->FindNext( findHandle ) )
+	{
+		if ( pFileName[0] == '.' )
+			continue;
+
+		char szPath[MAX_PATH];
+		V_sprintf_safe( szPath, "%s/%s", pDirectory, pFileName );
+
+		if ( g_pFullFileSystem->FindIsDirectory( findHandle ) )
+		{
+			subDirectories.AddToTail( szPath );
+			continue;
+		}
+
+		if ( !IsSoundFile( pFileName ) )
+			continue;
+
+		const uint64 hash = CSoundMetadataIndex::HashSoundName( szPath );
+		int existing = entries.Find( hash );
+		if ( entries.IsValidIndex( existing ) )
+		{
+			// the same file can show up in more than one search path, only a different name is a problem
+			if ( V_stricmp( entries[existing].name, szPath ) )
+				Warning( "Sound metadata hash collision between %s and %s\n", entries[existing].name.Get(), szPath );
+			continue;
+		}
+
+		SoundFileInfo info;
+		if ( !g_pFMODAudioEngine->ReadSoundInfo( szPath, info ) )
+		{
+			++nFailed;
+			continue;
+		}
+
+		SoundMetadataBuildEntry_t &buildEntry = entries[entries.Insert( hash )];
+		buildEntry.name = szPath;
+		buildEntry.entry.hash = hash;
+		buildEntry.entry.duration = info.duration;
+		buildEntry.entry.loopStartMs = info.loopStartMs;
+		buildEntry.entry.sampleRate = info.sampleRate;
+		buildEntry.entry.channels = (uint8) info.channels;
+		buildEntry.entry.bits = (uint8) info.bits;
+		buildEntry.entry.format = (uint8) MetadataFormatFromFMOD( info.type );
+		buildEntry.entry.pad = 0;
+	}
+	g_pFullFileSystem->FindClose( findHandle );
+
+	FOR_EACH_VEC( subDirectories, i )
+		CollectSoundMetadata( subDirectories[i], entries, nFailed );
+}
+
+static bool UInt64LessFunc( const uint64 &lhs, const uint64 &rhs )
+{
+	return lhs < rhs;
+}
+
+CON_COMMAND( nsnd_build_sound_metadata, "Scan the sound folder and write the sound metadata index used for sound durations" )
+{
+	if ( !g_pFullFileSystem )
+		return;
+
+	const float flStartTime = Plat_FloatTime();
+
+	// the map iterates in hash order which is exactly the order the index needs
+	CUtlMap<uint64, SoundMetadataBuildEntry_t, int> entries( UInt64LessFunc );
+	int nFailed = 0;
+	CollectSoundMetadata( "sound", entries, nFailed );
+
+	SoundMetadataHeader_t header;
+	header.id = SOUNDMETADATA_ID;
+	header.version = SOUNDMETADATA_VERSION;
+	header.entryCount = entries.Count();
+	header.reserved = 0;
+
+	CUtlBuffer buf;
+	buf.Put( &header, sizeof( header ) );
+	FOR_EACH_MAP( entries, i )
+		buf.Put( &entries[i].entry, sizeof( SoundMetadataEntry_t ) );
+
+	if ( !g_pFullFileSystem->WriteFile( SOUNDMETADATA_FILENAME, "MOD", buf ) )
+	{
+		Warning( "Unable to write %s\n", SOUNDMETADATA_FILENAME );
+		return;
+	}
+
+	ConMsg( "Wrote %d sounds to %s in %.2f seconds (%d failed to open)\n", entries.Count(),
+		SOUNDMETADATA_FILENAME, Plat_FloatTime() - flStartTime, nFailed );
+
+	g_SoundMetadata.Unload();
+	g_SoundMetadata.Load();
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <tier0/platform.h>
+#include <tier0/commonmacros.h>
+
+#define SOUNDMETADATA_ID		MAKEID( 'S', 'N', 'D', 'M' )
+#define SOUNDMETADATA_VERSION	1
+#define SOUNDMETADATA_FILENAME	"scripts/sound_metadata.bin"
+
+enum SoundMetadataFormat_t
+{
+	SOUNDMETADATA_FORMAT_UNKNOWN = 0,
+	SOUNDMETADATA_FORMAT_WAV,
+	SOUNDMETADATA_FORMAT_MP3,
+	SOUNDMETADATA_FORMAT_OGG,
+	SOUNDMETADATA_FORMAT_FLAC,
+};
+
+#pragma pack( push, 1 )
+struct SoundMetadataHeader_t
+{
+	int id;
+	int version;
+	int entryCount;
+	int reserved;
+};
+
+// entries are sorted by hash so lookups are a binary search over the loaded file
+struct SoundMetadataEntry_t
+{
+	uint64 hash;
+	float duration;
+	// offset of the loop marker in milliseconds, -1 if the sound doesn't loop
+	int loopStartMs;
+	uint32 sampleRate;
+	uint8 channels;
+	uint8 bits;
+	uint8 format;
+	uint8 pad;
+};
+#pragma pack( pop )
+
+//-----------------------------------------------------------------------------
+// Read only index of sound file metadata built by nsnd_build_sound_metadata.
+// The whole file is read once at startup and queried in place.
+//-----------------------------------------------------------------------------
+class CSoundMetadataIndex
+{
+public:
+	CSoundMetadataIndex();
+	~CSoundMetadataIndex();
+
+	bool Load( const char *pFileName = SOUNDMETADATA_FILENAME, const char *pPathID = "GAME" );
+	void Unload();
+	bool IsLoaded() const { return m_pEntries != nullptr; }
+	int Count() const { return m_nEntries; }
+
+	const SoundMetadataEntry_t *Find( const char *pSample ) const;
+	float GetDuration( const char *pSample ) const;
+
+	// sample names are hashed relative to the sound folder, without sound chars
+	static uint64 HashSoundName( const char *pSample );
+
+private:
+	void *m_pFileData;
+	const SoundMetadataEntry_t *m_pEntries;
+	int m_nEntries;
+};
+
+extern CSoundMetadataIndex g_SoundMetadata;
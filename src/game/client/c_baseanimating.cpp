@@ -2738,9 +2738,7 @@ CMouthInfo *C_BaseAnimating::GetMouth( void )
 ConVar cl_warn_thread_contested_bone_setup("cl_warn_thread_contested_bone_setup", "0" );
 #endif
 
-// Marked this developmentonly because it currently crashes, and users are enabling it and complaining because of
-// course.  Once this actually works it should just be FCVAR_INTERNAL_USE.
-ConVar cl_threaded_bone_setup("cl_threaded_bone_setup", "0", FCVAR_DEVELOPMENTONLY | FCVAR_INTERNAL_USE,
+ConVar cl_threaded_bone_setup("cl_threaded_bone_setup", "0", FCVAR_INTERNAL_USE,
                               "Enable parallel processing of C_BaseAnimating::SetupBones()" );
 
 //-----------------------------------------------------------------------------
@@ -2749,23 +2747,27 @@ ConVar cl_threaded_bone_setup("cl_threaded_bone_setup", "0", FCVAR_DEVELOPMENTON
 
 static void SetupBonesOnBaseAnimating( C_BaseAnimating *&pBaseAnimating )
 {
-	if ( !pBaseAnimating->GetMoveParent() )
-		pBaseAnimating->SetupBones( NULL, -1, -1, gpGlobals->curtime );
+	pBaseAnimating->SetupBones( NULL, -1, -1, gpGlobals->curtime );
 }
 
-static void PreThreadedBoneSetup()
-{
-	mdlcache->BeginLock();
-}
+static bool g_bInThreadedBoneSetup;
+static bool g_bDoThreadedBoneSetup;
 
-static void PostThreadedBoneSetup()
+// Number of animating entities above this one in the attachment hierarchy. Everything
+// at one depth only reads bones from lower depths, so each depth can run in parallel.
+static int GetBoneSetupDepth( C_BaseAnimating *pAnimating )
 {
-	mdlcache->EndLock();
+	int nDepth = 0;
+	for ( C_BaseEntity *pParent = pAnimating->GetMoveParent(); pParent; pParent = pParent->GetMoveParent() )
+	{
+		if ( pParent->GetBaseAnimating() )
+		{
+			++nDepth;
+		}
+	}
+	return nDepth;
 }
 
-static bool g_bInThreadedBoneSetup;
-static bool g_bDoThreadedBoneSetup;
-
 void C_BaseAnimating::InitBoneSetupThreadPool()
 {
 }
@@ -2782,17 +2784,110 @@ void C_BaseAnimating::ThreadedBoneSetup()
 		int nCount = g_PreviousBoneSetups.Count();
 		if ( nCount > 1 )
 		{
-			g_bInThreadedBoneSetup = true;
+			// Children read their parent's bones through GetAttachment(), so make sure every
+			// animating ancestor is in the graph too. The list grows while we walk it.
+			for ( int i = 0; i < g_PreviousBoneSetups.Count(); ++i )
+			{
+				for ( C_BaseEntity *pParent = g_PreviousBoneSetups[i]->GetMoveParent(); pParent; pParent = pParent->GetMoveParent() )
+				{
+					C_BaseAnimating *pParentAnimating = pParent->GetBaseAnimating();
+					if ( pParentAnimating && pParentAnimating->m_iMostRecentBoneSetupRequest != g_iPreviousBoneCounter )
+					{
+						pParentAnimating->m_iMostRecentBoneSetupRequest = g_iPreviousBoneCounter;
+						g_PreviousBoneSetups.AddToTail( pParentAnimating );
+					}
+				}
+			}
+			nCount = g_PreviousBoneSetups.Count();
 
-			ParallelProcess( "C_BaseAnimating::ThreadedBoneSetup", g_PreviousBoneSetups.Base(), nCount, &SetupBonesOnBaseAnimating, &PreThreadedBoneSetup, &PostThreadedBoneSetup );
+			// Bucket by depth so parents are always finished before their children start
+			CUtlVectorFixedGrowable< int, 64 > depths;
+			depths.SetCount( nCount );
+			int nMaxDepth = 0;
+			for ( int i = 0; i < nCount; ++i )
+			{
+				depths[i] = GetBoneSetupDepth( g_PreviousBoneSetups[i] );
+				nMaxDepth = MAX( nMaxDepth, depths[i] );
+			}
 
-			g_bInThreadedBoneSetup = false;
+			CUtlVector< C_BaseAnimating * > sorted;
+			sorted.EnsureCapacity( nCount );
+			CUtlVectorFixedGrowable< int, 8 > levelStart;
+			for ( int nDepth = 0; nDepth <= nMaxDepth; ++nDepth )
+			{
+				levelStart.AddToTail( sorted.Count() );
+				for ( int i = 0; i < nCount; ++i )
+				{
+					if ( depths[i] == nDepth )
+					{
+						sorted.AddToTail( g_PreviousBoneSetups[i] );
+					}
+				}
+			}
+			levelStart.AddToTail( sorted.Count() );
+
+			// Pull in the studio headers here, so the jobs only touch the mdlcache for
+			// animation data instead of holding the cache lock for the whole batch.
+			{
+				MDLCACHE_CRITICAL_SECTION();
+				for ( int i = 0; i < nCount; ++i )
+				{
+					sorted[i]->GetModelPtr();
+				}
+			}
+
+			for ( int nDepth = 0; nDepth <= nMaxDepth; ++nDepth )
+			{
+				int nFirst = levelStart[nDepth];
+				int nLevelCount = levelStart[nDepth + 1] - nFirst;
+
+				// Resolving an abs transform writes back up through the hierarchy, so do it
+				// here rather than letting sibling jobs race on a shared parent.
+				for ( int i = nFirst; i < nFirst + nLevelCount; ++i )
+				{
+					sorted[i]->GetAbsOrigin();
+				}
+
+				g_bInThreadedBoneSetup = true;
+
+				ParallelProcess( "C_BaseAnimating::ThreadedBoneSetup", sorted.Base() + nFirst, nLevelCount, &SetupBonesOnBaseAnimating );
+
+				g_bInThreadedBoneSetup = false;
+			}
 		}
 	}
 	g_iPreviousBoneCounter++;
 	g_PreviousBoneSetups.RemoveAll();
 }
 
+// The worker threads only need the cache lock while fetching the model; the main thread
+// keeps holding it across the whole setup as it always has.
+class CBoneSetupCacheLock
+{
+public:
+	CBoneSetupCacheLock() : m_bLocked( true )
+	{
+		mdlcache->BeginLock();
+	}
+
+	~CBoneSetupCacheLock()
+	{
+		Unlock();
+	}
+
+	void Unlock()
+	{
+		if ( m_bLocked )
+		{
+			mdlcache->EndLock();
+			m_bLocked = false;
+		}
+	}
+
+private:
+	bool m_bLocked;
+};
+
 bool C_BaseAnimating::SetupBones( matrix3x4_t *pBoneToWorldOut, int nMaxBones, int boneMask, float currentTime )
 {
 	VPROF_BUDGET( "C_BaseAnimating::SetupBones", VPROF_BUDGETGROUP_CLIENT_ANIMATION );
@@ -2842,14 +2937,6 @@ bool C_BaseAnimating::SetupBones( matrix3x4_t *pBoneToWorldOut, int nMaxBones, i
 		boneMask |= BONE_USED_BY_ANYTHING;
 	}
 
-	if ( g_bInThreadedBoneSetup )
-	{
-		if ( !m_BoneSetupLock.TryLock() )
-		{
-			return false;
-		}
-	}
-
 #ifdef DEBUG_BONE_SETUP_THREADING
 	if ( cl_warn_thread_contested_bone_setup.GetBool() )
 	{
@@ -2864,13 +2951,10 @@ bool C_BaseAnimating::SetupBones( matrix3x4_t *pBoneToWorldOut, int nMaxBones, i
 	}
 #endif
 
+	// Jobs only ever wait on an ancestor's lock while holding their own, and ancestors run
+	// in an earlier pass, so blocking here can't deadlock.
 	AUTO_LOCK( m_BoneSetupLock );
 
-	if ( g_bInThreadedBoneSetup )
-	{
-		m_BoneSetupLock.Unlock();
-	}
-
 	if ( m_iMostRecentModelBoneCounter != g_iModelBoneCounter )
 	{
 		// Clear out which bones we've touched this frame if this is 
@@ -2894,7 +2978,7 @@ bool C_BaseAnimating::SetupBones( matrix3x4_t *pBoneToWorldOut, int nMaxBones, i
 	}
 
 	int nBoneCount = m_CachedBoneData.Count();
-	if ( g_bDoThreadedBoneSetup && !g_bInThreadedBoneSetup && ( nBoneCount >= 16 ) && !GetMoveParent() && m_iMostRecentBoneSetupRequest != g_iPreviousBoneCounter )
+	if ( g_bDoThreadedBoneSetup && !g_bInThreadedBoneSetup && ( nBoneCount >= 16 ) && m_iMostRecentBoneSetupRequest != g_iPreviousBoneCounter )
 	{
 		m_iMostRecentBoneSetupRequest = g_iPreviousBoneCounter;
 		Assert( g_PreviousBoneSetups.Find( this ) == -1 );
@@ -2910,7 +2994,7 @@ bool C_BaseAnimating::SetupBones( matrix3x4_t *pBoneToWorldOut, int nMaxBones, i
 	// Have we cached off all bones meeting the flag set?
 	if( ( m_BoneAccessor.GetReadableBones() & boneMask ) != boneMask )
 	{
-		MDLCACHE_CRITICAL_SECTION();
+		CBoneSetupCacheLock cacheLock;
 
 		CStudioHdr *hdr = GetModelPtr();
 		if ( !hdr || !hdr->SequencesAvailable() )
@@ -2998,6 +3082,14 @@ bool C_BaseAnimating::SetupBones( matrix3x4_t *pBoneToWorldOut, int nMaxBones, i
 				m_pIk->SolveDependencies( pos, q, m_BoneAccessor.GetBoneArrayForWrite(), boneComputed );
 			}
 
+			// The anim blocks are only read while blending and solving IK above, and
+			// must not be evicted until then. Let the other bone setup jobs at the cache
+			// for the rest.
+			if ( g_bInThreadedBoneSetup )
+			{
+				cacheLock.Unlock();
+			}
+
 			BuildTransformations( hdr, pos, q, parentTransform, bonesMaskNeedRecalc, boneComputed );
 			
 			RemoveFlag( EFL_SETTING_UP_BONES );
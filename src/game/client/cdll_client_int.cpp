@@ -112,6 +112,7 @@
 #include "matsys_controls/matsyscontrols.h"
 #include "gamestats.h"
 #include "particle_parse.h"
+#include "bone_setup.h"
 #if defined( TF_CLIENT_DLL )
 #include "rtime.h"
 #include "tf_hud_disconnect_prompt.h"
@@ -1763,6 +1764,9 @@ void CHLClient::LevelShutdown( void )
 #endif
 	UncacheAllMaterials();
 
+	// cached animation frames point into model headers that may be unloaded now
+	Studio_FlushAnimFrameCache();
+
 #ifdef _XBOX
 	ReleaseRenderTargets();
 #endif
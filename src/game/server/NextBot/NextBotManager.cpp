@@ -6,6 +6,8 @@
 
 #include "NextBotManager.h"
 #include "NextBotInterface.h"
+#include "NextBotVisibility.h"
+#include "nav_mesh.h"
 
 #ifdef TERROR
 #include "ZombieBot/Infected/Infected.h"
@@ -242,6 +244,9 @@ NextBotManager::NextBotManager( void )
 	m_selectedBot = NULL;
 	
 	m_iUpdateTickrate = 0;
+
+	m_soundBucketTick = -1;
+	m_soundHeardTick = -1;
 }
 
 //---------------------------------------------------------------------------------------------
@@ -270,6 +275,8 @@ void NextBotManager::Reset( void )
 	}
 
 	m_selectedBot = NULL;
+
+	TheNextBotVisibility.Reset();
 }
 
 
@@ -391,6 +398,17 @@ void NextBotManager::Update( void )
 			nScheduled = m_botList.Count();
 		}
 
+		// trace ahead for the visions of the bots that are about to update
+		CUtlVector< INextBot * > updatingBots;
+		for( int u=m_botList.Head(); u != m_botList.InvalidIndex(); u = m_botList.Next( u ) )
+		{
+			if ( ( m_iUpdateTickrate < 1 || m_botList[u]->IsFlaggedForUpdate() ) && !IsDead( m_botList[u] ) )
+			{
+				updatingBots.AddToTail( m_botList[u] );
+			}
+		}
+		TheNextBotVisibility.Update( updatingBots );
+
 		if ( nb_update_debug.GetBool() )
 		{
 			int nIntentionalSliders = 0;
@@ -506,6 +524,8 @@ void NextBotManager::OnRoundRestart( void )
 //---------------------------------------------------------------------------------------------
 int NextBotManager::Register( INextBot *bot )
 {
+	m_soundBucketTick = -1;
+
 	return m_botList.AddToHead( bot );
 }
 
@@ -515,6 +535,9 @@ void NextBotManager::UnRegister( INextBot *bot )
 {
 	m_botList.Remove( bot->GetBotId() );
 
+	// the sound bucket holds bot pointers
+	m_soundBucketTick = -1;
+
 	if ( bot == m_selectedBot)
 	{
 		// we can't access virtual methods because this is called from a destructor, so just clear it
@@ -565,36 +588,154 @@ void NextBotManager::OnKilled( CBaseCombatCharacter *victim, const CTakeDamageIn
 
 
 //----------------------------------------------------------------------------------------------------------
-class NextBotSoundNotifyScan
+/**
+ * How far away a sound of the given level can be heard, in 5 dB steps. These are the
+ * distances the client's sound system fades sounds out over.
+ */
+static const float s_soundLevelRange[] =
 {
-public:
-	NextBotSoundNotifyScan( CBaseEntity *source, const Vector &pos, KeyValues *keys ) : m_source( source ), m_pos( pos ), m_keys( keys )
+	0.0f, 12.0f, 22.0f, 40.0f, 70.0f, 122.0f, 210.0f, 350.0f, 575.0f, 900.0f,									// 0 - 45 dB
+	1450.0f, 1925.0f, 2620.0f, 3424.0f, 4318.0f, 5290.0f, 6325.0f, 7412.0f, 8542.0f, 9708.0f,					// 50 - 95 dB
+	10905.0f, 12128.0f, 13374.0f, 14638.0f, 15920.0f, 17215.0f, 18524.0f, 19845.0f, 21175.0f, 22516.0f,			// 100 - 145 dB
+	23864.0f, 25220.0f, 26583.0f, 27952.0f, 29327.0f, 30707.0f, 32092.0f, 33482.0f, 34875.0f, 36273.0f,			// 150 - 195 dB
+	37674.0f, 39079.0f, 40487.0f, 41897.0f, 43311.0f, 44727.0f, 46146.0f, 47567.0f, 48990.0f, 50415.0f,			// 200 - 245 dB
+	51842.0f, 53272.0f,																							// 250 - 255 dB
+};
+
+static float SoundLevelToRange( soundlevel_t soundlevel )
+{
+	if ( soundlevel < 0 || soundlevel > 255 )
+		return 0.0f;
+
+	return s_soundLevelRange[ ( soundlevel + 2 ) / 5 ];
+}
+
+
+//---------------------------------------------------------------------------------------------
+/**
+ * Sort the bots by the nav grid cell they are in. There are usually many more sounds than
+ * bots, so this is only done once a tick, for the first sound that needs it.
+ */
+void NextBotManager::UpdateSoundBucket( void )
+{
+	if ( m_soundBucketTick == gpGlobals->tickcount )
+		return;
+
+	m_soundBucketTick = gpGlobals->tickcount;
+	m_soundBucket.RemoveAll();
+
+	for( int i=m_botList.Head(); i != m_botList.InvalidIndex(); i = m_botList.Next( i ) )
 	{
+		INextBot *bot = m_botList[i];
+		const Vector &botPos = bot->GetEntity()->GetAbsOrigin();
+
+		SoundBucketEntry entry;
+		entry.cell = TheNavMesh->WorldToGridX( botPos.x ) + TheNavMesh->WorldToGridY( botPos.y ) * TheNavMesh->GetGridSizeX();
+		entry.bot = bot;
+		m_soundBucket.AddToTail( entry );
 	}
 
-	bool operator() ( INextBot *bot )
+	m_soundBucket.SortPredicate( []( const SoundBucketEntry &lhs, const SoundBucketEntry &rhs ) { return lhs.cell < rhs.cell; } );
+}
+
+
+//---------------------------------------------------------------------------------------------
+/**
+ * Populate given vector with the bots within the given range of a sound
+ */
+void NextBotManager::CollectBotsInEarshot( const Vector &pos, float range, CUtlVector< INextBot * > *botVector )
+{
+	UpdateSoundBucket();
+
+	// bots may have moved a little since the bucket was built
+	const float slack = 100.0f;
+
+	int startX = TheNavMesh->WorldToGridX( pos.x - range - slack );
+	int endX = TheNavMesh->WorldToGridX( pos.x + range + slack );
+	int startY = TheNavMesh->WorldToGridY( pos.y - range - slack );
+	int endY = TheNavMesh->WorldToGridY( pos.y + range + slack );
+
+	for( int y = startY; y <= endY; ++y )
 	{
-		if ( bot->GetEntity()->IsAlive() && !bot->IsSelf( m_source ) )
+		int lo = startX + y * TheNavMesh->GetGridSizeX();
+		int hi = endX + y * TheNavMesh->GetGridSizeX();
+
+		// binary search for the first bot in this row's cells
+		int first = 0;
+		int last = m_soundBucket.Count();
+		while ( first < last )
 		{
-			bot->OnSound( m_source, m_pos, m_keys );
+			int mid = ( first + last ) / 2;
+			if ( m_soundBucket[ mid ].cell < lo )
+			{
+				first = mid + 1;
+			}
+			else
+			{
+				last = mid;
+			}
 		}
-		return true;
-	}
 
-	CBaseEntity *m_source;
-	const Vector &m_pos;
-	KeyValues *m_keys;
-};
+		for( int i = first; i < m_soundBucket.Count() && m_soundBucket[i].cell <= hi; ++i )
+		{
+			INextBot *bot = m_soundBucket[i].bot;
+			if ( ( bot->GetEntity()->GetAbsOrigin() - pos ).IsLengthLessThan( range ) )
+			{
+				botVector->AddToTail( bot );
+			}
+		}
+	}
+}
 
 
 //---------------------------------------------------------------------------------------------
 /**
- * When an entity emits a sound
+ * When an entity emits a sound.
+ * Only bots close enough to hear it are told. A source that plays the same sound from the same
+ * place more than once in a tick, such as the layers of a weapon's fire sound, is only heard once.
  */
-void NextBotManager::OnSound( CBaseEntity *source, const Vector &pos, KeyValues *keys )
+void NextBotManager::OnSound( CBaseEntity *source, const Vector &pos, KeyValues *keys, soundlevel_t soundlevel )
 {
-	NextBotSoundNotifyScan notify( source, pos, keys );
-	TheNextBots().ForEachBot( notify );
+	VPROF_BUDGET( "NextBotManager::OnSound", "NextBot" );
+
+	CUtlVector< INextBot * > hearers;
+
+	if ( soundlevel == SNDLVL_NONE || !TheNavMesh->HasGrid() )
+	{
+		CollectAllBots( &hearers );
+	}
+	else
+	{
+		CollectBotsInEarshot( pos, SoundLevelToRange( soundlevel ), &hearers );
+	}
+
+	if ( m_soundHeardTick != gpGlobals->tickcount )
+	{
+		m_soundHeardTick = gpGlobals->tickcount;
+		m_soundHeard.RemoveAll();
+	}
+
+	FOR_EACH_VEC( hearers, it )
+	{
+		INextBot *bot = hearers[ it ];
+		if ( !bot->GetEntity()->IsAlive() || bot->IsSelf( source ) )
+			continue;
+
+		// sounds with keys may mean something different each time
+		if ( source && !keys )
+		{
+			SoundHeard heard;
+			heard.botID = bot->GetBotId();
+			heard.source = source->entindex();
+			heard.pos = pos;
+			if ( m_soundHeard.Find( heard ) != m_soundHeard.InvalidHandle() )
+				continue;
+
+			m_soundHeard.Insert( heard );
+		}
+
+		bot->OnSound( source, pos, keys );
+	}
 
 	if ( source && IsDebugging( NEXTBOT_HEARING ) )
 	{
@@ -6,6 +6,8 @@
 #define _NEXT_BOT_MANAGER_H_
 
 #include "NextBotInterface.h"
+#include "tier1/utlhashtable.h"
+#include "tier1/generichash.h"
 
 class CTerrorPlayer;
 
@@ -106,7 +108,7 @@ public:
 	virtual void OnRoundRestart( void );					// when the scenario restarts
 	virtual void OnBeginChangeLevel( void );				// when the server is about to change maps
 	virtual void OnKilled( CBaseCombatCharacter *victim, const CTakeDamageInfo &info );	// when an actor is killed
-	virtual void OnSound( CBaseEntity *source, const Vector &pos, KeyValues *keys );				// when an entity emits a sound
+	virtual void OnSound( CBaseEntity *source, const Vector &pos, KeyValues *keys, soundlevel_t soundlevel = SNDLVL_NONE );	// when an entity emits a sound. Only bots within earshot of "soundlevel" hear it, or all bots if it is SNDLVL_NONE
 	virtual void OnSpokeConcept( CBaseCombatCharacter *who, AIConcept_t concept, AI_Response *response );	// when an Actor speaks a concept
 	virtual void OnWeaponFired( CBaseCombatCharacter *whoFired, CBaseCombatWeapon *weapon );		// when someone fires a weapon
 
@@ -147,6 +149,40 @@ protected:
 
 	CUtlLinkedList< INextBot * > m_botList;				// list of all active NextBots
 
+	// bots bucketed by nav grid cell, so a sound only has to visit the bots near it
+	struct SoundBucketEntry
+	{
+		int cell;
+		INextBot *bot;
+	};
+	CUtlVector< SoundBucketEntry > m_soundBucket;		// sorted by cell
+	int m_soundBucketTick;								// tick the bucket was built on, or -1 if it is out of date
+
+	// a sound a bot has already heard this tick
+	struct SoundHeard
+	{
+		int botID;
+		int source;										// entindex
+		Vector pos;
+
+		bool operator==( const SoundHeard &other ) const
+		{
+			return botID == other.botID && source == other.source && pos == other.pos;
+		}
+	};
+	struct SoundHeardHash
+	{
+		unsigned int operator()( const SoundHeard &heard ) const
+		{
+			return HashBlock( &heard, sizeof( heard ) );
+		}
+	};
+	CUtlHashtable< SoundHeard, empty_t, SoundHeardHash > m_soundHeard;
+	int m_soundHeardTick;
+
+	void UpdateSoundBucket( void );
+	void CollectBotsInEarshot( const Vector &pos, float range, CUtlVector< INextBot * > *botVector );
+
 	int m_iUpdateTickrate;
 	double m_CurUpdateStartTime;
 	double m_SumFrameTime;
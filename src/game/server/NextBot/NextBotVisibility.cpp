@@ -0,0 +1,239 @@
+// NextBotVisibility.cpp
+// Line-of-sight results shared by all NextBots
+//========= Copyright Valve Corporation, All rights reserved. ============//
+
+#include "cbase.h"
+#include "tier1/generichash.h"
+#include "vstdlib/jobthread.h"
+
+#include "NextBot.h"
+#include "NextBotVisionInterface.h"
+#include "NextBotBodyInterface.h"
+#include "NextBotUtil.h"
+#include "NextBotVisibility.h"
+
+#include "tier0/vprof.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+
+ConVar nb_vision_share_los( "nb_vision_share_los", "0", FCVAR_CHEAT, "Trace NextBot lines of sight ahead of their updates and reuse the results for nb_vision_los_cache_time. Only shares a trace when two queries ask for the same ray" );
+ConVar nb_vision_los_cache_time( "nb_vision_los_cache_time", "0.1", FCVAR_CHEAT, "How long, in seconds, a NextBot line of sight result is reused" );
+ConVar nb_vision_los_parallel( "nb_vision_los_parallel", "0", FCVAR_CHEAT, "Make the traces for NextBot lines of sight on the worker threads" );
+
+extern ConVar nb_blind;
+
+NextBotVisibility TheNextBotVisibility;
+
+
+//----------------------------------------------------------------------------------------------------------
+void NextBotVisibility::Reset( void )
+{
+	m_lineOfSight.RemoveAll();
+	m_queries.RemoveAll();
+	m_rays.RemoveAll();
+	m_rayIndex.RemoveAll();
+}
+
+
+//----------------------------------------------------------------------------------------------------------
+uint64 NextBotVisibility::GetKey( const CBaseEntity *viewer, const CBaseEntity *subject )
+{
+	return ( (uint64)(uint32)viewer->GetRefEHandle().ToInt() << 32 ) | (uint32)subject->GetRefEHandle().ToInt();
+}
+
+
+//----------------------------------------------------------------------------------------------------------
+bool NextBotVisibility::GetLineOfSight( const CBaseEntity *viewer, const CBaseEntity *subject, bool *isClear ) const
+{
+	if ( !nb_vision_share_los.GetBool() )
+		return false;
+
+	UtlHashHandle_t h = m_lineOfSight.Find( GetKey( viewer, subject ) );
+	if ( h == m_lineOfSight.InvalidHandle() )
+		return false;
+
+	const LineOfSight &los = m_lineOfSight.Element( h );
+	if ( gpGlobals->curtime - los.timestamp > nb_vision_los_cache_time.GetFloat() )
+		return false;
+
+	*isClear = los.isClear;
+	return true;
+}
+
+
+//----------------------------------------------------------------------------------------------------------
+void NextBotVisibility::SetLineOfSight( const CBaseEntity *viewer, const CBaseEntity *subject, bool isClear )
+{
+	if ( !nb_vision_share_los.GetBool() )
+		return;
+
+	LineOfSight los;
+	los.timestamp = gpGlobals->curtime;
+	los.isClear = isClear;
+	m_lineOfSight.Element( m_lineOfSight.Insert( GetKey( viewer, subject ) ) ) = los;
+}
+
+
+//----------------------------------------------------------------------------------------------------------
+unsigned int NextBotVisibility::RayHash::operator()( const Ray &ray ) const
+{
+	unsigned int hash = HashBlock( &ray.from, sizeof( Vector ) );
+	hash = hash * 31 + HashBlock( &ray.to, sizeof( Vector ) );
+	hash = hash * 31 + (unsigned int)HashIntp( (intp)ray.ignore );
+	return hash;
+}
+
+
+//----------------------------------------------------------------------------------------------------------
+/**
+ * Return the index of the ray between the given points, adding it if no other query has asked for it.
+ */
+int NextBotVisibility::AddRay( const Vector &from, const Vector &to, const CBaseEntity *subject )
+{
+	Ray ray;
+	ray.from = from;
+	ray.to = to;
+	ray.ignore = const_cast< CBaseEntity * >( subject )->MyCombatCharacterPointer() ? NULL : subject;
+	ray.isClear = false;
+
+	UtlHashHandle_t h = m_rayIndex.Find( ray );
+	if ( h != m_rayIndex.InvalidHandle() )
+	{
+		return m_rayIndex.Element( h );
+	}
+
+	int index = m_rays.AddToTail( ray );
+	m_rayIndex.Insert( ray, index );
+	return index;
+}
+
+
+//----------------------------------------------------------------------------------------------------------
+void NextBotVisibility::TraceRay( Ray &ray )
+{
+	trace_t result;
+	NextBotTraceFilterIgnoreActors filter( ray.ignore, COLLISION_GROUP_NONE );
+
+	UTIL_TraceLine( ray.from, ray.to, MASK_BLOCKLOS_AND_NPCS|CONTENTS_IGNORE_NODRAW_OPAQUE, &filter, &result );
+
+	ray.isClear = ( result.fraction >= 1.0f && !result.startsolid );
+}
+
+
+//----------------------------------------------------------------------------------------------------------
+/**
+ * Gather the line-of-sight traces the given bots' visions will need when they update, skipping any
+ * that were traced recently. Like IVision::IsLineOfSightClearToEntity(), each query tries the subject's
+ * center, then its eyes, then its feet, so the rays are traced in up to three rounds. Identical rays
+ * from different queries are only traced once.
+ */
+void NextBotVisibility::Update( const CUtlVector< INextBot * > &botVector )
+{
+	VPROF_BUDGET( "NextBotVisibility::Update", "NextBot" );
+
+	if ( !nb_vision_share_los.GetBool() || nb_blind.GetBool() )
+		return;
+
+	// forget results too old to use
+	float maxAge = nb_vision_los_cache_time.GetFloat();
+	UtlHashHandle_t h = m_lineOfSight.FirstHandle();
+	while ( h != m_lineOfSight.InvalidHandle() )
+	{
+		if ( gpGlobals->curtime - m_lineOfSight.Element( h ).timestamp > maxAge )
+		{
+			h = m_lineOfSight.RemoveAndAdvance( h );
+		}
+		else
+		{
+			h = m_lineOfSight.NextHandle( h );
+		}
+	}
+
+	m_queries.RemoveAll();
+
+	CUtlVector< CBaseEntity * > potentiallyVisible;
+	FOR_EACH_VEC( botVector, bit )
+	{
+		INextBot *bot = botVector[ bit ];
+		IVision *vision = bot->GetVisionInterface();
+		if ( !vision )
+			continue;
+
+		CBaseCombatCharacter *me = bot->GetEntity();
+		Vector eye = bot->GetBodyInterface()->GetEyePosition();
+
+		// this is the same set IVision::UpdateKnownEntities() will test
+		vision->CollectPotentiallyVisibleEntities( &potentiallyVisible );
+		FOR_EACH_VEC( potentiallyVisible, pit )
+		{
+			CBaseEntity *subject = potentiallyVisible[ pit ];
+			if ( !subject || subject == me || !subject->IsAlive() || vision->IsIgnored( subject ) )
+				continue;
+
+			if ( !vision->IsPotentiallyAbleToSee( subject, IVision::USE_FOV ) )
+				continue;
+
+			uint64 key = GetKey( me, subject );
+			if ( m_lineOfSight.Find( key ) != m_lineOfSight.InvalidHandle() )
+				continue;
+
+			Query &query = m_queries[ m_queries.AddToTail() ];
+			query.key = key;
+			query.subject = subject;
+			query.eye = eye;
+			query.spot[0] = subject->WorldSpaceCenter();
+			query.spot[1] = subject->EyePosition();
+			query.spot[2] = subject->GetAbsOrigin();
+			query.isClear = false;
+		}
+	}
+
+	int remaining = m_queries.Count();
+	for( int spot = 0; spot < 3 && remaining > 0; ++spot )
+	{
+		m_rays.RemoveAll();
+		m_rayIndex.RemoveAll();
+
+		FOR_EACH_VEC( m_queries, qit )
+		{
+			Query &query = m_queries[ qit ];
+			query.ray = query.isClear ? -1 : AddRay( query.eye, query.spot[ spot ], query.subject );
+		}
+
+		if ( nb_vision_los_parallel.GetBool() )
+		{
+			ParallelProcess( "NextBotVisibility::Update", m_rays.Base(), m_rays.Count(), &NextBotVisibility::TraceRay );
+		}
+		else
+		{
+			FOR_EACH_VEC( m_rays, rit )
+			{
+				TraceRay( m_rays[ rit ] );
+			}
+		}
+
+		remaining = 0;
+		FOR_EACH_VEC( m_queries, qit )
+		{
+			Query &query = m_queries[ qit ];
+			if ( query.ray < 0 )
+				continue;
+
+			query.isClear = m_rays[ query.ray ].isClear;
+			if ( !query.isClear )
+			{
+				++remaining;
+			}
+		}
+	}
+
+	FOR_EACH_VEC( m_queries, qit )
+	{
+		LineOfSight los;
+		los.timestamp = gpGlobals->curtime;
+		los.isClear = m_queries[ qit ].isClear;
+		m_lineOfSight.Element( m_lineOfSight.Insert( m_queries[ qit ].key ) ) = los;
+	}
+}
@@ -0,0 +1,73 @@
+// NextBotVisibility.h
+// Line-of-sight results shared by all NextBots
+//========= Copyright Valve Corporation, All rights reserved. ============//
+
+#ifndef _NEXT_BOT_VISIBILITY_H_
+#define _NEXT_BOT_VISIBILITY_H_
+
+#include "tier1/utlhashtable.h"
+
+class INextBot;
+
+
+//----------------------------------------------------------------------------------------------------------------
+/**
+ * Line-of-sight from NextBots' eyes to the entities they might see.
+ *
+ * Just before the bots scheduled for this tick update, the traces their visions are about to
+ * make are gathered up, each distinct ray is traced once, and the results are kept for a short
+ * time. IVision::IsLineOfSightClearToEntity() reads them back instead of tracing again.
+ */
+class NextBotVisibility
+{
+public:
+	void Reset( void );
+	void Update( const CUtlVector< INextBot * > &botVector );		// trace ahead for the given bots, which are about to update
+
+	bool GetLineOfSight( const CBaseEntity *viewer, const CBaseEntity *subject, bool *isClear ) const;	// return true and the result if viewer recently traced to subject
+	void SetLineOfSight( const CBaseEntity *viewer, const CBaseEntity *subject, bool isClear );
+
+private:
+	struct LineOfSight
+	{
+		float timestamp;
+		bool isClear;
+	};
+	CUtlHashtable< uint64, LineOfSight > m_lineOfSight;			// keyed by viewer and subject handles
+
+	struct Query
+	{
+		uint64 key;
+		const CBaseEntity *subject;
+		Vector eye;
+		Vector spot[3];											// the subject's center, eyes and feet, in the order IsLineOfSightClearToEntity() tries them
+		int ray;												// index into m_rays of the spot being tried
+		bool isClear;
+	};
+	CUtlVector< Query > m_queries;
+
+	struct Ray
+	{
+		Vector from;
+		Vector to;
+		const CBaseEntity *ignore;
+		bool isClear;
+
+		bool operator==( const Ray &other ) const	{ return from == other.from && to == other.to && ignore == other.ignore; }
+	};
+	struct RayHash
+	{
+		unsigned int operator()( const Ray &ray ) const;
+	};
+	CUtlVector< Ray > m_rays;
+	CUtlHashtable< Ray, int, RayHash > m_rayIndex;
+
+	static uint64 GetKey( const CBaseEntity *viewer, const CBaseEntity *subject );
+	int AddRay( const Vector &from, const Vector &to, const CBaseEntity *subject );
+	static void TraceRay( Ray &ray );
+};
+
+extern NextBotVisibility TheNextBotVisibility;
+
+
+#endif // _NEXT_BOT_VISIBILITY_H_
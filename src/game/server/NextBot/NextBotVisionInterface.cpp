@@ -12,6 +12,7 @@
 #include "NextBotVisionInterface.h"
 #include "NextBotBodyInterface.h"
 #include "NextBotUtil.h"
+#include "NextBotVisibility.h"
 
 #ifdef TERROR
 #include "querycache.h"
@@ -569,6 +570,29 @@ bool IVision::IsAbleToSee( CBaseEntity *subject, FieldOfViewCheckType checkFOV,
 {
 	VPROF_BUDGET( "IVision::IsAbleToSee", "NextBotExpensive" );
 
+	if ( !IsPotentiallyAbleToSee( subject, checkFOV ) )
+	{
+		return false;
+	}
+
+	// do actual line-of-sight trace
+	if ( !IsLineOfSightClearToEntity( subject ) )
+	{
+		return false;
+	}
+
+	return IsVisibleEntityNoticed( subject );
+}
+
+
+//------------------------------------------------------------------------------------------
+/**
+ * Return true if the subject is in range, not hidden by fog, in our field of view if asked,
+ * and in a nav area that is potentially visible from ours. Only a line-of-sight trace can
+ * tell if we actually see it.
+ */
+bool IVision::IsPotentiallyAbleToSee( CBaseEntity *subject, FieldOfViewCheckType checkFOV ) const
+{
 	if ( GetBot()->IsRangeGreaterThan( subject, GetMaxVisionRange() ) )
 	{
 		return false;
@@ -601,13 +625,7 @@ bool IVision::IsAbleToSee( CBaseEntity *subject, FieldOfViewCheckType checkFOV,
 		}
 	}
 
-	// do actual line-of-sight trace
-	if ( !IsLineOfSightClearToEntity( subject ) )
-	{
-		return false;
-	}
-
-	return IsVisibleEntityNoticed( subject );
+	return true;
 }
 
 
@@ -749,6 +767,13 @@ bool IVision::IsLineOfSightClearToEntity( const CBaseEntity *subject, Vector *vi
 	// TODO: Use plain-old traces until querycache/etc gets integrated
 	VPROF_BUDGET( "IVision::IsLineOfSightClearToEntity", "NextBot" );
 
+	// another bot may have just traced the same thing, or it was traced ahead of our update
+	bool isClear;
+	if ( !visibleSpot && TheNextBotVisibility.GetLineOfSight( GetBot()->GetEntity(), subject, &isClear ) )
+	{
+		return isClear;
+	}
+
 	trace_t result;
 	NextBotTraceFilterIgnoreActors filter( subject, COLLISION_GROUP_NONE );
 
@@ -768,7 +793,10 @@ bool IVision::IsLineOfSightClearToEntity( const CBaseEntity *subject, Vector *vi
 		*visibleSpot = result.endpos;
 	}
 
-	return ( result.fraction >= 1.0f && !result.startsolid );
+	isClear = ( result.fraction >= 1.0f && !result.startsolid );
+	TheNextBotVisibility.SetLineOfSight( GetBot()->GetEntity(), subject, isClear );
+
+	return isClear;
 
 #endif
 }
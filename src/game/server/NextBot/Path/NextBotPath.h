@@ -27,8 +27,19 @@ class IPathCost
 {
 public:
 	virtual float operator()( CNavArea *area, CNavArea *fromArea, const CNavLadder *ladder, const CFuncElevator *elevator, float length ) const = 0;
+
+	// identify this cost for cached cluster routes, see NavCostFunctorRouteKey()
+	virtual bool GetClusterRouteKey( intp *kind, unsigned int *state ) const
+	{
+		return false;
+	}
 };
 
+inline bool NavCostFunctorRouteKey( const IPathCost *costFunc, intp *kind, unsigned int *state )
+{
+	return costFunc->GetClusterRouteKey( kind, state );
+}
+
 
 //---------------------------------------------------------------------------------------------------------------
 /**
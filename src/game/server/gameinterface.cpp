@@ -89,6 +89,7 @@
 #include "tier3/tier3.h"
 #include "serverbenchmark_base.h"
 #include "querycache.h"
+#include "bone_setup.h"
 #include "player_voice_listener.h"
 
 #ifdef TF_DLL
@@ -1407,6 +1408,9 @@ void CServerGameDLL::LevelShutdown( void )
 	g_pParticleSystemMgr->UncacheAllParticleSystems();
 	g_pParticleSystemMgr->RecreateDictionary();
 
+	// cached animation frames point into model headers that may be unloaded now
+	Studio_FlushAnimFrameCache();
+
 	g_nCurrentChapterIndex = -1;
 
 #ifndef _XBOX
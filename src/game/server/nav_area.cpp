@@ -186,6 +186,7 @@ CNavArea::CNavArea( void )
 
 	m_parent = NULL;
 	m_parentHow = GO_NORTH;
+	m_clusterID = -1;
 	m_attributeFlags = 0;
 	m_place = TheNavMesh->GetNavPlace();
 	m_isUnderwater = false;
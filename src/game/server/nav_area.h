@@ -247,6 +247,8 @@ protected:
 
 	/* 128*/	CFuncElevator *m_elevator;									// if non-NULL, this area is in an elevator's path. The elevator can transport us vertically to another area.
 
+	/* 132*/	int m_clusterID;											// the cluster this area is in for hierarchical pathfinding, or -1 if none
+
 	// --- End critical data --- 
 };
 
@@ -275,6 +277,8 @@ public:
 	virtual void Save( CUtlBuffer &fileBuffer, unsigned int version ) const;	// (EXTEND)
 	virtual NavErrorType Load( CUtlBuffer &fileBuffer, unsigned int version, unsigned int subVersion );		// (EXTEND)
 	virtual NavErrorType PostLoad( void );								// (EXTEND) invoked after all areas have been loaded - for pointer binding, etc
+	virtual void SaveFlatCustomData( CUtlBuffer &fileBuffer ) const { }						// (EXTEND) store custom area data for derived classes in a flat nav file
+	virtual NavErrorType LoadFlatCustomData( CUtlBuffer &fileBuffer, unsigned int subVersion ) { return NAV_OK; }	// (EXTEND) load custom area data for derived classes from a flat nav file
 
 	virtual void SaveToSelectedSet( KeyValues *areaKey ) const;		// (EXTEND) saves attributes for the area to a KeyValues
 	virtual void RestoreFromSelectedSet( KeyValues *areaKey );		// (EXTEND) restores attributes from a KeyValues
@@ -446,6 +450,8 @@ public:
 
 	static void ClearSearchLists( void );						// clears the open and closed lists for a new search
 
+	int GetClusterID( void ) const		{ return m_clusterID; }	// cluster this area is in (see CNavClusterGraph), or -1 if none
+
 	void SetTotalCost( float value )	{ DebuggerBreakOnNaN_StagingOnly( value ); Assert( value >= 0.0 && !IS_NAN(value) ); m_totalCost = value; }
 	float GetTotalCost( void ) const	{ DebuggerBreakOnNaN_StagingOnly( m_totalCost ); return m_totalCost; }
 
@@ -643,6 +649,7 @@ public:
 private:
 	friend class CNavMesh;
 	friend class CNavLadder;
+	friend class CNavClusterGraph;
 	friend class CCSNavArea;									// allow CS load code to complete replace our default load behavior
 
 	static bool m_isReset;										// if true, don't bother cleaning up in destructor since everything is going away
@@ -692,6 +699,7 @@ private:
 	//- encounter spots ---------------------------------------------------------------------------------
 	SpotEncounterVector m_spotEncounters;						// list of possible ways to move thru this area, and the spots to look at as we do
 	void AddSpotEncounters( const CNavArea *from, NavDirType fromDir, const CNavArea *to, NavDirType toDir );	// add spot encounter data when moving from area to area
+	void ComputeSpotEncounterPath( SpotEncounter *e ) const;	// compute the path segment of an encounter whose areas are bound
 
 	float m_earliestOccupyTime[ MAX_NAV_TEAMS ];				// min time to reach this spot from spawn
 
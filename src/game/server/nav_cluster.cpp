@@ -0,0 +1,316 @@
+// nav_cluster.cpp
+// Clusters of nav areas, and the routes recent paths took through them
+//========= Copyright Valve Corporation, All rights reserved. ============//
+
+#include "cbase.h"
+#include "tier0/vprof.h"
+#include "tier1/generichash.h"
+
+#include "nav_mesh.h"
+#include "nav_cluster.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+
+ConVar nav_cluster_paths( "nav_cluster_paths", "0", FCVAR_GAMEDLL | FCVAR_CHEAT, "Limit path searches to the clusters of nav areas a recent path between the same clusters went through." );
+
+#define NAV_CLUSTER_MAX_AREAS		48		// most areas in one cluster
+#define NAV_CLUSTER_MAX_RADIUS		750.0f	// how far from its first area a cluster can reach
+#define NAV_CLUSTER_ROUTE_CACHE_SIZE	512		// most routes we remember
+#define NAV_CLUSTER_ROUTE_COST_SLACK	1.25f	// how much more than its learned cost a path along a route may cost before we look for a better one
+
+CNavClusterGraph TheNavClusters;
+
+
+//--------------------------------------------------------------------------------------------------------------
+CNavClusterGraph::CNavClusterGraph( void ) : m_routes( 0, NAV_CLUSTER_ROUTE_CACHE_SIZE )
+{
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+bool CNavClusterGraph::IsEnabled( void ) const
+{
+	return nav_cluster_paths.GetBool() && m_clusters.Count() > 0;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Grow clusters outward over floor connections from each area that isn't in one yet, until they
+ * are big enough or get too far from where they started. Then find each cluster's portals, and the
+ * clusters they lead into.
+ */
+void CNavClusterGraph::Build( void )
+{
+	VPROF( "CNavClusterGraph::Build" );
+
+	Reset();
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		TheNavAreas[ it ]->m_clusterID = -1;
+	}
+
+	CUtlVector< CNavArea * > queue;
+	FOR_EACH_VEC( TheNavAreas, sit )
+	{
+		CNavArea *seed = TheNavAreas[ sit ];
+		if ( seed->m_clusterID >= 0 )
+			continue;
+
+		int clusterID = m_clusters.AddToTail();
+		Cluster &cluster = m_clusters[ clusterID ];
+		cluster.m_areaCount = 0;
+		cluster.m_portalAreaCount = 0;
+
+		queue.RemoveAll();
+		queue.AddToTail( seed );
+		seed->m_clusterID = clusterID;
+
+		for ( int q = 0; q < queue.Count() && cluster.m_areaCount < NAV_CLUSTER_MAX_AREAS; ++q )
+		{
+			CNavArea *area = queue[ q ];
+			++cluster.m_areaCount;
+
+			for ( int dir = 0; dir < NUM_DIRECTIONS; ++dir )
+			{
+				const NavConnectVector *floorList = area->GetAdjacentAreas( (NavDirType)dir );
+				FOR_EACH_VEC( (*floorList), cit )
+				{
+					CNavArea *adjArea = (*floorList)[ cit ].area;
+					if ( adjArea->m_clusterID >= 0 )
+						continue;
+
+					if ( ( adjArea->GetCenter() - seed->GetCenter() ).AsVector2D().LengthSqr() > NAV_CLUSTER_MAX_RADIUS * NAV_CLUSTER_MAX_RADIUS )
+						continue;
+
+					adjArea->m_clusterID = clusterID;
+					queue.AddToTail( adjArea );
+				}
+			}
+		}
+
+		// anything queued that didn't fit is left for a later cluster
+		for ( int q = cluster.m_areaCount; q < queue.Count(); ++q )
+		{
+			queue[ q ]->m_clusterID = -1;
+		}
+	}
+
+	// an area is a portal if any of its ways out lead into another cluster
+	FOR_EACH_VEC( TheNavAreas, pit )
+	{
+		CNavArea *area = TheNavAreas[ pit ];
+		int cluster = area->m_clusterID;
+		bool isPortal = false;
+
+		for ( int dir = 0; dir < NUM_DIRECTIONS; ++dir )
+		{
+			const NavConnectVector *floorList = area->GetAdjacentAreas( (NavDirType)dir );
+			FOR_EACH_VEC( (*floorList), cit )
+			{
+				if ( (*floorList)[ cit ].area->m_clusterID != cluster )
+				{
+					AddNeighbor( cluster, (*floorList)[ cit ].area );
+					isPortal = true;
+				}
+			}
+		}
+
+		for ( int ladderDir = 0; ladderDir < CNavLadder::NUM_LADDER_DIRECTIONS; ++ladderDir )
+		{
+			const NavLadderConnectVector *ladderList = area->GetLadders( (CNavLadder::LadderDirectionType)ladderDir );
+			FOR_EACH_VEC( (*ladderList), lit )
+			{
+				const CNavLadder *ladder = (*ladderList)[ lit ].ladder;
+				AddNeighbor( cluster, ladder->m_topForwardArea );
+				AddNeighbor( cluster, ladder->m_topLeftArea );
+				AddNeighbor( cluster, ladder->m_topRightArea );
+				AddNeighbor( cluster, ladder->m_topBehindArea );
+				AddNeighbor( cluster, ladder->m_bottomArea );
+				isPortal = true;
+			}
+		}
+
+		const NavConnectVector &elevatorList = area->GetElevatorAreas();
+		FOR_EACH_VEC( elevatorList, eit )
+		{
+			AddNeighbor( cluster, elevatorList[ eit ].area );
+			isPortal = true;
+		}
+
+		if ( isPortal )
+		{
+			++m_clusters[ cluster ].m_portalAreaCount;
+		}
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavClusterGraph::AddNeighbor( int cluster, const CNavArea *area )
+{
+	if ( !area || area->m_clusterID < 0 || area->m_clusterID == cluster )
+		return;
+
+	CUtlVector< int > &neighbors = m_clusters[ cluster ].m_neighbors;
+	if ( neighbors.Find( area->m_clusterID ) == neighbors.InvalidIndex() )
+	{
+		neighbors.AddToTail( area->m_clusterID );
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavClusterGraph::Reset( void )
+{
+	m_clusters.RemoveAll();
+	m_routes.RemoveAll();
+	m_routeIndex.RemoveAll();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+unsigned int CNavClusterGraph::RouteKeyHash::operator()( const NavClusterRouteKey &key ) const
+{
+	unsigned int hash = HashInt( key.m_startCluster );
+	hash = hash * 31 + HashInt( key.m_goalCluster );
+	hash = hash * 31 + HashInt( key.m_teamID * 2 + ( key.m_ignoreNavBlockers ? 1 : 0 ) );
+	hash = hash * 31 + (unsigned int)HashIntp( key.m_costKind );
+	hash = hash * 31 + HashInt( key.m_costState );
+	return hash;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+const CNavClusterRoute *CNavClusterGraph::FindRoute( const NavClusterRouteKey &key )
+{
+	UtlHashHandle_t h = m_routeIndex.Find( key );
+	if ( h == m_routeIndex.InvalidHandle() )
+		return NULL;
+
+	// most recently used goes to the front
+	unsigned short index = m_routeIndex.Element( h );
+	m_routes.Unlink( index );
+	m_routes.LinkToHead( index );
+
+	return &m_routes[ index ].m_route;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Remember which clusters the path that NavAreaBuildPath() just found went through, by following
+ * parent pointers back from the goal. The clusters next to those are included too, so a later search
+ * can still get around something that has moved onto the path since, without leaving the route.
+ */
+void CNavClusterGraph::AddRoute( const NavClusterRouteKey &key, const CNavArea *goalArea, float costRatio )
+{
+	if ( m_routeIndex.Find( key ) != m_routeIndex.InvalidHandle() )
+		return;
+
+	if ( m_routes.Count() >= NAV_CLUSTER_ROUTE_CACHE_SIZE )
+	{
+		RemoveRouteAt( m_routes.Tail() );
+	}
+
+	unsigned short index = m_routes.AddToHead();
+	CachedRoute &cached = m_routes[ index ];
+	cached.m_key = key;
+	cached.m_route.m_clusters.Resize( m_clusters.Count(), true );
+	cached.m_route.m_maxCostRatio = costRatio * NAV_CLUSTER_ROUTE_COST_SLACK;
+
+	int lastCluster = -1;
+	for ( const CNavArea *area = goalArea; area; area = area->GetParent() )
+	{
+		int cluster = area->GetClusterID();
+		if ( cluster >= 0 && cluster != lastCluster )
+		{
+			lastCluster = cluster;
+			cached.m_route.m_clusters.Set( cluster );
+
+			const CUtlVector< int > &neighbors = m_clusters[ cluster ].m_neighbors;
+			FOR_EACH_VEC( neighbors, nit )
+			{
+				cached.m_route.m_clusters.Set( neighbors[ nit ] );
+			}
+		}
+	}
+
+	m_routeIndex.Insert( key, index );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavClusterGraph::RemoveRoute( const NavClusterRouteKey &key )
+{
+	UtlHashHandle_t h = m_routeIndex.Find( key );
+	if ( h != m_routeIndex.InvalidHandle() )
+	{
+		RemoveRouteAt( m_routeIndex.Element( h ) );
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavClusterGraph::RemoveRouteAt( unsigned short index )
+{
+	m_routeIndex.Remove( m_routes[ index ].m_key );
+	m_routes.Remove( index );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavClusterGraph::OnAreaBlocked( const CNavArea *area )
+{
+	int cluster = area->GetClusterID();
+	if ( cluster < 0 )
+		return;
+
+	unsigned short index = m_routes.Head();
+	while ( index != m_routes.InvalidIndex() )
+	{
+		unsigned short next = m_routes.Next( index );
+		if ( m_routes[ index ].m_route.Contains( cluster ) )
+		{
+			RemoveRouteAt( index );
+		}
+		index = next;
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+void CNavClusterGraph::OnAreaUnblocked( const CNavArea *area )
+{
+	m_routes.RemoveAll();
+	m_routeIndex.RemoveAll();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CON_COMMAND_F( nav_cluster_info, "Show how the Navigation Mesh is split into clusters for pathfinding.", FCVAR_GAMEDLL | FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	int clusterCount = TheNavClusters.GetClusterCount();
+	if ( clusterCount == 0 )
+	{
+		Msg( "No nav clusters.\n" );
+		return;
+	}
+
+	int portalAreaCount = 0;
+	int largest = 0;
+	for ( int i = 0; i < clusterCount; ++i )
+	{
+		portalAreaCount += TheNavClusters.GetPortalAreaCount( i );
+		largest = MAX( largest, TheNavClusters.GetAreaCount( i ) );
+	}
+
+	Msg( "%d areas in %d clusters (%.1f areas on average, %d at most), %d portal areas, %d cached routes\n",
+		 TheNavAreas.Count(), clusterCount, (float)TheNavAreas.Count() / clusterCount, largest, portalAreaCount, TheNavClusters.GetRouteCount() );
+}
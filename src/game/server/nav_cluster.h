@@ -0,0 +1,139 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose:
+//
+// $NoKeywords: $
+//===========================================================================//
+
+// Clusters of nav areas, and the routes recent paths took through them
+
+#ifndef _NAV_CLUSTER_H_
+#define _NAV_CLUSTER_H_
+
+#include "bitvec.h"
+#include "utllinkedlist.h"
+#include "tier1/utlhashtable.h"
+#include "tier1/generichash.h"
+
+class CNavArea;
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * What a cached cluster route was found for. Teams see different blocked areas and each cost
+ * functor, set up for a particular bot, has its own idea of the best way, so none of these share
+ * routes.
+ */
+struct NavClusterRouteKey
+{
+	int m_startCluster;
+	int m_goalCluster;
+	int m_teamID;
+	bool m_ignoreNavBlockers;
+	intp m_costKind;			// see NavCostFunctorRouteKey()
+	unsigned int m_costState;
+
+	bool operator==( const NavClusterRouteKey &other ) const
+	{
+		return m_startCluster == other.m_startCluster && m_goalCluster == other.m_goalCluster &&
+			   m_teamID == other.m_teamID && m_ignoreNavBlockers == other.m_ignoreNavBlockers &&
+			   m_costKind == other.m_costKind && m_costState == other.m_costState;
+	}
+};
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * The set of clusters a path between two clusters went through, and the clusters next to them.
+ * Later searches between the same clusters only expand areas inside it, and only keep what they
+ * find if it costs no more than the path the route was learned from, relative to how far apart
+ * the ends are.
+ */
+class CNavClusterRoute
+{
+public:
+	bool Contains( int cluster ) const
+	{
+		// areas created since the clusters were built don't belong to one, so never rule them out
+		return cluster < 0 || m_clusters.IsBitSet( cluster );
+	}
+
+	CVarBitVec m_clusters;
+	float m_maxCostRatio;		// most a path on this route may cost per unit of straight line distance
+};
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * The Navigation Mesh split into clusters of nearby, connected areas. Areas with connections into
+ * another cluster are its portals. A full A* search over the mesh is reduced to the clusters its
+ * result passed through, and that route is kept in a small LRU cache, so repeated searches between
+ * the same parts of the map only have to consider areas along the way.
+ */
+class CNavClusterGraph
+{
+public:
+	CNavClusterGraph( void );
+
+	void Build( void );								///< partition TheNavAreas into clusters, after a load
+	void Reset( void );								///< forget all clusters and routes
+
+	bool IsEnabled( void ) const;					///< true if NavAreaBuildPath() should use cached routes
+	int GetClusterCount( void ) const				{ return m_clusters.Count(); }
+	int GetAreaCount( int cluster ) const			{ return m_clusters[ cluster ].m_areaCount; }
+	int GetPortalAreaCount( int cluster ) const		{ return m_clusters[ cluster ].m_portalAreaCount; }
+	int GetRouteCount( void ) const					{ return m_routes.Count(); }
+
+	const CNavClusterRoute *FindRoute( const NavClusterRouteKey &key );	///< return the route for this key, or NULL
+	void AddRoute( const NavClusterRouteKey &key, const CNavArea *goalArea, float costRatio );	///< remember the clusters on the path found back from goalArea, and what it cost per unit of distance
+	void RemoveRoute( const NavClusterRouteKey &key );
+
+	void OnAreaBlocked( const CNavArea *area );		///< drop any route through this area's cluster
+	void OnAreaUnblocked( const CNavArea *area );	///< drop every route, since there may be a better way now
+
+private:
+	struct Cluster
+	{
+		int m_areaCount;
+		int m_portalAreaCount;						///< areas with a connection into another cluster
+		CUtlVector< int > m_neighbors;				///< clusters the portal areas lead into
+	};
+	CUtlVector< Cluster > m_clusters;
+
+	struct RouteKeyHash
+	{
+		unsigned int operator()( const NavClusterRouteKey &key ) const;
+	};
+
+	struct CachedRoute
+	{
+		NavClusterRouteKey m_key;
+		CNavClusterRoute m_route;
+	};
+	CUtlLinkedList< CachedRoute > m_routes;			///< most recently used first
+	CUtlHashtable< NavClusterRouteKey, unsigned short, RouteKeyHash > m_routeIndex;
+
+	void RemoveRouteAt( unsigned short index );
+	void AddNeighbor( int cluster, const CNavArea *area );
+};
+
+extern CNavClusterGraph TheNavClusters;
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Identifies the cost functor a path was built with, for NavClusterRouteKey: 'kind' tells functor
+ * types apart, and 'state' is a hash of whatever else its costs depend on besides the areas
+ * themselves, such as who it is finding a path for. Returns false if the functor can't say, in which
+ * case its searches are never narrowed to a cached route.
+ *
+ * Functors opt in by overloading this for a pointer to their own type, or for IPathCost by overriding
+ * IPathCost::GetClusterRouteKey().
+ */
+inline bool NavCostFunctorRouteKey( const void *costFunc, intp *kind, unsigned int *state )
+{
+	return false;
+}
+
+
+#endif // _NAV_CLUSTER_H_
@@ -11,6 +11,7 @@
 
 #include "cbase.h"
 #include "nav_mesh.h"
+#include "nav_flat.h"
 #include "gamerules.h"
 #include "datacache/imdlcache.h"
 
@@ -189,6 +190,21 @@ PlaceDirectory placeDirectory;
 	#define FORMAT_NAVFILE "maps\\%s.nav"
 	#define PATH_NAVFILE_EMBEDDED "maps\\embed.nav"
 #endif
+#define FORMAT_FLATNAVFILE "maps\\%s.fnav"
+
+ConVar nav_load_flat( "nav_load_flat", "1", FCVAR_GAMEDLL | FCVAR_CHEAT, "Load the map's flat nav file instead of its .nav file, if it has an up to date one." );
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return the name of this map's flat nav file, relative to the game directory
+ */
+static void GetFlatNavFilename( char *filename, int size )
+{
+	char maptmp[256];
+	const char *pszMapName = GetCleanMapName( STRING( gpGlobals->mapname ), maptmp );
+	Q_snprintf( filename, size, FORMAT_FLATNAVFILE, pszMapName );
+}
+
 
 //--------------------------------------------------------------------------------------------------------------
 /**
@@ -751,14 +767,7 @@ NavErrorType CNavArea::PostLoad( void )
 
 		if (e->from.area && e->to.area)
 		{
-			// compute path
-			float halfWidth;
-			ComputePortal( e->to.area, e->toDir, &e->path.to, &halfWidth );
-			ComputePortal( e->from.area, e->fromDir, &e->path.from, &halfWidth );
-
-			const float eyeHeight = HalfHumanHeight;
-			e->path.from.z = e->from.area->GetZ( e->path.from ) + eyeHeight;
-			e->path.to.z = e->to.area->GetZ( e->path.to ) + eyeHeight;
+			ComputeSpotEncounterPath( e );
 		}
 
 		// resolve HidingSpot IDs
@@ -802,6 +811,22 @@ NavErrorType CNavArea::PostLoad( void )
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Compute the path segment through this area of an encounter whose areas are bound
+ */
+void CNavArea::ComputeSpotEncounterPath( SpotEncounter *e ) const
+{
+	float halfWidth;
+	ComputePortal( e->to.area, e->toDir, &e->path.to, &halfWidth );
+	ComputePortal( e->from.area, e->fromDir, &e->path.from, &halfWidth );
+
+	const float eyeHeight = HalfHumanHeight;
+	e->path.from.z = e->from.area->GetZ( e->path.from ) + eyeHeight;
+	e->path.to.z = e->to.area->GetZ( e->path.to ) + eyeHeight;
+}
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Compute travel distance along shortest path from startPos to goalPos. 
@@ -1220,6 +1245,14 @@ bool CNavMesh::Save( void ) const
 	unsigned int navSize = filesystem->Size( filename );
 	DevMsg( "Size of nav file '%s' is %u bytes.\n", filename, navSize );
 
+	// keep the flat nav file in step, if there is one
+	char flatFilename[MAX_PATH];
+	GetFlatNavFilename( flatFilename, sizeof( flatFilename ) );
+	if ( filesystem->FileExists( flatFilename, "MOD" ) )
+	{
+		SaveFlat();
+	}
+
 	return true;
 }
 
@@ -1446,6 +1479,27 @@ NavErrorType CNavMesh::Load( void )
 
 	CNavArea::m_nextID = 1;
 
+	if ( nav_load_flat.GetBool() )
+	{
+		NavErrorType flatResult = LoadFlat();
+		if ( flatResult == NAV_OK )
+		{
+			// the areas are already bound, the rest is as for a .nav file
+			m_isLoadingFlat = true;
+			NavErrorType loadResult = PostLoad( NavCurrentVersion );
+			m_isLoadingFlat = false;
+
+			WarnIfMeshNeedsAnalysis( NavCurrentVersion );
+
+			return loadResult;
+		}
+
+		if ( flatResult != NAV_CANT_ACCESS_FILE )
+		{
+			DevMsg( "The flat navigation file is out of date or invalid, loading the .nav file instead.\n" );
+		}
+	}
+
 	bool navIsInBsp = false;
 	CUtlBuffer fileBuffer( 4096, 1024*1024, CUtlBuffer::READ_ONLY );
 	NavErrorType readResult = GetNavDataFromFile( fileBuffer, &navIsInBsp );
@@ -1632,11 +1686,14 @@ struct OneWayLink_t
  */
 NavErrorType CNavMesh::PostLoad( unsigned int version )
 {
-	// allow areas to connect to each other, etc
-	FOR_EACH_VEC( TheNavAreas, pit )
+	// allow areas to connect to each other, etc - areas from a flat nav file were bound as they were loaded
+	if ( !m_isLoadingFlat )
 	{
-		CNavArea *area = TheNavAreas[ pit ];
-		area->PostLoad();
+		FOR_EACH_VEC( TheNavAreas, pit )
+		{
+			CNavArea *area = TheNavAreas[ pit ];
+			area->PostLoad();
+		}
 	}
 
 	// allow hiding spots to compute information
@@ -1712,6 +1769,9 @@ NavErrorType CNavMesh::PostLoad( unsigned int version )
 
 	ValidateNavAreaConnections();
 
+	// group areas into clusters for hierarchical pathfinding
+	TheNavClusters.Build();
+
 	// TERROR: loading into a map directly creates entities before the mesh is loaded.  Tell the preexisting
 	// entities now that the mesh is loaded so they can update areas.
 	for ( int i=0; i<m_avoidanceObstacles.Count(); ++i )
@@ -1724,3 +1784,787 @@ NavErrorType CNavMesh::PostLoad( unsigned int version )
 	
 	return NAV_OK;
 }
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return the index a flat nav file gives the object with the given ID, or NAV_FLAT_NO_INDEX
+ */
+static unsigned int GetFlatIndex( const CUtlHashtable< unsigned int, unsigned int > &indexByID, unsigned int id )
+{
+	UtlHashHandle_t h = indexByID.Find( id );
+	return ( h == indexByID.InvalidHandle() ) ? NAV_FLAT_NO_INDEX : indexByID.Element( h );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Store Navigation Mesh to a flat nav file, laid out as described in nav_flat.h
+ */
+bool CNavMesh::SaveFlat( void ) const
+{
+	char filename[MAX_PATH];
+	GetFlatNavFilename( filename, sizeof( filename ) );
+	COM_FixSlashes( filename );
+
+	//
+	// Number the areas, ladders and hiding spots in the order they are stored
+	//
+	CUtlHashtable< unsigned int, unsigned int > areaIndex;
+	CUtlHashtable< unsigned int, unsigned int > ladderIndex;
+	CUtlHashtable< unsigned int, unsigned int > spotIndex;
+
+	CUtlVector< NavFlatArea > areas;
+	CUtlVector< NavFlatHidingSpot > hidingSpots;
+	areas.SetCount( TheNavAreas.Count() );
+
+	placeDirectory.Reset();
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		const CNavArea *area = TheNavAreas[ it ];
+		areaIndex.Insert( area->GetID(), it );
+
+		placeDirectory.AddPlace( area->GetPlace() );
+
+		NavFlatArea &flat = areas[ it ];
+		flat.hidingSpots.first = hidingSpots.Count();
+		flat.hidingSpots.count = area->m_hidingSpots.Count();
+
+		FOR_EACH_VEC( area->m_hidingSpots, sit )
+		{
+			const HidingSpot *spot = area->m_hidingSpots[ sit ];
+			spotIndex.Insert( spot->GetID(), hidingSpots.Count() );
+
+			NavFlatHidingSpot &flatSpot = hidingSpots[ hidingSpots.AddToTail() ];
+			flatSpot.id = spot->GetID();
+			flatSpot.pos = spot->GetPosition();
+			flatSpot.flags = spot->GetFlags();
+		}
+	}
+
+	CUtlVector< NavFlatLadder > ladders;
+	ladders.SetCount( m_ladders.Count() );
+
+	FOR_EACH_VEC( m_ladders, lit )
+	{
+		ladderIndex.Insert( m_ladders[ lit ]->GetID(), lit );
+	}
+
+	FOR_EACH_VEC( m_ladders, lit )
+	{
+		const CNavLadder *ladder = m_ladders[ lit ];
+		NavFlatLadder &flat = ladders[ lit ];
+
+		flat.id = ladder->GetID();
+		flat.width = ladder->m_width;
+		flat.top = ladder->m_top;
+		flat.bottom = ladder->m_bottom;
+		flat.length = ladder->m_length;
+		flat.dir = ladder->GetDir();
+		flat.topForwardArea = ladder->m_topForwardArea ? GetFlatIndex( areaIndex, ladder->m_topForwardArea->GetID() ) : NAV_FLAT_NO_INDEX;
+		flat.topLeftArea = ladder->m_topLeftArea ? GetFlatIndex( areaIndex, ladder->m_topLeftArea->GetID() ) : NAV_FLAT_NO_INDEX;
+		flat.topRightArea = ladder->m_topRightArea ? GetFlatIndex( areaIndex, ladder->m_topRightArea->GetID() ) : NAV_FLAT_NO_INDEX;
+		flat.topBehindArea = ladder->m_topBehindArea ? GetFlatIndex( areaIndex, ladder->m_topBehindArea->GetID() ) : NAV_FLAT_NO_INDEX;
+		flat.bottomArea = ladder->m_bottomArea ? GetFlatIndex( areaIndex, ladder->m_bottomArea->GetID() ) : NAV_FLAT_NO_INDEX;
+	}
+
+	//
+	// Store each area's data, and the lists it refers to
+	//
+	CUtlVector< unsigned int > connections;
+	CUtlVector< unsigned int > ladderConnections;
+	CUtlVector< NavFlatEncounter > encounters;
+	CUtlVector< NavFlatEncounterSpot > encounterSpots;
+	CUtlVector< NavFlatVisibleArea > visibleAreas;
+	CUtlBuffer areaCustom;
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		const CNavArea *area = TheNavAreas[ it ];
+		NavFlatArea &flat = areas[ it ];
+
+		flat.id = area->GetID();
+		flat.attributeFlags = area->m_attributeFlags;
+		flat.nwCorner = area->m_nwCorner;
+		flat.seCorner = area->m_seCorner;
+		flat.neZ = area->m_neZ;
+		flat.swZ = area->m_swZ;
+		flat.place = placeDirectory.GetIndex( area->GetPlace() );
+
+		for( int i=0; i<MAX_NAV_TEAMS; ++i )
+		{
+			flat.earliestOccupyTime[i] = area->m_earliestOccupyTime[i];
+		}
+
+		for( int i=0; i<NUM_CORNERS; ++i )
+		{
+			flat.lightIntensity[i] = area->m_lightIntensity[i];
+		}
+
+		flat.inheritVisibilityFrom = area->m_inheritVisibilityFrom.area ? GetFlatIndex( areaIndex, area->m_inheritVisibilityFrom.area->GetID() ) : NAV_FLAT_NO_INDEX;
+
+		for( int d=0; d<NUM_DIRECTIONS; d++ )
+		{
+			flat.connect[d].first = connections.Count();
+			FOR_EACH_VEC( area->m_connect[d], cit )
+			{
+				unsigned int index = GetFlatIndex( areaIndex, area->m_connect[d][ cit ].area->GetID() );
+				if ( index != NAV_FLAT_NO_INDEX )
+				{
+					connections.AddToTail( index );
+				}
+			}
+			flat.connect[d].count = connections.Count() - flat.connect[d].first;
+		}
+
+		for( int dir=0; dir<CNavLadder::NUM_LADDER_DIRECTIONS; ++dir )
+		{
+			flat.ladder[dir].first = ladderConnections.Count();
+			FOR_EACH_VEC( area->m_ladder[dir], lit )
+			{
+				unsigned int index = GetFlatIndex( ladderIndex, area->m_ladder[dir][ lit ].ladder->GetID() );
+				if ( index != NAV_FLAT_NO_INDEX )
+				{
+					ladderConnections.AddToTail( index );
+				}
+			}
+			flat.ladder[dir].count = ladderConnections.Count() - flat.ladder[dir].first;
+		}
+
+		flat.encounters.first = encounters.Count();
+		FOR_EACH_VEC( area->m_spotEncounters, eit )
+		{
+			const SpotEncounter *e = area->m_spotEncounters[ eit ];
+			if ( !e->from.area || !e->to.area )
+				continue;
+
+			NavFlatEncounter flatEncounter;
+			flatEncounter.from = GetFlatIndex( areaIndex, e->from.area->GetID() );
+			flatEncounter.fromDir = e->fromDir;
+			flatEncounter.to = GetFlatIndex( areaIndex, e->to.area->GetID() );
+			flatEncounter.toDir = e->toDir;
+			if ( flatEncounter.from == NAV_FLAT_NO_INDEX || flatEncounter.to == NAV_FLAT_NO_INDEX )
+				continue;
+
+			flatEncounter.spots.first = encounterSpots.Count();
+			FOR_EACH_VEC( e->spots, sit )
+			{
+				const SpotOrder &order = e->spots[ sit ];
+
+				NavFlatEncounterSpot flatSpot;
+				flatSpot.spot = order.spot ? GetFlatIndex( spotIndex, order.spot->GetID() ) : NAV_FLAT_NO_INDEX;
+				flatSpot.t = order.t;
+				if ( flatSpot.spot != NAV_FLAT_NO_INDEX )
+				{
+					encounterSpots.AddToTail( flatSpot );
+				}
+			}
+			flatEncounter.spots.count = encounterSpots.Count() - flatEncounter.spots.first;
+
+			encounters.AddToTail( flatEncounter );
+		}
+		flat.encounters.count = encounters.Count() - flat.encounters.first;
+
+		flat.visibleAreas.first = visibleAreas.Count();
+		for( int vit=0; vit<area->m_potentiallyVisibleAreas.Count(); ++vit )
+		{
+			const CNavArea::AreaBindInfo &info = area->m_potentiallyVisibleAreas[ vit ];
+
+			NavFlatVisibleArea flatVisible;
+			flatVisible.area = info.area ? GetFlatIndex( areaIndex, info.area->GetID() ) : NAV_FLAT_NO_INDEX;
+			flatVisible.attributes = info.attributes;
+			if ( flatVisible.area != NAV_FLAT_NO_INDEX )
+			{
+				visibleAreas.AddToTail( flatVisible );
+			}
+		}
+		flat.visibleAreas.count = visibleAreas.Count() - flat.visibleAreas.first;
+
+		flat.custom.first = areaCustom.TellPut();
+		area->SaveFlatCustomData( areaCustom );
+		flat.custom.count = areaCustom.TellPut() - flat.custom.first;
+	}
+
+	CUtlBuffer places;
+	placeDirectory.Save( places );
+
+	CUtlBuffer customPreArea;
+	SaveCustomDataPreArea( customPreArea );
+
+	CUtlBuffer custom;
+	SaveCustomData( custom );
+
+	//
+	// Lay the sections out after the header
+	//
+	NavFlatHeader header;
+	V_memset( &header, 0, sizeof( header ) );
+
+	const void *sectionData[ NUM_NAV_FLAT_SECTIONS ];
+	unsigned int sectionSize[ NUM_NAV_FLAT_SECTIONS ];
+
+	sectionData[ NAV_FLAT_PLACES ] = places.Base();
+	sectionSize[ NAV_FLAT_PLACES ] = places.TellPut();
+	sectionData[ NAV_FLAT_CUSTOM_PRE_AREA ] = customPreArea.Base();
+	sectionSize[ NAV_FLAT_CUSTOM_PRE_AREA ] = customPreArea.TellPut();
+	sectionData[ NAV_FLAT_AREAS ] = areas.Base();
+	sectionSize[ NAV_FLAT_AREAS ] = areas.Count() * sizeof( NavFlatArea );
+	sectionData[ NAV_FLAT_CONNECTIONS ] = connections.Base();
+	sectionSize[ NAV_FLAT_CONNECTIONS ] = connections.Count() * sizeof( unsigned int );
+	sectionData[ NAV_FLAT_LADDER_CONNECTIONS ] = ladderConnections.Base();
+	sectionSize[ NAV_FLAT_LADDER_CONNECTIONS ] = ladderConnections.Count() * sizeof( unsigned int );
+	sectionData[ NAV_FLAT_HIDING_SPOTS ] = hidingSpots.Base();
+	sectionSize[ NAV_FLAT_HIDING_SPOTS ] = hidingSpots.Count() * sizeof( NavFlatHidingSpot );
+	sectionData[ NAV_FLAT_ENCOUNTERS ] = encounters.Base();
+	sectionSize[ NAV_FLAT_ENCOUNTERS ] = encounters.Count() * sizeof( NavFlatEncounter );
+	sectionData[ NAV_FLAT_ENCOUNTER_SPOTS ] = encounterSpots.Base();
+	sectionSize[ NAV_FLAT_ENCOUNTER_SPOTS ] = encounterSpots.Count() * sizeof( NavFlatEncounterSpot );
+	sectionData[ NAV_FLAT_VISIBLE_AREAS ] = visibleAreas.Base();
+	sectionSize[ NAV_FLAT_VISIBLE_AREAS ] = visibleAreas.Count() * sizeof( NavFlatVisibleArea );
+	sectionData[ NAV_FLAT_AREA_CUSTOM ] = areaCustom.Base();
+	sectionSize[ NAV_FLAT_AREA_CUSTOM ] = areaCustom.TellPut();
+	sectionData[ NAV_FLAT_LADDERS ] = ladders.Base();
+	sectionSize[ NAV_FLAT_LADDERS ] = ladders.Count() * sizeof( NavFlatLadder );
+	sectionData[ NAV_FLAT_CUSTOM ] = custom.Base();
+	sectionSize[ NAV_FLAT_CUSTOM ] = custom.TellPut();
+
+	unsigned int offset = sizeof( NavFlatHeader );
+	for( int i=0; i<NUM_NAV_FLAT_SECTIONS; ++i )
+	{
+		header.section[i].offset = offset;
+		header.section[i].size = sectionSize[i];
+		offset += AlignValue( sectionSize[i], 4 );
+	}
+
+	// remember which .nav file and bsp this was written from, to tell when it is out of date
+	char navFilename[MAX_PATH];
+	char bspFilename[MAX_PATH];
+	char maptmp[256];
+	const char *pszMapName = GetCleanMapName( STRING( gpGlobals->mapname ), maptmp );
+	Q_snprintf( navFilename, sizeof( navFilename ), FORMAT_NAVFILE, pszMapName );
+	Q_snprintf( bspFilename, sizeof( bspFilename ), FORMAT_BSPFILE, STRING( gpGlobals->mapname ) );
+
+	header.magic = NAV_FLAT_MAGIC_NUMBER;
+	header.version = NavFlatCurrentVersion;
+	header.navVersion = NavCurrentVersion;
+	header.subVersion = GetSubVersionNumber();
+	header.bspSize = filesystem->Size( bspFilename );
+	header.navFileSize = filesystem->Size( navFilename, "MOD" );
+	header.navFileTime = (unsigned int)filesystem->GetFileTime( navFilename, "MOD" );
+	header.isAnalyzed = m_isAnalyzed;
+
+	CUtlBuffer fileBuffer( 4096, offset );
+	fileBuffer.Put( &header, sizeof( NavFlatHeader ) );
+
+	const unsigned int padding = 0;
+	for( int i=0; i<NUM_NAV_FLAT_SECTIONS; ++i )
+	{
+		if ( sectionSize[i] )
+		{
+			fileBuffer.Put( sectionData[i], sectionSize[i] );
+			fileBuffer.Put( &padding, AlignValue( sectionSize[i], 4 ) - sectionSize[i] );
+		}
+	}
+
+	if ( !filesystem->WriteFile( filename, "MOD", fileBuffer ) )
+	{
+		Warning( "Unable to save %d bytes to %s\n", fileBuffer.Size(), filename );
+		return false;
+	}
+
+	DevMsg( "Size of flat nav file '%s' is %u bytes.\n", filename, offset );
+
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+static bool IsFlatRangeValid( const NavFlatRange &range, unsigned int count )
+{
+	return range.first <= count && range.count <= count - range.first;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+template < typename T >
+static const T *GetFlatSection( const byte *data, NavFlatSectionType type, unsigned int *count )
+{
+	const NavFlatSection &section = ( (const NavFlatHeader *)data )->section[ type ];
+	*count = section.size / sizeof( T );
+	return (const T *)( data + section.offset );
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Make sure every section of a flat nav file lies within it, and every index in it refers to
+ * something, so the mesh can be bound together from it without further checks.
+ */
+static NavErrorType CheckFlatNavData( const byte *data, unsigned int size )
+{
+	if ( size < sizeof( NavFlatHeader ) )
+		return NAV_INVALID_FILE;
+
+	const NavFlatHeader *header = (const NavFlatHeader *)data;
+	if ( header->magic != NAV_FLAT_MAGIC_NUMBER )
+		return NAV_INVALID_FILE;
+
+	if ( header->version != NavFlatCurrentVersion )
+		return NAV_BAD_FILE_VERSION;
+
+	// byte sections have no record size
+	static const unsigned int recordSize[ NUM_NAV_FLAT_SECTIONS ] =
+	{
+		1,
+		1,
+		sizeof( NavFlatArea ),
+		sizeof( unsigned int ),
+		sizeof( unsigned int ),
+		sizeof( NavFlatHidingSpot ),
+		sizeof( NavFlatEncounter ),
+		sizeof( NavFlatEncounterSpot ),
+		sizeof( NavFlatVisibleArea ),
+		1,
+		sizeof( NavFlatLadder ),
+		1,
+	};
+
+	for( int i=0; i<NUM_NAV_FLAT_SECTIONS; ++i )
+	{
+		const NavFlatSection &section = header->section[i];
+		if ( section.offset % 4 || section.offset > size || section.size > size - section.offset || section.size % recordSize[i] )
+			return NAV_INVALID_FILE;
+	}
+
+	unsigned int areaCount, connectionCount, ladderConnectionCount, spotCount, encounterCount, encounterSpotCount, visibleAreaCount, areaCustomSize, ladderCount;
+	const NavFlatArea *areas = GetFlatSection< NavFlatArea >( data, NAV_FLAT_AREAS, &areaCount );
+	const unsigned int *connections = GetFlatSection< unsigned int >( data, NAV_FLAT_CONNECTIONS, &connectionCount );
+	const unsigned int *ladderConnections = GetFlatSection< unsigned int >( data, NAV_FLAT_LADDER_CONNECTIONS, &ladderConnectionCount );
+	GetFlatSection< NavFlatHidingSpot >( data, NAV_FLAT_HIDING_SPOTS, &spotCount );
+	const NavFlatEncounter *encounters = GetFlatSection< NavFlatEncounter >( data, NAV_FLAT_ENCOUNTERS, &encounterCount );
+	const NavFlatEncounterSpot *encounterSpots = GetFlatSection< NavFlatEncounterSpot >( data, NAV_FLAT_ENCOUNTER_SPOTS, &encounterSpotCount );
+	const NavFlatVisibleArea *visibleAreas = GetFlatSection< NavFlatVisibleArea >( data, NAV_FLAT_VISIBLE_AREAS, &visibleAreaCount );
+	GetFlatSection< byte >( data, NAV_FLAT_AREA_CUSTOM, &areaCustomSize );
+	const NavFlatLadder *ladders = GetFlatSection< NavFlatLadder >( data, NAV_FLAT_LADDERS, &ladderCount );
+
+	if ( areaCount == 0 )
+		return NAV_INVALID_FILE;
+
+	for( unsigned int i=0; i<areaCount; ++i )
+	{
+		const NavFlatArea &area = areas[i];
+
+		for( int d=0; d<NUM_DIRECTIONS; d++ )
+		{
+			if ( !IsFlatRangeValid( area.connect[d], connectionCount ) )
+				return NAV_CORRUPT_DATA;
+		}
+
+		for( int dir=0; dir<CNavLadder::NUM_LADDER_DIRECTIONS; ++dir )
+		{
+			if ( !IsFlatRangeValid( area.ladder[dir], ladderConnectionCount ) )
+				return NAV_CORRUPT_DATA;
+		}
+
+		if ( !IsFlatRangeValid( area.hidingSpots, spotCount ) ||
+			 !IsFlatRangeValid( area.encounters, encounterCount ) ||
+			 !IsFlatRangeValid( area.visibleAreas, visibleAreaCount ) ||
+			 !IsFlatRangeValid( area.custom, areaCustomSize ) )
+			return NAV_CORRUPT_DATA;
+
+		if ( area.inheritVisibilityFrom != NAV_FLAT_NO_INDEX && area.inheritVisibilityFrom >= areaCount )
+			return NAV_CORRUPT_DATA;
+	}
+
+	for( unsigned int i=0; i<connectionCount; ++i )
+	{
+		if ( connections[i] >= areaCount )
+			return NAV_CORRUPT_DATA;
+	}
+
+	for( unsigned int i=0; i<ladderConnectionCount; ++i )
+	{
+		if ( ladderConnections[i] >= ladderCount )
+			return NAV_CORRUPT_DATA;
+	}
+
+	for( unsigned int i=0; i<encounterCount; ++i )
+	{
+		const NavFlatEncounter &e = encounters[i];
+		if ( e.from >= areaCount || e.to >= areaCount || e.fromDir >= NUM_DIRECTIONS || e.toDir >= NUM_DIRECTIONS || !IsFlatRangeValid( e.spots, encounterSpotCount ) )
+			return NAV_CORRUPT_DATA;
+	}
+
+	for( unsigned int i=0; i<encounterSpotCount; ++i )
+	{
+		if ( encounterSpots[i].spot >= spotCount )
+			return NAV_CORRUPT_DATA;
+	}
+
+	for( unsigned int i=0; i<visibleAreaCount; ++i )
+	{
+		if ( visibleAreas[i].area >= areaCount )
+			return NAV_CORRUPT_DATA;
+	}
+
+	for( unsigned int i=0; i<ladderCount; ++i )
+	{
+		const NavFlatLadder &ladder = ladders[i];
+		const unsigned int ladderAreas[] = { ladder.topForwardArea, ladder.topLeftArea, ladder.topRightArea, ladder.topBehindArea, ladder.bottomArea };
+		for( int a=0; a<ARRAYSIZE( ladderAreas ); ++a )
+		{
+			if ( ladderAreas[a] != NAV_FLAT_NO_INDEX && ladderAreas[a] >= areaCount )
+				return NAV_CORRUPT_DATA;
+		}
+
+		if ( ladder.dir >= NUM_DIRECTIONS )
+			return NAV_CORRUPT_DATA;
+	}
+
+	return NAV_OK;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Load AI navigation data from the map's flat nav file, binding areas, ladders and hiding spots
+ * together by index as they are created. Nothing is loaded unless the whole file is valid and it
+ * was written from the mesh in the current .nav file.
+ */
+NavErrorType CNavMesh::LoadFlat( void )
+{
+	// records are stored in the byte order of the machine that wrote them
+	if ( IsX360() )
+		return NAV_CANT_ACCESS_FILE;
+
+	char filename[MAX_PATH];
+	GetFlatNavFilename( filename, sizeof( filename ) );
+
+	void *buffer = NULL;
+	int size = filesystem->ReadFileEx( filename, "MOD", &buffer, false, true );
+	if ( !buffer )
+		return NAV_CANT_ACCESS_FILE;
+
+	const byte *data = (const byte *)buffer;
+	const NavFlatHeader *header = (const NavFlatHeader *)data;
+
+	NavErrorType result = CheckFlatNavData( data, MAX( size, 0 ) );
+	if ( result == NAV_OK )
+	{
+		char navFilename[MAX_PATH];
+		char maptmp[256];
+		const char *pszMapName = GetCleanMapName( STRING( gpGlobals->mapname ), maptmp );
+		Q_snprintf( navFilename, sizeof( navFilename ), FORMAT_NAVFILE, pszMapName );
+
+		// the .nav file is the master copy, so if it has changed since this was written, use it instead
+		if ( header->navVersion != (unsigned int)NavCurrentVersion ||
+			 header->subVersion != GetSubVersionNumber() ||
+			 header->navFileSize != filesystem->Size( navFilename, "MOD" ) ||
+			 header->navFileTime != (unsigned int)filesystem->GetFileTime( navFilename, "MOD" ) )
+		{
+			result = NAV_FILE_OUT_OF_DATE;
+		}
+	}
+
+	if ( result != NAV_OK )
+	{
+		filesystem->FreeOptimalReadBuffer( buffer );
+		return result;
+	}
+
+	// verify that the bsp hasn't changed
+	char bspFilename[MAX_PATH] = { 0 };
+	Q_snprintf( bspFilename, sizeof( bspFilename ), FORMAT_BSPFILE, STRING( gpGlobals->mapname ) );
+
+	if ( filesystem->Size( bspFilename ) != header->bspSize )
+	{
+		if ( engine->IsDedicatedServer() )
+		{
+			// Warning doesn't print to the dedicated server console, so we'll use Msg instead
+			DevMsg( "The Navigation Mesh was built using a different version of this map.\n" );
+		}
+		else
+		{
+			DevWarning( "The Navigation Mesh was built using a different version of this map.\n" );
+		}
+		m_isOutOfDate = true;
+	}
+
+	m_isAnalyzed = header->isAnalyzed != 0;
+
+	unsigned int areaCount, connectionCount, ladderConnectionCount, spotCount, encounterCount, encounterSpotCount, visibleAreaCount, ladderCount, blobSize;
+	const NavFlatArea *flatAreas = GetFlatSection< NavFlatArea >( data, NAV_FLAT_AREAS, &areaCount );
+	const unsigned int *connections = GetFlatSection< unsigned int >( data, NAV_FLAT_CONNECTIONS, &connectionCount );
+	const unsigned int *ladderConnections = GetFlatSection< unsigned int >( data, NAV_FLAT_LADDER_CONNECTIONS, &ladderConnectionCount );
+	const NavFlatHidingSpot *flatSpots = GetFlatSection< NavFlatHidingSpot >( data, NAV_FLAT_HIDING_SPOTS, &spotCount );
+	const NavFlatEncounter *encounters = GetFlatSection< NavFlatEncounter >( data, NAV_FLAT_ENCOUNTERS, &encounterCount );
+	const NavFlatEncounterSpot *encounterSpots = GetFlatSection< NavFlatEncounterSpot >( data, NAV_FLAT_ENCOUNTER_SPOTS, &encounterSpotCount );
+	const NavFlatVisibleArea *visibleAreas = GetFlatSection< NavFlatVisibleArea >( data, NAV_FLAT_VISIBLE_AREAS, &visibleAreaCount );
+	const byte *areaCustom = GetFlatSection< byte >( data, NAV_FLAT_AREA_CUSTOM, &blobSize );
+	const NavFlatLadder *flatLadders = GetFlatSection< NavFlatLadder >( data, NAV_FLAT_LADDERS, &ladderCount );
+
+	// load Place directory
+	const byte *places = GetFlatSection< byte >( data, NAV_FLAT_PLACES, &blobSize );
+	CUtlBuffer placeBuffer( places, blobSize, CUtlBuffer::READ_ONLY );
+	placeDirectory.Load( placeBuffer, NavCurrentVersion );
+
+	const byte *customPreArea = GetFlatSection< byte >( data, NAV_FLAT_CUSTOM_PRE_AREA, &blobSize );
+	CUtlBuffer customPreAreaBuffer( customPreArea, blobSize, CUtlBuffer::READ_ONLY );
+	LoadCustomDataPreArea( customPreAreaBuffer, header->subVersion );
+
+	//
+	// Create the hiding spots and areas, and compute total extent
+	//
+	CUtlVector< HidingSpot * > spots;
+	spots.EnsureCapacity( spotCount );
+
+	for( unsigned int i=0; i<spotCount; ++i )
+	{
+		const NavFlatHidingSpot &flat = flatSpots[i];
+
+		HidingSpot *spot = CreateHidingSpot();
+		spot->m_id = flat.id;
+		spot->m_pos = flat.pos;
+		spot->m_flags = (unsigned char)flat.flags;
+
+		// update next ID to avoid ID collisions by later spots
+		if ( spot->m_id >= HidingSpot::m_nextID )
+			HidingSpot::m_nextID = spot->m_id+1;
+
+		spots.AddToTail( spot );
+	}
+
+	Extent extent;
+	extent.lo.x = 9999999999.9f;
+	extent.lo.y = 9999999999.9f;
+	extent.hi.x = -9999999999.9f;
+	extent.hi.y = -9999999999.9f;
+
+	PreLoadAreas( areaCount );
+	TheNavAreas.EnsureCapacity( areaCount );
+	Extent areaExtent;
+	for( unsigned int i=0; i<areaCount; ++i )
+	{
+		const NavFlatArea &flat = flatAreas[i];
+
+		CNavArea *area = CreateArea();
+		area->m_id = flat.id;
+
+		// update nextID to avoid collisions
+		if ( area->m_id >= CNavArea::m_nextID )
+			CNavArea::m_nextID = area->m_id+1;
+
+		area->m_attributeFlags = flat.attributeFlags;
+		area->m_nwCorner = flat.nwCorner;
+		area->m_seCorner = flat.seCorner;
+
+		area->m_center.x = (area->m_nwCorner.x + area->m_seCorner.x)/2.0f;
+		area->m_center.y = (area->m_nwCorner.y + area->m_seCorner.y)/2.0f;
+		area->m_center.z = (area->m_nwCorner.z + area->m_seCorner.z)/2.0f;
+
+		if ( ( area->m_seCorner.x - area->m_nwCorner.x ) > 0.0f && ( area->m_seCorner.y - area->m_nwCorner.y ) > 0.0f )
+		{
+			area->m_invDxCorners = 1.0f / ( area->m_seCorner.x - area->m_nwCorner.x );
+			area->m_invDyCorners = 1.0f / ( area->m_seCorner.y - area->m_nwCorner.y );
+		}
+		else
+		{
+			area->m_invDxCorners = area->m_invDyCorners = 0;
+
+			DevWarning( "Degenerate Navigation Area #%d at setpos %g %g %g\n", 
+				area->m_id, area->m_center.x, area->m_center.y, area->m_center.z );
+		}
+
+		area->m_neZ = flat.neZ;
+		area->m_swZ = flat.swZ;
+
+		area->CheckWaterLevel();
+
+		area->SetPlace( placeDirectory.IndexToPlace( flat.place ) );
+
+		for( int t=0; t<MAX_NAV_TEAMS; ++t )
+		{
+			area->m_earliestOccupyTime[t] = flat.earliestOccupyTime[t];
+		}
+
+		for( int c=0; c<NUM_CORNERS; ++c )
+		{
+			area->m_lightIntensity[c] = flat.lightIntensity[c];
+		}
+
+		for( unsigned int h=0; h<flat.hidingSpots.count; ++h )
+		{
+			area->m_hidingSpots.AddToTail( spots[ flat.hidingSpots.first + h ] );
+		}
+
+		CUtlBuffer customBuffer( areaCustom + flat.custom.first, flat.custom.count, CUtlBuffer::READ_ONLY );
+		area->LoadFlatCustomData( customBuffer, header->subVersion );
+
+		TheNavAreas.AddToTail( area );
+
+		area->GetExtent( &areaExtent );
+
+		if (areaExtent.lo.x < extent.lo.x)
+			extent.lo.x = areaExtent.lo.x;
+		if (areaExtent.lo.y < extent.lo.y)
+			extent.lo.y = areaExtent.lo.y;
+		if (areaExtent.hi.x > extent.hi.x)
+			extent.hi.x = areaExtent.hi.x;
+		if (areaExtent.hi.y > extent.hi.y)
+			extent.hi.y = areaExtent.hi.y;
+	}
+
+	// add the areas to the grid
+	AllocateGrid( extent.lo.x, extent.hi.x, extent.lo.y, extent.hi.y );
+
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		AddNavArea( TheNavAreas[ it ] );
+	}
+
+	//
+	// Set up all the ladders
+	//
+	m_ladders.EnsureCapacity( ladderCount );
+
+	for( unsigned int i=0; i<ladderCount; ++i )
+	{
+		const NavFlatLadder &flat = flatLadders[i];
+
+		CNavLadder *ladder = new CNavLadder;
+		ladder->m_id = flat.id;
+
+		// update nextID to avoid collisions
+		if ( ladder->m_id >= CNavLadder::m_nextID )
+			CNavLadder::m_nextID = ladder->m_id+1;
+
+		ladder->m_width = flat.width;
+		ladder->m_top = flat.top;
+		ladder->m_bottom = flat.bottom;
+		ladder->m_length = flat.length;
+		ladder->SetDir( (NavDirType)flat.dir );
+
+		ladder->m_topForwardArea = ( flat.topForwardArea != NAV_FLAT_NO_INDEX ) ? TheNavAreas[ flat.topForwardArea ] : NULL;
+		ladder->m_topLeftArea = ( flat.topLeftArea != NAV_FLAT_NO_INDEX ) ? TheNavAreas[ flat.topLeftArea ] : NULL;
+		ladder->m_topRightArea = ( flat.topRightArea != NAV_FLAT_NO_INDEX ) ? TheNavAreas[ flat.topRightArea ] : NULL;
+		ladder->m_topBehindArea = ( flat.topBehindArea != NAV_FLAT_NO_INDEX ) ? TheNavAreas[ flat.topBehindArea ] : NULL;
+		ladder->m_bottomArea = ( flat.bottomArea != NAV_FLAT_NO_INDEX ) ? TheNavAreas[ flat.bottomArea ] : NULL;
+
+		ladder->FindLadderEntity();
+
+		m_ladders.AddToTail( ladder );
+	}
+
+	//
+	// Bind the areas together - what CNavArea::PostLoad() does for a .nav file
+	//
+	FOR_EACH_VEC( TheNavAreas, it )
+	{
+		CNavArea *area = TheNavAreas[ it ];
+		const NavFlatArea &flat = flatAreas[ it ];
+
+		for( int dir=0; dir<CNavLadder::NUM_LADDER_DIRECTIONS; ++dir )
+		{
+			area->m_ladder[dir].EnsureCapacity( flat.ladder[dir].count );
+			for( unsigned int l=0; l<flat.ladder[dir].count; ++l )
+			{
+				NavLadderConnect connect;
+				connect.ladder = m_ladders[ ladderConnections[ flat.ladder[dir].first + l ] ];
+				area->m_ladder[dir].AddToTail( connect );
+			}
+		}
+
+		for( int d=0; d<NUM_DIRECTIONS; d++ )
+		{
+			area->m_connect[d].EnsureCapacity( flat.connect[d].count );
+			for( unsigned int c=0; c<flat.connect[d].count; ++c )
+			{
+				NavConnect connect;
+				connect.area = TheNavAreas[ connections[ flat.connect[d].first + c ] ];
+
+				// don't allow self-referential connections
+				if ( connect.area == area )
+					continue;
+
+				connect.length = ( connect.area->GetCenter() - area->GetCenter() ).Length();
+				area->m_connect[d].AddToTail( connect );
+			}
+		}
+
+		for( unsigned int e=0; e<flat.encounters.count; ++e )
+		{
+			const NavFlatEncounter &flatEncounter = encounters[ flat.encounters.first + e ];
+
+			SpotEncounter *encounter = new SpotEncounter;
+			encounter->from.area = TheNavAreas[ flatEncounter.from ];
+			encounter->fromDir = (NavDirType)flatEncounter.fromDir;
+			encounter->to.area = TheNavAreas[ flatEncounter.to ];
+			encounter->toDir = (NavDirType)flatEncounter.toDir;
+
+			area->ComputeSpotEncounterPath( encounter );
+
+			encounter->spots.EnsureCapacity( flatEncounter.spots.count );
+			for( unsigned int s=0; s<flatEncounter.spots.count; ++s )
+			{
+				const NavFlatEncounterSpot &flatSpot = encounterSpots[ flatEncounter.spots.first + s ];
+
+				SpotOrder order;
+				order.spot = spots[ flatSpot.spot ];
+				order.t = flatSpot.t;
+				encounter->spots.AddToTail( order );
+			}
+
+			area->m_spotEncounters.AddToTail( encounter );
+		}
+
+		area->m_potentiallyVisibleAreas.EnsureCapacity( flat.visibleAreas.count );
+		for( unsigned int v=0; v<flat.visibleAreas.count; ++v )
+		{
+			const NavFlatVisibleArea &flatVisible = visibleAreas[ flat.visibleAreas.first + v ];
+
+			CNavArea::AreaBindInfo info;
+			info.area = TheNavAreas[ flatVisible.area ];
+			info.attributes = (unsigned char)flatVisible.attributes;
+			area->m_potentiallyVisibleAreas.AddToTail( info );
+		}
+
+		area->m_inheritVisibilityFrom.area = ( flat.inheritVisibilityFrom != NAV_FLAT_NO_INDEX ) ? TheNavAreas[ flat.inheritVisibilityFrom ] : NULL;
+
+		// func avoid/prefer attributes are controlled by func_nav_cost entities
+		area->ClearAllNavCostEntities();
+	}
+
+	// mark stairways
+	MarkStairAreas();
+
+	//
+	// Load derived class mesh info
+	//
+	const byte *custom = GetFlatSection< byte >( data, NAV_FLAT_CUSTOM, &blobSize );
+	CUtlBuffer customBuffer( custom, blobSize, CUtlBuffer::READ_ONLY );
+	LoadCustomData( customBuffer, header->subVersion );
+
+	filesystem->FreeOptimalReadBuffer( buffer );
+
+	return NAV_OK;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+CON_COMMAND_F( nav_convert_flat, "Write the Navigation Mesh to a flat nav file, which loads faster than the .nav file. Once there is one, saving the mesh keeps it up to date.", FCVAR_GAMEDLL | FCVAR_CHEAT )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( !TheNavMesh->IsLoaded() )
+	{
+		Msg( "No Navigation Mesh is loaded.\n" );
+		return;
+	}
+
+	if ( !TheNavMesh->SaveFlat() )
+	{
+		Warning( "Unable to write the flat navigation file.\n" );
+	}
+}
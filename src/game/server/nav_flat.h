@@ -0,0 +1,143 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose:
+//
+// $NoKeywords: $
+//===========================================================================//
+
+// Layout of flat nav files, which load without looking anything up by ID
+
+#ifndef _NAV_FLAT_H_
+#define _NAV_FLAT_H_
+
+#include "nav.h"
+#include "nav_ladder.h"
+
+#define NAV_FLAT_MAGIC_NUMBER 0xFEEDF1A7		// to help identify flat nav files
+#define NAV_FLAT_NO_INDEX 0xFFFFFFFF			// an index that refers to nothing
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * A flat nav file holds the same data as a .nav file, as arrays of fixed size records that refer to
+ * each other by their index in the array rather than by ID. The whole file is read into memory at once
+ * and the records are used where they lie, so loading one doesn't parse each field in turn, and binding
+ * the mesh together doesn't have to look up every connection's area or encounter's hiding spot by ID.
+ *
+ * Records are stored in the byte order of the machine that wrote them, and each section starts on a
+ * four byte boundary.
+ *
+ * 1 = initial version
+ */
+const unsigned int NavFlatCurrentVersion = 1;
+
+enum NavFlatSectionType
+{
+	NAV_FLAT_PLACES,				// PlaceDirectory::Save()
+	NAV_FLAT_CUSTOM_PRE_AREA,		// CNavMesh::SaveCustomDataPreArea()
+	NAV_FLAT_AREAS,					// NavFlatArea
+	NAV_FLAT_CONNECTIONS,			// area indices
+	NAV_FLAT_LADDER_CONNECTIONS,	// ladder indices
+	NAV_FLAT_HIDING_SPOTS,			// NavFlatHidingSpot
+	NAV_FLAT_ENCOUNTERS,			// NavFlatEncounter
+	NAV_FLAT_ENCOUNTER_SPOTS,		// NavFlatEncounterSpot
+	NAV_FLAT_VISIBLE_AREAS,			// NavFlatVisibleArea
+	NAV_FLAT_AREA_CUSTOM,			// CNavArea::SaveFlatCustomData() of every area, one after another
+	NAV_FLAT_LADDERS,				// NavFlatLadder
+	NAV_FLAT_CUSTOM,				// CNavMesh::SaveCustomData()
+
+	NUM_NAV_FLAT_SECTIONS
+};
+
+struct NavFlatSection
+{
+	unsigned int offset;			// bytes from the start of the file
+	unsigned int size;				// in bytes
+};
+
+struct NavFlatRange
+{
+	unsigned int first;				// index of the first record, or byte offset for custom data
+	unsigned int count;
+};
+
+struct NavFlatHeader
+{
+	unsigned int magic;				// NAV_FLAT_MAGIC_NUMBER
+	unsigned int version;			// NavFlatCurrentVersion
+	unsigned int navVersion;		// .nav file version of the mesh that was written
+	unsigned int subVersion;		// CNavMesh::GetSubVersionNumber() of the mesh that was written
+	unsigned int bspSize;			// size of the bsp the mesh was built for
+	unsigned int navFileSize;		// size of the .nav file when this was written, to tell when it has been replaced
+	unsigned int navFileTime;		// modification time of the .nav file when this was written
+	unsigned int isAnalyzed;
+
+	NavFlatSection section[ NUM_NAV_FLAT_SECTIONS ];
+};
+
+struct NavFlatArea
+{
+	unsigned int id;
+	int attributeFlags;
+	Vector nwCorner;
+	Vector seCorner;
+	float neZ;
+	float swZ;
+	unsigned int place;											// index into the place directory
+	float earliestOccupyTime[ MAX_NAV_TEAMS ];
+	float lightIntensity[ NUM_CORNERS ];
+	unsigned int inheritVisibilityFrom;							// area index
+
+	NavFlatRange connect[ NUM_DIRECTIONS ];						// of NAV_FLAT_CONNECTIONS
+	NavFlatRange ladder[ CNavLadder::NUM_LADDER_DIRECTIONS ];	// of NAV_FLAT_LADDER_CONNECTIONS
+	NavFlatRange hidingSpots;									// of NAV_FLAT_HIDING_SPOTS
+	NavFlatRange encounters;									// of NAV_FLAT_ENCOUNTERS
+	NavFlatRange visibleAreas;									// of NAV_FLAT_VISIBLE_AREAS
+	NavFlatRange custom;										// bytes of NAV_FLAT_AREA_CUSTOM
+};
+
+struct NavFlatHidingSpot
+{
+	unsigned int id;
+	Vector pos;
+	unsigned int flags;
+};
+
+struct NavFlatEncounter
+{
+	unsigned int from;				// area index
+	unsigned int fromDir;
+	unsigned int to;				// area index
+	unsigned int toDir;
+	NavFlatRange spots;				// of NAV_FLAT_ENCOUNTER_SPOTS
+};
+
+struct NavFlatEncounterSpot
+{
+	unsigned int spot;				// hiding spot index
+	float t;
+};
+
+struct NavFlatVisibleArea
+{
+	unsigned int area;				// area index
+	unsigned int attributes;
+};
+
+struct NavFlatLadder
+{
+	unsigned int id;
+	float width;
+	Vector top;
+	Vector bottom;
+	float length;
+	unsigned int dir;
+	unsigned int topForwardArea;	// area indices
+	unsigned int topLeftArea;
+	unsigned int topRightArea;
+	unsigned int topBehindArea;
+	unsigned int bottomArea;
+};
+
+
+#endif // _NAV_FLAT_H_
@@ -17,6 +17,7 @@
 #include "viewport_panel_names.h"
 //#include "terror/TerrorShared.h"
 #include "fmtstr.h"
+#include "vstdlib/jobthread.h"
 
 #ifdef TERROR
 #include "func_simpleladder.h"
@@ -43,6 +44,7 @@ ConVar nav_generate_jump_connections( "nav_generate_jump_connections", "1", FCVA
 ConVar nav_generate_incremental_range( "nav_generate_incremental_range", "2000", FCVAR_CHEAT );
 ConVar nav_generate_incremental_tolerance( "nav_generate_incremental_tolerance", "0", FCVAR_CHEAT, "Z tolerance for adding new nav areas." );
 ConVar nav_area_max_size( "nav_area_max_size", "50", FCVAR_CHEAT, "Max area size created in nav generation" );
+ConVar nav_generate_parallel( "nav_generate_parallel", "0", FCVAR_CHEAT, "Make the traces for sampling walkable space and for fitting areas to the samples on the worker threads. The mesh generated is the same." );
 
 // Common bounding box for traces
 Vector NavTraceMins( -0.45, -0.45, 0 );
@@ -3164,6 +3166,12 @@ bool CNavMesh::TestArea( CNavNode *node, int width, int height )
 	return true;
 }
 
+//--------------------------------------------------------------------------------------------------------------
+void CNavMesh::ComputeAreaTest( AreaTest &test )
+{
+	test.fits = TheNavMesh->TestArea( test.node, test.width, test.height );
+}
+
 //--------------------------------------------------------------------------------------------------------------
 /** 
 * Checks if a node has an untraversable obstacle in any direction to a neighbor.  
@@ -3300,12 +3308,39 @@ void CNavMesh::CreateNavAreasFromNodes( void )
 
 	while( uncoveredNodes > 0 )
 	{
+		// Testing is most of the work here, and building an area can only make a later test fail, so
+		// test every uncovered node on the worker threads first. Only the ones that passed need testing
+		// again as the areas are built in order.
+		m_areaTests.RemoveAll();
+		if ( nav_generate_parallel.GetBool() )
+		{
+			for( CNavNode *node = CNavNode::GetFirst(); node; node = node->GetNext() )
+			{
+				if (node->IsCovered())
+					continue;
+
+				AreaTest &test = m_areaTests[ m_areaTests.AddToTail() ];
+				test.node = node;
+				test.width = tryWidth;
+				test.height = tryHeight;
+			}
+
+			ParallelProcess( "CNavMesh::CreateNavAreasFromNodes", m_areaTests.Base(), m_areaTests.Count(), &CNavMesh::ComputeAreaTest );
+		}
+
+		int testIndex = 0;
 		for( CNavNode *node = CNavNode::GetFirst(); node; node = node->GetNext() )
 		{
+			bool mayFit = true;
+			if ( testIndex < m_areaTests.Count() && m_areaTests[ testIndex ].node == node )
+			{
+				mayFit = m_areaTests[ testIndex++ ].fits;
+			}
+
 			if (node->IsCovered())
 				continue;
 
-			if (TestArea( node, tryWidth, tryHeight ))
+			if (mayFit && TestArea( node, tryWidth, tryHeight ))
 			{
 				int covered = BuildArea( node, tryWidth, tryHeight );
 				if (covered < 0)
@@ -3468,6 +3503,7 @@ void CNavMesh::BeginGeneration( bool incremental )
 
 	// the system will see this NULL and select the next walkable seed
 	m_currentNode = NULL;
+	m_sampleProbes.Purge();
 
 	// if there are no seed points, we can't generate
 	if (m_walkableSeeds.Count() == 0)
@@ -4350,6 +4386,298 @@ static bool IsNodeOverlapped( const Vector& pos, const Vector& offset )
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Return false if generation shouldn't sample at the given position
+ */
+bool CNavMesh::IsSampleStepInRange( const Vector &pos ) const
+{
+	// sanity check to not generate across the world for incremental generation
+	const float incrementalRange = nav_generate_incremental_range.GetFloat();
+	if ( m_generationMode == GENERATE_INCREMENTAL && incrementalRange > 0 )
+	{
+		bool inRange = false;
+		for ( int i=0; i<m_walkableSeeds.Count(); ++i )
+		{
+			const Vector &seedPos = m_walkableSeeds[i].pos;
+			if ( (seedPos - pos).IsLengthLessThan( incrementalRange ) )
+			{
+				inRange = true;
+				break;
+			}
+		}
+
+		if ( !inRange )
+		{
+			return false;
+		}
+	}
+
+	if ( m_generationMode == GENERATE_SIMPLIFY )
+	{
+		if ( !m_simplifyGenerationExtent.Contains( pos ) )
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Set up a probe for a step from the given node in the given direction
+ */
+void CNavMesh::InitSampleProbe( SampleProbe *probe, CNavNode *node, NavDirType dir ) const
+{
+	probe->node = node;
+	probe->dir = dir;
+
+	// start at current node position
+	probe->from = *node->GetPosition();
+	Vector pos = probe->from;
+
+	// snap to grid
+	int cx = SnapToGrid( pos.x );
+	int cy = SnapToGrid( pos.y );
+
+	// attempt to move to adjacent node
+	switch( dir )
+	{
+		case NORTH:		cy -= GenerationStepSize; break;
+		case SOUTH:		cy += GenerationStepSize; break;
+		case EAST:		cx += GenerationStepSize; break;
+		case WEST:		cx -= GenerationStepSize; break;
+	}
+
+	pos.x = cx;
+	pos.y = cy;
+	probe->pos = pos;
+
+	probe->testOverlap = ( m_generationMode != GENERATE_SIMPLIFY );
+	probe->displacementTest = nav_displacement_test.GetInt();
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Make the traces for one sample step. Only reads the world, so it is safe to run on the worker threads
+ * while the main thread waits.
+ */
+void CNavMesh::ComputeSampleProbe( SampleProbe &probe )
+{
+	probe.isReachable = false;
+	probe.isSky = false;
+	probe.isOverlapped = false;
+	probe.isOnDisplacement = false;
+	probe.isUnderDisplacement = false;
+
+	// test if we can move to new position
+	trace_t result;
+	const Vector &from = probe.from;
+	const Vector &pos = probe.pos;
+	CTraceFilterWalkableEntities filter( NULL, COLLISION_GROUP_NONE, WALK_THRU_EVERYTHING );
+	Vector to = vec3_origin, toNormal = vec3_origin;
+	float obstacleHeight = 0, obstacleStartDist = 0, obstacleEndDist = GenerationStepSize;
+	if ( TraceAdjacentNode( 0, from, pos, &result ) )
+	{
+		to = result.endpos;
+		toNormal = result.plane.normal;
+	}
+	else
+	{
+		// test going up ClimbUpHeight
+		bool success = false;
+		for ( float height = StepHeight; height <= ClimbUpHeight; height += 1.0f )
+		{						
+			trace_t tr;
+			Vector start( from );
+			Vector end( pos );
+			start.z += height;
+			end.z += height;
+			UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, TheNavMesh->GetGenerationTraceMask(), &filter, &tr );
+			if ( !tr.startsolid && tr.fraction == 1.0f )
+			{
+				if ( !StayOnFloor( &tr ) )
+				{
+					break;
+				}
+
+				to = tr.endpos;
+				toNormal = tr.plane.normal;
+
+				start = end = from;
+				end.z += height;
+				UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, TheNavMesh->GetGenerationTraceMask(), &filter, &tr );
+				if ( tr.fraction < 1.0f )
+				{
+					break;
+				}
+
+				// keep track of far up we had to go to find a path to the next node
+				obstacleHeight = height;
+				success = true;
+				break;
+			}
+			else
+			{
+				// Could not trace from node to node at this height, something is in the way.
+				// Trace in the other direction to see if we hit something
+				Vector vecToObstacleStart = tr.endpos - start;
+				Assert( vecToObstacleStart.LengthSqr() <= Square( GenerationStepSize ) );
+				if ( vecToObstacleStart.LengthSqr() <= Square( GenerationStepSize ) )
+				{
+					UTIL_TraceHull( end, start, NavTraceMins, NavTraceMaxs, TheNavMesh->GetGenerationTraceMask(), &filter, &tr );
+					if ( !tr.startsolid && tr.fraction < 1.0 )
+					{
+						// We hit something going the other direction.  There is some obstacle between the two nodes.
+						Vector vecToObstacleEnd = tr.endpos - start;
+						Assert( vecToObstacleEnd.LengthSqr() <= Square( GenerationStepSize ) );
+						if ( vecToObstacleEnd.LengthSqr() <= Square( GenerationStepSize )  )
+						{
+							// Remember the distances to start and end of the obstacle (with respect to the "from" node).
+							// Keep track of the last distances to obstacle as we keep increasing the height we do a trace for.
+							// If we do eventually clear the obstacle, these values will be the start and end distance to the
+							// very tip of the obstacle.
+							obstacleStartDist = vecToObstacleStart.Length();
+							obstacleEndDist = vecToObstacleEnd.Length();
+							if ( obstacleEndDist == 0 )
+							{
+								obstacleEndDist = GenerationStepSize;
+							}
+						}								
+					}
+				}
+			}
+		}
+
+		if ( !success )
+		{
+			return;
+		}
+	}
+
+	probe.isReachable = true;
+	probe.to = to;
+	probe.toNormal = toNormal;
+	probe.obstacleHeight = obstacleHeight;
+	probe.obstacleStartDist = obstacleStartDist;
+	probe.obstacleEndDist = obstacleEndDist;
+
+	// Don't generate nodes if we spill off the end of the world onto skybox
+	if ( result.surface.flags & ( SURF_SKY|SURF_SKY2D ) )
+	{
+		probe.isSky = true;
+		return;
+	}
+
+	// If we're incrementally generating, don't overlap existing nav areas.
+	if ( probe.testOverlap )
+	{
+		Vector testPos( to );
+		bool overlapSE = IsNodeOverlapped( testPos, Vector(  1,  1, HalfHumanHeight ) );
+		bool overlapSW = IsNodeOverlapped( testPos, Vector( -1,  1, HalfHumanHeight ) );
+		bool overlapNE = IsNodeOverlapped( testPos, Vector(  1, -1, HalfHumanHeight ) );
+		bool overlapNW = IsNodeOverlapped( testPos, Vector( -1, -1, HalfHumanHeight ) );
+		if ( overlapSE && overlapSW && overlapNE && overlapNW )
+		{
+			probe.isOverlapped = true;
+			return;
+		}
+	}
+
+	probe.isOnDisplacement = result.IsDispSurface();
+
+	if ( probe.displacementTest > 0 )
+	{
+		// Test for nodes under displacement surfaces.
+		// This happens during development, and is a pain because the space underneath a displacement
+		// is not 'solid'.
+		Vector start = to + Vector( 0, 0, 0 );
+		Vector end = start + Vector( 0, 0, probe.displacementTest );
+		UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, TheNavMesh->GetGenerationTraceMask(), &filter, &result );
+
+		if ( result.fraction > 0 )
+		{
+			end = start;
+			start = result.endpos;
+			UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, TheNavMesh->GetGenerationTraceMask(), &filter, &result );
+			if ( result.fraction < 1 )
+			{
+				// if we made it down to within StepHeight, maybe we're on a static prop
+				if ( result.endpos.z > to.z + StepHeight )
+				{
+					probe.isUnderDisplacement = true;
+				}
+			}
+		}
+	}
+}
+
+
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Make the traces for the steps SampleStep() is likely to take next on the worker threads: the
+ * directions not yet searched from the current node, and then from the most recently added nodes,
+ * since sampling continues from those. SampleStep() still takes the steps one at a time in the
+ * same order, so the nodes it makes are exactly the same as without this.
+ */
+void CNavMesh::PrefetchSampleProbes( void )
+{
+	VPROF( "CNavMesh::PrefetchSampleProbes" );
+
+	const int maxProbes = 1024;
+	const int maxNodesScanned = 4 * maxProbes;
+
+	m_sampleProbeBatch.RemoveAll();
+
+	CNavNode *node = m_currentNode;
+	CNavNode *next = CNavNode::GetFirst();
+	for( int scanned = 0; node && scanned < maxNodesScanned && m_sampleProbeBatch.Count() < maxProbes; ++scanned )
+	{
+		for( int dir = NORTH; dir < NUM_DIRECTIONS; dir++ )
+		{
+			// the current step has already been marked as visited
+			if ( node != m_currentNode || dir != m_generationDir )
+			{
+				if ( node->HasVisited( (NavDirType)dir ) )
+					continue;
+			}
+
+			if ( m_sampleProbes.Find( (uintp)node | dir ) != m_sampleProbes.InvalidHandle() )
+				continue;
+
+			SampleProbe &probe = m_sampleProbeBatch[ m_sampleProbeBatch.AddToTail() ];
+			InitSampleProbe( &probe, node, (NavDirType)dir );
+			if ( !IsSampleStepInRange( probe.pos ) )
+			{
+				m_sampleProbeBatch.RemoveMultipleFromTail( 1 );
+			}
+		}
+
+		// then go through the rest, newest first
+		if ( next == m_currentNode )
+		{
+			next = next->GetNext();
+		}
+		node = next;
+		if ( next )
+		{
+			next = next->GetNext();
+		}
+	}
+
+	ParallelProcess( "CNavMesh::PrefetchSampleProbes", m_sampleProbeBatch.Base(), m_sampleProbeBatch.Count(), &CNavMesh::ComputeSampleProbe );
+
+	FOR_EACH_VEC( m_sampleProbeBatch, it )
+	{
+		const SampleProbe &probe = m_sampleProbeBatch[ it ];
+		m_sampleProbes.Insert( (uintp)probe.node | probe.dir, probe );
+	}
+}
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Search the world and build a map of possible movements.
@@ -4374,6 +4702,7 @@ bool CNavMesh::SampleStep( void )
 			{
 				if ( m_generationMode == GENERATE_INCREMENTAL || m_generationMode == GENERATE_SIMPLIFY )
 				{
+					m_sampleProbes.Purge();
 					return false;
 				}
 
@@ -4394,6 +4723,7 @@ bool CNavMesh::SampleStep( void )
 				if (m_currentNode == NULL)
 				{
 					// all seeds exhausted, sampling complete
+					m_sampleProbes.Purge();
 					return false;
 				}
 			}
@@ -4407,157 +4737,50 @@ bool CNavMesh::SampleStep( void )
 			if (!m_currentNode->HasVisited( (NavDirType)dir ))
 			{
 				// have not searched in this direction yet
-
-				// start at current node position
-				Vector pos = *m_currentNode->GetPosition();
-
-				// snap to grid
-				int cx = SnapToGrid( pos.x );
-				int cy = SnapToGrid( pos.y );
-
-				// attempt to move to adjacent node
-				switch( dir )
-				{
-					case NORTH:		cy -= GenerationStepSize; break;
-					case SOUTH:		cy += GenerationStepSize; break;
-					case EAST:		cx += GenerationStepSize; break;
-					case WEST:		cx -= GenerationStepSize; break;
-				}
-
-				pos.x = cx;
-				pos.y = cy;
-
 				m_generationDir = (NavDirType)dir;
 
 				// mark direction as visited
 				m_currentNode->MarkAsVisited( m_generationDir );
 
-				// sanity check to not generate across the world for incremental generation
-				const float incrementalRange = nav_generate_incremental_range.GetFloat();
-				if ( m_generationMode == GENERATE_INCREMENTAL && incrementalRange > 0 )
+				// use the traces made ahead of time for this step, if there are some
+				SampleProbe probe;
+				UtlHashHandle_t h = m_sampleProbes.Find( (uintp)m_currentNode | m_generationDir );
+				if ( h == m_sampleProbes.InvalidHandle() && nav_generate_parallel.GetBool() )
 				{
-					bool inRange = false;
-					for ( int i=0; i<m_walkableSeeds.Count(); ++i )
-					{
-						const Vector &seedPos = m_walkableSeeds[i].pos;
-						if ( (seedPos - pos).IsLengthLessThan( incrementalRange ) )
-						{
-							inRange = true;
-							break;
-						}
-					}
-
-					if ( !inRange )
-					{
-						return true;
-					}
+					PrefetchSampleProbes();
+					h = m_sampleProbes.Find( (uintp)m_currentNode | m_generationDir );
 				}
 
-				if ( m_generationMode == GENERATE_SIMPLIFY )
+				if ( h != m_sampleProbes.InvalidHandle() )
 				{
-					if ( !m_simplifyGenerationExtent.Contains( pos ) )
+					probe = m_sampleProbes.Element( h );
+					m_sampleProbes.RemoveByHandle( h );
+				}
+				else
+				{
+					InitSampleProbe( &probe, m_currentNode, m_generationDir );
+					if ( !IsSampleStepInRange( probe.pos ) )
 					{
 						return true;
 					}
+
+					ComputeSampleProbe( probe );
 				}
 
 				// test if we can move to new position
-				trace_t result;
-				Vector from( *m_currentNode->GetPosition() );
-				CTraceFilterWalkableEntities filter( NULL, COLLISION_GROUP_NONE, WALK_THRU_EVERYTHING );
-				Vector to = vec3_origin, toNormal = vec3_origin;
-				float obstacleHeight = 0, obstacleStartDist = 0, obstacleEndDist = GenerationStepSize;
-				if ( TraceAdjacentNode( 0, from, pos, &result ) )
-				{
-					to = result.endpos;
-					toNormal = result.plane.normal;
-				}
-				else
+				if ( !probe.isReachable )
 				{
-					// test going up ClimbUpHeight
-					bool success = false;
-					for ( float height = StepHeight; height <= ClimbUpHeight; height += 1.0f )
-					{						
-						trace_t tr;
-						Vector start( from );
-						Vector end( pos );
-						start.z += height;
-						end.z += height;
-						UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
-						if ( !tr.startsolid && tr.fraction == 1.0f )
-						{
-							if ( !StayOnFloor( &tr ) )
-							{
-								break;
-							}
-
-							to = tr.endpos;
-							toNormal = tr.plane.normal;
-
-							start = end = from;
-							end.z += height;
-							UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
-							if ( tr.fraction < 1.0f )
-							{
-								break;
-							}
-
-							// keep track of far up we had to go to find a path to the next node
-							obstacleHeight = height;
-							success = true;
-							break;
-						}
-						else
-						{
-							// Could not trace from node to node at this height, something is in the way.
-							// Trace in the other direction to see if we hit something
-							Vector vecToObstacleStart = tr.endpos - start;
-							Assert( vecToObstacleStart.LengthSqr() <= Square( GenerationStepSize ) );
-							if ( vecToObstacleStart.LengthSqr() <= Square( GenerationStepSize ) )
-							{
-								UTIL_TraceHull( end, start, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &tr );
-								if ( !tr.startsolid && tr.fraction < 1.0 )
-								{
-									// We hit something going the other direction.  There is some obstacle between the two nodes.
-									Vector vecToObstacleEnd = tr.endpos - start;
-									Assert( vecToObstacleEnd.LengthSqr() <= Square( GenerationStepSize ) );
-									if ( vecToObstacleEnd.LengthSqr() <= Square( GenerationStepSize )  )
-									{
-										// Remember the distances to start and end of the obstacle (with respect to the "from" node).
-										// Keep track of the last distances to obstacle as we keep increasing the height we do a trace for.
-										// If we do eventually clear the obstacle, these values will be the start and end distance to the
-										// very tip of the obstacle.
-										obstacleStartDist = vecToObstacleStart.Length();
-										obstacleEndDist = vecToObstacleEnd.Length();
-										if ( obstacleEndDist == 0 )
-										{
-											obstacleEndDist = GenerationStepSize;
-										}
-									}								
-								}
-							}
-						}
-					}
-
-					if ( !success )
-					{
-						return true;
-					}
+					return true;
 				}
 
 				// Don't generate nodes if we spill off the end of the world onto skybox
-				if ( result.surface.flags & ( SURF_SKY|SURF_SKY2D ) )
+				if ( probe.isSky )
 				{
 					return true;
 				}
 
 				// If we're incrementally generating, don't overlap existing nav areas.
-				Vector testPos( to );
-				bool overlapSE = IsNodeOverlapped( testPos, Vector(  1,  1, HalfHumanHeight ) );
-				bool overlapSW = IsNodeOverlapped( testPos, Vector( -1,  1, HalfHumanHeight ) );
-				bool overlapNE = IsNodeOverlapped( testPos, Vector(  1, -1, HalfHumanHeight ) );
-				bool overlapNW = IsNodeOverlapped( testPos, Vector( -1, -1, HalfHumanHeight ) );
-				if ( overlapSE && overlapSW && overlapNE && overlapNW && m_generationMode != GENERATE_SIMPLIFY )
+				if ( probe.isOverlapped )
 				{
 					return true;
 				}
@@ -4566,7 +4789,7 @@ bool CNavMesh::SampleStep( void )
 				if ( nTolerance > 0 && m_generationMode == GENERATE_INCREMENTAL )
 				{
 					bool bValid = false;
-					int zPos = to.z;
+					int zPos = probe.to.z;
 					for ( int i=0; i<m_walkableSeeds.Count(); ++i )
 					{
 						const Vector &seedPos = m_walkableSeeds[i].pos;
@@ -4584,35 +4807,14 @@ bool CNavMesh::SampleStep( void )
 						return true;
 				}
 
-
-				bool isOnDisplacement = result.IsDispSurface();
-
-				if ( nav_displacement_test.GetInt() > 0 )
+				// if we made it down to within StepHeight of a displacement, maybe we're on a static prop
+				if ( probe.isUnderDisplacement )
 				{
-					// Test for nodes under displacement surfaces.
-					// This happens during development, and is a pain because the space underneath a displacement
-					// is not 'solid'.
-					Vector start = to + Vector( 0, 0, 0 );
-					Vector end = start + Vector( 0, 0, nav_displacement_test.GetInt() );
-					UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &result );
-
-					if ( result.fraction > 0 )
-					{
-						end = start;
-						start = result.endpos;
-						UTIL_TraceHull( start, end, NavTraceMins, NavTraceMaxs, GetGenerationTraceMask(), &filter, &result );
-						if ( result.fraction < 1 )
-						{
-							// if we made it down to within StepHeight, maybe we're on a static prop
-							if ( result.endpos.z > to.z + StepHeight )
-							{
-								return true;
-							}
-						}
-					}
+					return true;
 				}
 
-				float deltaZ = to.z - m_currentNode->GetPosition()->z;
+				float obstacleHeight = probe.obstacleHeight, obstacleStartDist = probe.obstacleStartDist, obstacleEndDist = probe.obstacleEndDist;
+				float deltaZ = probe.to.z - m_currentNode->GetPosition()->z;
 				// If there's an obstacle in the way and it's traversable, or the obstacle is not higher than the destination node itself minus a small epsilon
 				// (meaning the obstacle was just the height change to get to the destination node, no extra obstacle between the two), clear obstacle height
 				// and distances
@@ -4625,7 +4827,7 @@ bool CNavMesh::SampleStep( void )
 
 				// we can move here
 				// create a new navigation node, and update current node pointer
-				AddNode( to, toNormal, m_generationDir, m_currentNode, isOnDisplacement, obstacleHeight, obstacleStartDist, obstacleEndDist );
+				AddNode( probe.to, probe.toNormal, m_generationDir, m_currentNode, probe.isOnDisplacement, obstacleHeight, obstacleStartDist, obstacleEndDist );
 
 				return true;
 			}
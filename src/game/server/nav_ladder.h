@@ -93,6 +93,8 @@ public:
 	CBaseEntity *GetLadderEntity( void ) const;
 
 private:
+	friend class CNavMesh;
+
 	void FindLadderEntity( void );
 
 	EHANDLE m_ladderEntity;
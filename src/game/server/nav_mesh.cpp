@@ -111,6 +111,7 @@ void CNavMesh::Reset( void )
 
 	m_isAnalyzed = false;
 	m_isOutOfDate = false;
+	m_isLoadingFlat = false;
 	m_isEditing = false;
 	m_navPlace = UNDEFINED_PLACE;
 	m_markedArea = NULL;
@@ -162,6 +163,7 @@ CNavArea *CNavMesh::GetMarkedArea( void ) const
  */
 void CNavMesh::DestroyNavigationMesh( bool incremental )
 {
+	TheNavClusters.Reset();
 	m_blockedAreas.RemoveAll();
 	m_avoidanceObstacleAreas.RemoveAll();
 	m_transientAreas.RemoveAll();
@@ -3361,6 +3363,8 @@ void CNavMesh::OnAreaBlocked( CNavArea *area )
 	{
 		m_blockedAreas.AddToTail( area );
 	}
+
+	TheNavClusters.OnAreaBlocked( area );
 }
 
 
@@ -3369,6 +3373,8 @@ void CNavMesh::OnAreaBlocked( CNavArea *area )
 void CNavMesh::OnAreaUnblocked( CNavArea *area )
 {
 	m_blockedAreas.FindAndRemove( area );
+
+	TheNavClusters.OnAreaUnblocked( area );
 }
 
 
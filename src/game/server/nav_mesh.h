@@ -26,6 +26,7 @@
 #include "nav.h"
 #include "nav_area.h"
 #include "nav_colors.h"
+#include "nav_cluster.h"
 
 
 class CNavArea;
@@ -292,6 +293,7 @@ public:
 	const CUtlVector< Place > *GetPlacesFromNavFile( bool *hasUnnamedPlaces );	// Reads the used place names from the nav file (can be used to selectively precache before the nav is loaded)
 
 	virtual bool Save( void ) const;									// store Navigation Mesh to a file
+	bool SaveFlat( void ) const;										// store Navigation Mesh to a flat nav file, which loads faster
 	bool IsOutOfDate( void ) const	{ return m_isOutOfDate; }			// return true if the Navigation Mesh is older than the current map version
 
 	virtual unsigned int GetSubVersionNumber( void ) const;										// returns sub-version number of data format used by derived classes
@@ -323,6 +325,12 @@ public:
 
 	unsigned int GetNavAreaCount( void ) const	{ return m_areaCount; }	// return total number of nav areas
 
+	// the grid nav areas are partitioned into, for other systems that want to bucket things the same way
+	bool HasGrid( void ) const					{ return m_gridSizeX > 0 && m_gridSizeY > 0; }
+	int GetGridSizeX( void ) const				{ return m_gridSizeX; }
+	int WorldToGridX( float wx ) const;							// given X component, return grid index
+	int WorldToGridY( float wy ) const;							// given Y component, return grid index
+
 	// See GetNavAreaFlags_t for flags
 	CNavArea *GetNavArea( const Vector &pos, float beneathLimt = 120.0f ) const;	// given a position, return the nav area that IsOverlapping and is *immediately* beneath it
 	CNavArea *GetNavArea( CBaseEntity *pEntity, int nGetNavAreaFlags, float flBeneathLimit = 120.0f ) const;
@@ -1101,13 +1109,14 @@ private:
 	bool m_isLoaded;											// true if a Navigation Mesh has been loaded
 	bool m_isOutOfDate;											// true if the Navigation Mesh is older than the actual BSP
 	bool m_isAnalyzed;											// true if the Navigation Mesh needs analysis
+	bool m_isLoadingFlat;										// true while PostLoad() runs for areas LoadFlat() has already bound
+
+	NavErrorType LoadFlat( void );								// load the map's flat nav file, if it is up to date
 
 	enum { HASH_TABLE_SIZE = 256 };
 	CNavArea *m_hashTable[ HASH_TABLE_SIZE ];					// hash table to optimize lookup by ID
 	int ComputeHashKey( unsigned int id ) const;				// returns a hash key for the given nav area ID
 
-	int WorldToGridX( float wx ) const;							// given X component, return grid index
-	int WorldToGridY( float wy ) const;							// given Y component, return grid index
 	void AllocateGrid( float minX, float maxX, float minY, float maxY );	// clear and reset the grid to the given extents
 	void GridToWorld( int gridX, int gridY, Vector *pos ) const;
 
@@ -1191,7 +1200,45 @@ private:
 	bool SampleStep( void );									// sample the walkable areas of the map
 	void CreateNavAreasFromNodes( void );						// cover all of the sampled nodes with nav areas
 
+	// The traces SampleStep() makes to find where one step from a node in a direction lands.
+	// These depend only on the world, so nav_generate_parallel makes them ahead of time on the worker threads.
+	struct SampleProbe
+	{
+		CNavNode *node;											// stepping from this node
+		NavDirType dir;											// in this direction
+		Vector from;
+		Vector pos;												// to this grid position
+		bool testOverlap;										// check for existing areas at the destination
+		int displacementTest;									// nav_displacement_test
+
+		bool isReachable;										// results
+		bool isSky;
+		bool isOverlapped;
+		bool isOnDisplacement;
+		bool isUnderDisplacement;
+		Vector to;
+		Vector toNormal;
+		float obstacleHeight;
+		float obstacleStartDist;
+		float obstacleEndDist;
+	};
+	CUtlHashtable< uintp, SampleProbe > m_sampleProbes;			// probes made ahead of time, keyed by node and direction
+	CUtlVector< SampleProbe > m_sampleProbeBatch;
+	bool IsSampleStepInRange( const Vector &pos ) const;		// false if generation shouldn't sample at the given position
+	void InitSampleProbe( SampleProbe *probe, CNavNode *node, NavDirType dir ) const;
+	static void ComputeSampleProbe( SampleProbe &probe );
+	void PrefetchSampleProbes( void );							// compute probes for the steps SampleStep() is likely to take next
+
 	bool TestArea( CNavNode *node, int width, int height );		// check if an area of size (width, height) can fit, starting from node as upper left corner
+	struct AreaTest
+	{
+		CNavNode *node;
+		int width;
+		int height;
+		bool fits;
+	};
+	CUtlVector< AreaTest > m_areaTests;
+	static void ComputeAreaTest( AreaTest &test );
 	int BuildArea( CNavNode *node, int width, int height );		// create a CNavArea of size (width, height) starting fom node at upper left corner
 	bool CheckObstacles( CNavNode *node, int width, int height, int x, int y );
 
@@ -15,6 +15,7 @@
 #include "tier0/vprof.h"
 #include "mathlib/ssemath.h"
 #include "nav_area.h"
+#include "nav_cluster.h"
 
 
 
@@ -84,6 +85,15 @@ public:
 	}
 };
 
+// costs only depend on the areas, so every search can share routes
+inline bool NavCostFunctorRouteKey( const ShortestPathCost *costFunc, intp *kind, unsigned int *state )
+{
+	static char s_kind;
+	*kind = (intp)&s_kind;
+	*state = 0;
+	return true;
+}
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Find path from startArea to goalArea via an A* search, using supplied cost heuristic.
@@ -94,15 +104,18 @@ public:
  * If 'goalArea' is NULL, will compute a path as close as possible to 'goalPos'.
  * If 'goalPos' is NULL, will use the center of 'goalArea' as the goal position.
  * If 'maxPathLength' is nonzero, path building will stop when this length is reached.
+ * If 'route' is non-NULL, only areas in its clusters are searched, and the areas that had neighbors
+ * off the route are added to 'leftRoute', if given.
+ * If 'resume' is true, the open and closed lists are kept from the last search instead of starting over.
  * Returns true if a path exists.
  */
 #define IGNORE_NAV_BLOCKERS true
 template< typename CostFunctor >
-bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *goalPos, CostFunctor &costFunc, CNavArea **closestArea = NULL, float maxPathLength = 0.0f, int teamID = TEAM_ANY, bool ignoreNavBlockers = false )
+bool NavAreaBuildPathSearch( CNavArea *startArea, CNavArea *goalArea, const Vector *goalPos, CostFunctor &costFunc, CNavArea **closestArea, float maxPathLength, int teamID, bool ignoreNavBlockers, const CNavClusterRoute *route, CUtlVector< CNavArea * > *leftRoute = NULL, bool resume = false )
 {
 	VPROF_BUDGET( "NavAreaBuildPath", "NextBotSpiky" );
 
-	if ( closestArea )
+	if ( closestArea && !resume )
 	{
 		*closestArea = startArea;
 	}
@@ -111,7 +124,10 @@ bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *go
 	if (startArea == NULL)
 		return false;
 
-	startArea->SetParent( NULL );
+	if ( !resume )
+	{
+		startArea->SetParent( NULL );
+	}
 
 	if (goalArea != NULL && goalArea->IsBlocked( teamID, ignoreNavBlockers ))
 		goalArea = NULL;
@@ -128,23 +144,26 @@ bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *go
 	// determine actual goal position
 	Vector actualGoalPos = (goalPos) ? *goalPos : goalArea->GetCenter();
 
-	// start search
-	CNavArea::ClearSearchLists();
+	if ( !resume )
+	{
+		// start search
+		CNavArea::ClearSearchLists();
 
-	// compute estimate of path length
-	/// @todo Cost might work as "manhattan distance"
-	startArea->SetTotalCost( (startArea->GetCenter() - actualGoalPos).Length() );
+		// compute estimate of path length
+		/// @todo Cost might work as "manhattan distance"
+		startArea->SetTotalCost( (startArea->GetCenter() - actualGoalPos).Length() );
 
-	float initCost = costFunc( startArea, NULL, NULL, NULL, -1.0f );	
-	if (initCost < 0.0f)
-		return false;
-	startArea->SetCostSoFar( initCost );
-	startArea->SetPathLengthSoFar( 0.0 );
+		float initCost = costFunc( startArea, NULL, NULL, NULL, -1.0f );	
+		if (initCost < 0.0f)
+			return false;
+		startArea->SetCostSoFar( initCost );
+		startArea->SetPathLengthSoFar( 0.0 );
 
-	startArea->AddToOpenList();
+		startArea->AddToOpenList();
+	}
 
 	// keep track of the area we visit that is closest to the goal
-	float closestAreaDist = startArea->GetTotalCost();
+	float closestAreaDist = ( resume && closestArea && *closestArea ) ? ( (*closestArea)->GetCenter() - actualGoalPos ).Length() : startArea->GetTotalCost();
 
 	// do A* search
 	while( !CNavArea::IsOpenListEmpty() )
@@ -332,6 +351,16 @@ bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *go
 			if ( newArea->IsBlocked( teamID, ignoreNavBlockers ) )
 				continue;
 
+			// stay on the cached cluster route, if we have one
+			if ( route && !route->Contains( newArea->GetClusterID() ) )
+			{
+				if ( leftRoute && ( leftRoute->Count() == 0 || leftRoute->Tail() != area ) )
+				{
+					leftRoute->AddToTail( area );
+				}
+				continue;
+			}
+
 			float newCostSoFar = costFunc( newArea, area, ladder, elevator, length );
 
 			// NaNs really mess this function up causing tough to track down hangs. If
@@ -415,6 +444,82 @@ bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *go
 }
 
 
+//--------------------------------------------------------------------------------------------------------------
+/**
+ * Find path from startArea to goalArea via an A* search, as NavAreaBuildPathSearch() above.
+ * Searches from one area to another with no path length limit first try only the clusters
+ * (see CNavClusterGraph) that the last path between the same two clusters went through, and the
+ * clusters next to those, for the same team and cost functor state (see NavCostFunctorRouteKey()).
+ * If that fails, or finds a path that costs noticeably more per unit of distance than the one the
+ * route was learned from, the search carries on over the whole mesh from where it stopped. If there
+ * is no such route yet, the whole mesh is searched. Either way, the clusters of the path found are
+ * remembered for next time.
+ */
+template< typename CostFunctor >
+bool NavAreaBuildPath( CNavArea *startArea, CNavArea *goalArea, const Vector *goalPos, CostFunctor &costFunc, CNavArea **closestArea = NULL, float maxPathLength = 0.0f, int teamID = TEAM_ANY, bool ignoreNavBlockers = false )
+{
+	NavClusterRouteKey key;
+	if ( !startArea || !goalArea || maxPathLength > 0.0f || !TheNavClusters.IsEnabled() ||
+		 startArea->GetClusterID() < 0 || goalArea->GetClusterID() < 0 ||
+		 startArea->GetClusterID() == goalArea->GetClusterID() ||
+		 goalArea->IsBlocked( teamID, ignoreNavBlockers ) ||
+		 !NavCostFunctorRouteKey( &costFunc, &key.m_costKind, &key.m_costState ) )
+	{
+		return NavAreaBuildPathSearch( startArea, goalArea, goalPos, costFunc, closestArea, maxPathLength, teamID, ignoreNavBlockers, NULL );
+	}
+
+	key.m_startCluster = startArea->GetClusterID();
+	key.m_goalCluster = goalArea->GetClusterID();
+	key.m_teamID = teamID;
+	key.m_ignoreNavBlockers = ignoreNavBlockers;
+
+	// the straight line is the least any path can cost, so measure costs against it
+	Vector actualGoalPos = ( goalPos ) ? *goalPos : goalArea->GetCenter();
+	float straightDist = Max( ( actualGoalPos - startArea->GetCenter() ).Length(), 1.0f );
+
+	bool resume = false;
+	const CNavClusterRoute *route = TheNavClusters.FindRoute( key );
+	if ( route )
+	{
+		CUtlVector< CNavArea * > leftRoute;
+		bool found = NavAreaBuildPathSearch( startArea, goalArea, goalPos, costFunc, closestArea, maxPathLength, teamID, ignoreNavBlockers, route, &leftRoute );
+		if ( found && goalArea->GetCostSoFar() <= route->m_maxCostRatio * straightDist )
+		{
+			return true;
+		}
+
+		// the route doesn't work from here any more, or there's likely a better way - search everything and learn a new one
+		TheNavClusters.RemoveRoute( key );
+
+		// carry on from where the route search stopped, by opening the areas it didn't leave the route
+		// from again, along with the goal if it got there. Anything cheaper found on the way reopens
+		// the areas it improves, so the path found is as good as a search from scratch would give.
+		FOR_EACH_VEC( leftRoute, it )
+		{
+			CNavArea *area = leftRoute[ it ];
+			if ( area->IsClosed() )
+			{
+				area->RemoveFromClosedList();
+				area->AddToOpenList();
+			}
+		}
+
+		if ( found )
+		{
+			goalArea->AddToOpenList();
+		}
+
+		resume = true;
+	}
+
+	if ( !NavAreaBuildPathSearch( startArea, goalArea, goalPos, costFunc, closestArea, maxPathLength, teamID, ignoreNavBlockers, NULL, NULL, resume ) )
+		return false;
+
+	TheNavClusters.AddRoute( key, goalArea, goalArea->GetCostSoFar() / straightDist );
+	return true;
+}
+
+
 //--------------------------------------------------------------------------------------------------------------
 /**
  * Compute distance between two areas. Return -1 if can't reach 'endArea' from 'startArea'.
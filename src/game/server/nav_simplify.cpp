@@ -127,6 +127,7 @@ void CNavMesh::GenerateNodes( const Extent &bounds )
 {
 	m_simplifyGenerationExtent = bounds;
 	m_seedIdx = 0;
+	m_sampleProbes.Purge();
 
 	Assert( m_generationMode == GENERATE_SIMPLIFY );
 	while ( SampleStep() )
@@ -10,9 +10,9 @@
 #include "igamesystem.h"
 #include "ilagcompensationmanager.h"
 #include "inetchannelinfo.h"
-#include "utllinkedlist.h"
 #include "BaseAnimatingOverlay.h"
 #include "tier0/vprof.h"
+#include "mathlib/ssemath.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -36,6 +36,7 @@ ConVar sv_lagflushbonecache( "sv_lagflushbonecache", "1", FCVAR_DEVELOPMENTONLY,
 ConVar sv_showlagcompensation( "sv_showlagcompensation", "0", FCVAR_CHEAT, "Show lag compensated hitboxes whenever a player is lag compensated." );
 
 ConVar sv_unlag_fixstuck( "sv_unlag_fixstuck", "0", FCVAR_DEVELOPMENTONLY, "Disallow backtracking a player for lag compensation if it will cause them to become stuck" );
+ConVar sv_unlag_aimcone( "sv_unlag_aimcone", "0", 0, "Players further away than they can run in sv_maxunlag are only lag compensated if a shot straying this many degrees from the aim direction could hit the box around where they are and where they were (0 compensates everyone)", true, 0.0f, true, 89.0f );
 
 //-----------------------------------------------------------------------------
 // Purpose: 
@@ -126,6 +127,114 @@ public:
 	float					m_flPoseParameters[MAXSTUDIOPOSEPARAM];
 };
 
+//-----------------------------------------------------------------------------
+// Purpose: A player's history. Records go into a ring buffer oldest first; what
+//			the time search and interpolation read is kept in arrays of its own
+//			so finding and lerping the backtrack touches as little as possible.
+//-----------------------------------------------------------------------------
+#define MAX_LAG_RECORDS	256		// must be a power of two. sv_maxunlag 1.0 at 128 ticks needs 129
+
+struct LagAnimRecord
+{
+	LayerRecord				m_layerRecords[MAX_LAYER_RECORDS];
+	int						m_masterSequence;
+	float					m_masterCycle;
+	float					m_flPoseParameters[MAXSTUDIOPOSEPARAM];
+};
+
+class CLagTrack
+{
+public:
+	CLagTrack()
+	{
+		RemoveAll();
+	}
+
+	void RemoveAll()
+	{
+		m_nFirst = 0;
+		m_nCount = 0;
+		m_nLastBreak = -1;
+	}
+
+	// Records are numbered by when they were added, so a number stays valid until
+	// the record falls off the end. First() is the oldest, Last() the newest.
+	int		Count() const				{ return m_nCount; }
+	int		First() const				{ return m_nFirst; }
+	int		Last() const				{ return m_nFirst + m_nCount - 1; }
+	int		Slot( int nRecord ) const	{ return nRecord & ( MAX_LAG_RECORDS - 1 ); }
+
+	// Add a record after Last(), dropping the oldest if we're full; returns its slot
+	int AddToTail()
+	{
+		if ( m_nCount == MAX_LAG_RECORDS )
+		{
+			RemoveFromHead();
+		}
+		++m_nCount;
+		return Slot( Last() );
+	}
+
+	void RemoveFromHead()
+	{
+		Assert( m_nCount > 0 );
+		++m_nFirst;
+		--m_nCount;
+	}
+
+	// Newest record at or before flTargetTime, or the oldest one if they're all later.
+	// Simulation times only ever go up along the track.
+	int FindRecord( float flTargetTime ) const
+	{
+		int nLow = First();
+		int nHigh = Last();
+		int nFound = nLow;
+		while ( nLow <= nHigh )
+		{
+			int nMid = ( nLow + nHigh ) >> 1;
+			if ( m_flSimulationTime[ Slot( nMid ) ] <= flTargetTime )
+			{
+				nFound = nMid;
+				nLow = nMid + 1;
+			}
+			else
+			{
+				nHigh = nMid - 1;
+			}
+		}
+		return nFound;
+	}
+
+	int						m_nFirst;
+	int						m_nCount;
+
+	// Newest record we can't backtrack to or past: the player was dead in it or got
+	// teleported between it and the next one. -1 if there hasn't been one.
+	int						m_nLastBreak;
+
+	float					m_flSimulationTime[MAX_LAG_RECORDS];
+	int						m_fFlags[MAX_LAG_RECORDS];
+	Vector					m_vecOrigin[MAX_LAG_RECORDS];
+	QAngle					m_vecAngles[MAX_LAG_RECORDS];
+	Vector					m_vecMinsPreScaled[MAX_LAG_RECORDS];
+	Vector					m_vecMaxsPreScaled[MAX_LAG_RECORDS];
+	LagAnimRecord			m_anim[MAX_LAG_RECORDS];
+};
+
+// Where one player is going for the current lag compensation session
+struct LagBacktrack
+{
+	CBasePlayer				*m_pPlayer;
+	int						m_nRecord;		// slot of the record at or before the target time
+	int						m_nPrevRecord;	// slot of the record after it, or -1 if it's the newest
+	float					m_flFrac;		// how far from m_nRecord towards m_nPrevRecord to go
+
+	Vector					m_vecOrigin;
+	QAngle					m_vecAngles;
+	Vector					m_vecMinsPreScaled;
+	Vector					m_vecMaxsPreScaled;
+};
+
 
 //
 // Try to take the player from his current origin to vWantedPos.
@@ -185,6 +294,7 @@ public:
 	CLagCompensationManager( char const *name ) : CAutoGameSystemPerFrame( name ), m_flTeleportDistanceSqr( 64 *64 )
 	{
 		m_isCurrentlyDoingCompensation = false;
+		memset( m_pPlayerTrack, 0, sizeof( m_pPlayerTrack ) );
 	}
 
 	// IServerSystem stuff
@@ -211,15 +321,25 @@ public:
 
 private:
 	void			BacktrackPlayer( CBasePlayer *player, float flTargetTime );
+	bool			FindBacktrack( CBasePlayer *pPlayer, float flTargetTime, LagBacktrack &backtrack ) const;
+	void			LerpBacktracks( LagBacktrack *pBacktracks, int nCount ) const;
+	int				CullBacktracks( LagBacktrack *pBacktracks, int nCount, const CBasePlayer *pShooter, const CUserCmd *cmd ) const;
+	void			ApplyBacktrack( const LagBacktrack &backtrack, float flTargetTime );
 
 	void ClearHistory()
 	{
 		for ( int i=0; i<MAX_PLAYERS; i++ )
-			m_PlayerTrack[i].Purge();
+		{
+			delete m_pPlayerTrack[i];
+			m_pPlayerTrack[i] = NULL;
+		}
 	}
 
-	// keep a list of lag records for each player
-	CUtlFixedLinkedList< LagRecord >	m_PlayerTrack[ MAX_PLAYERS ];
+	// keep a history of lag records for each player, allocated the first time they have one
+	CLagTrack				*m_pPlayerTrack[ MAX_PLAYERS ];
+
+	// Scratchpad for the players we're moving back this session
+	LagBacktrack			m_Backtracks[ MAX_PLAYERS ];
 
 	// Scratchpad for determining what needs to be restored
 	CBitVec<MAX_PLAYERS>	m_RestorePlayer;
@@ -255,18 +375,18 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 	VPROF_BUDGET( "FrameUpdatePostEntityThink", "CLagCompensationManager" );
 
 	// remove all records before that time:
-	int flDeadtime = gpGlobals->curtime - sv_maxunlag.GetFloat();
+	float flDeadtime = gpGlobals->curtime - sv_maxunlag.GetFloat();
 
 	// Iterate all active players
 	for ( int i = 1; i <= gpGlobals->maxClients; i++ )
 	{
 		CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
 
-		CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[i-1];
+		CLagTrack *track = m_pPlayerTrack[i-1];
 
 		if ( !pPlayer )
 		{
-			if ( track->Count() > 0 )
+			if ( track )
 			{
 				track->RemoveAll();
 			}
@@ -274,66 +394,80 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 			continue;
 		}
 
-		Assert( track->Count() < 1000 ); // insanity check
-
-		// remove tail records that are too old
-		intp tailIndex = track->Tail();
-		while ( track->IsValidIndex( tailIndex ) )
+		if ( !track )
 		{
-			LagRecord &tail = track->Element( tailIndex );
+			track = m_pPlayerTrack[i-1] = new CLagTrack;
+		}
 
-			// if tail is within limits, stop
-			if ( tail.m_flSimulationTime >= flDeadtime )
+		// remove records from the old end that are too old
+		while ( track->Count() > 0 )
+		{
+			// if the oldest is within limits, stop
+			if ( track->m_flSimulationTime[ track->Slot( track->First() ) ] >= flDeadtime )
 				break;
-			
-			// remove tail, get new tail
-			track->Remove( tailIndex );
-			tailIndex = track->Tail();
+
+			track->RemoveFromHead();
 		}
 
-		// check if head has same simulation time
+		// check if the newest has the same simulation time
 		if ( track->Count() > 0 )
 		{
-			LagRecord &head = track->Element( track->Head() );
+			int head = track->Slot( track->Last() );
 
 			// check if player changed simulation time since last time updated
-			if ( head.m_flSimulationTime >= pPlayer->GetSimulationTime() )
+			if ( track->m_flSimulationTime[head] >= pPlayer->GetSimulationTime() )
 				continue; // don't add new entry for same or older time
+
+			// we can't backtrack across a teleport, so remember where the last one was
+			Vector delta = pPlayer->GetLocalOrigin() - track->m_vecOrigin[head];
+			if ( delta.Length2DSqr() > m_flTeleportDistanceSqr )
+			{
+				track->m_nLastBreak = track->Last();
+			}
 		}
 
 		// add new record to player track
-		LagRecord &record = track->Element( track->AddToHead() );
+		int record = track->AddToTail();
 
-		record.m_fFlags = 0;
+		track->m_fFlags[record] = 0;
 		if ( pPlayer->IsAlive() )
 		{
-			record.m_fFlags |= LC_ALIVE;
+			track->m_fFlags[record] |= LC_ALIVE;
+		}
+		else
+		{
+			// or past a death
+			track->m_nLastBreak = track->Last();
 		}
 
-		record.m_flSimulationTime	= pPlayer->GetSimulationTime();
-		record.m_vecAngles			= pPlayer->GetLocalAngles();
-		record.m_vecOrigin			= pPlayer->GetLocalOrigin();
-		record.m_vecMinsPreScaled	= pPlayer->CollisionProp()->OBBMinsPreScaled();
-		record.m_vecMaxsPreScaled	= pPlayer->CollisionProp()->OBBMaxsPreScaled();
+		track->m_flSimulationTime[record]	= pPlayer->GetSimulationTime();
+		track->m_vecAngles[record]			= pPlayer->GetLocalAngles();
+		track->m_vecOrigin[record]			= pPlayer->GetLocalOrigin();
+		track->m_vecMinsPreScaled[record]	= pPlayer->CollisionProp()->OBBMinsPreScaled();
+		track->m_vecMaxsPreScaled[record]	= pPlayer->CollisionProp()->OBBMaxsPreScaled();
 
+		LagAnimRecord &anim = track->m_anim[record];
 		int layerCount = pPlayer->GetNumAnimOverlays();
-		for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
+		for( int layerIndex = 0; layerIndex < MAX_LAYER_RECORDS; ++layerIndex )
 		{
-			CAnimationLayer *currentLayer = pPlayer->GetAnimOverlay(layerIndex);
+			// the slot is being reused, so clear out whatever the player doesn't have
+			anim.m_layerRecords[layerIndex] = LayerRecord();
+
+			CAnimationLayer *currentLayer = ( layerIndex < layerCount ) ? pPlayer->GetAnimOverlay(layerIndex) : NULL;
 			if( currentLayer )
 			{
-				record.m_layerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
-				record.m_layerRecords[layerIndex].m_order = currentLayer->m_nOrder;
-				record.m_layerRecords[layerIndex].m_sequence = currentLayer->m_nSequence;
-				record.m_layerRecords[layerIndex].m_weight = currentLayer->m_flWeight;
+				anim.m_layerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
+				anim.m_layerRecords[layerIndex].m_order = currentLayer->m_nOrder;
+				anim.m_layerRecords[layerIndex].m_sequence = currentLayer->m_nSequence;
+				anim.m_layerRecords[layerIndex].m_weight = currentLayer->m_flWeight;
 			}
 		}
-		record.m_masterSequence = pPlayer->GetSequence();
-		record.m_masterCycle = pPlayer->GetCycle();
+		anim.m_masterSequence = pPlayer->GetSequence();
+		anim.m_masterCycle = pPlayer->GetCycle();
 
 		for( int i=0; i<MAXSTUDIOPOSEPARAM; i++ )
 		{
-			record.m_flPoseParameters[i] = pPlayer->GetPoseParameter(i);
+			anim.m_flPoseParameters[i] = pPlayer->GetPoseParameter(i);
 		}
 	}
 
@@ -411,6 +545,12 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 		targettick = gpGlobals->tickcount - TIME_TO_TICKS( correct );
 	}
 	
+	float flTargetTime = TICKS_TO_TIME( targettick );
+
+	// Work out where everyone is going first, so the lerps can be done together and
+	// anyone who can't be in the line of fire doesn't get moved at all
+	int nBacktracks = 0;
+
 	// Iterate all active players
 	const CBitVec<MAX_EDICTS> *pEntityTransmitBits = engine->GetEntityTransmitBitsForClient( player->entindex() - 1 );
 	for ( int i = 1; i <= gpGlobals->maxClients; i++ )
@@ -432,110 +572,268 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 		if ( !player->WantsLagCompensationOnEntity( pPlayer, cmd, pEntityTransmitBits ) )
 			continue;
 
-		// Move other player back in time
-		BacktrackPlayer( pPlayer, TICKS_TO_TIME( targettick ) );
+		if ( FindBacktrack( pPlayer, flTargetTime, m_Backtracks[nBacktracks] ) )
+		{
+			++nBacktracks;
+		}
 	}
-}
 
-void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTargetTime )
-{
-	Vector org;
-	Vector minsPreScaled;
-	Vector maxsPreScaled;
-	QAngle ang;
+	LerpBacktracks( m_Backtracks, nBacktracks );
+	nBacktracks = CullBacktracks( m_Backtracks, nBacktracks, player, cmd );
 
-	VPROF_BUDGET( "BacktrackPlayer", "CLagCompensationManager" );
-	int pl_index = pPlayer->entindex() - 1;
+	// Move other players back in time
+	for ( int i = 0; i < nBacktracks; i++ )
+	{
+		// sv_unlag_fixstuck may have already done this one
+		if ( m_RestorePlayer.Get( m_Backtracks[i].m_pPlayer->entindex() - 1 ) )
+			continue;
 
+		ApplyBacktrack( m_Backtracks[i], flTargetTime );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Find the records either side of flTargetTime for this player. Returns
+//			false if there aren't any we can use.
+//-----------------------------------------------------------------------------
+bool CLagCompensationManager::FindBacktrack( CBasePlayer *pPlayer, float flTargetTime, LagBacktrack &backtrack ) const
+{
 	// get track history of this player
-	CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[ pl_index ];
+	const CLagTrack *track = m_pPlayerTrack[ pPlayer->entindex() - 1 ];
 
 	// check if we have at leat one entry
-	if ( track->Count() <= 0 )
-		return;
+	if ( !track || track->Count() <= 0 )
+		return false;
 
-	intp curr = track->Head();
+	// Every record from the one we use up to now has to be usable: the player has to
+	// have been alive, and not teleported between any two of them or since the last
+	int nRecord = track->FindRecord( flTargetTime );
+	if ( nRecord <= track->m_nLastBreak )
+	{
+		// player must be alive, lost track
+		return false;
+	}
 
-	LagRecord *prevRecord = NULL;
-	LagRecord *record = NULL;
+	Vector delta = track->m_vecOrigin[ track->Slot( track->Last() ) ] - pPlayer->GetLocalOrigin();
+	if ( delta.Length2DSqr() > m_flTeleportDistanceSqr )
+	{
+		// lost track, too much difference
+		return false;
+	}
 
-	Vector prevOrg = pPlayer->GetLocalOrigin();
-	
-	// Walk context looking for any invalidating event
-	while( track->IsValidIndex(curr) )
+	backtrack.m_pPlayer = pPlayer;
+	backtrack.m_nRecord = track->Slot( nRecord );
+	backtrack.m_nPrevRecord = ( nRecord < track->Last() ) ? track->Slot( nRecord + 1 ) : -1;
+	backtrack.m_flFrac = 0.0f;
+
+	int record = backtrack.m_nRecord;
+	int prevRecord = backtrack.m_nPrevRecord;
+	if ( prevRecord >= 0 && 
+		 (track->m_flSimulationTime[record] < flTargetTime) &&
+		 (track->m_flSimulationTime[record] < track->m_flSimulationTime[prevRecord]) )
 	{
-		// remember last record
-		prevRecord = record;
+		// we didn't find the exact time but have a valid previous record
+		// so interpolate between these two records;
+
+		Assert( track->m_flSimulationTime[prevRecord] > track->m_flSimulationTime[record] );
+		Assert( flTargetTime < track->m_flSimulationTime[prevRecord] );
+
+		// calc fraction between both records
+		backtrack.m_flFrac = ( flTargetTime - track->m_flSimulationTime[record] ) / 
+			( track->m_flSimulationTime[prevRecord] - track->m_flSimulationTime[record] );
 
-		// get next record
-		record = &track->Element( curr );
+		Assert( backtrack.m_flFrac > 0 && backtrack.m_flFrac < 1 ); // should never extrapolate
+	}
+
+	return true;
+}
 
-		if ( !(record->m_fFlags & LC_ALIVE) )
+//-----------------------------------------------------------------------------
+// Purpose: Interpolate the position, angles and size of each backtrack. The
+//			vectors are done four players at a time.
+//-----------------------------------------------------------------------------
+void CLagCompensationManager::LerpBacktracks( LagBacktrack *pBacktracks, int nCount ) const
+{
+	for ( int i = 0; i < nCount; i += 4 )
+	{
+		// pad the last group out with the first player in it
+		const CLagTrack *tracks[4];
+		int records[4], prevRecords[4];
+		float fracs[4];
+		for ( int j = 0; j < 4; j++ )
 		{
-			// player most be alive, lost track
-			return;
+			const LagBacktrack &backtrack = pBacktracks[ ( i + j < nCount ) ? i + j : i ];
+			tracks[j] = m_pPlayerTrack[ backtrack.m_pPlayer->entindex() - 1 ];
+			records[j] = backtrack.m_nRecord;
+
+			// with nothing to interpolate to, a fraction of zero leaves the record as it is
+			prevRecords[j] = ( backtrack.m_nPrevRecord >= 0 ) ? backtrack.m_nPrevRecord : backtrack.m_nRecord;
+			fracs[j] = backtrack.m_flFrac;
 		}
 
-		Vector delta = record->m_vecOrigin - prevOrg;
-		if ( delta.Length2DSqr() > m_flTeleportDistanceSqr )
-		{
-			// lost track, too much difference
-			return; 
+		fltx4 frac = LoadUnalignedSIMD( fracs );
+		FourVectors from, to;
+
+#define LERP_FOUR_BACKTRACKS( field )																\
+		from.LoadAndSwizzle( tracks[0]->field[records[0]], tracks[1]->field[records[1]],			\
+							 tracks[2]->field[records[2]], tracks[3]->field[records[3]] );			\
+		to.LoadAndSwizzle( tracks[0]->field[prevRecords[0]], tracks[1]->field[prevRecords[1]],		\
+						   tracks[2]->field[prevRecords[2]], tracks[3]->field[prevRecords[3]] );	\
+		to -= from;																					\
+		to *= frac;																					\
+		to += from;																					\
+		for ( int j = 0; j < 4 && i + j < nCount; j++ )												\
+		{																							\
+			pBacktracks[i + j].field = to.Vec( j );													\
 		}
 
-		// did we find a context smaller than target time ?
-		if ( record->m_flSimulationTime <= flTargetTime )
-			break; // hurra, stop
+		LERP_FOUR_BACKTRACKS( m_vecOrigin );
+		LERP_FOUR_BACKTRACKS( m_vecMinsPreScaled );
+		LERP_FOUR_BACKTRACKS( m_vecMaxsPreScaled );
 
-		prevOrg = record->m_vecOrigin;
+#undef LERP_FOUR_BACKTRACKS
 
-		// go one step back
-		curr = track->Next( curr );
+		// angles have to go through quaternions
+		for ( int j = 0; j < 4 && i + j < nCount; j++ )
+		{
+			LagBacktrack &backtrack = pBacktracks[i + j];
+			const CLagTrack *track = tracks[j];
+			if ( backtrack.m_flFrac > 0.0f )
+			{
+				backtrack.m_vecAngles = Lerp( backtrack.m_flFrac, track->m_vecAngles[backtrack.m_nRecord], track->m_vecAngles[backtrack.m_nPrevRecord] );
+			}
+			else
+			{
+				backtrack.m_vecAngles = track->m_vecAngles[backtrack.m_nRecord];
+			}
+		}
 	}
+}
 
-	Assert( record );
+//-----------------------------------------------------------------------------
+// Purpose: Drop the backtracks that can't matter for this shot: players far enough
+//			away that the distance check in WantsLagCompensationOnEntity doesn't
+//			cover them, whose bounds now and back then are both well off the line
+//			the shooter is looking down. Returns how many are left.
+//-----------------------------------------------------------------------------
+int CLagCompensationManager::CullBacktracks( LagBacktrack *pBacktracks, int nCount, const CBasePlayer *pShooter, const CUserCmd *cmd ) const
+{
+	float flCone = sv_unlag_aimcone.GetFloat();
+	if ( flCone <= 0.0f || nCount <= 0 )
+		return nCount;
+
+	CBasePlayer *pPlayerShooter = const_cast< CBasePlayer * >( pShooter );
+	Vector vecEye = pPlayerShooter->EyePosition();
+	Vector vecForward;
+	AngleVectors( cmd->viewangles + pPlayerShooter->GetPunchAngle(), &vecForward );
+
+	// the slabs divide by the aim direction, so keep it off zero
+	Vector vecInvForward;
+	for ( int k = 0; k < 3; k++ )
+	{
+		float flDir = ( fabsf( vecForward[k] ) < 1e-6f ) ? ( ( vecForward[k] < 0.0f ) ? -1e-6f : 1e-6f ) : vecForward[k];
+		vecInvForward[k] = 1.0f / flDir;
+	}
 
-	if ( !record )
+	FourVectors eye, invForward;
+	eye.DuplicateVector( vecEye );
+	invForward.DuplicateVector( vecInvForward );
+	fltx4 tanCone = ReplicateX4( tanf( DEG2RAD( flCone ) ) );
+	fltx4 maxDist = ReplicateX4( MAX_TRACE_LENGTH );
+
+	int nKept = 0;
+	for ( int i = 0; i < nCount; i += 4 )
 	{
-		if ( sv_unlag_debug.GetBool() )
+		// each player's box around where they are and where we'd move them back to
+		Vector mins[4], maxs[4];
+		float radii[4], nears[4];
+		for ( int j = 0; j < 4; j++ )
 		{
-			DevMsg( "No valid positions in history for BacktrackPlayer client ( %s )\n", pPlayer->GetPlayerName() );
+			const LagBacktrack &backtrack = pBacktracks[ ( i + j < nCount ) ? i + j : i ];
+			CBasePlayer *pPlayer = backtrack.m_pPlayer;
+
+			pPlayer->CollisionProp()->WorldSpaceAABB( &mins[j], &maxs[j] );
+			float flScale = pPlayer->GetModelScale();
+			VectorMin( mins[j], backtrack.m_vecOrigin + backtrack.m_vecMinsPreScaled * flScale, mins[j] );
+			VectorMax( maxs[j], backtrack.m_vecOrigin + backtrack.m_vecMaxsPreScaled * flScale, maxs[j] );
+
+			radii[j] = ( maxs[j] - mins[j] ).Length() * 0.5f;
+
+			// same "could be running past us" distance as CBasePlayer::WantsLagCompensationOnEntity
+			nears[j] = 1.5f * pPlayer->MaxSpeed() * sv_maxunlag.GetFloat() + radii[j];
 		}
 
-		return; // that should never happen
+		FourVectors boxMins, boxMaxs;
+		boxMins.LoadAndSwizzle( mins[0], mins[1], mins[2], mins[3] );
+		boxMaxs.LoadAndSwizzle( maxs[0], maxs[1], maxs[2], maxs[3] );
+		fltx4 radius = LoadUnalignedSIMD( radii );
+		fltx4 nearDist = LoadUnalignedSIMD( nears );
+
+		FourVectors delta = boxMins;
+		delta += boxMaxs;
+		delta *= 0.5f;
+		delta -= eye;
+		fltx4 dist = SqrtSIMD( delta * delta );
+		fltx4 isNear = CmpLtSIMD( dist, nearDist );
+
+		// a shot that strays up to the cone from where we aimed lands this far off the aim ray by
+		// the time it gets there, so grow the box by that much and clip the ray against its slabs
+		fltx4 spread = MulSIMD( AddSIMD( dist, radius ), tanCone );
+		fltx4 enter = Four_Zeros;
+		fltx4 exit = maxDist;
+		for ( int k = 0; k < 3; k++ )
+		{
+			fltx4 lo = MulSIMD( SubSIMD( SubSIMD( boxMins[k], spread ), eye[k] ), invForward[k] );
+			fltx4 hi = MulSIMD( SubSIMD( AddSIMD( boxMaxs[k], spread ), eye[k] ), invForward[k] );
+			enter = MaxSIMD( enter, MinSIMD( lo, hi ) );
+			exit = MinSIMD( exit, MaxSIMD( lo, hi ) );
+		}
+		fltx4 onRay = CmpLeSIMD( enter, exit );
+		int nKeep = TestSignSIMD( OrSIMD( onRay, isNear ) );
+
+		for ( int j = 0; j < 4 && i + j < nCount; j++ )
+		{
+			if ( nKeep & ( 1 << j ) )
+			{
+				pBacktracks[nKept++] = pBacktracks[i + j];
+			}
+		}
 	}
 
-	float frac = 0.0f;
-	if ( prevRecord && 
-		 (record->m_flSimulationTime < flTargetTime) &&
-		 (record->m_flSimulationTime < prevRecord->m_flSimulationTime) )
-	{
-		// we didn't find the exact time but have a valid previous record
-		// so interpolate between these two records;
+	return nKept;
+}
 
-		Assert( prevRecord->m_flSimulationTime > record->m_flSimulationTime );
-		Assert( flTargetTime < prevRecord->m_flSimulationTime );
 
-		// calc fraction between both records
-		frac = ( flTargetTime - record->m_flSimulationTime ) / 
-			( prevRecord->m_flSimulationTime - record->m_flSimulationTime );
 
-		Assert( frac > 0 && frac < 1 ); // should never extrapolate
+//-----------------------------------------------------------------------------
+// Purpose: Move one player back on their own, for sv_unlag_fixstuck
+//-----------------------------------------------------------------------------
+void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTargetTime )
+{
+	LagBacktrack backtrack;
+	if ( !FindBacktrack( pPlayer, flTargetTime, backtrack ) )
+		return;
 
-		ang				= Lerp( frac, record->m_vecAngles, prevRecord->m_vecAngles );
-		org				= Lerp( frac, record->m_vecOrigin, prevRecord->m_vecOrigin );
-		minsPreScaled	= Lerp( frac, record->m_vecMinsPreScaled, prevRecord->m_vecMinsPreScaled );
-		maxsPreScaled	= Lerp( frac, record->m_vecMaxsPreScaled, prevRecord->m_vecMaxsPreScaled );
-	}
-	else
-	{
-		// we found the exact record or no other record to interpolate with
-		// just copy these values since they are the best we have
-		org				= record->m_vecOrigin;
-		ang				= record->m_vecAngles;
-		minsPreScaled	= record->m_vecMinsPreScaled;
-		maxsPreScaled	= record->m_vecMaxsPreScaled;
-	}
+	LerpBacktracks( &backtrack, 1 );
+	ApplyBacktrack( backtrack, flTargetTime );
+}
+
+void CLagCompensationManager::ApplyBacktrack( const LagBacktrack &backtrack, float flTargetTime )
+{
+	VPROF_BUDGET( "BacktrackPlayer", "CLagCompensationManager" );
+
+	CBasePlayer *pPlayer = backtrack.m_pPlayer;
+	int pl_index = pPlayer->entindex() - 1;
+
+	const CLagTrack *track = m_pPlayerTrack[ pl_index ];
+	const LagAnimRecord *record = &track->m_anim[ backtrack.m_nRecord ];
+	const LagAnimRecord *prevRecord = ( backtrack.m_nPrevRecord >= 0 ) ? &track->m_anim[ backtrack.m_nPrevRecord ] : NULL;
+	float frac = backtrack.m_flFrac;
+
+	Vector org = backtrack.m_vecOrigin;
+	Vector minsPreScaled = backtrack.m_vecMinsPreScaled;
+	Vector maxsPreScaled = backtrack.m_vecMaxsPreScaled;
+	QAngle ang = backtrack.m_vecAngles;
 
 	// See if this is still a valid position for us to teleport to
 	if ( sv_unlag_fixstuck.GetBool() )
@@ -707,8 +1005,8 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 			bool interpolated = false;
 			if( (frac > 0.0f)  &&  interpolationAllowed )
 			{
-				LayerRecord &recordsLayerRecord = record->m_layerRecords[layerIndex];
-				LayerRecord &prevRecordsLayerRecord = prevRecord->m_layerRecords[layerIndex];
+				const LayerRecord &recordsLayerRecord = record->m_layerRecords[layerIndex];
+				const LayerRecord &prevRecordsLayerRecord = prevRecord->m_layerRecords[layerIndex];
 				if( (recordsLayerRecord.m_order == prevRecordsLayerRecord.m_order)
 					&& (recordsLayerRecord.m_sequence == prevRecordsLayerRecord.m_sequence)
 					)
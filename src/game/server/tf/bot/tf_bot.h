@@ -1062,6 +1062,41 @@ public:
 		}
 	}
 
+	virtual bool GetClusterRouteKey( intp *kind, unsigned int *state ) const
+	{
+		static char s_kind;
+		*kind = (intp)&s_kind;
+
+		// everything about the bot that the costs above depend on, besides what's going on in the areas
+		struct
+		{
+			int routeType;
+			int team;
+			int playerClass;
+			int isMiniBoss;
+			float stepHeight;
+			float maxJumpHeight;
+			float maxDropHeight;
+			int preference;		// the bot and time period that pick its own default route
+		} routeState;
+		memset( &routeState, 0, sizeof( routeState ) );
+
+		routeState.routeType = m_routeType;
+		routeState.team = m_me->GetTeamNumber();
+		routeState.playerClass = m_me->GetPlayerClass()->GetClassIndex();
+		routeState.isMiniBoss = m_me->IsMiniBoss();
+		routeState.stepHeight = m_stepHeight;
+		routeState.maxJumpHeight = m_maxJumpHeight;
+		routeState.maxDropHeight = m_maxDropHeight;
+		if ( m_routeType == DEFAULT_ROUTE && !m_me->IsMiniBoss() )
+		{
+			routeState.preference = m_me->GetEntity()->entindex() * ( (int)( gpGlobals->curtime / 10.0f ) + 1 );
+		}
+
+		*state = HashBlock( &routeState, sizeof( routeState ) );
+		return true;
+	}
+
 	CTFBot *m_me;
 	RouteType m_routeType;
 	float m_stepHeight;
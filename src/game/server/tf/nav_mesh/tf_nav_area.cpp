@@ -816,6 +816,33 @@ NavErrorType CTFNavArea::Load( CUtlBuffer &fileBuffer, unsigned int version, uns
 }
 
 
+//------------------------------------------------------------------------------------------------
+void CTFNavArea::SaveFlatCustomData( CUtlBuffer &fileBuffer ) const
+{
+	CNavArea::SaveFlatCustomData( fileBuffer );
+
+	// save attribute flags
+	unsigned int attributes = m_attributeFlags & TF_NAV_PERSISTENT_ATTRIBUTES;
+	fileBuffer.PutUnsignedInt( attributes );
+}
+
+
+//------------------------------------------------------------------------------------------------
+NavErrorType CTFNavArea::LoadFlatCustomData( CUtlBuffer &fileBuffer, unsigned int subVersion )
+{
+	CNavArea::LoadFlatCustomData( fileBuffer, subVersion );
+
+	m_attributeFlags = fileBuffer.GetUnsignedInt();
+	if ( !fileBuffer.IsValid() )
+	{
+		Warning( "Can't read TF-specific attributes\n" );
+		return NAV_INVALID_FILE;
+	}
+
+	return NAV_OK;
+}
+
+
 //--------------------------------------------------------------------------------------------------------
 unsigned int CTFNavArea::m_masterTFMark = 1;
 
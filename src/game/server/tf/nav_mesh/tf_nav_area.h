@@ -77,6 +77,8 @@ public:
 
 	virtual void Save( CUtlBuffer &fileBuffer, unsigned int version ) const;								// (EXTEND)
 	virtual NavErrorType Load( CUtlBuffer &fileBuffer, unsigned int version, unsigned int subVersion );		// (EXTEND)
+	virtual void SaveFlatCustomData( CUtlBuffer &fileBuffer ) const;											// (EXTEND)
+	virtual NavErrorType LoadFlatCustomData( CUtlBuffer &fileBuffer, unsigned int subVersion );				// (EXTEND)
 
 	float GetIncursionDistance( int team ) const;				// return travel distance from the team's active spawn room to this area, -1 for invalid
 	CTFNavArea *GetNextIncursionArea( int team ) const;			// return adjacent area with largest increase in incursion distance
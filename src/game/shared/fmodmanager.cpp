@@ -70,6 +70,11 @@ void CFMODManager::LevelInitPreEntity()
 #endif
 }
 
+void CFMODManager::LevelInitPostEntity()
+{
+	m_pFMODSystem->OnLevelInitPostEntity();
+}
+
 void CFMODManager::LevelShutdownPreEntity()
 {
 #ifdef CLIENT_DLL
@@ -17,6 +17,7 @@ public:
 	virtual void Shutdown();
 
 	virtual void LevelInitPreEntity();
+	virtual void LevelInitPostEntity();
 	virtual void LevelShutdownPreEntity();
 
 	virtual void OnSave();
@@ -622,6 +622,9 @@ CGameMovement::CGameMovement( void )
 
 	mv					= NULL;
 
+	m_nTraceMemoCount	= -1;
+	m_nTraceMemoNext	= 0;
+
 	memset( m_flStuckCheckTime, 0, sizeof(m_flStuckCheckTime) );
 }
 
@@ -1196,6 +1199,8 @@ void CGameMovement::FinishTrackPredictionErrors( CBasePlayer *pPlayer )
 //-----------------------------------------------------------------------------
 void CGameMovement::FinishMove( void )
 {
+	StopTraceMemo();
+
 	mv->m_nOldButtons = mv->m_nButtons;
 	mv->m_flOldForwardMove = mv->m_flForwardMove;
 }
@@ -3494,6 +3499,74 @@ void CGameMovement::ResetGetPointContentsCache()
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Remember hull traces from here until FinishMove(). Nothing the
+//			player's traces can hit moves while the player does, so a trace
+//			with the same hull, endpoints, mask and collision group gets the
+//			same result, and e.g. CategorizePosition() on a player who hasn't
+//			moved needn't trace again.
+//-----------------------------------------------------------------------------
+void CGameMovement::StartTraceMemo( void )
+{
+	m_nTraceMemoCount = 0;
+	m_nTraceMemoNext = 0;
+}
+
+
+void CGameMovement::StopTraceMemo( void )
+{
+	m_nTraceMemoCount = -1;
+}
+
+
+bool CGameMovement::FindTraceMemo( const Vector& start, const Vector& end, const Vector& mins, const Vector& maxs, unsigned int fMask, int collisionGroup, trace_t& pm ) const
+{
+	if ( !g_bMovementOptimizations )
+		return false;
+
+	for ( int i = 0; i < m_nTraceMemoCount; ++i )
+	{
+		const MovementTrace_t &memo = m_TraceMemo[ i ];
+		if ( memo.m_vecStart == start && memo.m_vecEnd == end && 
+			 memo.m_vecMins == mins && memo.m_vecMaxs == maxs &&
+			 memo.m_fMask == fMask && memo.m_nCollisionGroup == collisionGroup )
+		{
+			pm = memo.m_Trace;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+void CGameMovement::AddTraceMemo( const Vector& start, const Vector& end, const Vector& mins, const Vector& maxs, unsigned int fMask, int collisionGroup, const trace_t& pm )
+{
+	if ( !g_bMovementOptimizations || m_nTraceMemoCount < 0 )
+		return;
+
+	int i;
+	if ( m_nTraceMemoCount < MAX_TRACE_MEMO )
+	{
+		i = m_nTraceMemoCount++;
+	}
+	else
+	{
+		i = m_nTraceMemoNext;
+		m_nTraceMemoNext = ( m_nTraceMemoNext + 1 ) % MAX_TRACE_MEMO;
+	}
+
+	MovementTrace_t &memo = m_TraceMemo[ i ];
+	memo.m_vecStart = start;
+	memo.m_vecEnd = end;
+	memo.m_vecMins = mins;
+	memo.m_vecMaxs = maxs;
+	memo.m_fMask = fMask;
+	memo.m_nCollisionGroup = collisionGroup;
+	memo.m_Trace = pm;
+}
+
+
 int CGameMovement::GetPointContentsCached( const Vector &point, int slot )
 {
 	if ( g_bMovementOptimizations ) 
@@ -4563,6 +4636,8 @@ void CGameMovement::PlayerMove( void )
 {
 	VPROF( "CGameMovement::PlayerMove" );
 
+	StartTraceMemo();
+
 	CheckParameters();
 	
 	// clear output applied velocity
@@ -4921,10 +4996,16 @@ void CGameMovement::TracePlayerBBox( const Vector& start, const Vector& end, uns
 {
 	VPROF( "CGameMovement::TracePlayerBBox" );
 
+	Vector mins = GetPlayerMins();
+	Vector maxs = GetPlayerMaxs();
+	if ( FindTraceMemo( start, end, mins, maxs, fMask, collisionGroup, pm ) )
+		return;
+
 	Ray_t ray;
-	ray.Init( start, end, GetPlayerMins(), GetPlayerMaxs() );
+	ray.Init( start, end, mins, maxs );
 	UTIL_TraceRay( ray, fMask, mv->m_nPlayerHandle.Get(), collisionGroup, &pm );
 
+	AddTraceMemo( start, end, mins, maxs, fMask, collisionGroup, pm );
 }
 
 
@@ -215,6 +215,11 @@ protected:
 	void ResetGetPointContentsCache();
 	int GetPointContentsCached( const Vector &point, int slot );
 
+	void StartTraceMemo( void );
+	void StopTraceMemo( void );
+	bool FindTraceMemo( const Vector& start, const Vector& end, const Vector& mins, const Vector& maxs, unsigned int fMask, int collisionGroup, trace_t& pm ) const;
+	void AddTraceMemo( const Vector& start, const Vector& end, const Vector& mins, const Vector& maxs, unsigned int fMask, int collisionGroup, const trace_t& pm );
+
 	// Ducking
 	virtual void	Duck( void );
 	virtual void	HandleDuckingSpeedCrop();
@@ -273,6 +278,26 @@ protected:
 	int m_CachedGetPointContents[ MAX_PLAYERS_ARRAY_SAFE ][ MAX_PC_CACHE_SLOTS ];
 	Vector m_CachedGetPointContentsPoint[ MAX_PLAYERS_ARRAY_SAFE ][ MAX_PC_CACHE_SLOTS ];	
 
+	enum
+	{
+		MAX_TRACE_MEMO = 16,
+	};
+
+	// Hull traces already made while moving the current player, so identical ones aren't made again.
+	struct MovementTrace_t
+	{
+		Vector			m_vecStart;
+		Vector			m_vecEnd;
+		Vector			m_vecMins;
+		Vector			m_vecMaxs;
+		unsigned int	m_fMask;
+		int				m_nCollisionGroup;
+		trace_t			m_Trace;
+	};
+	MovementTrace_t m_TraceMemo[ MAX_TRACE_MEMO ];
+	int				m_nTraceMemoCount;		// -1 when no player is being moved
+	int				m_nTraceMemoNext;		// entry to replace once the memo is full
+
 	Vector			m_vecProximityMins;		// Used to be globals in sv_user.cpp.
 	Vector			m_vecProximityMaxs;
 
@@ -2319,12 +2319,19 @@ void CTFGameMovement::TracePlayerBBox( const Vector& start, const Vector& end, u
 	if( tf_solidobjects.GetBool() == false )
 		return BaseClass::TracePlayerBBox( start, end, fMask, collisionGroup, pm );
 
+	Vector mins = GetPlayerMins();
+	Vector maxs = GetPlayerMaxs();
+	if ( FindTraceMemo( start, end, mins, maxs, fMask, collisionGroup, pm ) )
+		return;
+
 	Ray_t ray;
-	ray.Init( start, end, GetPlayerMins(), GetPlayerMaxs() );
+	ray.Init( start, end, mins, maxs );
 	
 	CTraceFilterObject traceFilter( mv->m_nPlayerHandle.Get(), collisionGroup );
 
 	enginetrace->TraceRay( ray, fMask, &traceFilter, &pm );
+
+	AddTraceMemo( start, end, mins, maxs, fMask, collisionGroup, pm );
 }
 
 //-----------------------------------------------------------------------------
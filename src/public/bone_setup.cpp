@@ -20,6 +20,8 @@
 #include "datamanager.h"
 #include "convar.h"
 #include "tier0/tslist.h"
+#include "tier1/utlhashtable.h"
+#include "tier1/generichash.h"
 #include "vphysics_interface.h"
 #ifdef CLIENT_DLL
 	#include "posedebugger.h"
@@ -46,13 +48,26 @@ public:
 };
 
 // -----------------------------------------------------------------
+// Scratch arrays for bone setup. Each thread keeps a few freed blocks of its own so
+// threaded bone setup doesn't bounce every alloc off the shared list; anything past
+// that goes back to the shared list for other threads.
+#define BONE_SETUP_THREAD_BLOCKS 8
+
 template <typename T>
 class CBoneSetupMemoryPool
 {
 public:
 	T *Alloc()
 	{
-		T *p = (T *)m_FreeBlocks.Pop();
+		T *p = s_pThreadBlocks;
+		if ( p )
+		{
+			s_pThreadBlocks = *(T **)p;
+			s_nThreadBlocks--;
+			return p;
+		}
+
+		p = (T *)m_FreeBlocks.Pop();
 		if ( !p )
 		{
 			p = new T[MAXSTUDIOBONES];
@@ -67,13 +82,27 @@ public:
 
 	void Free( T *p )
 	{
+		if ( s_nThreadBlocks < BONE_SETUP_THREAD_BLOCKS )
+		{
+			*(T **)p = s_pThreadBlocks;
+			s_pThreadBlocks = p;
+			s_nThreadBlocks++;
+			return;
+		}
+
 		m_FreeBlocks.Push( (TSLNodeBase_t *)p );
 	}
 
 private:
 	CTSListBase m_FreeBlocks;
+
+	static CTHREADLOCALPTR( T ) s_pThreadBlocks;
+	static CTHREADLOCALINT s_nThreadBlocks;
 };
 
+template <typename T> CTHREADLOCALPTR( T ) CBoneSetupMemoryPool<T>::s_pThreadBlocks;
+template <typename T> CTHREADLOCALINT CBoneSetupMemoryPool<T>::s_nThreadBlocks;
+
 CBoneSetupMemoryPool<Quaternion> g_QaternionPool;
 CBoneSetupMemoryPool<Vector> g_VectorPool;
 CBoneSetupMemoryPool<matrix3x4_t> g_MatrixPool;
@@ -567,6 +596,343 @@ inline void CalcBonePosition( int frame, float s,
 
 
 
+//-----------------------------------------------------------------------------
+// Purpose: cache of decoded animation frames. Crowds playing the same sequences
+//			decode the same run-length streams over and over, so each section frame
+//			is decoded once into both ends of its blend and kept in a shared LRU.
+//-----------------------------------------------------------------------------
+static ConVar anim_framecache( "anim_framecache", "1", 0, "Cache decoded animation frames between bone setups." );
+
+#define ANIM_FRAME_CACHE_SIZE	( 2 * 1024 * 1024L )
+
+struct animframebone_t
+{
+	Quaternion	q1;
+	Quaternion	q2;
+	Vector		pos1;
+	Vector		pos2;
+	bool		bAlign;			// rotation is animated and needs the fixed alignment applied after blending
+};
+
+class CAnimFrameData
+{
+public:
+	// you must implement these static functions for the ResourceManager
+	// -----------------------------------------------------------
+	static CAnimFrameData *CreateResource( CAnimFrameData * const &pData ) { return pData; }
+	static unsigned int EstimatedSize( CAnimFrameData * const &pData ) { return pData->m_size; }
+	// -----------------------------------------------------------
+	// member functions that must be present for the ResourceManager
+	void				DestroyResource() { free( this ); }
+	CAnimFrameData		*GetData() { return this; }
+	unsigned int		Size() { return m_size; }
+	// -----------------------------------------------------------
+
+	animframebone_t		*Bones() { return (animframebone_t *)( this + 1 ); }
+
+	unsigned int		m_size;
+	int					m_numBones;
+};
+
+// Keyed on the animation and its frame rather than where the section happens to be
+// loaded, since anim blocks can be thrown out and reloaded somewhere else. The
+// animdesc lives in the model's header, so the cache is flushed whenever models
+// may have been unloaded (Studio_FlushAnimFrameCache).
+struct AnimFrameKey_t
+{
+	const mstudioanimdesc_t	*pAnimdesc;
+	int						iFrame;			// frame within the whole animation
+	int						nPad;
+
+	bool operator==( const AnimFrameKey_t &other ) const
+	{
+		return pAnimdesc == other.pAnimdesc && iFrame == other.iFrame;
+	}
+};
+
+struct AnimFrameKeyHash_t
+{
+	unsigned int operator()( const AnimFrameKey_t &key ) const
+	{
+		return HashBlock( &key, sizeof( key ) );
+	}
+};
+
+static CDataManager<CAnimFrameData, CAnimFrameData *, CAnimFrameData *, CThreadFastMutex> g_AnimFrameCache( ANIM_FRAME_CACHE_SIZE );
+static CUtlHashtable<AnimFrameKey_t, memhandle_t, AnimFrameKeyHash_t> g_AnimFrameHandles;
+
+//-----------------------------------------------------------------------------
+// Purpose: decode both ends of the blend for one bone. Matches CalcBoneQuaternion
+//			and CalcBonePosition, minus the blend itself.
+//-----------------------------------------------------------------------------
+static void DecodeBoneFrame( int frame, const Quaternion &baseQuat, const RadianEuler &baseRot, const Vector &baseRotScale,
+						int iBaseFlags, const Vector &basePos, const Vector &baseBoneScale,
+						const mstudioanim_t *panim, animframebone_t &bone )
+{
+	bone.bAlign = false;
+	if ( panim->flags & STUDIO_ANIM_RAWROT )
+	{
+		bone.q1 = bone.q2 = *(panim->pQuat48());
+	}
+	else if ( panim->flags & STUDIO_ANIM_RAWROT2 )
+	{
+		bone.q1 = bone.q2 = *(panim->pQuat64());
+	}
+	else if ( !(panim->flags & STUDIO_ANIM_ANIMROT) )
+	{
+		if (panim->flags & STUDIO_ANIM_DELTA)
+		{
+			bone.q1.Init( 0.0f, 0.0f, 0.0f, 1.0f );
+		}
+		else
+		{
+			bone.q1 = baseQuat;
+		}
+		bone.q2 = bone.q1;
+	}
+	else
+	{
+		mstudioanim_valueptr_t *pValuesPtr = panim->pRotV();
+		RadianEuler angle1, angle2;
+
+		ExtractAnimValue( frame, pValuesPtr->pAnimvalue( 0 ), baseRotScale.x, angle1.x, angle2.x );
+		ExtractAnimValue( frame, pValuesPtr->pAnimvalue( 1 ), baseRotScale.y, angle1.y, angle2.y );
+		ExtractAnimValue( frame, pValuesPtr->pAnimvalue( 2 ), baseRotScale.z, angle1.z, angle2.z );
+
+		if (!(panim->flags & STUDIO_ANIM_DELTA))
+		{
+			angle1.x = angle1.x + baseRot.x;
+			angle1.y = angle1.y + baseRot.y;
+			angle1.z = angle1.z + baseRot.z;
+			angle2.x = angle2.x + baseRot.x;
+			angle2.y = angle2.y + baseRot.y;
+			angle2.z = angle2.z + baseRot.z;
+			bone.bAlign = ( iBaseFlags & BONE_FIXED_ALIGNMENT ) != 0;
+		}
+
+		AngleQuaternion( angle1, bone.q1 );
+		if (angle1.x != angle2.x || angle1.y != angle2.y || angle1.z != angle2.z)
+		{
+			AngleQuaternion( angle2, bone.q2 );
+		}
+		else
+		{
+			bone.q2 = bone.q1;
+		}
+	}
+
+	if (panim->flags & STUDIO_ANIM_RAWPOS)
+	{
+		bone.pos1 = bone.pos2 = *(panim->pPos());
+	}
+	else if (!(panim->flags & STUDIO_ANIM_ANIMPOS))
+	{
+		if (panim->flags & STUDIO_ANIM_DELTA)
+		{
+			bone.pos1.Init( 0.0f, 0.0f, 0.0f );
+		}
+		else
+		{
+			bone.pos1 = basePos;
+		}
+		bone.pos2 = bone.pos1;
+	}
+	else
+	{
+		mstudioanim_valueptr_t *pPosV = panim->pPosV();
+		for (int j = 0; j < 3; j++)
+		{
+			ExtractAnimValue( frame, pPosV->pAnimvalue( j ), baseBoneScale[j], bone.pos1[j], bone.pos2[j] );
+		}
+
+		if (!(panim->flags & STUDIO_ANIM_DELTA))
+		{
+			bone.pos1 += basePos;
+			bone.pos2 += basePos;
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: blend a cached bone to the sub frame, the same way CalcBoneQuaternion
+//			and CalcBonePosition would have
+//-----------------------------------------------------------------------------
+static void BlendBoneFrame( const animframebone_t &bone, float s, const Quaternion &baseAlignment, Quaternion &q, Vector &pos )
+{
+	if ( s > 0.001f )
+	{
+		if ( bone.q1 != bone.q2 )
+		{
+			QuaternionBlend( bone.q1, bone.q2, s, q );
+		}
+		else
+		{
+			q = bone.q1;
+		}
+		pos = bone.pos1 * (1.0 - s) + bone.pos2 * s;
+	}
+	else
+	{
+		q = bone.q1;
+		pos = bone.pos1;
+	}
+
+	Assert( q.IsValid() && pos.IsValid() );
+
+	if ( bone.bAlign )
+	{
+		QuaternionAlign( baseAlignment, q, q );
+	}
+}
+
+inline void BlendBoneFrame( const animframebone_t &bone, float s,
+						const mstudiobone_t *pBone,
+						const mstudiolinearbone_t *pLinearBones,
+						const mstudioanim_t *panim, Quaternion &q, Vector &pos )
+{
+	BlendBoneFrame( bone, s, pLinearBones ? pLinearBones->qalignment(panim->bone) : pBone->qAlignment, q, pos );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: find or decode the frame for a section of an animation, and hold it
+//			in the cache until this goes out of scope. Bones() is indexed by the
+//			position in the mstudioanim_t chain, and is NULL if caching is off.
+//-----------------------------------------------------------------------------
+class CAnimFrameCacheLock
+{
+public:
+	CAnimFrameCacheLock( const mstudioanimdesc_t &animdesc, const mstudioanim_t *panim, int iFrame, int iLocalFrame,
+						 const mstudiobone_t *pBones, const mstudiolinearbone_t *pLinearBones );
+	~CAnimFrameCacheLock();
+
+	const animframebone_t *Bones() const { return m_pData ? m_pData->Bones() : NULL; }
+
+private:
+	memhandle_t		m_hData;
+	CAnimFrameData	*m_pData;
+};
+
+CAnimFrameCacheLock::CAnimFrameCacheLock( const mstudioanimdesc_t &animdesc, const mstudioanim_t *panim, int iFrame, int iLocalFrame,
+										  const mstudiobone_t *pBones, const mstudiolinearbone_t *pLinearBones )
+{
+	m_hData = INVALID_MEMHANDLE;
+	m_pData = NULL;
+	if ( !panim || !anim_framecache.GetBool() )
+		return;
+
+	AnimFrameKey_t key;
+	key.pAnimdesc = &animdesc;
+	key.iFrame = iFrame;
+	key.nPad = 0;
+
+	{
+		AUTO_LOCK( g_AnimFrameCache.AccessMutex() );
+		UtlHashHandle_t h = g_AnimFrameHandles.Find( key );
+		if ( h != g_AnimFrameHandles.InvalidHandle() )
+		{
+			m_pData = g_AnimFrameCache.LockResource( g_AnimFrameHandles.Element( h ) );
+			if ( m_pData )
+			{
+				m_hData = g_AnimFrameHandles.Element( h );
+				return;
+			}
+		}
+	}
+
+	// decode outside the lock, other threads only wait for the table
+	int nBones = 0;
+	for ( const mstudioanim_t *pBoneAnim = panim; pBoneAnim; pBoneAnim = pBoneAnim->pNext() )
+	{
+		nBones++;
+	}
+
+	unsigned int size = sizeof( CAnimFrameData ) + nBones * sizeof( animframebone_t );
+	CAnimFrameData *pData = (CAnimFrameData *)malloc( size );
+	pData->m_size = size;
+	pData->m_numBones = nBones;
+
+	animframebone_t *pFrameBones = pData->Bones();
+	for ( const mstudioanim_t *pBoneAnim = panim; pBoneAnim; pBoneAnim = pBoneAnim->pNext(), pFrameBones++ )
+	{
+		int iBone = pBoneAnim->bone;
+		if ( iBone >= 255 )
+		{
+			// never looked up, see the FIXME in CalcVirtualAnimation
+			memset( pFrameBones, 0, sizeof( animframebone_t ) );
+		}
+		else if ( pLinearBones )
+		{
+			DecodeBoneFrame( iLocalFrame, pLinearBones->quat(iBone), pLinearBones->rot(iBone), pLinearBones->rotscale(iBone), pLinearBones->flags(iBone),
+				pLinearBones->pos(iBone), pLinearBones->posscale(iBone), pBoneAnim, *pFrameBones );
+		}
+		else
+		{
+			const mstudiobone_t *pBone = &pBones[iBone];
+			DecodeBoneFrame( iLocalFrame, pBone->quat, pBone->rot, pBone->rotscale, pBone->flags,
+				pBone->pos, pBone->posscale, pBoneAnim, *pFrameBones );
+		}
+	}
+
+	AUTO_LOCK( g_AnimFrameCache.AccessMutex() );
+
+	// someone else may have decoded the same frame while we were
+	UtlHashHandle_t h = g_AnimFrameHandles.Find( key );
+	if ( h != g_AnimFrameHandles.InvalidHandle() )
+	{
+		m_pData = g_AnimFrameCache.LockResource( g_AnimFrameHandles.Element( h ) );
+		if ( m_pData )
+		{
+			m_hData = g_AnimFrameHandles.Element( h );
+			free( pData );
+			return;
+		}
+	}
+
+	// the table only ever points at live frames or ones the LRU has already thrown
+	// away; drop the dead ones once they start to outnumber the live ones
+	if ( g_AnimFrameHandles.Count() > 1024 && g_AnimFrameHandles.Count() > 4 * g_AnimFrameCache.UsedSize() / size )
+	{
+		for ( UtlHashHandle_t i = g_AnimFrameHandles.FirstHandle(); i != g_AnimFrameHandles.InvalidHandle(); )
+		{
+			if ( !g_AnimFrameCache.GetResource_NoLockNoLRUTouch( g_AnimFrameHandles.Element( i ) ) )
+			{
+				i = g_AnimFrameHandles.RemoveAndAdvance( i );
+			}
+			else
+			{
+				i = g_AnimFrameHandles.NextHandle( i );
+			}
+		}
+	}
+
+	m_hData = g_AnimFrameCache.CreateResource( pData, true );
+	m_pData = pData;
+
+	// Insert() hands back a stale entry for this key rather than replacing it
+	g_AnimFrameHandles.Element( g_AnimFrameHandles.Insert( key, m_hData ) ) = m_hData;
+}
+
+CAnimFrameCacheLock::~CAnimFrameCacheLock()
+{
+	if ( m_pData )
+	{
+		AUTO_LOCK( g_AnimFrameCache.AccessMutex() );
+		g_AnimFrameCache.UnlockResource( m_hData );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: throw away every cached frame, call when models may be unloaded
+//-----------------------------------------------------------------------------
+void Studio_FlushAnimFrameCache()
+{
+	AUTO_LOCK( g_AnimFrameCache.AccessMutex() );
+	g_AnimFrameCache.FlushAllUnlocked();
+	g_AnimFrameHandles.RemoveAll();
+}
+
+
+
 void SetupSingleBoneMatrix( 
 	CStudioHdr *pOwnerHdr, 
 	int nSequence, 
@@ -960,8 +1326,11 @@ static void CalcVirtualAnimation( virtualmodel_t *pVModel, const CStudioHdr *pSt
 		return;
 	}
 
+	CAnimFrameCacheLock frameCache( animdesc, panim, iFrame, iLocalFrame, pAnimbone, pAnimLinearBones );
+	const animframebone_t *pFrameBones = frameCache.Bones();
+
 	// FIXME: change encoding so that bone -1 is never the case
-	while (panim && panim->bone < 255)
+	for ( int n = 0; panim && panim->bone < 255; n++ )
 	{
 		int j = pAnimGroup->masterBone[panim->bone];
 		if ( j >= 0 && ( pStudioHdr->boneFlags(j) & boneMask ) )
@@ -970,8 +1339,15 @@ static void CalcVirtualAnimation( virtualmodel_t *pVModel, const CStudioHdr *pSt
 
 			if (k >= 0 && pweight[k] > 0.0f)
 			{
-				CalcBoneQuaternion( iLocalFrame, s, &pAnimbone[panim->bone], pAnimLinearBones, panim, q[j] );
-				CalcBonePosition  ( iLocalFrame, s, &pAnimbone[panim->bone], pAnimLinearBones, panim, pos[j] );
+				if ( pFrameBones )
+				{
+					BlendBoneFrame( pFrameBones[n], s, &pAnimbone[panim->bone], pAnimLinearBones, panim, q[j], pos[j] );
+				}
+				else
+				{
+					CalcBoneQuaternion( iLocalFrame, s, &pAnimbone[panim->bone], pAnimLinearBones, panim, q[j] );
+					CalcBonePosition  ( iLocalFrame, s, &pAnimbone[panim->bone], pAnimLinearBones, panim, pos[j] );
+				}
 #ifdef STUDIO_ENABLE_PERF_COUNTERS
 				pStudioHdr->m_nPerfAnimatedBones++;
 #endif
@@ -1091,6 +1467,10 @@ static void CalcAnimation( const CStudioHdr *pStudioHdr,	Vector *pos, Quaternion
 		return;
 	}
 
+	CAnimFrameCacheLock frameCache( animdesc, panim, iFrame, iLocalFrame, pbone, pLinearBones );
+	const animframebone_t *pFrameBones = frameCache.Bones();
+	int nAnimBone = 0;
+
 	// BUGBUG: the sequence, the anim, and the model can have all different bone mappings.
 	for (int i = 0; i < pStudioHdr->numbones(); i++, pbone++, pweight++)
 	{
@@ -1098,14 +1478,22 @@ static void CalcAnimation( const CStudioHdr *pStudioHdr,	Vector *pos, Quaternion
 		{
 			if (*pweight > 0 && (pStudioHdr->boneFlags(i) & boneMask))
 			{
-				CalcBoneQuaternion( iLocalFrame, s, pbone, pLinearBones, panim, q[i] );
-				CalcBonePosition  ( iLocalFrame, s, pbone, pLinearBones, panim, pos[i] );
+				if ( pFrameBones )
+				{
+					BlendBoneFrame( pFrameBones[nAnimBone], s, pbone, pLinearBones, panim, q[i], pos[i] );
+				}
+				else
+				{
+					CalcBoneQuaternion( iLocalFrame, s, pbone, pLinearBones, panim, q[i] );
+					CalcBonePosition  ( iLocalFrame, s, pbone, pLinearBones, panim, pos[i] );
+				}
 #ifdef STUDIO_ENABLE_PERF_COUNTERS
 				pStudioHdr->m_nPerfAnimatedBones++;
 				pStudioHdr->m_nPerfUsedBones++;
 #endif
 			}
 			panim = panim->pNext();
+			nAnimBone++;
 		}
 		else if (*pweight > 0 && (pStudioHdr->boneFlags(i) & boneMask))
 		{
@@ -1366,6 +1754,129 @@ void WorldSpaceSlerp(
 
 
 
+//-----------------------------------------------------------------------------
+// Purpose: SIMD blend kernels for SlerpBones, BlendBones and ScaleBones. They work
+//			on four bones at a time; bones that shouldn't change are masked out per
+//			lane and come back exactly as they went in.
+//-----------------------------------------------------------------------------
+COMPILE_TIME_ASSERT( sizeof( QuaternionAligned ) == sizeof( Quaternion ) );
+
+// The last group of four can run off the end of the skeleton. It goes through a copy
+// so nothing reads or writes past the caller's arrays.
+class CFourBoneLanes
+{
+public:
+	CFourBoneLanes( Quaternion *q, int nBone, int nBoneCount ) : m_pDest( q + nBone ), m_nLanes( MIN( nBoneCount - nBone, 4 ) )
+	{
+		m_pLanes = m_pDest;
+		if ( m_nLanes < 4 )
+		{
+			for ( int k = 0; k < 4; k++ )
+			{
+				m_tail[k] = ( k < m_nLanes ) ? m_pDest[k] : quat_identity;
+			}
+			m_pLanes = m_tail;
+		}
+	}
+
+	void Load( FourQuaternions &q ) const
+	{
+		q.LoadAndSwizzle( m_pLanes[0], m_pLanes[1], m_pLanes[2], m_pLanes[3] );
+	}
+
+	void Store( const FourQuaternions &q )
+	{
+		q.SwizzleAndStore( m_pLanes[0], m_pLanes[1], m_pLanes[2], m_pLanes[3] );
+		if ( m_pLanes != m_pDest )
+		{
+			for ( int k = 0; k < m_nLanes; k++ )
+			{
+				m_pDest[k] = m_tail[k];
+			}
+		}
+	}
+
+private:
+	Quaternion	*m_pDest;
+	Quaternion	*m_pLanes;
+	int			m_nLanes;
+	Quaternion	m_tail[4];
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: q1 = QuaternionSlerp( q2, q1, 1 - s2 ) or QuaternionBlend, skipping the
+//			align for BONE_FIXED_ALIGNMENT bones. pS2 has a weight per bone, padded
+//			out to a multiple of four, and bones with no weight are left alone.
+//-----------------------------------------------------------------------------
+static void BlendQuaternionsSIMD( const CStudioHdr *pStudioHdr, int nBoneCount, Quaternion *q1, const Quaternion *q2, const float *pS2, bool bSlerp )
+{
+	for ( int i = 0; i < nBoneCount; i += 4 )
+	{
+		fltx4 s2 = LoadUnalignedSIMD( pS2 + i );
+		fltx4 active = CmpGtSIMD( s2, Four_Zeros );
+		if ( !TestSignSIMD( active ) )
+			continue;
+
+		CFourBoneLanes lanes1( q1, i, nBoneCount );
+		CFourBoneLanes lanes2( const_cast< Quaternion * >( q2 ), i, nBoneCount );
+
+		FourQuaternions a, b;
+		lanes1.Load( a );
+		lanes2.Load( b );
+
+		float flAlign[4];
+		for ( int k = 0; k < 4; k++ )
+		{
+			flAlign[k] = ( i + k < nBoneCount && !( pStudioHdr->boneFlags( i + k ) & BONE_FIXED_ALIGNMENT ) ) ? 1.0f : 0.0f;
+		}
+		FourQuaternions aligned = a;
+		aligned.Align( b );
+		aligned.MaskedAssign( CmpEqSIMD( LoadUnalignedSIMD( flAlign ), Four_Zeros ), a );
+
+		FourQuaternions result;
+		fltx4 s1 = SubSIMD( Four_Ones, s2 );
+		if ( bSlerp )
+		{
+			result.SlerpNoAlign( b, aligned, s1 );
+		}
+		else
+		{
+			result.BlendNoAlign( b, aligned, s1 );
+		}
+
+		a.MaskedAssign( active, result );
+		lanes1.Store( a );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: q1 = QuaternionIdentityBlend( q1, t ) for the bones with a non-zero
+//			entry in pActive, which is padded out to a multiple of four
+//-----------------------------------------------------------------------------
+static void IdentityBlendQuaternionsSIMD( int nBoneCount, Quaternion *q1, const float *pActive, float t )
+{
+	fltx4 t4 = ReplicateX4( t );
+	for ( int i = 0; i < nBoneCount; i += 4 )
+	{
+		fltx4 active = CmpGtSIMD( LoadUnalignedSIMD( pActive + i ), Four_Zeros );
+		if ( !TestSignSIMD( active ) )
+			continue;
+
+		CFourBoneLanes lanes( q1, i, nBoneCount );
+
+		FourQuaternions a;
+		lanes.Load( a );
+
+		FourQuaternions result = a;
+		result.IdentityBlend( t4 );
+
+		a.MaskedAssign( active, result );
+		lanes.Store( a );
+	}
+}
+
+
+
 //-----------------------------------------------------------------------------
 // Purpose: blend together q1,pos1 with q2,pos2.  Return result in q1,pos1.  
 //			0 returns q1, pos1.  1 returns q2, pos2
@@ -1402,9 +1913,14 @@ void SlerpBones(
 		pSeqGroup = pVModel->pSeqGroup( sequence );
 	}
 
-	// Build weightlist for all bones
+	// Build weightlist for all bones, padded out to whole groups of four for the SIMD blend
 	int nBoneCount = pStudioHdr->numbones();
-	float *pS2 = (float*)stackalloc( nBoneCount * sizeof(float) );
+	int nPaddedCount = ( nBoneCount + 3 ) & ~3;
+	float *pS2 = (float*)stackalloc( nPaddedCount * sizeof(float) );
+	for (i = nBoneCount; i < nPaddedCount; i++)
+	{
+		pS2[i] = 0.0f;
+	}
 	for (i = 0; i < nBoneCount; i++)
 	{
 		// skip unused bones
@@ -1475,7 +1991,8 @@ void SlerpBones(
 		return;
 	}
 
-	QuaternionAligned q3;
+	BlendQuaternionsSIMD( pStudioHdr, nBoneCount, q1, q2, pS2, true );
+
 	for (i = 0; i < nBoneCount; i++)
 	{
 		s2 = pS2[i];
@@ -1484,37 +2001,6 @@ void SlerpBones(
 
 		s1 = 1.0 - s2;
 
-#ifdef _X360
-		fltx4  q1simd, q2simd, result;
-		q1simd = LoadUnalignedSIMD( q1[i].Base() );
-		q2simd = LoadAlignedSIMD( q2[i] );
-#endif
-		if ( pStudioHdr->boneFlags(i) & BONE_FIXED_ALIGNMENT )
-		{
-#ifndef _X360
-			QuaternionSlerpNoAlign( q2[i], q1[i], s1, q3 );
-#else
-			result = QuaternionSlerpNoAlignSIMD( q2simd, q1simd, s1 );
-#endif
-		}
-		else
-		{
-#ifndef _X360
-			QuaternionSlerp( q2[i], q1[i], s1, q3 );
-#else
-			result = QuaternionSlerpSIMD( q2simd, q1simd, s1 );
-#endif
-		}
-
-#ifndef _X360
-		q1[i][0] = q3[0];
-		q1[i][1] = q3[1];
-		q1[i][2] = q3[2];
-		q1[i][3] = q3[3];
-#else
-		StoreUnalignedSIMD( q1[i].Base(), result );
-#endif
-
 		pos1[i][0] = pos1[i][0] * s1 + pos2[i][0] * s2;
 		pos1[i][1] = pos1[i][1] * s1 + pos2[i][1] * s2;
 		pos1[i][2] = pos1[i][2] * s1 + pos2[i][2] * s2;
@@ -1540,7 +2026,6 @@ void BlendBones(
 	int boneMask )
 {
 	int			i, j;
-	Quaternion		q3;
 
 	virtualmodel_t *pVModel = pStudioHdr->GetVirtualModel();
 	const virtualgroup_t *pSeqGroup = NULL;
@@ -1586,10 +2071,16 @@ void BlendBones(
 	float s2 = s;
 	float s1 = 1.0 - s2;
 
-	for (i = 0; i < pStudioHdr->numbones(); i++)
+	// weight of q2 for each bone, zero for the ones we skip
+	int nBoneCount = pStudioHdr->numbones();
+	int nPaddedCount = ( nBoneCount + 3 ) & ~3;
+	float *pS2 = (float*)stackalloc( nPaddedCount * sizeof(float) );
+	for (i = 0; i < nPaddedCount; i++)
 	{
+		pS2[i] = 0.0f;
+
 		// skip unused bones
-		if (!(pStudioHdr->boneFlags(i) & boneMask))
+		if (i >= nBoneCount || !(pStudioHdr->boneFlags(i) & boneMask))
 		{
 			continue;
 		}
@@ -1605,18 +2096,16 @@ void BlendBones(
 
 		if (j >= 0 && seqdesc.weight( j ) > 0.0)
 		{
-			if (pStudioHdr->boneFlags(i) & BONE_FIXED_ALIGNMENT)
-			{
-				QuaternionBlendNoAlign( q2[i], q1[i], s1, q3 );
-			}
-			else
-			{
-				QuaternionBlend( q2[i], q1[i], s1, q3 );
-			}
-			q1[i][0] = q3[0];
-			q1[i][1] = q3[1];
-			q1[i][2] = q3[2];
-			q1[i][3] = q3[3];
+			pS2[i] = s2;
+		}
+	}
+
+	BlendQuaternionsSIMD( pStudioHdr, nBoneCount, q1, q2, pS2, false );
+
+	for (i = 0; i < nBoneCount; i++)
+	{
+		if (pS2[i] > 0.0f)
+		{
 			pos1[i][0] = pos1[i][0] * s1 + pos2[i][0] * s2;
 			pos1[i][1] = pos1[i][1] * s1 + pos2[i][1] * s2;
 			pos1[i][2] = pos1[i][2] * s1 + pos2[i][2] * s2;
@@ -1651,10 +2140,16 @@ void ScaleBones(
 	float s2 = s;
 	float s1 = 1.0 - s2;
 
-	for (i = 0; i < pStudioHdr->numbones(); i++)
+	// which bones get scaled, padded out to whole groups of four for the SIMD blend
+	int nBoneCount = pStudioHdr->numbones();
+	int nPaddedCount = ( nBoneCount + 3 ) & ~3;
+	float *pActive = (float*)stackalloc( nPaddedCount * sizeof(float) );
+	for (i = 0; i < nPaddedCount; i++)
 	{
+		pActive[i] = 0.0f;
+
 		// skip unused bones
-		if (!(pStudioHdr->boneFlags(i) & boneMask))
+		if (i >= nBoneCount || !(pStudioHdr->boneFlags(i) & boneMask))
 		{
 			continue;
 		}
@@ -1670,7 +2165,16 @@ void ScaleBones(
 
 		if (j >= 0 && seqdesc.weight( j ) > 0.0)
 		{
-			QuaternionIdentityBlend( q1[i], s1, q1[i] );
+			pActive[i] = 1.0f;
+		}
+	}
+
+	IdentityBlendQuaternionsSIMD( nBoneCount, q1, pActive, s1 );
+
+	for (i = 0; i < nBoneCount; i++)
+	{
+		if (pActive[i] > 0.0f)
+		{
 			VectorScale( pos1[i], s2, pos1[i] );
 		}
 	}
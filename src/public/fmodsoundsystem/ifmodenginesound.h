@@ -5,8 +5,8 @@
 #include "eiface.h"
 #include <sentence.h>
 
-#define IFMODENGINESOUND_CLIENT_INTERFACE_VERSION	"IFMODEngineSoundClient001"
-#define IFMODENGINESOUND_SERVER_INTERFACE_VERSION	"IFMODEngineSoundServer001"
+#define IFMODENGINESOUND_CLIENT_INTERFACE_VERSION	"IFMODEngineSoundClient002"
+#define IFMODENGINESOUND_SERVER_INTERFACE_VERSION	"IFMODEngineSoundServer002"
 
 // extended IEngineSound interface required for to handle engine tasks and additional functionality
 class CAudioSource;
@@ -16,6 +16,7 @@ abstract_class IFMODEngineSound : public IEngineSound
 public:
 	virtual void Initialize( CreateInterfaceFn appSystemFactory, CreateInterfaceFn physicsFactory, CreateInterfaceFn gameFactory, CGlobalVarsBase *globals ) = 0;
 	virtual void Shutdown() = 0;
+	virtual void OnLevelInitPostEntity() = 0;
 
 	// Client only
 	virtual void Update( float frametime ) = 0;
@@ -363,5 +363,142 @@ FORCEINLINE fltx4 QuaternionSlerpSIMD( const fltx4 &p, const fltx4 &q, float t )
 
 #endif // ALLOW_SIMD_QUATERNION_MATH
 
+
+//---------------------------------------------------------------------
+// FourQuaternions stores 4 independent quaternions as x x x x y y y y
+// z z z z w w w w. Every op works on all four lanes with no horizontal
+// math, so unlike the functions above these are a win on PC as well.
+// Each lane matches the scalar function of the same name.
+//---------------------------------------------------------------------
+class ALIGN16 FourQuaternions
+{
+public:
+	fltx4 x, y, z, w;
+
+	/// load 4 Quaternions, performing transpose op
+	FORCEINLINE void LoadAndSwizzle( const Quaternion &a, const Quaternion &b, const Quaternion &c, const Quaternion &d )
+	{
+		x = LoadUnalignedSIMD( a.Base() );
+		y = LoadUnalignedSIMD( b.Base() );
+		z = LoadUnalignedSIMD( c.Base() );
+		w = LoadUnalignedSIMD( d.Base() );
+		TransposeSIMD( x, y, z, w );
+	}
+
+	/// transpose back and store to 4 Quaternions
+	FORCEINLINE void SwizzleAndStore( Quaternion &a, Quaternion &b, Quaternion &c, Quaternion &d ) const
+	{
+		fltx4 tx = x, ty = y, tz = z, tw = w;
+		TransposeSIMD( tx, ty, tz, tw );
+		StoreUnalignedSIMD( a.Base(), tx );
+		StoreUnalignedSIMD( b.Base(), ty );
+		StoreUnalignedSIMD( c.Base(), tz );
+		StoreUnalignedSIMD( d.Base(), tw );
+	}
+
+	/// 4 dot products
+	FORCEINLINE fltx4 Dot( const FourQuaternions &q ) const
+	{
+		return MaddSIMD( w, q.w, MaddSIMD( z, q.z, MaddSIMD( y, q.y, MulSIMD( x, q.x ) ) ) );
+	}
+
+	/// lanes set in mask take their value from src
+	FORCEINLINE void MaskedAssign( const fltx4 &mask, const FourQuaternions &src )
+	{
+		x = ::MaskedAssign( mask, src.x, x );
+		y = ::MaskedAssign( mask, src.y, y );
+		z = ::MaskedAssign( mask, src.z, z );
+		w = ::MaskedAssign( mask, src.w, w );
+	}
+
+	/// QuaternionNormalize
+	FORCEINLINE void Normalize()
+	{
+		fltx4 radius = Dot( *this );
+		// a zero quaternion is left alone
+		radius = ::MaskedAssign( CmpEqSIMD( radius, Four_Zeros ), Four_Ones, radius );
+		fltx4 iradius = DivSIMD( Four_Ones, SqrtSIMD( radius ) );
+		x = MulSIMD( x, iradius );
+		y = MulSIMD( y, iradius );
+		z = MulSIMD( z, iradius );
+		w = MulSIMD( w, iradius );
+	}
+
+	/// QuaternionAlign, lanes of this are flipped to be within 180 degrees of p
+	FORCEINLINE void Align( const FourQuaternions &p )
+	{
+		fltx4 dx = SubSIMD( p.x, x ), dy = SubSIMD( p.y, y ), dz = SubSIMD( p.z, z ), dw = SubSIMD( p.w, w );
+		fltx4 sx = AddSIMD( p.x, x ), sy = AddSIMD( p.y, y ), sz = AddSIMD( p.z, z ), sw = AddSIMD( p.w, w );
+		fltx4 a = MaddSIMD( dw, dw, MaddSIMD( dz, dz, MaddSIMD( dy, dy, MulSIMD( dx, dx ) ) ) );
+		fltx4 b = MaddSIMD( sw, sw, MaddSIMD( sz, sz, MaddSIMD( sy, sy, MulSIMD( sx, sx ) ) ) );
+		fltx4 flip = CmpGtSIMD( a, b );
+		x = ::MaskedAssign( flip, NegSIMD( x ), x );
+		y = ::MaskedAssign( flip, NegSIMD( y ), y );
+		z = ::MaskedAssign( flip, NegSIMD( z ), z );
+		w = ::MaskedAssign( flip, NegSIMD( w ), w );
+	}
+
+	/// QuaternionBlendNoAlign with a separate t per lane
+	FORCEINLINE void BlendNoAlign( const FourQuaternions &p, const FourQuaternions &q, const fltx4 &t )
+	{
+		fltx4 sclp = SubSIMD( Four_Ones, t );
+		x = MaddSIMD( sclp, p.x, MulSIMD( t, q.x ) );
+		y = MaddSIMD( sclp, p.y, MulSIMD( t, q.y ) );
+		z = MaddSIMD( sclp, p.z, MulSIMD( t, q.z ) );
+		w = MaddSIMD( sclp, p.w, MulSIMD( t, q.w ) );
+		Normalize();
+	}
+
+	/// QuaternionSlerpNoAlign with a separate t per lane
+	FORCEINLINE void SlerpNoAlign( const FourQuaternions &p, const FourQuaternions &q, const fltx4 &t )
+	{
+		static const fltx4 kSlerpEpsilon = { 0.000001f, 0.000001f, 0.000001f, 0.000001f };
+		static const fltx4 kHalfPi = { 0.5f * M_PI_F, 0.5f * M_PI_F, 0.5f * M_PI_F, 0.5f * M_PI_F };
+
+		fltx4 omt = SubSIMD( Four_Ones, t );
+		fltx4 cosom = p.Dot( q );
+
+		// lanes that are nearly the same lerp, lanes that are nearly opposite go via a perpendicular
+		fltx4 opposite = CmpLeSIMD( AddSIMD( Four_Ones, cosom ), kSlerpEpsilon );
+		fltx4 nearlySame = CmpLeSIMD( SubSIMD( Four_Ones, cosom ), kSlerpEpsilon );
+		fltx4 linear = OrSIMD( opposite, nearlySame );
+
+		fltx4 omega = ArcCosSIMD( MinSIMD( MaxSIMD( cosom, NegSIMD( Four_Ones ) ), Four_Ones ) );
+		fltx4 sinom = ::MaskedAssign( linear, Four_Ones, SinSIMD( omega ) );
+		fltx4 sclp = DivSIMD( SinSIMD( MulSIMD( omt, omega ) ), sinom );
+		fltx4 sclq = DivSIMD( SinSIMD( MulSIMD( t, omega ) ), sinom );
+		sclp = ::MaskedAssign( nearlySame, omt, sclp );
+		sclq = ::MaskedAssign( nearlySame, t, sclq );
+
+		x = MaddSIMD( sclp, p.x, MulSIMD( sclq, q.x ) );
+		y = MaddSIMD( sclp, p.y, MulSIMD( sclq, q.y ) );
+		z = MaddSIMD( sclp, p.z, MulSIMD( sclq, q.z ) );
+		w = MaddSIMD( sclp, p.w, MulSIMD( sclq, q.w ) );
+
+		if ( TestSignSIMD( opposite ) )
+		{
+			fltx4 sclpOpp = SinSIMD( MulSIMD( omt, kHalfPi ) );
+			fltx4 sclqOpp = SinSIMD( MulSIMD( t, kHalfPi ) );
+			x = ::MaskedAssign( opposite, MaddSIMD( sclpOpp, p.x, MulSIMD( sclqOpp, NegSIMD( q.y ) ) ), x );
+			y = ::MaskedAssign( opposite, MaddSIMD( sclpOpp, p.y, MulSIMD( sclqOpp, q.x ) ), y );
+			z = ::MaskedAssign( opposite, MaddSIMD( sclpOpp, p.z, MulSIMD( sclqOpp, NegSIMD( q.w ) ) ), z );
+			w = ::MaskedAssign( opposite, q.z, w );
+		}
+	}
+
+	/// QuaternionIdentityBlend in place with a separate t per lane
+	FORCEINLINE void IdentityBlend( const fltx4 &t )
+	{
+		fltx4 sclp = SubSIMD( Four_Ones, t );
+		x = MulSIMD( x, sclp );
+		y = MulSIMD( y, sclp );
+		z = MulSIMD( z, sclp );
+		fltx4 negative = CmpLtSIMD( w, Four_Zeros );
+		w = MulSIMD( w, sclp );
+		w = ::MaskedAssign( negative, SubSIMD( w, t ), AddSIMD( w, t ) );
+		Normalize();
+	}
+};
+
 #endif // SSEQUATMATH_H
 
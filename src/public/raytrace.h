@@ -13,6 +13,8 @@
 #include <mathlib/mathlib.h>
 #include <bspfile.h>
 
+class CUtlBuffer;
+
 // fast SSE-ONLY ray tracing module. Based upon various "real time ray tracing" research.
 //#define DEBUG_RAYTRACE 1
 
@@ -193,6 +195,49 @@ protected:
 };
 
 
+#define BVHNODE_STATE_LEAF 3								// axis 0..2 for inner nodes
+
+struct CacheOptimizedBVHNode
+{
+	// 32 bytes, two nodes to a cache line. As with the kd-tree, the right child is stored right
+	// after the left child and the low 2 bits of Children hold the split axis, or
+	// BVHNODE_STATE_LEAF. Leaves hold a run of TriangleIndexList instead of a child index.
+
+	Vector m_vecMins;
+	int32 Children;
+	Vector m_vecMaxs;
+	int32 m_nTriangleCount;									// leaves only
+
+	inline int NodeType(void) const
+	{
+		return Children & 3;
+	}
+
+	inline int32 TriangleIndexStart(void) const
+	{
+		assert(NodeType()==BVHNODE_STATE_LEAF);
+		return Children>>2;
+	}
+
+	inline int LeftChild(void) const
+	{
+		assert(NodeType()!=BVHNODE_STATE_LEAF);
+		return Children>>2;
+	}
+
+	inline int RightChild(void) const
+	{
+		return LeftChild()+1;
+	}
+
+	inline int NumberOfTrianglesInLeaf(void) const
+	{
+		assert(NodeType()==BVHNODE_STATE_LEAF);
+		return m_nTriangleCount;
+	}
+};
+
+
 struct RayTracingSingleResult
 {
 	Vector surface_normal;									// surface normal at intersection
@@ -220,6 +265,10 @@ public:
 #define RTE_FLAGS_FAST_TREE_GENERATION 1
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS 2				// saves memory if not needed
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS 4
+#define RTE_FLAGS_BVH 8										// build a bounding volume hierarchy instead
+															// of a kd-tree. It is built in parallel and
+															// traces rays with any mix of directions
+															// as one bundle.
 
 enum RayTraceLightingMode_t {
 	DIRECT_LIGHTING,										// just dot product lighting
@@ -262,6 +311,7 @@ public:
 
 	FourVectors BackgroundColor;							//< color where no intersection
 	CUtlVector<CacheOptimizedKDNode> OptimizedKDTree;		//< the packed kdtree. root is 0
+	CUtlVector<CacheOptimizedBVHNode> OptimizedBVH;			//< the packed bvh, if RTE_FLAGS_BVH. root is 0
 	CUtlBlockVector<CacheOptimizedTriangle> OptimizedTriangleList; //< the packed triangles
 	CUtlVector<int32> TriangleIndexList;					//< the list of triangle indices.
 	CUtlVector<LightDesc_t> LightList;						//< the list of lights
@@ -297,6 +347,17 @@ public:
 	// SetupAccelerationStructure to prepare for tracing
 	void SetupAccelerationStructure(void);
 
+	// sets up for tracing with a bvh like SetupAccelerationStructure with RTE_FLAGS_BVH, after
+	// checking it against a kd-tree with nRays random rays. returns how many rays didn't match.
+	int SetupAccelerationStructureAndTestBVH(int nRays);
+
+	// a built acceleration structure can be saved and later restored in place of calling
+	// SetupAccelerationStructure, as long as the same triangles have been added. The hash is of
+	// the triangles and must be calculated before the structure is set up.
+	uint64 CalculateGeometryHash(void) const;
+	void SaveAccelerationStructure(CUtlBuffer &buf, uint64 nGeometryHash) const;
+	bool LoadAccelerationStructure(CUtlBuffer &buf, uint64 nGeometryHash);
+
 
 	// lowest level intersection routine - fire 4 rays through the scene. all 4 rays must pass the
 	// Check() function, and t extents must be initialized. skipid can be set to exclude a
@@ -310,6 +371,11 @@ public:
 					RayTracingResult *rslt_out,
 					int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
 
+	// bvh version of Trace4Rays. The rays don't need matching direction signs.
+	void TraceBVH4Rays(const FourRays &rays, fltx4 TMin, fltx4 TMax,
+					   RayTracingResult *rslt_out,
+					   int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
+
 	// compute virtual light sources to model inter-reflection
 	void ComputeVirtualLightSources(void);
 
@@ -356,6 +422,12 @@ public:
 	void CalculateTriangleListBounds(int32 const *tris,int ntris,
 									 Vector &minout, Vector &maxout);
 
+	// builds the kd-tree from the root with RefineNode
+	void BuildKDTree(void);
+
+	// binned surface area heuristic build, used instead of BuildKDTree when RTE_FLAGS_BVH is set
+	void BuildBVH(void);
+
 	void AddInfinitePointLight(Vector position,				// light center
 							   Vector intensity);			// rgb amount
 
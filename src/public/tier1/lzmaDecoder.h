@@ -19,8 +19,10 @@
 
 #if !defined( _X360 )
 #define LZMA_ID				(('A'<<24)|('M'<<16)|('Z'<<8)|('L'))
+#define LZMA_BLOCKS_ID		(('B'<<24)|('M'<<16)|('Z'<<8)|('L'))
 #else
 #define LZMA_ID				(('L'<<24)|('Z'<<16)|('M'<<8)|('A'))
+#define LZMA_BLOCKS_ID		(('L'<<24)|('Z'<<16)|('M'<<8)|('B'))
 #endif
 
 // bind the buffer for correct identification
@@ -32,6 +34,18 @@ struct lzma_header_t
 	unsigned int	lzmaSize;		// always little endian
 	unsigned char	properties[5];
 };
+
+// Large buffers can be split into blocks that are compressed independently, so they
+// can be compressed or decompressed on several threads, or streamed a block at a time.
+// The header is followed by blockCount+1 offsets from the start of the header, the last
+// one being the end of the data. Each block is a complete lzma_header_t stream.
+struct lzma_blocks_header_t
+{
+	unsigned int	id;
+	unsigned int	actualSize;		// always little endian, all blocks together
+	unsigned int	blockSize;		// always little endian, uncompressed size of every block but the last
+	unsigned int	blockCount;		// always little endian
+};
 #pragma pack()
 
 class CLZMAStream;
@@ -39,9 +53,19 @@ class CLZMAStream;
 class CLZMA
 {
 public:
+	// These accept both single streams and block compressed buffers
 	static unsigned int	Uncompress( unsigned char *pInput, unsigned char *pOutput );
 	static bool			IsCompressed( unsigned char *pInput );
 	static unsigned int	GetActualSize( unsigned char *pInput );
+
+	// Block compressed buffers only. Blocks can be uncompressed in any order and on any thread;
+	// UncompressBlock writes the block to its place in pOutput, which is the whole uncompressed buffer.
+	static bool			IsBlockCompressed( unsigned char *pInput );
+	static unsigned int	GetBlockCount( unsigned char *pInput );
+	static unsigned int	UncompressBlock( unsigned char *pInput, unsigned int nBlock, unsigned char *pOutput );
+
+private:
+	static unsigned int	UncompressStream( unsigned char *pInput, unsigned char *pOutput );
 };
 
 // For files besides the implementation, we forward declare a dummy struct. We can't unconditionally forward declare
@@ -58,7 +82,7 @@ public:
 	~CLZMAStream();
 
 	// Initialize a stream to read data from a LZMA style zip file, passing the original size from the zip headers.
-	// Streams with a source-engine style header (lzma_header_t) do not need an init call.
+	// Streams with a source-engine style header (lzma_header_t or lzma_blocks_header_t) do not need an init call.
 	void InitZIPHeader( unsigned int nCompressedSize, unsigned int nOriginalSize );
 
 	// Attempt to read up to nMaxInputBytes from the compressed stream, writing up to nMaxOutputBytes to pOutput.
@@ -85,6 +109,11 @@ private:
 	void FreeDecoderState();
 	bool CreateDecoderState( const unsigned char *pProperties );
 
+	// Decodes block compressed data, starting each block's decoder as its header comes in
+	bool ReadBlocks( unsigned char *pInput, unsigned int nMaxInputBytes,
+	                 unsigned char *pOutput, unsigned int nMaxOutputBytes,
+	                 /* out */ unsigned int &nCompressedBytesRead, /* out */ unsigned int &nOutputBytesWritten );
+
 	// Init from a zip-embedded LZMA stream. Requires the original size be passed from zip headers.
 	CLzmaDec_t *m_pDecoderState;
 
@@ -93,10 +122,16 @@ private:
 	unsigned int m_nCompressedSize;
 	unsigned int m_nCompressedBytesRead;
 
+	// What is left of the current block when reading block compressed data
+	unsigned int m_nBlockActualRemaining;
+	unsigned int m_nBlockCompressedRemaining;
+
 	// If we have read past the header
 	bool m_bParsedHeader   : 1;
 	// If InitZIPHeader() was called. We're expecting a zip-style header and have size information.
 	bool m_bZIPStyleHeader : 1;
+	// If the header was a lzma_blocks_header_t
+	bool m_bBlocks         : 1;
 };
 
 #endif
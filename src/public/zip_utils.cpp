@@ -17,9 +17,11 @@
 #endif
 #include "utlbuffer.h"
 #include "utllinkedlist.h"
+#include "utlmap.h"
 #include "zip_utils.h"
 #include "zip_uncompressed.h"
 #include "checksum_crc.h"
+#include "checksum_sha1.h"
 #include "byteswap.h"
 #include "utlstring.h"
 
@@ -376,6 +378,8 @@ public:
 	void			SetBigEndian( bool bigEndian );
 	void			ActivateByteSwapping( bool bActivate );
 
+	void			SetDeduplicateFiles( bool bDeduplicate );
+
 private:
 	enum
 	{
@@ -396,8 +400,10 @@ private:
 	unsigned int	m_AlignmentSize;
 	bool			m_bForceAlignment;
 	bool			m_bCompatibleFormat;
+	bool			m_bDeduplicateFiles;
 
 	unsigned short	CalculatePadding( unsigned int filenameLen, unsigned int pos );
+	void			FindDuplicateFiles( void );
 	void			SaveDirectory( IWriteStream& stream );
 	int				MakeXZipCommentString( char *pComment );
 	void			ParseXZipCommentString( const char *pComment );
@@ -438,6 +444,16 @@ private:
 
 		// The compression used on the data if any
 		IZip::eCompressionType m_eCompressionType;
+
+		// SHA1 of the stored (possibly compressed) data, filled in on demand
+		SHADigest_t		m_Hash;
+		bool			m_bHashValid;
+
+		// Entry whose stored data this one shares, and the longest name sharing
+		// this entry's data ( set and valid during final write )
+		int				m_nDuplicateOf;
+		unsigned int	m_nSharedNameLength;
+		unsigned short	m_ExtraFieldLength;
 	};
 
 	// For fast name lookup and sorting
@@ -464,6 +480,11 @@ CZipFile::CZipEntry::CZipEntry( void )
 	m_DiskCacheOffset = 0;
 	m_SourceDiskOffset = 0;
 	m_eCompressionType = IZip::eCompressionType_None;
+	memset( m_Hash, 0, sizeof( m_Hash ) );
+	m_bHashValid = false;
+	m_nDuplicateOf = -1;
+	m_nSharedNameLength = 0;
+	m_ExtraFieldLength = 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -491,6 +512,11 @@ CZipFile::CZipEntry::CZipEntry( const CZipFile::CZipEntry& src )
 	m_ZipCRC = src.m_ZipCRC;
 	m_DiskCacheOffset = src.m_DiskCacheOffset;
 	m_SourceDiskOffset = src.m_SourceDiskOffset;
+	memcpy( m_Hash, src.m_Hash, sizeof( m_Hash ) );
+	m_bHashValid = src.m_bHashValid;
+	m_nDuplicateOf = src.m_nDuplicateOf;
+	m_nSharedNameLength = src.m_nSharedNameLength;
+	m_ExtraFieldLength = src.m_ExtraFieldLength;
 }
 
 //-----------------------------------------------------------------------------
@@ -513,6 +539,7 @@ CZipFile::CZipFile( const char *pDiskCacheWritePath, bool bSortByName )
 	m_AlignmentSize = 0;
 	m_bForceAlignment = false;
 	m_bCompatibleFormat = true;
+	m_bDeduplicateFiles = false;
 
 	m_bUseDiskCacheForWrites = ( pDiskCacheWritePath != NULL );
 	m_DiskCacheWritePath = pDiskCacheWritePath;
@@ -614,6 +641,11 @@ void CZipFile::ActivateByteSwapping( bool bActivate )
 	m_Swap.ActivateByteSwapping( bActivate );
 }
 
+void CZipFile::SetDeduplicateFiles( bool bDeduplicate )
+{
+	m_bDeduplicateFiles = bDeduplicate;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Load pak file from raw buffer
 // Input  : *buffer - 
@@ -1089,6 +1121,7 @@ void CZipFile::AddBufferToZip( const char *relativename, void *data, int length,
 		update->m_nCompressedSize = outLength;
 		update->m_nUncompressedSize = uncompressedLength;
 		update->m_ZipCRC = zipCRC;
+		update->m_bHashValid = false;
 
 		if ( m_hDiskCacheWriteFile != INVALID_HANDLE_VALUE )
 		{
@@ -1296,6 +1329,72 @@ unsigned short CZipFile::CalculatePadding( unsigned int filenameLen, unsigned in
 	return (unsigned short)( m_AlignmentSize - ( ( pos + headerSize ) % m_AlignmentSize ) );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Match up files whose stored data is identical so it's only written
+//  once. The first file in write order keeps the data, later copies point their
+//  directory entries at its local header.
+//-----------------------------------------------------------------------------
+void CZipFile::FindDuplicateFiles( void )
+{
+	CUtlMap< CSHA, int > hashToFile( DefLessFunc( CSHA ) );
+
+	for ( int i = m_Files.FirstInorder(); i != m_Files.InvalidIndex(); i = m_Files.NextInorder( i ) )
+	{
+		CZipEntry *e = &m_Files[i];
+		e->m_nDuplicateOf = m_Files.InvalidIndex();
+		e->m_nSharedNameLength = V_strlen( e->m_Name.String() );
+
+		if ( !m_bDeduplicateFiles || e->m_nCompressedSize <= 0 )
+			continue;
+
+		if ( !e->m_bHashValid )
+		{
+			void *pData = e->m_pData;
+			CUtlBuffer cacheBuffer;
+			if ( !pData && m_hDiskCacheWriteFile != INVALID_HANDLE_VALUE )
+			{
+				cacheBuffer.EnsureCapacity( e->m_nCompressedSize );
+				CWin32File::FileSeek( m_hDiskCacheWriteFile, e->m_DiskCacheOffset, FILE_BEGIN );
+				if ( CWin32File::FileRead( m_hDiskCacheWriteFile, cacheBuffer.Base(), e->m_nCompressedSize ) )
+				{
+					pData = cacheBuffer.Base();
+				}
+			}
+
+			if ( !pData )
+				continue;
+
+			GenerateHash( e->m_Hash, pData, e->m_nCompressedSize );
+			e->m_bHashValid = true;
+		}
+
+		CSHA hash( e->m_Hash );
+		int nFound = hashToFile.Find( hash );
+		if ( nFound == hashToFile.InvalidIndex() )
+		{
+			hashToFile.Insert( hash, i );
+			continue;
+		}
+
+		CZipEntry *pOwner = &m_Files[ hashToFile[nFound] ];
+		if ( pOwner->m_nCompressedSize != e->m_nCompressedSize ||
+			 pOwner->m_nUncompressedSize != e->m_nUncompressedSize ||
+			 pOwner->m_eCompressionType != e->m_eCompressionType ||
+			 pOwner->m_ZipCRC != e->m_ZipCRC )
+		{
+			continue;
+		}
+
+		e->m_nDuplicateOf = hashToFile[nFound];
+		pOwner->m_nSharedNameLength = Max( pOwner->m_nSharedNameLength, e->m_nSharedNameLength );
+	}
+
+	if ( m_hDiskCacheWriteFile != INVALID_HANDLE_VALUE )
+	{
+		CWin32File::FileSeek( m_hDiskCacheWriteFile, 0, FILE_END );
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Create the XZIP identifying comment string
 // Output : Length
@@ -1347,6 +1446,8 @@ void CZipFile::ParseXZipCommentString( const char *pCommentString )
 //-----------------------------------------------------------------------------
 unsigned int CZipFile::CalculateSize( void )
 {
+	FindDuplicateFiles();
+
 	unsigned int size = 0;
 	unsigned int dirHeaders = 0;
 	for ( int i = m_Files.FirstInorder(); i != m_Files.InvalidIndex(); i = m_Files.NextInorder( i ) )
@@ -1356,12 +1457,19 @@ unsigned int CZipFile::CalculateSize( void )
 		if ( e->m_nCompressedSize == 0 )
 			continue;
 
-		// local file header
+		if ( e->m_nDuplicateOf != m_Files.InvalidIndex() )
+		{
+			// data is already counted, only the directory header is written
+			dirHeaders += sizeof( ZIP_FileHeader ) + m_Files[e->m_nDuplicateOf].m_nSharedNameLength;
+			continue;
+		}
+
+		// local file header, with room for the longest name sharing its data
 		size += sizeof( ZIP_LocalFileHeader );
-		size += V_strlen( e->m_Name.String() );
+		size += e->m_nSharedNameLength;
 
 		// every file has a directory header that duplicates the filename 
-		dirHeaders += sizeof( ZIP_FileHeader ) + V_strlen( e->m_Name.String() );
+		dirHeaders += sizeof( ZIP_FileHeader ) + e->m_nSharedNameLength;
 
 		// calculate padding
 		if ( m_AlignmentSize != 0 )
@@ -1490,12 +1598,24 @@ void CZipFile::SaveToBuffer( CUtlBuffer& buf )
 //-----------------------------------------------------------------------------
 void CZipFile::SaveDirectory( IWriteStream& stream )
 {
+	FindDuplicateFiles();
+
+	// shared data reserves extra field space for the longest name pointing at it, and every
+	// name pointing at it is padded out to that length plus the owner's alignment padding
+	unsigned int nPaddingSize = m_AlignmentSize;
+	for ( int i = m_Files.FirstInorder(); i != m_Files.InvalidIndex(); i = m_Files.NextInorder( i ) )
+	{
+		const CZipEntry *e = &m_Files[i];
+		const CZipEntry *pOwner = ( e->m_nDuplicateOf != m_Files.InvalidIndex() ) ? &m_Files[e->m_nDuplicateOf] : e;
+		nPaddingSize = Max( nPaddingSize, m_AlignmentSize + pOwner->m_nSharedNameLength - V_strlen( e->m_Name.String() ) );
+	}
+
 	void *pPaddingBuffer = NULL;
-	if ( m_AlignmentSize )
+	if ( nPaddingSize )
 	{
 		// get a temp buffer for all padding work
-		pPaddingBuffer = malloc( m_AlignmentSize );
-		memset( pPaddingBuffer, 0x00, m_AlignmentSize );
+		pPaddingBuffer = malloc( nPaddingSize );
+		memset( pPaddingBuffer, 0x00, nPaddingSize );
 	}
 
 	if ( m_hDiskCacheWriteFile != INVALID_HANDLE_VALUE )
@@ -1516,6 +1636,13 @@ void CZipFile::SaveDirectory( IWriteStream& stream )
 		CZipEntry *e = &m_Files[i];
 		Assert( e );
 
+		if ( e->m_nDuplicateOf != m_Files.InvalidIndex() )
+		{
+			// data was already written for an earlier file, only the directory entry is needed
+			e->m_ZipOffset = m_Files[e->m_nDuplicateOf].m_ZipOffset;
+			continue;
+		}
+
 		// Fix up the offset
 		e->m_ZipOffset = stream.Tell() - zipOffsetInStream;
 
@@ -1552,13 +1679,16 @@ void CZipFile::SaveDirectory( IWriteStream& stream )
 			hdr.compressedSize = e->m_nCompressedSize;
 			hdr.uncompressedSize = e->m_nUncompressedSize;
 			hdr.fileNameLength = V_strlen( pFilename );
-			hdr.extraFieldLength = CalculatePadding( hdr.fileNameLength, e->m_ZipOffset );
+			unsigned int nReserved = e->m_nSharedNameLength - hdr.fileNameLength;
+			hdr.extraFieldLength = nReserved + CalculatePadding( hdr.fileNameLength + nReserved, e->m_ZipOffset );
+			e->m_ExtraFieldLength = hdr.extraFieldLength;
 			int extraFieldLength = hdr.extraFieldLength;
 
 			// Swap header in place
 			m_Swap.SwapFieldsToTargetEndian( &hdr );
 			stream.Put( &hdr, sizeof( hdr ) );
 			stream.Put( pFilename, V_strlen( pFilename ) );
+			Assert( (unsigned int)extraFieldLength <= nPaddingSize );
 			stream.Put( pPaddingBuffer, extraFieldLength );
 			stream.Put( e->m_pData, e->m_nCompressedSize );
 
@@ -1596,7 +1726,13 @@ void CZipFile::SaveDirectory( IWriteStream& stream )
 		CZipEntry *e = &m_Files[i];
 		Assert( e );
 
-		if ( e->m_nCompressedSize > 0 && e->m_pData != NULL )
+		const CZipEntry *pOwner = e;
+		if ( e->m_nDuplicateOf != m_Files.InvalidIndex() )
+		{
+			pOwner = &m_Files[e->m_nDuplicateOf];
+		}
+
+		if ( e->m_nCompressedSize > 0 && pOwner->m_pData != NULL )
 		{
 			ZIP_FileHeader hdr = { 0 };
 			hdr.signature = PKID( 1, 2 );
@@ -1618,7 +1754,9 @@ void CZipFile::SaveDirectory( IWriteStream& stream )
 			hdr.compressedSize = e->m_nCompressedSize;
 			hdr.uncompressedSize = e->m_nUncompressedSize;
 			hdr.fileNameLength = V_strlen( e->m_Name.String() );
-			hdr.extraFieldLength = CalculatePadding( hdr.fileNameLength, e->m_ZipOffset );
+			// readers locate the data from the directory entry, so the name and extra field
+			// have to add up to the owning local header's
+			hdr.extraFieldLength = V_strlen( pOwner->m_Name.String() ) + pOwner->m_ExtraFieldLength - hdr.fileNameLength;
 			hdr.fileCommentLength = 0;
 			hdr.diskNumberStart = 0;
 			hdr.internalFileAttribs = 0;
@@ -1632,15 +1770,22 @@ void CZipFile::SaveDirectory( IWriteStream& stream )
 			stream.Put( e->m_Name.String(), V_strlen( e->m_Name.String() ) );
 			if ( m_bCompatibleFormat )
 			{
+				Assert( (unsigned int)extraFieldLength <= nPaddingSize );
 				stream.Put( pPaddingBuffer, extraFieldLength );
 			}
 
 			realNumFiles++;
+		}
+	}
 
-			if ( m_hDiskCacheWriteFile != INVALID_HANDLE_VALUE )
+	if ( m_hDiskCacheWriteFile != INVALID_HANDLE_VALUE )
+	{
+		// clear out temp hackery, only once every duplicate has seen its owner's
+		for ( i = m_Files.FirstInorder(); i != m_Files.InvalidIndex(); i = m_Files.NextInorder( i ) )
+		{
+			if ( m_Files[i].m_nCompressedSize > 0 )
 			{
-				// clear out temp hackery
-				e->m_pData = NULL;
+				m_Files[i].m_pData = NULL;
 			}
 		}
 	}
@@ -1740,6 +1885,8 @@ public:
 
 	virtual unsigned int	GetAlignment() OVERRIDE;
 
+	virtual void			SetDeduplicateFiles( bool bDeduplicate ) OVERRIDE;
+
 private:
 	CZipFile				m_ZipFile;
 };
@@ -1868,3 +2015,8 @@ unsigned int CZip::GetAlignment()
 	return m_ZipFile.GetAlignment();
 }
 
+void CZip::SetDeduplicateFiles( bool bDeduplicate )
+{
+	m_ZipFile.SetDeduplicateFiles( bDeduplicate );
+}
+
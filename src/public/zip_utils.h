@@ -79,6 +79,11 @@ public:
 	virtual void			SetBigEndian( bool bigEndian ) = 0;
 	virtual void			ActivateByteSwapping( bool bActivate ) = 0;
 
+	// Store files with identical contents once, every name's directory entry points at the same data.
+	// Readers that locate data through the central directory (like this one) handle it, some strict
+	// unzip tools will report the entries as overlapping.
+	virtual void			SetDeduplicateFiles( bool bDeduplicate ) = 0;
+
 	// Create/Release additional instances
 	// Disk Caching is necessary for large zips
 	static IZip *CreateZip( const char *pDiskCacheWritePath = NULL, bool bSortByName = false );
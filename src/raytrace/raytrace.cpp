@@ -4,7 +4,9 @@
 #include "raytrace.h"
 #include <filesystem_tools.h>
 #include <cmdlib.h>
+#include <threads.h>
 #include <stdio.h>
+#include "vstdlib/random.h"
 
 static bool SameSign(float a, float b)
 {
@@ -274,10 +276,114 @@ static float BoxSurfaceArea(Vector const &boxmin, Vector const &boxmax)
 	return 2.0*((boxdim[0]*boxdim[2])+(boxdim[0]*boxdim[1])+(boxdim[1]*boxdim[2]));
 }
 
+// intersect four rays with one triangle, keeping the closest hit of each ray in rslt_out
+static FORCEINLINE void IntersectTriangle4( const FourRays &rays, int tnum, TriIntersectData_t const *tri,
+											RayTracingResult *rslt_out, ITransparentTriangleCallback *pCallback )
+{
+	// compute plane intersection
+	FourVectors N;
+	N.x = ReplicateX4( tri->m_flNx );
+	N.y = ReplicateX4( tri->m_flNy );
+	N.z = ReplicateX4( tri->m_flNz );
+
+	fltx4 DDotN = rays.direction * N;
+	// mask off zero or near zero (ray parallel to surface)
+	fltx4 did_hit = OrSIMD( CmpGtSIMD( DDotN,FourEpsilons ),
+							CmpLtSIMD( DDotN, FourNegativeEpsilons ) );
+
+	fltx4 numerator=SubSIMD( ReplicateX4( tri->m_flD ), rays.origin * N );
+
+	fltx4 isect_t=DivSIMD( numerator,DDotN );
+	// now, we have the distance to the plane. lets update our mask
+	did_hit = AndSIMD( did_hit, CmpGtSIMD( isect_t, FourZeros ) );
+	//did_hit=AndSIMD(did_hit,CmpLtSIMD(isect_t,TMax));
+	did_hit = AndSIMD( did_hit, CmpLtSIMD( isect_t, rslt_out->HitDistance ) );
+
+	if ( ! IsAnyNegative( did_hit ) )
+		return;
+
+	// now, check 3 edges
+	fltx4 hitc1 = AddSIMD( rays.origin[tri->m_nCoordSelect0],
+						MulSIMD( isect_t, rays.direction[ tri->m_nCoordSelect0] ) );
+	fltx4 hitc2 = AddSIMD( rays.origin[tri->m_nCoordSelect1],
+						   MulSIMD( isect_t, rays.direction[tri->m_nCoordSelect1] ) );
+	
+	// do barycentric coordinate check
+	fltx4 B0 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
+
+	B0 = AddSIMD(
+		B0,
+		MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
+	B0 = AddSIMD(
+		B0, ReplicateX4( tri->m_ProjectedEdgeEquations[2] ) );
+
+	did_hit = AndSIMD( did_hit, CmpGeSIMD( B0, FourZeros ) );
+
+	fltx4 B1 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
+	B1 = AddSIMD(
+		B1,
+		MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[4]), hitc2 ) );
+
+	B1 = AddSIMD(
+		B1, ReplicateX4( tri->m_ProjectedEdgeEquations[5] ) );
+	
+	did_hit = AndSIMD( did_hit, CmpGeSIMD( B1, FourZeros ) );
+
+	fltx4 B2 = AddSIMD( B1, B0 );
+	did_hit = AndSIMD( did_hit, CmpLeSIMD( B2, Four_Ones ) );
+
+	if ( ! IsAnyNegative( did_hit ) )
+		return;
+
+	// if the triangle is transparent
+	if ( tri->m_nFlags & FCACHETRI_TRANSPARENT )
+	{
+		if ( pCallback )
+		{
+			// assuming a triangle indexed as v0, v1, v2
+			// the projected edge equations are set up such that the vert opposite the first
+			// equation is v2, and the vert opposite the second equation is v0
+			// Therefore we pass them back in 1, 2, 0 order
+			// Also B2 is currently B1 + B0 and needs to be 1 - (B1+B0) in order to be a real
+			// barycentric coordinate.  Compute that now and pass it to the callback
+			fltx4 b2 = SubSIMD( Four_Ones, B2 );
+			if ( pCallback->VisitTriangle_ShouldContinue( *tri, rays, &did_hit, &B1, &b2, &B0, tnum ) )
+			{
+				did_hit = Four_Zeros;
+			}
+		}
+	}
+	// now, set the hit_id and closest_hit fields for any enabled rays
+	fltx4 replicated_n = ReplicateIX4(tnum);
+	StoreAlignedSIMD((float *) rslt_out->HitIds,
+				 OrSIMD(AndSIMD(replicated_n,did_hit),
+						   AndNotSIMD(did_hit,LoadAlignedSIMD(
+											 (float *) rslt_out->HitIds))));
+	rslt_out->HitDistance=OrSIMD(AndSIMD(isect_t,did_hit),
+					 AndNotSIMD(did_hit,rslt_out->HitDistance));
+
+	rslt_out->surface_normal.x=OrSIMD(
+		AndSIMD(N.x,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.x));
+	rslt_out->surface_normal.y=OrSIMD(
+		AndSIMD(N.y,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.y));
+	rslt_out->surface_normal.z=OrSIMD(
+		AndSIMD(N.z,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.z));
+}
+
 void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 TMax,
 									   RayTracingResult *rslt_out,
 									   int32 skip_id, ITransparentTriangleCallback *pCallback)
 {
+	if ( OptimizedBVH.Count() )
+	{
+		// no need to split up rays of different directions
+		TraceBVH4Rays( rays, TMin, TMax, rslt_out, skip_id, pCallback );
+		return;
+	}
+
 	int msk=rays.CalculateDirectionSignMask();
 	if (msk!=-1)
 		Trace4Rays(rays,TMin,TMax,msk,rslt_out,skip_id, pCallback);
@@ -346,6 +452,12 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 									   int DirectionSignMask, RayTracingResult *rslt_out,
 									   int32 skip_id, ITransparentTriangleCallback *pCallback)
 {
+	if ( OptimizedBVH.Count() )
+	{
+		TraceBVH4Rays( rays, TMin, TMax, rslt_out, skip_id, pCallback );
+		return;
+	}
+
 	rays.Check();
 
 	memset(rslt_out->HitIds,0xff,sizeof(rslt_out->HitIds));
@@ -475,100 +587,7 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 				if ( ( mailboxids[mbox_slot] != tnum ) && ( tri->m_nTriangleID != skip_id ) )
 				{
 					mailboxids[mbox_slot] = tnum;
-					// compute plane intersection
-
-
-					FourVectors N;
-					N.x = ReplicateX4( tri->m_flNx );
-					N.y = ReplicateX4( tri->m_flNy );
-					N.z = ReplicateX4( tri->m_flNz );
-
-					fltx4 DDotN = rays.direction * N;
-					// mask off zero or near zero (ray parallel to surface)
-					fltx4 did_hit = OrSIMD( CmpGtSIMD( DDotN,FourEpsilons ),
-											CmpLtSIMD( DDotN, FourNegativeEpsilons ) );
-
-					fltx4 numerator=SubSIMD( ReplicateX4( tri->m_flD ), rays.origin * N );
-
-					fltx4 isect_t=DivSIMD( numerator,DDotN );
-					// now, we have the distance to the plane. lets update our mask
-					did_hit = AndSIMD( did_hit, CmpGtSIMD( isect_t, FourZeros ) );
-					//did_hit=AndSIMD(did_hit,CmpLtSIMD(isect_t,TMax));
-					did_hit = AndSIMD( did_hit, CmpLtSIMD( isect_t, rslt_out->HitDistance ) );
-
-					if ( ! IsAnyNegative( did_hit ) )
-						continue;
-
-					// now, check 3 edges
-					fltx4 hitc1 = AddSIMD( rays.origin[tri->m_nCoordSelect0],
-										MulSIMD( isect_t, rays.direction[ tri->m_nCoordSelect0] ) );
-					fltx4 hitc2 = AddSIMD( rays.origin[tri->m_nCoordSelect1],
-										   MulSIMD( isect_t, rays.direction[tri->m_nCoordSelect1] ) );
-					
-					// do barycentric coordinate check
-					fltx4 B0 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
-
-					B0 = AddSIMD(
-						B0,
-						MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
-					B0 = AddSIMD(
-						B0, ReplicateX4( tri->m_ProjectedEdgeEquations[2] ) );
-
-					did_hit = AndSIMD( did_hit, CmpGeSIMD( B0, FourZeros ) );
-
-					fltx4 B1 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
-					B1 = AddSIMD(
-						B1,
-						MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[4]), hitc2 ) );
-
-					B1 = AddSIMD(
-						B1, ReplicateX4( tri->m_ProjectedEdgeEquations[5] ) );
-					
-					did_hit = AndSIMD( did_hit, CmpGeSIMD( B1, FourZeros ) );
-
-					fltx4 B2 = AddSIMD( B1, B0 );
-					did_hit = AndSIMD( did_hit, CmpLeSIMD( B2, Four_Ones ) );
-
-					if ( ! IsAnyNegative( did_hit ) )
-						continue;
-
-					// if the triangle is transparent
-					if ( tri->m_nFlags & FCACHETRI_TRANSPARENT )
-					{
-						if ( pCallback )
-						{
-							// assuming a triangle indexed as v0, v1, v2
-							// the projected edge equations are set up such that the vert opposite the first
-							// equation is v2, and the vert opposite the second equation is v0
-							// Therefore we pass them back in 1, 2, 0 order
-							// Also B2 is currently B1 + B0 and needs to be 1 - (B1+B0) in order to be a real
-							// barycentric coordinate.  Compute that now and pass it to the callback
-							fltx4 b2 = SubSIMD( Four_Ones, B2 );
-							if ( pCallback->VisitTriangle_ShouldContinue( *tri, rays, &did_hit, &B1, &b2, &B0, tnum ) )
-							{
-								did_hit = Four_Zeros;
-							}
-						}
-					}
-					// now, set the hit_id and closest_hit fields for any enabled rays
-					fltx4 replicated_n = ReplicateIX4(tnum);
-					StoreAlignedSIMD((float *) rslt_out->HitIds,
-								 OrSIMD(AndSIMD(replicated_n,did_hit),
-										   AndNotSIMD(did_hit,LoadAlignedSIMD(
-															 (float *) rslt_out->HitIds))));
-					rslt_out->HitDistance=OrSIMD(AndSIMD(isect_t,did_hit),
-									 AndNotSIMD(did_hit,rslt_out->HitDistance));
-
-					rslt_out->surface_normal.x=OrSIMD(
-						AndSIMD(N.x,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.x));
-					rslt_out->surface_normal.y=OrSIMD(
-						AndSIMD(N.y,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.y));
-					rslt_out->surface_normal.z=OrSIMD(
-						AndSIMD(N.z,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.z));
-					
+					IntersectTriangle4( rays, tnum, tri, rslt_out, pCallback );
 				}
 			} while (--ntris);
 			// now, check if all rays have terminated
@@ -592,6 +611,78 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 }
 
 
+#define BVH_MAX_DEPTH 48									// also the size of the traversal stack
+
+void RayTracingEnvironment::TraceBVH4Rays(const FourRays &rays, fltx4 TMin, fltx4 TMax,
+										  RayTracingResult *rslt_out,
+										  int32 skip_id, ITransparentTriangleCallback *pCallback)
+{
+	memset(rslt_out->HitIds,0xff,sizeof(rslt_out->HitIds));
+
+	rslt_out->HitDistance=ReplicateX4(1.0e23);
+
+	rslt_out->surface_normal.DuplicateVector(Vector(0.,0.,0.));
+	FourVectors OneOverRayDir=rays.direction;
+	OneOverRayDir.MakeReciprocalSaturate();
+
+	// the rays don't have to agree in direction. the summed direction just picks which child
+	// gets visited first, which only matters for how soon the far child can be culled.
+	int near_idx[3];
+	for(int c=0;c<3;c++)
+	{
+		fltx4 const &dir=rays.direction[c];
+		float sum=SubFloat(dir,0)+SubFloat(dir,1)+SubFloat(dir,2)+SubFloat(dir,3);
+		near_idx[c]=(sum<0)?1:0;
+	}
+
+	int NodeStack[BVH_MAX_DEPTH];
+	int stack_depth=0;
+	int cur_node=0;
+	while(1)
+	{
+		CacheOptimizedBVHNode const *CurNode=&(OptimizedBVH[cur_node]);
+
+		// clip the rays against the node's box. rays already hit closer than the box are out.
+		fltx4 tnear=TMin;
+		fltx4 tfar=MinSIMD(TMax,rslt_out->HitDistance);
+		for(int c=0;c<3;c++)
+		{
+			fltx4 isect_min_t=
+				MulSIMD(SubSIMD(ReplicateX4(CurNode->m_vecMins[c]),rays.origin[c]),OneOverRayDir[c]);
+			fltx4 isect_max_t=
+				MulSIMD(SubSIMD(ReplicateX4(CurNode->m_vecMaxs[c]),rays.origin[c]),OneOverRayDir[c]);
+			tnear=MaxSIMD(tnear,MinSIMD(isect_min_t,isect_max_t));
+			tfar=MinSIMD(tfar,MaxSIMD(isect_min_t,isect_max_t));
+		}
+		if ( IsAnyNegative( CmpLeSIMD( tnear, tfar ) ) )
+		{
+			int node_type=CurNode->NodeType();
+			if (node_type != BVHNODE_STATE_LEAF)
+			{
+				int left_child=CurNode->LeftChild();
+				assert(stack_depth<BVH_MAX_DEPTH);
+				NodeStack[stack_depth++]=left_child+(near_idx[node_type]^1);
+				cur_node=left_child+near_idx[node_type];
+				continue;
+			}
+			int ntris=CurNode->NumberOfTrianglesInLeaf();
+			int32 const *tlist=&(TriangleIndexList[CurNode->TriangleIndexStart()]);
+			// a triangle is only ever in one leaf, so there's no need for a mailbox
+			for(int i=0;i<ntris;i++)
+			{
+				int tnum=tlist[i];
+				TriIntersectData_t const *tri = &( OptimizedTriangleList[tnum].m_Data.m_IntersectData );
+				if ( tri->m_nTriangleID != skip_id )
+					IntersectTriangle4( rays, tnum, tri, rslt_out, pCallback );
+			}
+		}
+		if (! stack_depth)
+			return;
+		cur_node=NodeStack[--stack_depth];
+	}
+}
+
+
 int RayTracingEnvironment::MakeLeafNode(int first_tri, int last_tri)
 {
 	CacheOptimizedKDNode ret;
@@ -869,7 +960,285 @@ void RayTracingEnvironment::RefineNode(int node_number,int32 const *tri_list,int
 }
 
 
-void RayTracingEnvironment::SetupAccelerationStructure(void)
+// The bvh is built with the same cost model, evaluated at the boundaries of a fixed number of
+// bins of triangle centroids rather than at every triangle edge. Each triangle ends up in exactly
+// one leaf, so unlike the kd-tree the build never has to clip or duplicate triangles. Once the
+// top of the tree has been split up, the remaining subtrees are independent and are built on all
+// the tool threads.
+
+#define BVH_NUM_BINS 16
+#define BVH_MAX_LEAF_TRIS 16								// force a split above this many
+
+struct BVHPrim_t
+{
+	Vector m_vecMins;
+	Vector m_vecMaxs;
+	Vector m_vecCentroid;
+};
+
+struct BVHBin_t
+{
+	Vector m_vecMins;
+	Vector m_vecMaxs;
+	int m_nCount;
+};
+
+struct BVHJob_t
+{
+	int m_nPlaceholder;										// node in OptimizedBVH this subtree replaces
+	int m_nFirst;
+	int m_nCount;
+	int m_nDepth;
+	CUtlVector<CacheOptimizedBVHNode> m_Nodes;				// root is 0
+};
+
+class CBVHBuilder
+{
+public:
+	CBVHBuilder( RayTracingEnvironment *pEnv );
+	~CBVHBuilder();
+
+	void Build();
+
+private:
+	void BuildNode( CUtlVector<CacheOptimizedBVHNode> &nodes, int nNode, int nFirst, int nCount,
+					int nDepth, bool bDeferSmallSubtrees );
+	static void BuildJobThread( int iThread, int iJob );
+
+	RayTracingEnvironment *m_pEnv;
+	int32 *m_pTris;
+	CUtlVector<BVHPrim_t> m_Prims;
+	CUtlVector<BVHJob_t *> m_Jobs;
+	int m_nDeferBelow;
+
+	static CBVHBuilder *s_pBuilder;							// for the thread callback
+};
+
+CBVHBuilder *CBVHBuilder::s_pBuilder;
+
+CBVHBuilder::CBVHBuilder( RayTracingEnvironment *pEnv )
+{
+	m_pEnv = pEnv;
+	m_pTris = NULL;
+	m_nDeferBelow = 0;
+}
+
+CBVHBuilder::~CBVHBuilder()
+{
+	m_Jobs.PurgeAndDeleteElements();
+}
+
+static FORCEINLINE int BVHBinIndex( float flCentroid, float flMin, float flScale )
+{
+	int nBin = (int)( ( flCentroid - flMin ) * flScale );
+	return clamp( nBin, 0, BVH_NUM_BINS - 1 );
+}
+
+void CBVHBuilder::BuildNode( CUtlVector<CacheOptimizedBVHNode> &nodes, int nNode, int nFirst, int nCount,
+							 int nDepth, bool bDeferSmallSubtrees )
+{
+	// bounds of the node, and of the centroids that get binned
+	Vector vecMins( 1.0e23, 1.0e23, 1.0e23 ), vecMaxs( -1.0e23, -1.0e23, -1.0e23 );
+	Vector vecCMins = vecMins, vecCMaxs = vecMaxs;
+	for ( int i = 0; i < nCount; i++ )
+	{
+		BVHPrim_t const &prim = m_Prims[ m_pTris[nFirst + i] ];
+		VectorMin( vecMins, prim.m_vecMins, vecMins );
+		VectorMax( vecMaxs, prim.m_vecMaxs, vecMaxs );
+		VectorMin( vecCMins, prim.m_vecCentroid, vecCMins );
+		VectorMax( vecCMaxs, prim.m_vecCentroid, vecCMaxs );
+	}
+	nodes[nNode].m_vecMins = vecMins;
+	nodes[nNode].m_vecMaxs = vecMaxs;
+
+	if ( bDeferSmallSubtrees && nCount < m_nDeferBelow )
+	{
+		BVHJob_t *pJob = new BVHJob_t;
+		pJob->m_nPlaceholder = nNode;
+		pJob->m_nFirst = nFirst;
+		pJob->m_nCount = nCount;
+		pJob->m_nDepth = nDepth;
+		m_Jobs.AddToTail( pJob );
+		return;
+	}
+
+	int nBestAxis = -1;
+	int nBestBin = 0;
+	float flBestCost = 1.0e30;
+	if ( nCount > 2 && nDepth < BVH_MAX_DEPTH - 1 )
+	{
+		float flOneOverArea = 1.0 / max( BoxSurfaceArea( vecMins, vecMaxs ), 1.0e-10f );
+		for ( int axis = 0; axis < 3; axis++ )
+		{
+			float flExtent = vecCMaxs[axis] - vecCMins[axis];
+			if ( flExtent <= 0 )
+				continue;
+			float flScale = BVH_NUM_BINS / flExtent;
+
+			BVHBin_t bins[BVH_NUM_BINS];
+			for ( int b = 0; b < BVH_NUM_BINS; b++ )
+			{
+				bins[b].m_vecMins.Init( 1.0e23, 1.0e23, 1.0e23 );
+				bins[b].m_vecMaxs.Init( -1.0e23, -1.0e23, -1.0e23 );
+				bins[b].m_nCount = 0;
+			}
+			for ( int i = 0; i < nCount; i++ )
+			{
+				BVHPrim_t const &prim = m_Prims[ m_pTris[nFirst + i] ];
+				BVHBin_t &bin = bins[ BVHBinIndex( prim.m_vecCentroid[axis], vecCMins[axis], flScale ) ];
+				VectorMin( bin.m_vecMins, prim.m_vecMins, bin.m_vecMins );
+				VectorMax( bin.m_vecMaxs, prim.m_vecMaxs, bin.m_vecMaxs );
+				bin.m_nCount++;
+			}
+
+			// sweep from the right to get the cost of everything past each boundary
+			float flRightCost[BVH_NUM_BINS];
+			Vector vecRMins = bins[BVH_NUM_BINS - 1].m_vecMins, vecRMaxs = bins[BVH_NUM_BINS - 1].m_vecMaxs;
+			int nRight = bins[BVH_NUM_BINS - 1].m_nCount;
+			for ( int b = BVH_NUM_BINS - 1; b > 0; b-- )
+			{
+				if ( b < BVH_NUM_BINS - 1 )
+				{
+					VectorMin( vecRMins, bins[b].m_vecMins, vecRMins );
+					VectorMax( vecRMaxs, bins[b].m_vecMaxs, vecRMaxs );
+					nRight += bins[b].m_nCount;
+				}
+				flRightCost[b] = nRight ? nRight * BoxSurfaceArea( vecRMins, vecRMaxs ) : 0;
+			}
+
+			// and from the left, splitting after bin b
+			Vector vecLMins( 1.0e23, 1.0e23, 1.0e23 ), vecLMaxs( -1.0e23, -1.0e23, -1.0e23 );
+			int nLeft = 0;
+			for ( int b = 0; b < BVH_NUM_BINS - 1; b++ )
+			{
+				VectorMin( vecLMins, bins[b].m_vecMins, vecLMins );
+				VectorMax( vecLMaxs, bins[b].m_vecMaxs, vecLMaxs );
+				nLeft += bins[b].m_nCount;
+				if ( nLeft == 0 || nLeft == nCount )
+					continue;
+				float flCost = COST_OF_TRAVERSAL + COST_OF_INTERSECTION * flOneOverArea *
+					( nLeft * BoxSurfaceArea( vecLMins, vecLMaxs ) + flRightCost[b + 1] );
+				if ( flCost < flBestCost )
+				{
+					flBestCost = flCost;
+					nBestAxis = axis;
+					nBestBin = b;
+				}
+			}
+		}
+	}
+
+	bool bMustSplit = ( nCount > BVH_MAX_LEAF_TRIS ) && ( nDepth < BVH_MAX_DEPTH - 1 );
+	if ( !bMustSplit && ( nBestAxis == -1 || flBestCost >= COST_OF_INTERSECTION * nCount ) )
+	{
+		nodes[nNode].Children = ( nFirst << 2 ) | BVHNODE_STATE_LEAF;
+		nodes[nNode].m_nTriangleCount = nCount;
+		return;
+	}
+
+	int nLeft;
+	if ( nBestAxis != -1 )
+	{
+		// partition the triangle list in place
+		float flMin = vecCMins[nBestAxis];
+		float flScale = BVH_NUM_BINS / ( vecCMaxs[nBestAxis] - flMin );
+		int i = nFirst, j = nFirst + nCount - 1;
+		while ( i <= j )
+		{
+			if ( BVHBinIndex( m_Prims[ m_pTris[i] ].m_vecCentroid[nBestAxis], flMin, flScale ) <= nBestBin )
+				i++;
+			else
+				V_swap( m_pTris[i], m_pTris[j--] );
+		}
+		nLeft = i - nFirst;
+	}
+	else
+	{
+		// all the centroids are in the same place. any split is as good as any other
+		nBestAxis = 0;
+		nLeft = nCount / 2;
+	}
+
+	int nChildren = nodes.AddMultipleToTail( 2 );
+	nodes[nNode].Children = ( nChildren << 2 ) | nBestAxis;
+	nodes[nNode].m_nTriangleCount = 0;
+	BuildNode( nodes, nChildren, nFirst, nLeft, nDepth + 1, bDeferSmallSubtrees );
+	BuildNode( nodes, nChildren + 1, nFirst + nLeft, nCount - nLeft, nDepth + 1, bDeferSmallSubtrees );
+}
+
+void CBVHBuilder::BuildJobThread( int iThread, int iJob )
+{
+	BVHJob_t *pJob = s_pBuilder->m_Jobs[iJob];
+	pJob->m_Nodes.AddToTail();
+	s_pBuilder->BuildNode( pJob->m_Nodes, 0, pJob->m_nFirst, pJob->m_nCount, pJob->m_nDepth, false );
+}
+
+void CBVHBuilder::Build()
+{
+	int nTris = m_pEnv->OptimizedTriangleList.Count();
+	m_Prims.SetCount( nTris );
+	m_pEnv->TriangleIndexList.SetCount( nTris );
+	m_pTris = m_pEnv->TriangleIndexList.Base();
+	for ( int t = 0; t < nTris; t++ )
+	{
+		CacheOptimizedTriangle const &tri = m_pEnv->OptimizedTriangleList[t];
+		BVHPrim_t &prim = m_Prims[t];
+		prim.m_vecMins = tri.Vertex( 0 );
+		prim.m_vecMaxs = tri.Vertex( 0 );
+		for ( int v = 1; v < 3; v++ )
+		{
+			VectorMin( prim.m_vecMins, tri.Vertex( v ), prim.m_vecMins );
+			VectorMax( prim.m_vecMaxs, tri.Vertex( v ), prim.m_vecMaxs );
+		}
+		prim.m_vecCentroid = 0.5 * ( prim.m_vecMins + prim.m_vecMaxs );
+		m_pTris[t] = t;
+	}
+
+	// split the top of the tree here until there's about 4 subtrees per thread left
+	if ( numthreads > 1 )
+		m_nDeferBelow = max( nTris / ( 4 * numthreads ), 1024 );
+
+	CUtlVector<CacheOptimizedBVHNode> &nodes = m_pEnv->OptimizedBVH;
+	nodes.RemoveAll();
+	nodes.AddToTail();
+	BuildNode( nodes, 0, 0, nTris, 0, true );
+
+	if ( m_Jobs.Count() )
+	{
+		s_pBuilder = this;
+		RunThreadsOnIndividual( m_Jobs.Count(), false, BuildJobThread );
+		s_pBuilder = NULL;
+
+		// splice the subtrees in, in the order they were deferred so the result is the same
+		// regardless of how the threads got scheduled
+		for ( int j = 0; j < m_Jobs.Count(); j++ )
+		{
+			CUtlVector<CacheOptimizedBVHNode> &subtree = m_Jobs[j]->m_Nodes;
+			int nOffset = nodes.Count() - 1;
+			for ( int i = 0; i < subtree.Count(); i++ )
+			{
+				CacheOptimizedBVHNode node = subtree[i];
+				if ( node.NodeType() != BVHNODE_STATE_LEAF )
+					node.Children += nOffset << 2;
+				if ( i == 0 )
+					nodes[ m_Jobs[j]->m_nPlaceholder ] = node;
+				else
+					nodes.AddToTail( node );
+			}
+		}
+	}
+}
+
+void RayTracingEnvironment::BuildBVH(void)
+{
+	CBVHBuilder builder( this );
+	builder.Build();
+	m_MinBound = OptimizedBVH[0].m_vecMins;
+	m_MaxBound = OptimizedBVH[0].m_vecMaxs;
+}
+
+
+void RayTracingEnvironment::BuildKDTree(void)
 {
 	CacheOptimizedKDNode root{};
 	OptimizedKDTree.AddToTail(root);
@@ -880,6 +1249,19 @@ void RayTracingEnvironment::SetupAccelerationStructure(void)
 								m_MaxBound);
 	RefineNode(0,root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,m_MaxBound,0);
 	delete[] root_triangle_list;
+}
+
+
+void RayTracingEnvironment::SetupAccelerationStructure(void)
+{
+	if ( Flags & RTE_FLAGS_BVH )
+	{
+		BuildBVH();
+	}
+	else
+	{
+		BuildKDTree();
+	}
 
 	// now, convert all triangles to "intersection format"
 	for(int i=0;i<OptimizedTriangleList.Count();i++)
@@ -887,6 +1269,84 @@ void RayTracingEnvironment::SetupAccelerationStructure(void)
 }
 
 
+//-----------------------------------------------------------------------------
+// Builds both a kd-tree and a bvh, then traces the same random rays through each. A ray
+// that misses in one and hits in the other, or hits at a different distance, is a mismatch.
+// Two triangles hit at the same distance, such as along a shared edge, may legitimately come
+// back with different ids, so those aren't counted. Afterwards rays are traced with the bvh.
+//-----------------------------------------------------------------------------
+int RayTracingEnvironment::SetupAccelerationStructureAndTestBVH(int nRays)
+{
+	// the bvh fills TriangleIndexList from the start, and the kd-tree's leaves are added after it
+	BuildBVH();
+	BuildKDTree();
+	Vector vecMins = m_MinBound;
+	Vector vecMaxs = m_MaxBound;
+	Flags |= RTE_FLAGS_BVH;
+
+	for(int i=0;i<OptimizedTriangleList.Count();i++)
+		OptimizedTriangleList[i].ChangeIntoIntersectionFormat();
+
+	// fixed seed, so a mismatch can be reproduced
+	CUniformRandomStream random;
+	random.SetSeed( 1 );
+	float flMaxDist = ( vecMaxs - vecMins ).Length();
+	fltx4 TMax = ReplicateX4( flMaxDist );
+
+	CUtlVector<CacheOptimizedBVHNode> bvh;
+	int nMismatches = 0;
+	for ( int i = 0; i < nRays; i += 4 )
+	{
+		FourRays rays;
+		for ( int j = 0; j < 4; j++ )
+		{
+			Vector vecDir( random.RandomFloat( -1.0f, 1.0f ), random.RandomFloat( -1.0f, 1.0f ), random.RandomFloat( -1.0f, 1.0f ) );
+			if ( VectorNormalize( vecDir ) < 1.0e-3f )
+			{
+				vecDir.Init( 0.0f, 0.0f, 1.0f );
+			}
+
+			rays.origin.X(j) = random.RandomFloat( vecMins.x, vecMaxs.x );
+			rays.origin.Y(j) = random.RandomFloat( vecMins.y, vecMaxs.y );
+			rays.origin.Z(j) = random.RandomFloat( vecMins.z, vecMaxs.z );
+			rays.direction.X(j) = vecDir.x;
+			rays.direction.Y(j) = vecDir.y;
+			rays.direction.Z(j) = vecDir.z;
+		}
+
+		// with no bvh nodes Trace4Rays falls back to the kd-tree
+		RayTracingResult kdResult, bvhResult;
+		OptimizedBVH.Swap( bvh );
+		Trace4Rays( rays, Four_Zeros, TMax, &kdResult );
+		OptimizedBVH.Swap( bvh );
+		Trace4Rays( rays, Four_Zeros, TMax, &bvhResult );
+
+		for ( int j = 0; j < 4 && i + j < nRays; j++ )
+		{
+			if ( kdResult.HitIds[j] == bvhResult.HitIds[j] )
+				continue;
+
+			float flKDDist = SubFloat( kdResult.HitDistance, j );
+			float flBVHDist = SubFloat( bvhResult.HitDistance, j );
+			if ( kdResult.HitIds[j] != -1 && bvhResult.HitIds[j] != -1 &&
+				 fabs( flKDDist - flBVHDist ) <= 1.0e-3f * ( 1.0f + flKDDist ) )
+				continue;
+
+			if ( nMismatches < 10 )
+			{
+				Warning( "bvh mismatch: ray from (%f %f %f) along (%f %f %f) hit %d at %f in the kd-tree, %d at %f in the bvh\n",
+						 rays.origin.X(j), rays.origin.Y(j), rays.origin.Z(j),
+						 rays.direction.X(j), rays.direction.Y(j), rays.direction.Z(j),
+						 kdResult.HitIds[j], flKDDist, bvhResult.HitIds[j], flBVHDist );
+			}
+			++nMismatches;
+		}
+	}
+
+	return nMismatches;
+}
+
+
 
 void RayTracingEnvironment::AddInfinitePointLight(Vector position, Vector intensity)
 {
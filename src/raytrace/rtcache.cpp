@@ -0,0 +1,146 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Saving and restoring a built acceleration structure, so repeated
+//			compiles of the same geometry don't have to rebuild the tree.
+//
+//=============================================================================//
+
+#include "raytrace.h"
+#include <tier0/commonmacros.h>
+#include <tier1/generichash.h>
+#include <tier1/utlbuffer.h>
+
+#define RTCACHE_ID		MAKEID( 'V', 'R', 'T', 'C' )
+#define RTCACHE_VERSION	1
+#define RTCACHE_ALIGN	16
+
+// File layout. Every array starts on an RTCACHE_ALIGN boundary at the offset given in the
+// header and is stored exactly as it is in memory, so the file can be used in place.
+//		RayTraceCacheHeader_t
+//		TriIntersectData_t		numTriangles of them
+//		CacheOptimizedKDNode	numKDNodes of them
+//		CacheOptimizedBVHNode	numBVHNodes of them
+//		int32					numTriangleIndices of them
+struct RayTraceCacheHeader_t
+{
+	int		id;
+	int		version;
+	uint64	geometryHash;
+	uint32	flags;											// RTE_FLAGS_BVH if it's a bvh
+	int		numTriangles;
+	int		numKDNodes;
+	int		numBVHNodes;
+	int		numTriangleIndices;
+	int		triangleOffset;
+	int		kdNodeOffset;
+	int		bvhNodeOffset;
+	int		triangleIndexOffset;
+	Vector	minBound;
+	Vector	maxBound;
+};
+
+
+uint64 RayTracingEnvironment::CalculateGeometryHash(void) const
+{
+	// only what the tree is built from. colors and materials don't change it
+	CUtlBuffer buf;
+	buf.EnsureCapacity( OptimizedTriangleList.Count() * ( 2 * sizeof(int32) + 9 * sizeof(float) ) );
+	for(int i=0;i<OptimizedTriangleList.Count();i++)
+	{
+		TriGeometryData_t const &tri=OptimizedTriangleList[i].m_Data.m_GeometryData;
+		buf.PutInt( tri.m_nTriangleID );
+		buf.Put( tri.m_VertexCoordData, sizeof( tri.m_VertexCoordData ) );
+		buf.PutInt( tri.m_nFlags );
+	}
+	buf.PutUnsignedInt( Flags & RTE_FLAGS_BVH );
+	return MurmurHash64( buf.Base(), buf.TellPut(), RTCACHE_VERSION );
+}
+
+
+static int PutAlignedArray( CUtlBuffer &buf, void const *pData, int nSize )
+{
+	while ( buf.TellPut() % RTCACHE_ALIGN )
+		buf.PutUnsignedChar( 0 );
+	int nOffset = buf.TellPut();
+	buf.Put( pData, nSize );
+	return nOffset;
+}
+
+void RayTracingEnvironment::SaveAccelerationStructure(CUtlBuffer &buf, uint64 nGeometryHash) const
+{
+	RayTraceCacheHeader_t header;
+	memset( &header, 0, sizeof( header ) );
+	header.id = RTCACHE_ID;
+	header.version = RTCACHE_VERSION;
+	header.geometryHash = nGeometryHash;
+	header.flags = Flags & RTE_FLAGS_BVH;
+	header.numTriangles = OptimizedTriangleList.Count();
+	header.numKDNodes = OptimizedKDTree.Count();
+	header.numBVHNodes = OptimizedBVH.Count();
+	header.numTriangleIndices = TriangleIndexList.Count();
+	header.minBound = m_MinBound;
+	header.maxBound = m_MaxBound;
+
+	int nHeaderPos = buf.TellPut();
+	buf.Put( &header, sizeof( header ) );
+
+	// the triangles are in blocks, so they go one at a time
+	while ( buf.TellPut() % RTCACHE_ALIGN )
+		buf.PutUnsignedChar( 0 );
+	header.triangleOffset = buf.TellPut();
+	for(int i=0;i<OptimizedTriangleList.Count();i++)
+		buf.Put( &OptimizedTriangleList[i].m_Data.m_IntersectData, sizeof( TriIntersectData_t ) );
+
+	header.kdNodeOffset = PutAlignedArray( buf, OptimizedKDTree.Base(),
+										   OptimizedKDTree.Count() * sizeof( CacheOptimizedKDNode ) );
+	header.bvhNodeOffset = PutAlignedArray( buf, OptimizedBVH.Base(),
+											OptimizedBVH.Count() * sizeof( CacheOptimizedBVHNode ) );
+	header.triangleIndexOffset = PutAlignedArray( buf, TriangleIndexList.Base(),
+												  TriangleIndexList.Count() * sizeof( int32 ) );
+
+	// go back and fill in the offsets
+	int nEnd = buf.TellPut();
+	buf.SeekPut( CUtlBuffer::SEEK_HEAD, nHeaderPos );
+	buf.Put( &header, sizeof( header ) );
+	buf.SeekPut( CUtlBuffer::SEEK_HEAD, nEnd );
+}
+
+
+static bool ArrayInBuffer( CUtlBuffer const &buf, int nOffset, int nCount, int nElementSize )
+{
+	return ( nOffset >= 0 ) && ( nCount >= 0 ) && ( nOffset % RTCACHE_ALIGN == 0 ) &&
+		( (int64)nOffset + (int64)nCount * nElementSize <= buf.TellPut() );
+}
+
+bool RayTracingEnvironment::LoadAccelerationStructure(CUtlBuffer &buf, uint64 nGeometryHash)
+{
+	if ( buf.TellPut() < (int)sizeof( RayTraceCacheHeader_t ) )
+		return false;
+	RayTraceCacheHeader_t const &header = *(RayTraceCacheHeader_t const *)buf.Base();
+	if ( header.id != RTCACHE_ID || header.version != RTCACHE_VERSION ||
+		 header.geometryHash != nGeometryHash || header.flags != ( Flags & RTE_FLAGS_BVH ) ||
+		 header.numTriangles != OptimizedTriangleList.Count() )
+		return false;
+	if ( !ArrayInBuffer( buf, header.triangleOffset, header.numTriangles, sizeof( TriIntersectData_t ) ) ||
+		 !ArrayInBuffer( buf, header.kdNodeOffset, header.numKDNodes, sizeof( CacheOptimizedKDNode ) ) ||
+		 !ArrayInBuffer( buf, header.bvhNodeOffset, header.numBVHNodes, sizeof( CacheOptimizedBVHNode ) ) ||
+		 !ArrayInBuffer( buf, header.triangleIndexOffset, header.numTriangleIndices, sizeof( int32 ) ) )
+		return false;
+
+	byte const *pBase = (byte const *)buf.Base();
+
+	// this replaces both the tree build and the conversion to intersection format
+	TriIntersectData_t const *pTris = (TriIntersectData_t const *)( pBase + header.triangleOffset );
+	for(int i=0;i<header.numTriangles;i++)
+		OptimizedTriangleList[i].m_Data.m_IntersectData = pTris[i];
+
+	OptimizedKDTree.CopyArray( (CacheOptimizedKDNode const *)( pBase + header.kdNodeOffset ),
+							   header.numKDNodes );
+	OptimizedBVH.CopyArray( (CacheOptimizedBVHNode const *)( pBase + header.bvhNodeOffset ),
+							header.numBVHNodes );
+	TriangleIndexList.CopyArray( (int32 const *)( pBase + header.triangleIndexOffset ),
+								 header.numTriangleIndices );
+	m_MinBound = header.minBound;
+	m_MaxBound = header.maxBound;
+	return true;
+}
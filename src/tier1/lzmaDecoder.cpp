@@ -94,7 +94,7 @@ static ISzAlloc g_Alloc = { SzAlloc, SzFree };
 bool CLZMA::IsCompressed( unsigned char *pInput )
 {
 	lzma_header_t *pHeader = (lzma_header_t *)pInput;
-	if ( pHeader && pHeader->id == LZMA_ID )
+	if ( pHeader && ( pHeader->id == LZMA_ID || pHeader->id == LZMA_BLOCKS_ID ) )
 	{
 		return true;
 	}
@@ -103,6 +103,28 @@ bool CLZMA::IsCompressed( unsigned char *pInput )
 	return false;
 }
 
+//-----------------------------------------------------------------------------
+// Returns true if buffer is split into independently compressed blocks.
+//-----------------------------------------------------------------------------
+/* static */
+bool CLZMA::IsBlockCompressed( unsigned char *pInput )
+{
+	lzma_blocks_header_t *pHeader = (lzma_blocks_header_t *)pInput;
+	return pHeader && pHeader->id == LZMA_BLOCKS_ID;
+}
+
+//-----------------------------------------------------------------------------
+// Returns the number of blocks in a block compressed buffer, 0 if it isn't one.
+//-----------------------------------------------------------------------------
+/* static */
+unsigned int CLZMA::GetBlockCount( unsigned char *pInput )
+{
+	if ( !IsBlockCompressed( pInput ) )
+		return 0;
+
+	return LittleLong( ((lzma_blocks_header_t *)pInput)->blockCount );
+}
+
 //-----------------------------------------------------------------------------
 // Returns uncompressed size of compressed input buffer. Used for allocating output
 // buffer for decompression. Returns 0 if input buffer is not compressed.
@@ -116,6 +138,11 @@ unsigned int CLZMA::GetActualSize( unsigned char *pInput )
 		return LittleLong( pHeader->actualSize );
 	}
 
+	if ( IsBlockCompressed( pInput ) )
+	{
+		return LittleLong( ((lzma_blocks_header_t *)pInput)->actualSize );
+	}
+
 	// unrecognized
 	return 0;
 }
@@ -126,6 +153,58 @@ unsigned int CLZMA::GetActualSize( unsigned char *pInput )
 //-----------------------------------------------------------------------------
 /* static */
 unsigned int CLZMA::Uncompress( unsigned char *pInput, unsigned char *pOutput )
+{
+	if ( IsBlockCompressed( pInput ) )
+	{
+		unsigned int nBlocks = GetBlockCount( pInput );
+		unsigned int nTotal = 0;
+		for ( unsigned int i = 0; i < nBlocks; i++ )
+		{
+			unsigned int nSize = UncompressBlock( pInput, i, pOutput );
+			if ( !nSize )
+				return 0;
+			nTotal += nSize;
+		}
+		return nTotal;
+	}
+
+	return UncompressStream( pInput, pOutput );
+}
+
+//-----------------------------------------------------------------------------
+// Uncompress one block of a block compressed buffer into its place in pOutput.
+// Returns the size of the block, 0 on failure. Safe to call from any thread.
+//-----------------------------------------------------------------------------
+/* static */
+unsigned int CLZMA::UncompressBlock( unsigned char *pInput, unsigned int nBlock, unsigned char *pOutput )
+{
+	lzma_blocks_header_t *pHeader = (lzma_blocks_header_t *)pInput;
+	if ( !IsBlockCompressed( pInput ) || nBlock >= LittleLong( pHeader->blockCount ) )
+	{
+		return 0;
+	}
+
+	unsigned int nBlockSize = LittleLong( pHeader->blockSize );
+	unsigned int nActualSize = LittleLong( pHeader->actualSize );
+	unsigned int *pOffsets = (unsigned int *)( pHeader + 1 );
+
+	unsigned int nStart = nBlock * nBlockSize;
+	unsigned int nExpectedSize = Min( nBlockSize, nActualSize - nStart );
+	unsigned char *pBlock = pInput + LittleLong( pOffsets[nBlock] );
+	if ( GetActualSize( pBlock ) != nExpectedSize )
+	{
+		Warning( "LZMA block %u has the wrong size (%u, expecting %u)\n", nBlock, GetActualSize( pBlock ), nExpectedSize );
+		return 0;
+	}
+
+	return UncompressStream( pBlock, pOutput + nStart );
+}
+
+//-----------------------------------------------------------------------------
+// Uncompress a single lzma_header_t stream.
+//-----------------------------------------------------------------------------
+/* static */
+unsigned int CLZMA::UncompressStream( unsigned char *pInput, unsigned char *pOutput )
 {
 	lzma_header_t *pHeader = (lzma_header_t *)pInput;
 	if ( pHeader->id != LZMA_ID )
@@ -175,8 +254,11 @@ CLZMAStream::CLZMAStream()
 	  m_nActualBytesRead ( 0 ),
 	  m_nCompressedSize( 0 ),
 	  m_nCompressedBytesRead ( 0 ),
+	  m_nBlockActualRemaining( 0 ),
+	  m_nBlockCompressedRemaining( 0 ),
 	  m_bParsedHeader( false ),
-	  m_bZIPStyleHeader( false )
+	  m_bZIPStyleHeader( false ),
+	  m_bBlocks( false )
 {}
 
 CLZMAStream::~CLZMAStream()
@@ -251,6 +333,15 @@ bool CLZMAStream::Read( unsigned char *pInput, unsigned int nMaxInputBytes,
 		nMaxInputBytes -= nBytesConsumed;
 	}
 
+	if ( m_bBlocks )
+	{
+		m_nCompressedBytesRead += nCompressedBytesRead;
+		unsigned int nHeaderBytes = nCompressedBytesRead;
+		bool bResult = ReadBlocks( pInput, nMaxInputBytes, pOutput, nMaxOutputBytes, nCompressedBytesRead, nOutputBytesWritten );
+		nCompressedBytesRead += nHeaderBytes;
+		return bResult;
+	}
+
 	// These are input ( available size ) *and* output ( size processed ) vars for lzma
 	SizeT expectedInputRemaining = m_nCompressedSize - Min( m_nCompressedBytesRead + nCompressedBytesRead, m_nCompressedSize );
 	SizeT expectedOutputRemaining = m_nActualSize - m_nActualBytesRead;
@@ -309,6 +400,94 @@ bool CLZMAStream::Read( unsigned char *pInput, unsigned int nMaxInputBytes,
 	return true;
 }
 
+// Blocks are laid out back to back, so reading them is reading one stream after another.
+// Each block's header may arrive in a later call than the end of the previous block.
+bool CLZMAStream::ReadBlocks( unsigned char *pInput, unsigned int nMaxInputBytes,
+                              unsigned char *pOutput, unsigned int nMaxOutputBytes,
+                              /* out */ unsigned int &nCompressedBytesRead,
+                              /* out */ unsigned int &nOutputBytesWritten )
+{
+	nCompressedBytesRead = 0;
+	nOutputBytesWritten = 0;
+
+	if ( m_nActualBytesRead >= m_nActualSize && !m_nBlockCompressedRemaining )
+	{
+		// called at EOF
+		return false;
+	}
+
+	while ( m_nActualBytesRead < m_nActualSize || m_nBlockCompressedRemaining )
+	{
+		if ( m_pDecoderState && !m_nBlockActualRemaining )
+		{
+			// skip anything the decoder didn't need from the end of the block
+			unsigned int nSkip = Min( nMaxInputBytes, m_nBlockCompressedRemaining );
+			pInput += nSkip;
+			nMaxInputBytes -= nSkip;
+			nCompressedBytesRead += nSkip;
+			m_nCompressedBytesRead += nSkip;
+			m_nBlockCompressedRemaining -= nSkip;
+			if ( m_nBlockCompressedRemaining )
+				break;
+
+			FreeDecoderState();
+			continue;
+		}
+
+		if ( !m_pDecoderState )
+		{
+			// start of the next block
+			if ( nMaxInputBytes < sizeof( lzma_header_t ) )
+				break;
+
+			lzma_header_t *pHeader = (lzma_header_t *)pInput;
+			if ( pHeader->id != LZMA_ID || !CreateDecoderState( pHeader->properties ) )
+			{
+				Warning( "Unrecognized LZMA block\n" );
+				return false;
+			}
+
+			m_nBlockActualRemaining = LittleLong( pHeader->actualSize );
+			m_nBlockCompressedRemaining = LittleLong( pHeader->lzmaSize );
+			pInput += sizeof( lzma_header_t );
+			nMaxInputBytes -= sizeof( lzma_header_t );
+			nCompressedBytesRead += sizeof( lzma_header_t );
+			m_nCompressedBytesRead += sizeof( lzma_header_t );
+		}
+
+		SizeT inSize = Min( nMaxInputBytes, m_nBlockCompressedRemaining );
+		SizeT outSize = Min( nMaxOutputBytes, m_nBlockActualRemaining );
+		ELzmaStatus status;
+		ELzmaFinishMode finishMode = ( inSize == m_nBlockCompressedRemaining && outSize == m_nBlockActualRemaining ) ? LZMA_FINISH_END : LZMA_FINISH_ANY;
+		SRes result = LzmaDec_DecodeToBuf( m_pDecoderState, pOutput, &outSize, pInput, &inSize, finishMode, &status );
+		if ( result != SZ_OK )
+		{
+			return false;
+		}
+
+		pInput += inSize;
+		nMaxInputBytes -= inSize;
+		pOutput += outSize;
+		nMaxOutputBytes -= outSize;
+
+		nCompressedBytesRead += inSize;
+		nOutputBytesWritten += outSize;
+		m_nCompressedBytesRead += inSize;
+		m_nActualBytesRead += outSize;
+		m_nBlockCompressedRemaining -= inSize;
+		m_nBlockActualRemaining -= outSize;
+
+		if ( m_nBlockActualRemaining && !inSize && !outSize )
+		{
+			// blocked on input or output
+			break;
+		}
+	}
+
+	Assert( m_nCompressedBytesRead <= m_nCompressedSize );
+	return true;
+}
+
 bool CLZMAStream::GetExpectedBytesRemaining( /* out */ unsigned int &nBytesRemaining )
 {
 	if ( !m_bParsedHeader && !m_bZIPStyleHeader ) {
@@ -386,6 +565,23 @@ CLZMAStream::eHeaderParse CLZMAStream::TryParseHeader( unsigned char *pInput, un
 
 		nBytesConsumed += nLZMAPropertiesSize;
 	}
+	else if ( nBytesAvailable >= sizeof( lzma_blocks_header_t ) && CLZMA::IsBlockCompressed( pInput ) )
+	{
+		// Block compressed, each block's decoder is created when its header is reached
+		lzma_blocks_header_t *pHeader = (lzma_blocks_header_t *)pInput;
+		unsigned int nBlocks = LittleLong( pHeader->blockCount );
+		unsigned int nHeaderSize = sizeof( lzma_blocks_header_t ) + ( nBlocks + 1 ) * sizeof( unsigned int );
+		if ( nBytesAvailable < nHeaderSize )
+		{
+			return eHeaderParse_NeedMoreBytes;
+		}
+
+		unsigned int *pOffsets = (unsigned int *)( pHeader + 1 );
+		m_nActualSize = LittleLong( pHeader->actualSize );
+		m_nCompressedSize = LittleLong( pOffsets[nBlocks] );
+		m_bBlocks = true;
+		nBytesConsumed += nHeaderSize;
+	}
 	else
 	{
 		// Else native source engine style header
@@ -28,6 +28,7 @@
 #include "vtf/vtf.h"
 #include "lzma/lzma.h"
 #include "tier1/lzmaDecoder.h"
+#include "threads.h"
 
 #include "tier0/memdbgon.h"
 
@@ -718,6 +719,10 @@ CGameLump	g_GameLumps;
 
 static IZip *s_pakFile = 0;
 
+// Layout of pakfiles written by WriteBSPFile and RepackBSP
+static bool s_bPakFileDeduplicate = false;
+static unsigned int s_nPakFileAlignment = 0;
+
 //-----------------------------------------------------------------------------
 // Keep the file position aligned to an arbitrary boundary.
 // Returns updated file position.
@@ -789,12 +794,53 @@ void ForceAlignment( IZip *pak, bool bAlign, bool bCompatibleFormat, unsigned in
 	pak->ForceAlignment( bAlign, bCompatibleFormat, alignmentSize );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Store files with identical contents once, and optionally store every
+//			file uncompressed on an aligned boundary so it can be mapped in place
+//-----------------------------------------------------------------------------
+void SetPakFileLayout( bool bDeduplicate, unsigned int alignmentSize )
+{
+	if ( alignmentSize && !IsPowerOfTwo( alignmentSize ) )
+	{
+		Warning( "Pakfile alignment %u isn't a power of two, files won't be aligned\n", alignmentSize );
+		alignmentSize = 0;
+	}
+
+	s_bPakFileDeduplicate = bDeduplicate;
+	s_nPakFileAlignment = alignmentSize;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Re-store every file in the pak uncompressed
+//-----------------------------------------------------------------------------
+static void DecompressPakFile( IZip *pak )
+{
+	// replacing a file keeps its place in the directory, so iterating is safe
+	int id = -1;
+	int fileSize;
+	char relativeName[MAX_PATH];
+	while ( ( id = GetNextFilename( pak, id, relativeName, sizeof( relativeName ), fileSize ) ) != -1 )
+	{
+		CUtlBuffer buf;
+		if ( ReadFileFromPak( pak, relativeName, false, buf ) )
+		{
+			AddBufferToPak( pak, relativeName, buf.Base(), buf.TellPut(), false, IZip::eCompressionType_None );
+		}
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Store data back out to .bsp file
 //-----------------------------------------------------------------------------
 static void WritePakFileLump( void )
 {
 	CUtlBuffer buf( 0, 0 );
+	GetPakFile()->SetDeduplicateFiles( s_bPakFileDeduplicate );
+	if ( s_nPakFileAlignment )
+	{
+		DecompressPakFile( GetPakFile() );
+		ForceAlignment( GetPakFile(), true, true, s_nPakFileAlignment );
+	}
 	GetPakFile()->ActivateByteSwapping( IsX360() );
 	GetPakFile()->SaveToBuffer( buf );
 
@@ -4447,20 +4493,224 @@ int SortLumpsByOffset( const SortedLump_t *pSortedLumpA, const SortedLump_t *pSo
 	return 0;
 }
 
-bool CompressGameLump( dheader_t *pInBSPHeader, dheader_t *pOutBSPHeader, CUtlBuffer &outputBuffer, CompressFunc_t pCompressFunc )
+//-----------------------------------------------------------------------------
+// RepackBSP gathers every lump it wants compressed and compresses them all at
+// once across threads. With a block size set, big lumps are also split into
+// blocks that are compressed independently (see lzma_blocks_header_t).
+//-----------------------------------------------------------------------------
+
+struct LumpCompressJob_t
 {
-	CByteswap	byteSwap;
+	int				lump;
+	unsigned int	start;
+	unsigned int	size;
+	CUtlBuffer		output;
+	bool			bCompressed;
+};
+
+class CLumpCompressor
+{
+public:
+	CLumpCompressor( CompressFunc_t pCompressFunc, unsigned int nBlockSize ) : m_pCompressFunc( pCompressFunc ), m_nBlockSize( nBlockSize ) {}
+	~CLumpCompressor() { m_Inputs.PurgeAndDeleteElements(); }
+
+	// Takes over the contents of inputBuffer. Returns the lump's handle.
+	int		AddLump( CUtlBuffer &inputBuffer );
+	void	CompressAll();
+
+	// Returns false if the lump should be written as is, in pInput
+	bool	GetLump( int hLump, CUtlBuffer *&pInput, CUtlBuffer &compressedBuffer );
+
+private:
+	static void CompressJob( int iThread, int iJob );
+
+	CompressFunc_t					m_pCompressFunc;
+	unsigned int					m_nBlockSize;
+	CUtlVector<CUtlBuffer *>		m_Inputs;
+	CUtlVector<int>					m_FirstJob;
+	CUtlVector<LumpCompressJob_t>	m_Jobs;
+
+	static CLumpCompressor			*s_pCompressor;
+};
+
+CLumpCompressor *CLumpCompressor::s_pCompressor = NULL;
+
+int CLumpCompressor::AddLump( CUtlBuffer &inputBuffer )
+{
+	int hLump = m_Inputs.AddToTail( new CUtlBuffer );
+	m_Inputs[hLump]->Swap( inputBuffer );
+	m_FirstJob.AddToTail( m_Jobs.Count() );
+
+	if ( !m_pCompressFunc )
+		return hLump;
+
+	// block compression is LZMA specific, anyone else gets the lump in one piece
+	unsigned int nSize = m_Inputs[hLump]->TellPut() - m_Inputs[hLump]->TellGet();
+	unsigned int nBlockSize = ( m_pCompressFunc == RepackBSPCallback_LZMA && m_nBlockSize ) ? m_nBlockSize : nSize;
+	for ( unsigned int nStart = 0; nStart < nSize; nStart += nBlockSize )
+	{
+		LumpCompressJob_t &job = m_Jobs[m_Jobs.AddToTail()];
+		job.lump = hLump;
+		job.start = nStart;
+		job.size = Min( nBlockSize, nSize - nStart );
+		job.bCompressed = false;
+	}
+
+	return hLump;
+}
+
+void CLumpCompressor::CompressJob( int iThread, int iJob )
+{
+	LumpCompressJob_t &job = s_pCompressor->m_Jobs[iJob];
+	CUtlBuffer *pInput = s_pCompressor->m_Inputs[job.lump];
+
+	CUtlBuffer inputBuffer;
+	inputBuffer.SetExternalBuffer( (byte *)pInput->Base() + pInput->TellGet() + job.start, job.size, job.size );
+	job.bCompressed = s_pCompressor->m_pCompressFunc( inputBuffer, job.output );
+}
+
+void CLumpCompressor::CompressAll()
+{
+	if ( !m_Jobs.Count() )
+		return;
+
+	// the compress callbacks get called from every thread at once
+	s_pCompressor = this;
+	RunThreadsOnIndividual( m_Jobs.Count(), false, CompressJob );
+	s_pCompressor = NULL;
+}
+
+bool CLumpCompressor::GetLump( int hLump, CUtlBuffer *&pInput, CUtlBuffer &compressedBuffer )
+{
+	pInput = m_Inputs[hLump];
+
+	int nFirstJob = m_FirstJob[hLump];
+	int nJobs = ( ( hLump + 1 < m_FirstJob.Count() ) ? m_FirstJob[hLump + 1] : m_Jobs.Count() ) - nFirstJob;
+	if ( !nJobs )
+		return false;
+
+	for ( int i = 0; i < nJobs; i++ )
+	{
+		if ( !m_Jobs[nFirstJob + i].bCompressed )
+			return false;
+	}
+
+	if ( nJobs == 1 && !m_Jobs[nFirstJob].start && m_Jobs[nFirstJob].size == pInput->TellPut() - pInput->TellGet() )
+	{
+		// one piece, nothing to wrap
+		compressedBuffer.Swap( m_Jobs[nFirstJob].output );
+		return true;
+	}
+
+	lzma_blocks_header_t header;
+	header.id = LZMA_BLOCKS_ID;
+	header.actualSize = LittleLong( pInput->TellPut() - pInput->TellGet() );
+	header.blockSize = LittleLong( m_nBlockSize );
+	header.blockCount = LittleLong( nJobs );
+	compressedBuffer.Put( &header, sizeof( header ) );
+
+	unsigned int nOffset = sizeof( header ) + ( nJobs + 1 ) * sizeof( unsigned int );
+	for ( int i = 0; i <= nJobs; i++ )
+	{
+		compressedBuffer.PutUnsignedInt( LittleLong( nOffset ) );
+		if ( i < nJobs )
+		{
+			nOffset += m_Jobs[nFirstJob + i].output.TellPut();
+		}
+	}
+
+	for ( int i = 0; i < nJobs; i++ )
+	{
+		CUtlBuffer &blockBuffer = m_Jobs[nFirstJob + i].output;
+		compressedBuffer.Put( blockBuffer.Base(), blockBuffer.TellPut() );
+		blockBuffer.Purge();
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Gets a lump's data ready to be compressed again, uncompressing it if need be.
+//-----------------------------------------------------------------------------
+static void GetRepackLumpInput( byte *pLumpData, int filelen, bool bCompressed, CUtlBuffer &inputBuffer )
+{
+	if ( bCompressed )
+	{
+		if ( CLZMA::IsCompressed( pLumpData ) )
+		{
+			inputBuffer.EnsureCapacity( CLZMA::GetActualSize( pLumpData ) );
+			unsigned int outSize = CLZMA::Uncompress( pLumpData, (unsigned char *)inputBuffer.Base() );
+			inputBuffer.SeekPut( CUtlBuffer::SEEK_CURRENT, outSize );
+			if ( outSize != CLZMA::GetActualSize( pLumpData ) )
+			{
+				Warning( "Decompressed size differs from header, BSP may be corrupt\n" );
+			}
+		}
+		else
+		{
+			Assert( CLZMA::IsCompressed( pLumpData ) );
+			Warning( "Unsupported BSP: Unrecognized compressed lump\n" );
+		}
+	}
+	else
+	{
+		// Just use input
+		inputBuffer.SetExternalBuffer( pLumpData, filelen, filelen );
+	}
+}
 
+static dgamelumpheader_t *GetRepackGameLumpHeader( dheader_t *pInBSPHeader )
+{
 	dgamelumpheader_t* pInGameLumpHeader = (dgamelumpheader_t*)(((byte *)pInBSPHeader) + pInBSPHeader->lumps[LUMP_GAME_LUMP].fileofs);
-	dgamelump_t* pInGameLump = (dgamelump_t*)(pInGameLumpHeader + 1);
 
 	if ( IsX360() )
 	{
+		CByteswap	byteSwap;
 		byteSwap.ActivateByteSwapping( true );
 		byteSwap.SwapFieldsToTargetEndian( pInGameLumpHeader );
-		byteSwap.SwapFieldsToTargetEndian( pInGameLump, pInGameLumpHeader->lumpCount );
+		byteSwap.SwapFieldsToTargetEndian( (dgamelump_t*)(pInGameLumpHeader + 1), pInGameLumpHeader->lumpCount );
+	}
+
+	return pInGameLumpHeader;
+}
+
+//-----------------------------------------------------------------------------
+// Queues up each game lump for compression, returns the handle of the first one.
+//-----------------------------------------------------------------------------
+static int AddGameLumpsToCompressor( dgamelumpheader_t *pInGameLumpHeader, dheader_t *pInBSPHeader, CLumpCompressor &compressor )
+{
+	dgamelump_t* pInGameLump = (dgamelump_t*)(pInGameLumpHeader + 1);
+
+	int hFirstLump = -1;
+	for ( int i = 0; i < pInGameLumpHeader->lumpCount; i++ )
+	{
+		CUtlBuffer inputBuffer;
+		if ( pInGameLump[i].filelen )
+		{
+			GetRepackLumpInput( ((byte *)pInBSPHeader) + pInGameLump[i].fileofs, pInGameLump[i].filelen,
+			                    ( pInGameLump[i].flags & GAMELUMPFLAG_COMPRESSED ) != 0, inputBuffer );
+		}
+
+		int hLump = compressor.AddLump( inputBuffer );
+		if ( i == 0 )
+		{
+			hFirstLump = hLump;
+		}
+	}
+
+	return hFirstLump;
+}
+
+bool CompressGameLump( dgamelumpheader_t *pInGameLumpHeader, dheader_t *pOutBSPHeader, CUtlBuffer &outputBuffer, CLumpCompressor &compressor, int hFirstLump )
+{
+	CByteswap	byteSwap;
+	if ( IsX360() )
+	{
+		byteSwap.ActivateByteSwapping( true );
 	}
 
+	dgamelump_t* pInGameLump = (dgamelump_t*)(pInGameLumpHeader + 1);
+
 	unsigned int newOffset = outputBuffer.TellPut();
 	// Make room for gamelump header and gamelump structs, which we'll write at the end
 	outputBuffer.SeekPut( CUtlBuffer::SEEK_CURRENT, sizeof( dgamelumpheader_t ) );
@@ -4481,40 +4731,14 @@ bool CompressGameLump( dheader_t *pInBSPHeader, dheader_t *pOutBSPHeader, CUtlBu
 
 	for ( int i = 0; i < pInGameLumpHeader->lumpCount; i++ )
 	{
-		CUtlBuffer inputBuffer;
+		CUtlBuffer *pInputBuffer;
 		CUtlBuffer compressedBuffer;
 
 		sOutGameLump[i].fileofs = AlignBuffer( outputBuffer, 4 );
 
 		if ( pInGameLump[i].filelen )
 		{
-			if ( pInGameLump[i].flags & GAMELUMPFLAG_COMPRESSED )
-			{
-				byte *pCompressedLump = ((byte *)pInBSPHeader) + pInGameLump[i].fileofs;
-				if ( CLZMA::IsCompressed( pCompressedLump ) )
-				{
-					inputBuffer.EnsureCapacity( CLZMA::GetActualSize( pCompressedLump ) );
-					unsigned int outSize = CLZMA::Uncompress( pCompressedLump, (unsigned char *)inputBuffer.Base() );
-					inputBuffer.SeekPut( CUtlBuffer::SEEK_CURRENT, outSize );
-					if ( outSize != CLZMA::GetActualSize( pCompressedLump ) )
-					{
-						Warning( "Decompressed size differs from header, BSP may be corrupt\n" );
-					}
-				}
-				else
-				{
-					Assert( CLZMA::IsCompressed( pCompressedLump ) );
-					Warning( "Unsupported BSP: Unrecognized compressed game lump\n" );
-				}
-
-			}
-			else
-			{
-				inputBuffer.SetExternalBuffer( ((byte *)pInBSPHeader) + pInGameLump[i].fileofs,
-				                               pInGameLump[i].filelen, pInGameLump[i].filelen );
-			}
-
-			bool bCompressed = pCompressFunc ? pCompressFunc( inputBuffer, compressedBuffer ) : false;
+			bool bCompressed = compressor.GetLump( hFirstLump + i, pInputBuffer, compressedBuffer );
 			if ( bCompressed )
 			{
 				sOutGameLump[i].flags |= GAMELUMPFLAG_COMPRESSED;
@@ -4526,7 +4750,7 @@ bool CompressGameLump( dheader_t *pInBSPHeader, dheader_t *pOutBSPHeader, CUtlBu
 			{
 				// as is, clear compression flag from input lump
 				sOutGameLump[i].flags &= ~GAMELUMPFLAG_COMPRESSED;
-				outputBuffer.Put( inputBuffer.Base(), inputBuffer.TellPut() );
+				outputBuffer.Put( pInputBuffer->Base(), pInputBuffer->TellPut() );
 			}
 		}
 	}
@@ -4585,7 +4809,7 @@ bool RepackBSPCallback_LZMA( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer )
 }
 
 
-bool RepackBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFunc_t pCompressFunc, IZip::eCompressionType packfileCompression )
+bool RepackBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFunc_t pCompressFunc, IZip::eCompressionType packfileCompression, unsigned int nLumpBlockSize )
 {
 	dheader_t *pInBSPHeader = (dheader_t *)inputBuffer.Base();
 	// The 360 swaps this header to disk. For some reason.
@@ -4620,6 +4844,42 @@ bool RepackBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFunc_
 	}
 	sortedLumps.Sort( SortLumpsByOffset );
 
+	// uncompress everything that's going to be compressed again, then compress it all at once
+	CLumpCompressor compressor( pCompressFunc, nLumpBlockSize );
+	int lumpHandles[HEADER_LUMPS];
+	dgamelumpheader_t *pInGameLumpHeader = NULL;
+	for ( int i = 0; i < HEADER_LUMPS; ++i )
+	{
+		lump_t *pLump = &pInBSPHeader->lumps[i];
+		lumpHandles[i] = -1;
+
+		if ( !pLump->filelen || i == LUMP_PAKFILE )
+			continue;
+
+		if ( i == LUMP_GAME_LUMP )
+		{
+			// the game lump has to have each of its components individually compressed
+			pInGameLumpHeader = GetRepackGameLumpHeader( pInBSPHeader );
+			lumpHandles[i] = AddGameLumpsToCompressor( pInGameLumpHeader, pInBSPHeader, compressor );
+			continue;
+		}
+
+		byte *pLumpData = ((byte *)pInBSPHeader) + pLump->fileofs;
+		CUtlBuffer inputBuffer;
+		if ( pLump->uncompressedSize && CLZMA::GetActualSize( pLumpData ) != (unsigned int)pLump->uncompressedSize )
+		{
+			Assert( CLZMA::GetActualSize( pLumpData ) == (unsigned int)pLump->uncompressedSize );
+			Warning( "Unsupported BSP: Unrecognized compressed lump\n" );
+		}
+		else
+		{
+			GetRepackLumpInput( pLumpData, pLump->filelen, pLump->uncompressedSize != 0, inputBuffer );
+		}
+		lumpHandles[i] = compressor.AddLump( inputBuffer );
+	}
+
+	compressor.CompressAll();
+
 	// iterate in sorted order
 	for ( int i = 0; i < HEADER_LUMPS; ++i )
 	{
@@ -4637,49 +4897,30 @@ bool RepackBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFunc_
 			int alignment = 4;
 			if ( lumpNum == LUMP_PAKFILE )
 			{
-				alignment = 2048;
+				alignment = Max( 2048u, s_nPakFileAlignment );
 			}
 			unsigned int newOffset = AlignBuffer( outputBuffer, alignment );
 
-			CUtlBuffer inputBuffer;
-			if ( pSortedLump->pLump->uncompressedSize )
-			{
-				byte *pCompressedLump = ((byte *)pInBSPHeader) + pSortedLump->pLump->fileofs;
-				if ( CLZMA::IsCompressed( pCompressedLump ) && pSortedLump->pLump->uncompressedSize == CLZMA::GetActualSize( pCompressedLump ) )
-				{
-					inputBuffer.EnsureCapacity( CLZMA::GetActualSize( pCompressedLump ) );
-					unsigned int outSize = CLZMA::Uncompress( pCompressedLump, (unsigned char *)inputBuffer.Base() );
-					inputBuffer.SeekPut( CUtlBuffer::SEEK_CURRENT, outSize );
-					if ( outSize != pSortedLump->pLump->uncompressedSize )
-					{
-						Warning( "Decompressed size differs from header, BSP may be corrupt\n" );
-					}
-				}
-				else
-				{
-					Assert( CLZMA::IsCompressed( pCompressedLump ) &&
-					        pSortedLump->pLump->uncompressedSize == CLZMA::GetActualSize( pCompressedLump ) );
-					Warning( "Unsupported BSP: Unrecognized compressed lump\n" );
-				}
-			}
-			else
-			{
-				// Just use input
-				inputBuffer.SetExternalBuffer( ((byte *)pInBSPHeader) + pSortedLump->pLump->fileofs,
-				                               pSortedLump->pLump->filelen, pSortedLump->pLump->filelen );
-			}
-
 			if ( lumpNum == LUMP_GAME_LUMP )
 			{
-				// the game lump has to have each of its components individually compressed
-				CompressGameLump( pInBSPHeader, &sOutBSPHeader, outputBuffer, pCompressFunc );
+				CompressGameLump( pInGameLumpHeader, &sOutBSPHeader, outputBuffer, compressor, lumpHandles[lumpNum] );
 			}
 			else if ( lumpNum == LUMP_PAKFILE )
 			{
+				CUtlBuffer inputBuffer;
+				GetRepackLumpInput( ((byte *)pInBSPHeader) + pSortedLump->pLump->fileofs, pSortedLump->pLump->filelen,
+				                    pSortedLump->pLump->uncompressedSize != 0, inputBuffer );
+
 				IZip *newPakFile = IZip::CreateZip( NULL );
 				IZip *oldPakFile = IZip::CreateZip( NULL );
 				oldPakFile->ParseFromBuffer( inputBuffer.Base(), inputBuffer.Size() );
 
+				newPakFile->SetDeduplicateFiles( s_bPakFileDeduplicate );
+				if ( s_nPakFileAlignment && packfileCompression == IZip::eCompressionType_None )
+				{
+					ForceAlignment( newPakFile, true, true, s_nPakFileAlignment );
+				}
+
 				int id = -1;
 				int fileSize;
 				while ( 1 )
@@ -4716,11 +4957,12 @@ bool RepackBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFunc_
 			}
 			else
 			{
+				CUtlBuffer *pInputBuffer;
 				CUtlBuffer compressedBuffer;
-				bool bCompressed = pCompressFunc ? pCompressFunc( inputBuffer, compressedBuffer ) : false;
+				bool bCompressed = compressor.GetLump( lumpHandles[lumpNum], pInputBuffer, compressedBuffer );
 				if ( bCompressed )
 				{
-					sOutBSPHeader.lumps[lumpNum].uncompressedSize = inputBuffer.TellPut();
+					sOutBSPHeader.lumps[lumpNum].uncompressedSize = pInputBuffer->TellPut();
 					sOutBSPHeader.lumps[lumpNum].filelen = compressedBuffer.TellPut();
 					sOutBSPHeader.lumps[lumpNum].fileofs = newOffset;
 					outputBuffer.Put( compressedBuffer.Base(), compressedBuffer.TellPut() );
@@ -4730,8 +4972,8 @@ bool RepackBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFunc_
 				{
 					// add as is
 					sOutBSPHeader.lumps[lumpNum].fileofs = newOffset;
-					sOutBSPHeader.lumps[lumpNum].filelen = inputBuffer.TellPut();
-					outputBuffer.Put( inputBuffer.Base(), inputBuffer.TellPut() );
+					sOutBSPHeader.lumps[lumpNum].filelen = pInputBuffer->TellPut();
+					outputBuffer.Put( pInputBuffer->Base(), pInputBuffer->TellPut() );
 				}
 			}
 		}
@@ -204,6 +204,9 @@ bool				ReadFileFromPak( IZip *pak, const char *pRelativeName, bool bTextMode, C
 void				RemoveFileFromPak( IZip *pak, const char *pRelativeName );
 int					GetNextFilename( IZip *pak, int id, char *pBuffer, int bufferSize, int &fileSize );
 void				ForceAlignment( IZip *pak, bool bAlign, bool bCompatibleFormat, unsigned int alignmentSize );
+// bDeduplicate stores files with identical contents once. A non-zero alignmentSize stores every file
+// uncompressed, starting on that boundary, so the engine can map it straight out of the bsp.
+void				SetPakFileLayout( bool bDeduplicate, unsigned int alignmentSize );
 
 typedef bool (*CompressFunc_t)( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer );
 typedef bool (*VTFConvertFunc_t)( const char *pDebugName, CUtlBuffer &sourceBuf, CUtlBuffer &targetBuf, CompressFunc_t pCompressFunc );
@@ -297,8 +300,11 @@ void	PrintBSPFileSizes(void);
 void	PrintBSPPackDirectory(void);
 void	ReleasePakFileLumps(void);
 
+// Compress callbacks are called from several threads at once.
 bool	RepackBSPCallback_LZMA( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer );
-bool	RepackBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFunc_t pCompressFunc, IZip::eCompressionType packfileCompression );
+// With LZMA, lumps bigger than nLumpBlockSize are split into independently compressed blocks. 0, the default,
+// keeps every lump a single stream, which is all engines without block support in CLZMA can read.
+bool	RepackBSP( CUtlBuffer &inputBuffer, CUtlBuffer &outputBuffer, CompressFunc_t pCompressFunc, IZip::eCompressionType packfileCompression, unsigned int nLumpBlockSize = 0 );
 bool	SwapBSPFile( const char *filename, const char *swapFilename, bool bSwapOnLoad, VTFConvertFunc_t pVTFConvertFunc, VHVFixupFunc_t pVHVFixupFunc, CompressFunc_t pCompressFunc );
 
 bool	GetPakFileLump( const char *pBSPFilename, void **pPakData, int *pPakSize );
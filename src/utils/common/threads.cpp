@@ -1,6 +1,6 @@
 //========= Copyright Valve Corporation, All rights reserved. ============//
 //
-// Purpose: 
+// Purpose:
 //
 // $Workfile:     $
 // $Date:         $
@@ -13,13 +13,20 @@
 
 #define	USED
 
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
 #include "cmdlib.h"
 #define NO_THREAD_NAMES
 #include "threads.h"
 #include "pacifier.h"
-
-#define	MAX_THREADS	16
+#include "tier0/threadtools.h"
 
 
 class CRunThreadsData
@@ -28,20 +35,110 @@ public:
 	int m_iThread;
 	void *m_pUserData;
 	RunThreadsFn m_Fn;
+	ERunThreadsPriority m_ePriority;
 };
 
-CRunThreadsData g_RunThreadsData[MAX_THREADS];
+CRunThreadsData g_RunThreadsData[MAX_TOOL_THREADS];
 
 
-int		dispatch;
-int		workcount;
 qboolean		pacifier;
 
 qboolean	threaded;
 bool g_bLowPriorityThreads = false;
+bool g_bThreadAffinity = true;
+
+ThreadHandle_t g_ThreadHandles[MAX_TOOL_THREADS];
+static CInterlockedInt g_nRunningThreads;
+static CThreadEvent g_ThreadsDone( true );		// set by the last thread to finish
+
+// Index of the tool thread we're running on, so GetThreadWork can find its own range
+static CTHREADLOCALINT g_iCurrentThread;
+
+
+/*
+===================================================================
+
+WORK SCHEDULER
+
+Every thread starts with an equal contiguous slice of the work items and
+takes from the front of it. A thread that runs out steals the back half of
+whichever slice has the most left, so uneven work balances out without every
+GetThreadWork call going through a global lock.
+
+===================================================================
+*/
+
+struct CThreadWorkRange
+{
+	CThreadFastMutex m_Mutex;
+	int m_iNext;
+	int m_iEnd;
+	// only ever written by the owning thread, read by the pacifier
+	volatile int m_nDispatched;
+	// keep neighbouring threads' ranges off each other's cache lines
+	char m_Pad[64];
+};
+
+static CThreadWorkRange g_WorkRanges[MAX_TOOL_THREADS];
+static int g_nWorkCount;
+
+
+static void InitWorkRanges( int workcnt )
+{
+	g_nWorkCount = workcnt;
+	for ( int i = 0; i < numthreads; i++ )
+	{
+		g_WorkRanges[i].m_iNext = (int)( (int64)workcnt * i / numthreads );
+		g_WorkRanges[i].m_iEnd = (int)( (int64)workcnt * ( i + 1 ) / numthreads );
+		g_WorkRanges[i].m_nDispatched = 0;
+	}
+}
+
 
-HANDLE g_ThreadHandles[MAX_THREADS];
+static bool StealWork( int iThread )
+{
+	CThreadWorkRange &self = g_WorkRanges[iThread];
 
+	while ( 1 )
+	{
+		// the sizes can change under us, this is just a hint for who to lock
+		int iVictim = -1;
+		int nMostRemaining = 0;
+		for ( int i = 0; i < numthreads; i++ )
+		{
+			int nRemaining = g_WorkRanges[i].m_iEnd - g_WorkRanges[i].m_iNext;
+			if ( i != iThread && nRemaining > nMostRemaining )
+			{
+				nMostRemaining = nRemaining;
+				iVictim = i;
+			}
+		}
+
+		if ( iVictim == -1 )
+			return false;
+
+		CThreadWorkRange &victim = g_WorkRanges[iVictim];
+		int iStart, iEnd;
+		victim.m_Mutex.Lock();
+		int nRemaining = victim.m_iEnd - victim.m_iNext;
+		if ( nRemaining <= 0 )
+		{
+			// somebody beat us to it, look again
+			victim.m_Mutex.Unlock();
+			continue;
+		}
+		iEnd = victim.m_iEnd;
+		iStart = iEnd - ( nRemaining + 1 ) / 2;
+		victim.m_iEnd = iStart;
+		victim.m_Mutex.Unlock();
+
+		self.m_Mutex.Lock();
+		self.m_iNext = iStart;
+		self.m_iEnd = iEnd;
+		self.m_Mutex.Unlock();
+		return true;
+	}
+}
 
 
 /*
@@ -52,23 +149,36 @@ GetThreadWork
 */
 int	GetThreadWork (void)
 {
-	int	r;
-
-	ThreadLock ();
+	int iThread = g_iCurrentThread;
+	if ( iThread < 0 || iThread >= numthreads )
+		iThread = 0;
 
-	if (dispatch == workcount)
+	CThreadWorkRange &range = g_WorkRanges[iThread];
+	while ( 1 )
 	{
-		ThreadUnlock ();
-		return -1;
-	}
+		range.m_Mutex.Lock();
+		if ( range.m_iNext < range.m_iEnd )
+		{
+			int r = range.m_iNext++;
+			range.m_Mutex.Unlock();
 
-	UpdatePacifier( (float)dispatch / workcount );
+			range.m_nDispatched = range.m_nDispatched + 1;
+			return r;
+		}
+		range.m_Mutex.Unlock();
+
+		if ( !StealWork( iThread ) )
+			return -1;
+	}
+}
 
-	r = dispatch;
-	dispatch++;
-	ThreadUnlock ();
 
-	return r;
+static int GetDispatchedWorkCount()
+{
+	int nDispatched = 0;
+	for ( int i = 0; i < numthreads; i++ )
+		nDispatched += g_WorkRanges[i].m_nDispatched;
+	return nDispatched;
 }
 
 
@@ -83,7 +193,7 @@ void ThreadWorkerFunction( int iThread, void *pUserData )
 		work = GetThreadWork ();
 		if (work == -1)
 			break;
-		 
+
 		workfunction( iThread, work );
 	}
 }
@@ -92,7 +202,7 @@ void RunThreadsOnIndividual (int workcnt, qboolean showpacifier, ThreadWorkerFn
 {
 	if (numthreads == -1)
 		ThreadSetDefault ();
-	
+
 	workfunction = func;
 	RunThreadsOn (workcnt, showpacifier, ThreadWorkerFunction);
 }
@@ -101,45 +211,272 @@ void RunThreadsOnIndividual (int workcnt, qboolean showpacifier, ThreadWorkerFn
 /*
 ===================================================================
 
-WIN32
+PROCESSOR TOPOLOGY
+
+Threads are pinned round robin across NUMA nodes so each node gets an even
+share of the work and memory bandwidth.
 
 ===================================================================
 */
 
-int		numthreads = -1;
-CRITICAL_SECTION		crit;
-static int enter;
+struct ToolProcessor_t
+{
+	int m_nGroup;	// windows processor group, unused elsewhere
+	int m_nCPU;		// processor number within the group
+};
+
+static CUtlVector<ToolProcessor_t> g_ProcessorOrder;
 
+#ifdef _WIN32
 
-class CCritInit
+static void BuildProcessorOrder()
 {
-public:
-	CCritInit()
+	g_ProcessorOrder.RemoveAll();
+
+	CUtlVector< CUtlVector<ToolProcessor_t> > nodes;
+	ULONG nHighestNode = 0;
+	if ( GetNumaHighestNodeNumber( &nHighestNode ) )
+	{
+		nodes.SetCount( nHighestNode + 1 );
+		for ( USHORT iNode = 0; iNode <= nHighestNode; iNode++ )
+		{
+			GROUP_AFFINITY affinity;
+			if ( !GetNumaNodeProcessorMaskEx( iNode, &affinity ) )
+				continue;
+
+			for ( int iBit = 0; iBit < 64; iBit++ )
+			{
+				if ( affinity.Mask & ( (KAFFINITY)1 << iBit ) )
+				{
+					ToolProcessor_t proc = { affinity.Group, iBit };
+					nodes[iNode].AddToTail( proc );
+				}
+			}
+		}
+	}
+
+	for ( int iSlot = 0; ; iSlot++ )
 	{
-		InitializeCriticalSection (&crit);
+		bool bAdded = false;
+		FOR_EACH_VEC( nodes, iNode )
+		{
+			if ( iSlot < nodes[iNode].Count() )
+			{
+				g_ProcessorOrder.AddToTail( nodes[iNode][iSlot] );
+				bAdded = true;
+			}
+		}
+		if ( !bAdded )
+			break;
 	}
-} g_CritInit;
+}
 
+static int GetLogicalProcessorCount()
+{
+	// unlike GetSystemInfo this counts every processor group, not just ours
+	return (int)GetActiveProcessorCount( ALL_PROCESSOR_GROUPS );
+}
 
+static void PinCurrentThread( const ToolProcessor_t &proc )
+{
+	GROUP_AFFINITY affinity;
+	memset( &affinity, 0, sizeof( affinity ) );
+	affinity.Group = (WORD)proc.m_nGroup;
+	affinity.Mask = (KAFFINITY)1 << proc.m_nCPU;
+	SetThreadGroupAffinity( GetCurrentThread(), &affinity, NULL );
+}
+
+static void SetCurrentThreadPriority( ERunThreadsPriority ePriority )
+{
+	if ( ePriority == k_eRunThreadsPriority_UseGlobalState )
+	{
+		if( g_bLowPriorityThreads )
+			SetThreadPriority( GetCurrentThread(), THREAD_PRIORITY_LOWEST );
+	}
+	else if ( ePriority == k_eRunThreadsPriority_Idle )
+	{
+		SetThreadPriority( GetCurrentThread(), THREAD_PRIORITY_IDLE );
+	}
+}
 
 void SetLowPriority()
 {
 	SetPriorityClass( GetCurrentProcess(), IDLE_PRIORITY_CLASS );
 }
 
+#else
 
-void ThreadSetDefault (void)
+// the CPUs we're allowed to run on, which taskset or a container may have cut down
+static bool GetAllowedCPUs( cpu_set_t &allowed )
+{
+	CPU_ZERO( &allowed );
+	return sched_getaffinity( 0, sizeof( allowed ), &allowed ) == 0;
+}
+
+// parses a sysfs cpu list such as "0-15,32-47", keeping the CPUs in allowed
+static void ParseCPUList( const char *pList, const cpu_set_t &allowed, CUtlVector<ToolProcessor_t> &cpus )
+{
+	while ( *pList )
+	{
+		char *pEnd;
+		int iFirst = strtol( pList, &pEnd, 10 );
+		if ( pEnd == pList )
+			break;
+
+		int iLast = iFirst;
+		pList = pEnd;
+		if ( *pList == '-' )
+		{
+			iLast = strtol( pList + 1, &pEnd, 10 );
+			pList = pEnd;
+		}
+
+		for ( int iCPU = iFirst; iCPU <= iLast; iCPU++ )
+		{
+			if ( iCPU < 0 || iCPU >= CPU_SETSIZE || !CPU_ISSET( iCPU, &allowed ) )
+				continue;
+
+			ToolProcessor_t proc = { 0, iCPU };
+			cpus.AddToTail( proc );
+		}
+
+		if ( *pList == ',' )
+			pList++;
+		else
+			break;
+	}
+}
+
+static void BuildProcessorOrder()
+{
+	g_ProcessorOrder.RemoveAll();
+
+	cpu_set_t allowed;
+	if ( !GetAllowedCPUs( allowed ) )
+		return;
+
+	CUtlVector< CUtlVector<ToolProcessor_t> > nodes;
+	for ( int iNode = 0; ; iNode++ )
+	{
+		char szPath[MAX_PATH];
+		V_sprintf_safe( szPath, "/sys/devices/system/node/node%d/cpulist", iNode );
+		FILE *fp = fopen( szPath, "r" );
+		if ( !fp )
+			break;
+
+		char szList[4096];
+		if ( fgets( szList, sizeof( szList ), fp ) )
+		{
+			CUtlVector<ToolProcessor_t> &node = nodes[nodes.AddToTail()];
+			ParseCPUList( szList, allowed, node );
+			if ( node.Count() == 0 )
+				nodes.Remove( nodes.Count() - 1 );
+		}
+		fclose( fp );
+	}
+
+	// no NUMA information, treat the machine as one node
+	if ( nodes.Count() == 0 )
+	{
+		CUtlVector<ToolProcessor_t> &node = nodes[nodes.AddToTail()];
+		for ( int iCPU = 0; iCPU < CPU_SETSIZE; iCPU++ )
+		{
+			if ( !CPU_ISSET( iCPU, &allowed ) )
+				continue;
+
+			ToolProcessor_t proc = { 0, iCPU };
+			node.AddToTail( proc );
+		}
+	}
+
+	for ( int iSlot = 0; ; iSlot++ )
+	{
+		bool bAdded = false;
+		FOR_EACH_VEC( nodes, iNode )
+		{
+			if ( iSlot < nodes[iNode].Count() )
+			{
+				g_ProcessorOrder.AddToTail( nodes[iNode][iSlot] );
+				bAdded = true;
+			}
+		}
+		if ( !bAdded )
+			break;
+	}
+}
+
+static int GetLogicalProcessorCount()
+{
+	cpu_set_t allowed;
+	if ( GetAllowedCPUs( allowed ) )
+		return CPU_COUNT( &allowed );
+
+	return (int)sysconf( _SC_NPROCESSORS_ONLN );
+}
+
+static void PinCurrentThread( const ToolProcessor_t &proc )
+{
+	if ( proc.m_nCPU >= CPU_SETSIZE )
+		return;
+
+	cpu_set_t cpus;
+	CPU_ZERO( &cpus );
+	CPU_SET( proc.m_nCPU, &cpus );
+	pthread_setaffinity_np( pthread_self(), sizeof( cpus ), &cpus );
+}
+
+static void SetCurrentThreadPriority( ERunThreadsPriority ePriority )
 {
-	SYSTEM_INFO info;
+	// on linux each thread has its own nice value
+	if ( ePriority == k_eRunThreadsPriority_UseGlobalState )
+	{
+		if( g_bLowPriorityThreads )
+			setpriority( PRIO_PROCESS, (id_t)syscall( SYS_gettid ), 10 );
+	}
+	else if ( ePriority == k_eRunThreadsPriority_Idle )
+	{
+		setpriority( PRIO_PROCESS, (id_t)syscall( SYS_gettid ), 19 );
+	}
+}
 
+void SetLowPriority()
+{
+	setpriority( PRIO_PROCESS, 0, 19 );
+}
+
+#endif
+
+
+/*
+===================================================================
+
+THREADS
+
+===================================================================
+*/
+
+int		numthreads = -1;
+CThreadMutex		crit;
+static int enter;
+
+
+void ThreadSetDefault (void)
+{
 	if (numthreads == -1)	// not set manually
 	{
-		GetSystemInfo (&info);
-		numthreads = info.dwNumberOfProcessors;
-		if (numthreads < 1 || numthreads > 32)
+		numthreads = GetLogicalProcessorCount();
+		if (numthreads < 1)
 			numthreads = 1;
 	}
 
+	if (numthreads > MAX_TOOL_THREADS)
+	{
+		Warning ("%i threads requested, limiting to %i\n", numthreads, MAX_TOOL_THREADS);
+		numthreads = MAX_TOOL_THREADS;
+	}
+
+	BuildProcessorOrder();
+
 	Msg ("%i threads\n", numthreads);
 }
 
@@ -148,7 +485,7 @@ void ThreadLock (void)
 {
 	if (!threaded)
 		return;
-	EnterCriticalSection (&crit);
+	crit.Lock ();
 	if (enter)
 		Error ("Recursive ThreadLock\n");
 	enter = 1;
@@ -161,15 +498,26 @@ void ThreadUnlock (void)
 	if (!enter)
 		Error ("ThreadUnlock without lock\n");
 	enter = 0;
-	LeaveCriticalSection (&crit);
+	crit.Unlock ();
 }
 
 
 // This runs in the thread and dispatches a RunThreadsFn call.
-DWORD WINAPI InternalRunThreadsFn( LPVOID pParameter )
+static uintp InternalRunThreadsFn( void *pParameter )
 {
 	CRunThreadsData *pData = (CRunThreadsData*)pParameter;
+	g_iCurrentThread = pData->m_iThread;
+
+	// only pin when we're using the whole machine, otherwise leave placement to the OS
+	if ( g_bThreadAffinity && numthreads == g_ProcessorOrder.Count() )
+		PinCurrentThread( g_ProcessorOrder[pData->m_iThread] );
+
+	SetCurrentThreadPriority( pData->m_ePriority );
+
 	pData->m_Fn( pData->m_iThread, pData->m_pUserData );
+
+	if ( --g_nRunningThreads == 0 )
+		g_ThreadsDone.Set();
 	return 0;
 }
 
@@ -182,43 +530,32 @@ void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePr
 	if ( numthreads > MAX_TOOL_THREADS )
 		numthreads = MAX_TOOL_THREADS;
 
+	g_nRunningThreads = numthreads;
+	g_ThreadsDone.Reset();
+
 	for ( int i=0; i < numthreads ;i++ )
 	{
 		g_RunThreadsData[i].m_iThread = i;
 		g_RunThreadsData[i].m_pUserData = pUserData;
 		g_RunThreadsData[i].m_Fn = fn;
+		g_RunThreadsData[i].m_ePriority = ePriority;
 
-		DWORD dwDummy;
-		g_ThreadHandles[i] = CreateThread(
-		   NULL,	// LPSECURITY_ATTRIBUTES lpsa,
-		   0,		// DWORD cbStack,
-		   InternalRunThreadsFn,	// LPTHREAD_START_ROUTINE lpStartAddr,
-		   &g_RunThreadsData[i],	// LPVOID lpvThreadParm,
-		   0,			// DWORD fdwCreate,
-		   &dwDummy );
-
-		if ( ePriority == k_eRunThreadsPriority_UseGlobalState )
-		{
-			if( g_bLowPriorityThreads )
-				SetThreadPriority( g_ThreadHandles[i], THREAD_PRIORITY_LOWEST );
-		}
-		else if ( ePriority == k_eRunThreadsPriority_Idle )
-		{
-			SetThreadPriority( g_ThreadHandles[i], THREAD_PRIORITY_IDLE );
-		}
+		g_ThreadHandles[i] = CreateSimpleThread( InternalRunThreadsFn, &g_RunThreadsData[i] );
 	}
 }
 
 
 void RunThreads_End()
 {
-	WaitForMultipleObjects( numthreads, g_ThreadHandles, TRUE, INFINITE );
 	for ( int i=0; i < numthreads; i++ )
-		CloseHandle( g_ThreadHandles[i] );
+	{
+		ThreadJoin( g_ThreadHandles[i] );
+		ReleaseThreadHandle( g_ThreadHandles[i] );
+	}
 
 	threaded = false;
 }
-	
+
 
 /*
 =============
@@ -230,8 +567,7 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	int		start, end;
 
 	start = Plat_FloatTime();
-	dispatch = 0;
-	workcount = workcnt;
+	InitWorkRanges( workcnt );
 	StartPacifier("");
 	pacifier = showpacifier;
 
@@ -241,8 +577,17 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	return;
 #endif
 
-	
+
 	RunThreads_Start( fn, pUserData );
+
+	// the workers only count what they've taken, the pacifier is drawn from here
+	// while we wait for the last of them to finish
+	while ( !g_ThreadsDone.Wait( 50 ) )
+	{
+		if ( g_nWorkCount > 0 )
+			UpdatePacifier( (float)GetDispatchedWorkCount() / g_nWorkCount );
+	}
+
 	RunThreads_End();
 
 
@@ -253,5 +598,3 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 		printf (" (%i)\n", end-start);
 	}
 }
-
-
@@ -7,12 +7,24 @@
 //=============================================================================//
 
 #include "vbsp.h"
+#include "tier0/threadtools.h"
 
 
 int		c_nodes;
 int		c_nonvis;
 int		c_active_brushes;
 
+// Once the brush lists get this short, BuildTree_r leaves the subtree for the threads.
+// 0 while the subtrees themselves are being built.
+static int s_nDeferSubtreeBrushes = 0;
+
+struct BuildTreeJob_t
+{
+	node_t		*node;
+	bspbrush_t	*brushes;
+};
+static CUtlVector<BuildTreeJob_t> s_BuildTreeJobs;
+
 // if a brush just barely pokes onto the other side,
 // let it slide by without chopping
 #define	PLANESIDE_EPSILON	0.001
@@ -310,17 +322,15 @@ AllocNode
 */
 node_t *AllocNode (void)
 {
-	static int s_NodeCount = 0;
+	static CInterlockedInt s_NodeCount;
 
 	node_t	*node;
 
 	node = (node_t*)malloc(sizeof(*node));
 	memset (node, 0, sizeof(*node));
-	node->id = s_NodeCount;
+	node->id = s_NodeCount++;
 	node->diskId = -1;
 
-	s_NodeCount++;
-
 	return node;
 }
 
@@ -332,7 +342,7 @@ AllocBrush
 */
 bspbrush_t *AllocBrush (int numsides)
 {
-	static int s_BrushId = 0;
+	static CInterlockedInt s_BrushId;
 
 	bspbrush_t	*bb;
 	int			c;
@@ -1374,11 +1384,32 @@ node_t *BuildTree_r (node_t *node, bspbrush_t *brushes)
 	// recursively process children
 	for (i=0 ; i<2 ; i++)
 	{
+		if (s_nDeferSubtreeBrushes && CountBrushList (children[i]) < s_nDeferSubtreeBrushes)
+		{
+			BuildTreeJob_t &job = s_BuildTreeJobs[s_BuildTreeJobs.AddToTail()];
+			job.node = node->children[i];
+			job.brushes = children[i];
+			continue;
+		}
 		node->children[i] = BuildTree_r (node->children[i], children[i]);
 	}
 
 	return node;
 }
+
+
+/*
+================
+BuildTree_Thread
+
+Subtrees don't share any brushes, so each one can be built on its own thread
+and the tree comes out the same no matter how they're scheduled.
+================
+*/
+void BuildTree_Thread (int iThread, int iJob)
+{
+	BuildTree_r (s_BuildTreeJobs[iJob].node, s_BuildTreeJobs[iJob].brushes);
+}
 	  
 
 //===========================================================
@@ -1447,10 +1478,32 @@ tree_t *BrushBSP (bspbrush_t *brushlist, Vector& mins, Vector& maxs)
 
 	tree->headnode = node;
 
-	node = BuildTree_r (node, brushlist);
-	qprintf ("%5i visible nodes\n", c_nodes/2 - c_nonvis);
-	qprintf ("%5i nonvis nodes\n", c_nonvis);
-	qprintf ("%5i leafs\n", (c_nodes+1)/2);
+	// split the top of the tree here, then build what's left on the threads. The
+	// blocks of the world model are already built on the threads, so not for those.
+	if (numthreads > 1 && ThreadInMainThread () && c_brushes >= 64)
+	{
+		s_nDeferSubtreeBrushes = max (c_brushes / (4 * numthreads), 16);
+		node = BuildTree_r (node, brushlist);
+		s_nDeferSubtreeBrushes = 0;
+
+		if (s_BuildTreeJobs.Count())
+		{
+			RunThreadsOnIndividual (s_BuildTreeJobs.Count(), false, BuildTree_Thread);
+		}
+		s_BuildTreeJobs.Purge ();
+	}
+	else
+	{
+		node = BuildTree_r (node, brushlist);
+	}
+
+	// the node counts are only kept single threaded
+	if (numthreads == 1)
+	{
+		qprintf ("%5i visible nodes\n", c_nodes/2 - c_nonvis);
+		qprintf ("%5i nonvis nodes\n", c_nonvis);
+		qprintf ("%5i leafs\n", (c_nodes+1)/2);
+	}
 #if 0
 {	// debug code
 static node_t	*tnode;
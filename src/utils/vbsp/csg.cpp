@@ -266,7 +266,10 @@ static void ComputeBoundingPlanes( const Vector& clipmins, const Vector& clipmax
 {
 	Vector normal;
 	float dist;
-	for (int i=0 ; i<2 ; i++)
+
+	// only x and y are clipped here, but BrushBSP makes its head node from all six
+	// sides of the box on the tool threads, so create the z planes now as well
+	for (int i=0 ; i<3 ; i++)
 	{
 		VectorClear (normal);
 		normal[i] = 1;
@@ -9,6 +9,7 @@
 
 #include "vbsp.h"
 #include "utlvector.h"
+#include "tier0/threadtools.h"
 #include "utilmatlib.h"
 #include <float.h>
 #include "mstristrip.h"
@@ -30,8 +31,8 @@
 #define	POINT_EPSILON		0.1
 #define	OFF_EPSILON			0.25
 
-int	c_merge;
-int	c_subdivide;
+CInterlockedInt	c_merge;
+CInterlockedInt	c_subdivide;
 
 int	c_totalverts;
 int	c_uniqueverts;
@@ -787,18 +788,17 @@ face_t *FixTjuncs (node_t *headnode, face_t *pLeafFaceList)
 
 //========================================================
 
-int		c_faces;
+CInterlockedInt	c_faces;
 
 face_t	*AllocFace (void)
 {
-	static int s_FaceId = 0;
+	static CInterlockedInt s_FaceId;
 
 	face_t	*f;
 
 	f = (face_t*)malloc(sizeof(*f));
 	memset (f, 0, sizeof(*f));
-	f->id = s_FaceId;
-	++s_FaceId;
+	f->id = s_FaceId++;
 
 	c_faces++;
 
@@ -1399,6 +1399,12 @@ face_t *FaceFromPortal (portal_t *p, int pside)
 	return f;
 }
 
+// Nodes in the order their faces get merged, children before parents
+static CUtlVector<node_t *> s_MergeFaceNodes;
+
+// Most brush entities only have a handful of nodes, not worth starting the threads for
+#define MIN_THREADED_MERGE_NODES	256
+
 /*
 ===============
 MakeFaces_r
@@ -1423,12 +1429,8 @@ void MakeFaces_r (node_t *node)
 		MakeFaces_r (node->children[0]);
 		MakeFaces_r (node->children[1]);
 
-		// merge together all visible faces on the node
-		if (!nomerge)
-			MergeFaceList(&node->faces);
-		if (!nosubdiv)
-			SubdivideFaceList(&node->faces);
-
+		// a node's faces all come from leafs below it, so they're complete now
+		s_MergeFaceNodes.AddToTail( node );
 		return;
 	}
 
@@ -1451,6 +1453,25 @@ void MakeFaces_r (node_t *node)
 	}
 }
 
+/*
+===============
+MergeNodeFaces_Thread
+
+Merging and subdividing only touches the node's own face list, so
+each node can go to a different thread.
+===============
+*/
+void MergeNodeFaces_Thread (int iThread, int iNode)
+{
+	node_t *node = s_MergeFaceNodes[iNode];
+
+	// merge together all visible faces on the node
+	if (!nomerge)
+		MergeFaceList(&node->faces);
+	if (!nosubdiv)
+		SubdivideFaceList(&node->faces);
+}
+
 typedef winding_t *pwinding_t;
 
 static void PrintWinding( winding_t *w )
@@ -1804,7 +1825,20 @@ void MakeFaces (node_t *node)
 
 	MakeFaces_r (node);
 
+	if (numthreads > 1 && s_MergeFaceNodes.Count() >= MIN_THREADED_MERGE_NODES)
+	{
+		RunThreadsOnIndividual (s_MergeFaceNodes.Count(), false, MergeNodeFaces_Thread);
+	}
+	else
+	{
+		for (int i = 0; i < s_MergeFaceNodes.Count(); i++)
+		{
+			MergeNodeFaces_Thread (0, i);
+		}
+	}
+	s_MergeFaceNodes.Purge();
+
 	qprintf ("%5i makefaces\n", c_nodefaces);
-	qprintf ("%5i merged\n", c_merge);
-	qprintf ("%5i subdivided\n", c_subdivide);
+	qprintf ("%5i merged\n", (int)c_merge);
+	qprintf ("%5i subdivided\n", (int)c_subdivide);
 }
\ No newline at end of file
@@ -84,6 +84,16 @@ int			entity_num;
 
 node_t		*block_nodes[BLOCKS_SPACE+2][BLOCKS_SPACE+2];
 
+// Each block's brushes, clipped to the block but not yet chopped
+static CUtlVector<bspbrush_t *> s_BlockBrushes;
+
+struct PhaseTime_t
+{
+	const char	*m_pName;
+	float		m_flSeconds;
+};
+static CUtlVector<PhaseTime_t> s_PhaseTimes;
+
 //-----------------------------------------------------------------------------
 // Assign occluder areas (must happen *after* the world model is processed)
 //-----------------------------------------------------------------------------
@@ -146,13 +156,52 @@ node_t	*BlockTree (int xl, int yl, int xh, int yh)
 	return node;
 }
 
+static void GetBlockBounds (int blocknum, int &xblock, int &yblock, Vector &mins, Vector &maxs)
+{
+	yblock = block_yl + blocknum / (block_xh-block_xl+1);
+	xblock = block_xl + blocknum % (block_xh-block_xl+1);
+
+	mins[0] = xblock*BLOCKS_SIZE;
+	mins[1] = yblock*BLOCKS_SIZE;
+	mins[2] = MIN_COORD_INTEGER;
+	maxs[0] = (xblock+1)*BLOCKS_SIZE;
+	maxs[1] = (yblock+1)*BLOCKS_SIZE;
+	maxs[2] = MAX_COORD_INTEGER;
+}
+
 /*
 ============
-ProcessBlock_Thread
+MakeBlockBrushList
 
+Clipping to the block can add planes and the areaportal fixup changes
+the map brushes, so this part runs on the main thread for every block
+before any of them are chopped.
 ============
 */
 int			brush_start, brush_end;
+void MakeBlockBrushList (int blocknum)
+{
+	int		xblock, yblock;
+	Vector		mins, maxs;
+	bspbrush_t	*brushes;
+
+	GetBlockBounds (blocknum, xblock, yblock, mins, maxs);
+
+	// the makelist and chopbrushes could be cached between the passes...
+	brushes = MakeBspBrushList (brush_start, brush_end, mins, maxs, NO_DETAIL);
+	if (brushes)
+	{
+		FixupAreaportalWaterBrushes( brushes );
+	}
+	s_BlockBrushes[blocknum] = brushes;
+}
+
+/*
+============
+ProcessBlock_Thread
+
+============
+*/
 void ProcessBlock_Thread (int threadnum, int blocknum)
 {
 	int		xblock, yblock;
@@ -161,20 +210,11 @@ void ProcessBlock_Thread (int threadnum, int blocknum)
 	tree_t		*tree;
 	node_t		*node;
 
-	yblock = block_yl + blocknum / (block_xh-block_xl+1);
-	xblock = block_xl + blocknum % (block_xh-block_xl+1);
+	GetBlockBounds (blocknum, xblock, yblock, mins, maxs);
 
 	qprintf ("############### block %2i,%2i ###############\n", xblock, yblock);
 
-	mins[0] = xblock*BLOCKS_SIZE;
-	mins[1] = yblock*BLOCKS_SIZE;
-	mins[2] = MIN_COORD_INTEGER;
-	maxs[0] = (xblock+1)*BLOCKS_SIZE;
-	maxs[1] = (yblock+1)*BLOCKS_SIZE;
-	maxs[2] = MAX_COORD_INTEGER;
-
-	// the makelist and chopbrushes could be cached between the passes...
-	brushes = MakeBspBrushList (brush_start, brush_end, mins, maxs, NO_DETAIL);
+	brushes = s_BlockBrushes[blocknum];
 	if (!brushes)
 	{
 		node = AllocNode ();
@@ -184,7 +224,6 @@ void ProcessBlock_Thread (int threadnum, int blocknum)
 		return;
 	}    
 
-	FixupAreaportalWaterBrushes( brushes );
 	if (!nocsg)
 		brushes = ChopBrushes (brushes);
 
@@ -208,6 +247,7 @@ void ProcessWorldModel (void)
 	qboolean	leaked;
 	int	optimize;
 	int			start;
+	float		flStart;
 
 	e = &entities[entity_num];
 
@@ -253,12 +293,24 @@ void ProcessWorldModel (void)
 		block_yh = BLOCKS_MAX;
 	}
 
+	int nBlocks = (block_xh-block_xl+1)*(block_yh-block_yl+1);
 	for (optimize = 0 ; optimize <= 1 ; optimize++)
 	{
 		qprintf ("--------------------------------------------\n");
 
-		RunThreadsOnIndividual ((block_xh-block_xl+1)*(block_yh-block_yl+1),
-			!verbose, ProcessBlock_Thread);
+		flStart = Plat_FloatTime();
+		s_BlockBrushes.SetCount( nBlocks );
+		for (int i = 0; i < nBlocks; i++)
+		{
+			MakeBlockBrushList (i);
+		}
+		AddPhaseTime( "Brush lists", Plat_FloatTime() - flStart );
+
+		// CSG and BSP for each block are independent of the other blocks
+		flStart = Plat_FloatTime();
+		RunThreadsOnIndividual (nBlocks, !verbose, ProcessBlock_Thread);
+		s_BlockBrushes.Purge();
+		AddPhaseTime( "CSG and BSP", Plat_FloatTime() - flStart );
 
 		//
 		// build the division tree
@@ -284,6 +336,7 @@ void ProcessWorldModel (void)
 		//
 
 		// make the portals/faces by traversing down to each empty leaf
+		flStart = Plat_FloatTime();
 		MakeTreePortals (tree);
 
 		if (FloodEntities (tree))
@@ -305,6 +358,7 @@ void ProcessWorldModel (void)
 
 		// mark the brush sides that actually turned into faces
 		MarkVisibleSides (tree, brush_start, brush_end, NO_DETAIL);
+		AddPhaseTime( "Portals and flood", Plat_FloatTime() - flStart );
 		if (noopt || leaked)
 			break;
 		if (!optimize)
@@ -320,12 +374,13 @@ void ProcessWorldModel (void)
 
 	RemoveAreaPortalBrushes_R( tree->headnode );
 
-	start = Plat_FloatTime();
+	start = flStart = Plat_FloatTime();
 	Msg("Building Faces...");
 	// this turns portals with one solid side into faces
 	// it also subdivides each face if necessary to fit max lightmap dimensions
 	MakeFaces (tree->headnode);
 	Msg("done (%d)\n", (int)(Plat_FloatTime() - start) );
+	AddPhaseTime( "Faces", Plat_FloatTime() - flStart );
 
 	if (glview)
 	{
@@ -337,10 +392,12 @@ void ProcessWorldModel (void)
 	face_t *pLeafFaceList = NULL;
 	if ( !nodetail )
 	{
+		flStart = Plat_FloatTime();
 		pLeafFaceList = MergeDetailTree( tree, brush_start, brush_end );
+		AddPhaseTime( "Detail", Plat_FloatTime() - flStart );
 	}
 
-	start = Plat_FloatTime();
+	start = flStart = Plat_FloatTime();
 
 	Msg("FixTjuncs...\n");
 	
@@ -361,6 +418,7 @@ void ProcessWorldModel (void)
 	Msg("WriteBSP...\n");
 	WriteBSP (tree->headnode, pLeafFaceList);
 	Msg("done (%d)\n", (int)(Plat_FloatTime() - start) );
+	AddPhaseTime( "FixTjuncs and WriteBSP", Plat_FloatTime() - flStart );
 
 	if (!leaked)
 	{
@@ -829,7 +887,9 @@ void ProcessModels (void)
 
 	// Clip occluder brushes against each other, 
 	// Remove them from the list of models to process below
+	float flStart = Plat_FloatTime();
 	EmitOccluderBrushes( );
+	AddPhaseTime( "Occluders", Plat_FloatTime() - flStart );
 
 	for ( entity_num=0; entity_num < num_entities; ++entity_num )
 	{
@@ -847,7 +907,9 @@ void ProcessModels (void)
 		}
 		else
 		{
+			flStart = Plat_FloatTime();
 			ProcessSubModel( );
+			AddPhaseTime( "Brush entities", Plat_FloatTime() - flStart );
 		}
 
 		EndModel ();
@@ -860,7 +922,41 @@ void ProcessModels (void)
 
 	// Turn the skybox into a cubemap in case we don't build env_cubemap textures.
 	Cubemap_CreateDefaultCubemaps();
+	flStart = Plat_FloatTime();
 	EndBSPFile ();
+	AddPhaseTime( "Props, physics and write", Plat_FloatTime() - flStart );
+}
+
+
+//-----------------------------------------------------------------------------
+// Phase timings
+//-----------------------------------------------------------------------------
+void AddPhaseTime( const char *pPhase, float flSeconds )
+{
+	FOR_EACH_VEC( s_PhaseTimes, i )
+	{
+		if ( !Q_strcmp( s_PhaseTimes[i].m_pName, pPhase ) )
+		{
+			s_PhaseTimes[i].m_flSeconds += flSeconds;
+			return;
+		}
+	}
+
+	PhaseTime_t &phase = s_PhaseTimes[s_PhaseTimes.AddToTail()];
+	phase.m_pName = pPhase;
+	phase.m_flSeconds = flSeconds;
+}
+
+void PrintPhaseTimes()
+{
+	if ( !s_PhaseTimes.Count() )
+		return;
+
+	Msg( "\nPhase timings:\n" );
+	FOR_EACH_VEC( s_PhaseTimes, i )
+	{
+		Msg( "  %-26s %8.2f seconds\n", s_PhaseTimes[i].m_pName, s_PhaseTimes[i].m_flSeconds );
+	}
 }
 
 
@@ -886,6 +982,8 @@ int RunVBSP( int argc, char **argv )
 	int		i;
 	double		start, end;
 	char		path[1024];
+	bool		bPakDeduplicate = false;
+	unsigned int	nPakAlignment = 0;
 
 	CommandLine()->CreateCmdLine( argc, argv );
 	MathLib_Init( 2.2f, 2.2f, 0.0f, OVERBRIGHT, false, false, false, false );
@@ -1111,6 +1209,22 @@ int RunVBSP( int argc, char **argv )
 		{
 			g_bKeepStaleZip = true;
 		}
+		else if ( !Q_stricmp( argv[i], "-pakdedup" ) )
+		{
+			bPakDeduplicate = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-pakalign" ) )
+		{
+			if ( ++i < argc && *argv[i] )
+			{
+				nPakAlignment = atoi( argv[i] );
+			}
+			else
+			{
+				Warning( "Error: expected an alignment in bytes after '-pakalign'\n" );
+				return -1;
+			}
+		}
 		else if ( !Q_stricmp( argv[i], "-xbox" ) )
 		{
 			// enable mandatory xbox extensions
@@ -1230,6 +1344,9 @@ int RunVBSP( int argc, char **argv )
 				"                    they don't need lightmaps.\n"
 				"  -keepstalezip   : Keep the BSP's zip files intact but regenerate everything\n"
 				"                    else.\n"
+				"  -pakdedup       : Store files with identical contents once in the pakfile.\n"
+				"  -pakalign #     : Store pakfile files uncompressed and aligned to # bytes so\n"
+				"                    they can be mapped in place.\n"
 				"  -virtualdispphysics : Use virtual (not precomputed) displacement collision models\n"
 				"  -xbox           : Enable mandatory xbox options\n"
 				"  -x360		   : Generate Xbox360 version of vsp\n"
@@ -1244,6 +1361,8 @@ int RunVBSP( int argc, char **argv )
 		CmdLib_Exit( 1 );
 	}
 
+	SetPakFileLayout( bPakDeduplicate, nPakAlignment );
+
 	// Sanity check
 	if ( *g_szEmbedDir && ( onlyents || onlyprops ) )
 	{
@@ -1277,7 +1396,6 @@ int RunVBSP( int argc, char **argv )
 	}
 
 	ThreadSetDefault ();
-	numthreads = 1;		// multiple threads aren't helping...
 
 	// Setup the logfile.
 	char logFile[512];
@@ -1392,7 +1510,9 @@ int RunVBSP( int argc, char **argv )
 			AddBufferToPak( GetPakFile(), "stale.txt", "stale", strlen( "stale" ) + 1, false );
 		}
 
+		float flStart = Plat_FloatTime();
 		LoadMapFile (name);
+		AddPhaseTime( "Load map", Plat_FloatTime() - flStart );
 		WorldVertexTransitionFixup();
 		if( ( g_nDXLevel == 0 ) || ( g_nDXLevel >= 70 ) )
 		{
@@ -1414,6 +1534,8 @@ int RunVBSP( int argc, char **argv )
 	}
 
 	end = Plat_FloatTime();
+
+	PrintPhaseTimes();
 	
 	char str[512];
 	GetHourMinuteSecondsString( (int)( end - start ), str, sizeof( str ) );
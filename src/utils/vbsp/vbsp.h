@@ -375,6 +375,10 @@ bool 	LoadMapFile( const char *pszFileName );
 int		GetVertexnum( Vector& v );
 bool Is3DSkyboxArea( int area );
 
+// Wall clock seconds spent in each compile phase, summed by name and printed at the end of the log
+void AddPhaseTime( const char *pPhase, float flSeconds );
+void PrintPhaseTimes();
+
 //=============================================================================
 
 // textures.c
@@ -0,0 +1,742 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Sidecar cache for incremental relighting.
+//
+//=============================================================================//
+
+#include "vrad.h"
+#include "lightmap.h"
+#include "lightcache.h"
+#include "packed_transfers.h"
+#include "tier1/generichash.h"
+#include "tier1/utlbuffer.h"
+#include "tier1/utlmap.h"
+
+bool g_bLightCache = false;
+
+#define LIGHTCACHE_ID		MAKEID( 'V', 'R', 'L', 'C' )
+#define LIGHTCACHE_VERSION	1
+
+// File layout:
+//		LightCacheHeader_t
+//		LightCacheBounds_t		numBrushes of them
+//		LightCacheFace_t		numFaces of them, each followed by its lighting
+//		LightCacheLight_t		numLights of them
+//		per patch: int count, transfer_t[count]		only when numPatches != 0
+struct LightCacheHeader_t
+{
+	int		id;
+	int		version;
+	uint64	settingsHash;
+	uint64	worldHash;
+	int		numBrushes;
+	int		numFaces;
+	int		numLights;
+	int		numPatches;
+};
+
+// Anything that blocks or receives light. Changing one relights everything that can see its old or new bounds.
+struct LightCacheBounds_t
+{
+	uint64	hash;
+	Vector	mins;
+	Vector	maxs;
+};
+
+// Followed by numsamples LightingValue_t for each normal of each used style
+struct LightCacheFace_t
+{
+	LightCacheBounds_t	bounds;
+	int		numsamples;			// 0 when the face didn't get lit
+	int		normalCount;
+	byte	styles[MAXLIGHTMAPS];
+};
+
+struct LightCacheLight_t
+{
+	uint64	hash;
+	Vector	origin;
+	int		type;
+};
+
+static char							s_szCacheFile[MAX_PATH];
+static uint64						s_nSettingsHash;
+static uint64						s_nWorldHash;
+
+static CUtlVector<LightCacheBounds_t>	s_Brushes;
+static CUtlVector<LightCacheBounds_t>	s_Faces;
+static CUtlVector<LightCacheLight_t>	s_Lights;
+
+// The previous compile's file, and where to find what can be reused in it
+static CUtlBuffer					s_CacheFile;
+static CUtlVector<int>				s_FaceReuse;		// offset of the face's LightCacheFace_t, -1 to relight
+static int							s_nTransferOffset = -1;
+
+int GetVisCache( int lastoffset, int cluster, byte *pvs );
+
+extern int total_transfer;
+extern int max_transfer;
+
+
+//-----------------------------------------------------------------------------
+// Hashing
+//-----------------------------------------------------------------------------
+static uint64 HashBuffer( const CUtlBuffer &buf )
+{
+	return MurmurHash64( buf.Base(), buf.TellPut(), LIGHTCACHE_VERSION );
+}
+
+static void AddPointToBounds( const Vector &v, LightCacheBounds_t &bounds )
+{
+	VectorMin( bounds.mins, v, bounds.mins );
+	VectorMax( bounds.maxs, v, bounds.maxs );
+}
+
+static void HashBrush( int iBrush, CUtlBuffer &buf, LightCacheBounds_t &bounds )
+{
+	dbrush_t *pBrush = &dbrushes[iBrush];
+
+	buf.SeekPut( CUtlBuffer::SEEK_HEAD, 0 );
+	buf.PutInt( pBrush->contents );
+
+	// vbsp always adds the axial planes, so they give us the brush's bounds
+	bounds.mins.Init( -MAX_COORD_INTEGER, -MAX_COORD_INTEGER, -MAX_COORD_INTEGER );
+	bounds.maxs.Init( MAX_COORD_INTEGER, MAX_COORD_INTEGER, MAX_COORD_INTEGER );
+
+	for ( int i = 0; i < pBrush->numsides; i++ )
+	{
+		dbrushside_t *side = &dbrushsides[pBrush->firstside + i];
+		dplane_t *plane = &dplanes[side->planenum];
+		buf.Put( &plane->normal, sizeof( Vector ) );
+		buf.PutFloat( plane->dist );
+		buf.PutInt( side->bevel );
+		buf.PutInt( ( side->texinfo >= 0 ) ? texinfo[side->texinfo].flags : 0 );
+
+		if ( plane->type < 3 )
+		{
+			if ( plane->normal[plane->type] > 0 )
+				bounds.maxs[plane->type] = plane->dist;
+			else
+				bounds.mins[plane->type] = -plane->dist;
+		}
+	}
+
+	bounds.hash = HashBuffer( buf );
+}
+
+static void HashFace( int facenum, CUtlBuffer &buf, LightCacheBounds_t &bounds )
+{
+	dface_t *f = &g_pFaces[facenum];
+	texinfo_t *tx = &texinfo[f->texinfo];
+	dtexdata_t *pTexData = &dtexdata[tx->texdata];
+	dplane_t *plane = &dplanes[f->planenum];
+
+	buf.SeekPut( CUtlBuffer::SEEK_HEAD, 0 );
+	buf.Put( &plane->normal, sizeof( Vector ) );
+	buf.PutFloat( plane->dist );
+	buf.PutChar( f->side );
+	buf.Put( &face_offset[facenum], sizeof( Vector ) );
+
+	bounds.mins.Init( COORD_EXTENT, COORD_EXTENT, COORD_EXTENT );
+	bounds.maxs.Init( -COORD_EXTENT, -COORD_EXTENT, -COORD_EXTENT );
+
+	for ( int i = 0; i < f->numedges; i++ )
+	{
+		int se = dsurfedges[f->firstedge + i];
+		int iVert = ( se < 0 ) ? dedges[-se].v[1] : dedges[se].v[0];
+		Vector v = dvertexes[iVert].point + face_offset[facenum];
+		buf.Put( &v, sizeof( v ) );
+		AddPointToBounds( v, bounds );
+	}
+
+	buf.Put( tx->textureVecsTexelsPerWorldUnits, sizeof( tx->textureVecsTexelsPerWorldUnits ) );
+	buf.Put( tx->lightmapVecsLuxelsPerWorldUnits, sizeof( tx->lightmapVecsLuxelsPerWorldUnits ) );
+	buf.PutInt( tx->flags );
+	buf.Put( &pTexData->reflectivity, sizeof( Vector ) );
+	buf.PutString( TexDataStringTable_GetString( pTexData->nameStringTableID ) );
+	buf.Put( f->m_LightmapTextureMinsInLuxels, sizeof( f->m_LightmapTextureMinsInLuxels ) );
+	buf.Put( f->m_LightmapTextureSizeInLuxels, sizeof( f->m_LightmapTextureSizeInLuxels ) );
+	buf.PutUnsignedInt( f->smoothingGroups );
+
+	float flDispHeight = 0.0f;
+	if ( f->dispinfo != -1 )
+	{
+		ddispinfo_t *pDisp = &g_dispinfo[f->dispinfo];
+		buf.Put( &pDisp->startPosition, sizeof( Vector ) );
+		buf.PutInt( pDisp->power );
+		buf.PutInt( pDisp->minTess );
+		buf.PutFloat( pDisp->smoothingAngle );
+		buf.PutInt( pDisp->contents );
+
+		for ( int i = 0; i < pDisp->NumVerts(); i++ )
+		{
+			CDispVert *pVert = &g_DispVerts[pDisp->m_iDispVertStart + i];
+			buf.Put( &pVert->m_vVector, sizeof( Vector ) );
+			buf.PutFloat( pVert->m_flDist );
+			buf.PutFloat( pVert->m_flAlpha );
+			flDispHeight = max( flDispHeight, fabs( pVert->m_flDist ) );
+		}
+	}
+
+	// a little slop so faces lying on a leaf boundary touch the leaves on both sides
+	Vector vecPad( flDispHeight + 1.0f, flDispHeight + 1.0f, flDispHeight + 1.0f );
+	bounds.mins -= vecPad;
+	bounds.maxs += vecPad;
+
+	bounds.hash = HashBuffer( buf );
+}
+
+static void HashLight( directlight_t *dl, CUtlBuffer &buf, LightCacheLight_t &light )
+{
+	// leave out anything that's an index into the bsp, those move around whenever the map changes
+	dworldlight_t wl = dl->light;
+	wl.cluster = 0;
+	wl.texinfo = 0;
+	wl.owner = 0;
+
+	buf.SeekPut( CUtlBuffer::SEEK_HEAD, 0 );
+	buf.Put( &wl, sizeof( wl ) );
+	buf.PutFloat( dl->m_flStartFadeDistance );
+	buf.PutFloat( dl->m_flEndFadeDistance );
+	buf.PutFloat( dl->m_flCapDist );
+
+	light.hash = HashBuffer( buf );
+	light.origin = dl->light.origin;
+	light.type = dl->light.type;
+}
+
+static uint64 HashWorld()
+{
+	// transfers only depend on the patches, the geometry between them and vis
+	CUtlBuffer buf;
+	buf.PutInt( g_Patches.Count() );
+	for ( int i = 0; i < s_Brushes.Count(); i++ )
+	{
+		buf.Put( &s_Brushes[i].hash, sizeof( uint64 ) );
+	}
+	for ( int i = 0; i < s_Faces.Count(); i++ )
+	{
+		buf.Put( &s_Faces[i].hash, sizeof( uint64 ) );
+	}
+	buf.PutInt( visdatasize );
+	buf.Put( dvisdata, visdatasize );
+	return HashBuffer( buf );
+}
+
+
+//-----------------------------------------------------------------------------
+// Clusters touched by a box
+//-----------------------------------------------------------------------------
+static int BoxOnDPlaneSide( const LightCacheBounds_t &bounds, const dplane_t *plane )
+{
+	Vector vecCenter = ( bounds.mins + bounds.maxs ) * 0.5f;
+	Vector vecExtents = bounds.maxs - vecCenter;
+	float flDist = DotProduct( vecCenter, plane->normal ) - plane->dist;
+	float flRadius = fabs( plane->normal.x ) * vecExtents.x + fabs( plane->normal.y ) * vecExtents.y + fabs( plane->normal.z ) * vecExtents.z;
+
+	if ( flDist > flRadius )
+		return 1;
+	if ( flDist < -flRadius )
+		return 2;
+	return 3;
+}
+
+static void MarkBoxClusters_r( int node, const LightCacheBounds_t &bounds, byte *pClusters )
+{
+	while ( node >= 0 )
+	{
+		dnode_t *pNode = &dnodes[node];
+		int side = BoxOnDPlaneSide( bounds, &dplanes[pNode->planenum] );
+		if ( side == 3 )
+		{
+			MarkBoxClusters_r( pNode->children[0], bounds, pClusters );
+			node = pNode->children[1];
+		}
+		else
+		{
+			node = pNode->children[side - 1];
+		}
+	}
+
+	int cluster = dleafs[-1 - node].cluster;
+	if ( cluster >= 0 )
+	{
+		pClusters[cluster >> 3] |= 1 << ( cluster & 7 );
+	}
+}
+
+static bool BoxTouchesClusters_r( int node, const LightCacheBounds_t &bounds, const byte *pClusters )
+{
+	while ( node >= 0 )
+	{
+		dnode_t *pNode = &dnodes[node];
+		int side = BoxOnDPlaneSide( bounds, &dplanes[pNode->planenum] );
+		if ( side == 3 )
+		{
+			if ( BoxTouchesClusters_r( pNode->children[0], bounds, pClusters ) )
+				return true;
+			node = pNode->children[1];
+		}
+		else
+		{
+			node = pNode->children[side - 1];
+		}
+	}
+
+	// solid leaves and leaves outside the world count as touched
+	int cluster = dleafs[-1 - node].cluster;
+	return ( cluster < 0 ) || ( pClusters[cluster >> 3] & ( 1 << ( cluster & 7 ) ) );
+}
+
+static void MergeClusterPVS( int cluster, byte *pAffected )
+{
+	byte pvs[MAX_MAP_CLUSTERS/8];
+	GetVisCache( -1, cluster, pvs );
+
+	for ( int i = 0; i < ( dvis->numclusters + 7 ) / 8; i++ )
+	{
+		pAffected[i] |= pvs[i];
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Loading
+//-----------------------------------------------------------------------------
+static bool UInt64LessFunc( const uint64 &lhs, const uint64 &rhs )
+{
+	return lhs < rhs;
+}
+
+// Maps each hash to its value, or to -1 when the hash shows up more than once
+static void InsertUnique( CUtlMap<uint64, int, int> &map, uint64 hash, int nValue )
+{
+	int i = map.Find( hash );
+	if ( map.IsValidIndex( i ) )
+	{
+		map[i] = -1;
+	}
+	else
+	{
+		map.Insert( hash, nValue );
+	}
+}
+
+// Pairs up lights with the same hash; whatever is left over in lights is new, changed or removed.
+static void FindUnmatchedLights( const CUtlVector<LightCacheLight_t> &lights, const CUtlVector<LightCacheLight_t> &others, CUtlVector<int> &unmatched )
+{
+	CUtlMap<uint64, int, int> counts( UInt64LessFunc );
+	for ( int i = 0; i < others.Count(); i++ )
+	{
+		int j = counts.Find( others[i].hash );
+		if ( counts.IsValidIndex( j ) )
+			counts[j]++;
+		else
+			counts.Insert( others[i].hash, 1 );
+	}
+
+	for ( int i = 0; i < lights.Count(); i++ )
+	{
+		int j = counts.Find( lights[i].hash );
+		if ( counts.IsValidIndex( j ) && counts[j] > 0 )
+			counts[j]--;
+		else
+			unmatched.AddToTail( i );
+	}
+}
+
+static bool ReadCacheFile( CUtlMap<uint64, int, int> &oldFaces, CUtlVector<LightCacheBounds_t> &oldBrushes, CUtlVector<LightCacheBounds_t> &oldFaceBounds, CUtlVector<LightCacheLight_t> &oldLights )
+{
+	if ( !g_pFileSystem->ReadFile( s_szCacheFile, NULL, s_CacheFile ) )
+	{
+		Msg( "No light cache at %s, lighting everything\n", s_szCacheFile );
+		return false;
+	}
+
+	LightCacheHeader_t header;
+	s_CacheFile.Get( &header, sizeof( header ) );
+	if ( !s_CacheFile.IsValid() || header.id != LIGHTCACHE_ID || header.version != LIGHTCACHE_VERSION )
+	{
+		Warning( "Light cache %s is invalid, lighting everything\n", s_szCacheFile );
+		return false;
+	}
+
+	if ( header.settingsHash != s_nSettingsHash )
+	{
+		Msg( "Lighting options or static props changed since %s was written, lighting everything\n", s_szCacheFile );
+		return false;
+	}
+
+	oldBrushes.SetCount( header.numBrushes );
+	s_CacheFile.Get( oldBrushes.Base(), header.numBrushes * sizeof( LightCacheBounds_t ) );
+
+	oldFaceBounds.SetCount( header.numFaces );
+	for ( int i = 0; i < header.numFaces && s_CacheFile.IsValid(); i++ )
+	{
+		int nOffset = s_CacheFile.TellGet();
+
+		LightCacheFace_t face;
+		s_CacheFile.Get( &face, sizeof( face ) );
+		oldFaceBounds[i] = face.bounds;
+
+		int nStyles = 0;
+		while ( nStyles < MAXLIGHTMAPS && face.styles[nStyles] != 255 )
+			nStyles++;
+		s_CacheFile.SeekGet( CUtlBuffer::SEEK_CURRENT, face.numsamples * face.normalCount * nStyles * sizeof( LightingValue_t ) );
+
+		InsertUnique( oldFaces, face.bounds.hash, face.numsamples ? nOffset : -1 );
+	}
+
+	oldLights.SetCount( header.numLights );
+	s_CacheFile.Get( oldLights.Base(), header.numLights * sizeof( LightCacheLight_t ) );
+
+	if ( !s_CacheFile.IsValid() )
+	{
+		Warning( "Light cache %s is truncated, lighting everything\n", s_szCacheFile );
+		return false;
+	}
+
+	if ( header.numPatches && header.numPatches == g_Patches.Count() && header.worldHash == s_nWorldHash )
+	{
+		s_nTransferOffset = s_CacheFile.TellGet();
+
+		// make sure it's all there before anything gets restored
+		for ( int i = 0; i < header.numPatches && s_CacheFile.IsValid(); i++ )
+		{
+			int nTransfers = s_CacheFile.GetInt();
+			s_CacheFile.SeekGet( CUtlBuffer::SEEK_CURRENT, nTransfers * sizeof( transfer_t ) );
+		}
+
+		if ( !s_CacheFile.IsValid() )
+		{
+			Warning( "Light cache %s has truncated transfers, rebuilding them\n", s_szCacheFile );
+			s_nTransferOffset = -1;
+		}
+	}
+
+	return true;
+}
+
+void LoadLightCache( const char *pFilename, uint64 nSettingsHash )
+{
+	V_strncpy( s_szCacheFile, pFilename, sizeof( s_szCacheFile ) );
+	s_nSettingsHash = nSettingsHash;
+
+	// hash what we have now, this is written out again at the end
+	CUtlBuffer buf;
+
+	s_Brushes.SetCount( numbrushes );
+	for ( int i = 0; i < numbrushes; i++ )
+	{
+		if ( dbrushes[i].contents & MASK_OPAQUE )
+		{
+			HashBrush( i, buf, s_Brushes[i] );
+		}
+		else
+		{
+			// doesn't block light
+			memset( &s_Brushes[i], 0, sizeof( LightCacheBounds_t ) );
+		}
+	}
+
+	s_Faces.SetCount( numfaces );
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		HashFace( i, buf, s_Faces[i] );
+	}
+
+	s_Lights.RemoveAll();
+	for ( directlight_t *dl = activelights; dl != NULL; dl = dl->next )
+	{
+		HashLight( dl, buf, s_Lights[s_Lights.AddToTail()] );
+	}
+
+	s_nWorldHash = HashWorld();
+
+	s_FaceReuse.SetCount( numfaces );
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		s_FaceReuse[i] = -1;
+	}
+
+	CUtlMap<uint64, int, int> oldFaces( UInt64LessFunc );
+	CUtlVector<LightCacheBounds_t> oldBrushes;
+	CUtlVector<LightCacheBounds_t> oldFaceBounds;
+	CUtlVector<LightCacheLight_t> oldLights;
+	if ( !ReadCacheFile( oldFaces, oldBrushes, oldFaceBounds, oldLights ) )
+	{
+		s_CacheFile.Purge();
+		return;
+	}
+
+	//
+	// anything that was added or removed dirties the clusters it touches,
+	// and every face that can see one of those clusters gets relit
+	//
+	byte dirtyClusters[MAX_MAP_CLUSTERS/8];
+	memset( dirtyClusters, 0, sizeof( dirtyClusters ) );
+
+	CUtlMap<uint64, int, int> curFaces( UInt64LessFunc );
+	for ( int i = 0; i < s_Faces.Count(); i++ )
+	{
+		InsertUnique( curFaces, s_Faces[i].hash, i );
+	}
+
+	for ( int i = 0; i < s_Faces.Count(); i++ )
+	{
+		if ( !oldFaces.IsValidIndex( oldFaces.Find( s_Faces[i].hash ) ) )
+			MarkBoxClusters_r( dmodels[0].headnode, s_Faces[i], dirtyClusters );
+	}
+
+	for ( int i = 0; i < oldFaceBounds.Count(); i++ )
+	{
+		if ( !curFaces.IsValidIndex( curFaces.Find( oldFaceBounds[i].hash ) ) )
+			MarkBoxClusters_r( dmodels[0].headnode, oldFaceBounds[i], dirtyClusters );
+	}
+
+	CUtlMap<uint64, int, int> curBrushes( UInt64LessFunc );
+	CUtlMap<uint64, int, int> prevBrushes( UInt64LessFunc );
+	for ( int i = 0; i < s_Brushes.Count(); i++ )
+	{
+		InsertUnique( curBrushes, s_Brushes[i].hash, i );
+	}
+	for ( int i = 0; i < oldBrushes.Count(); i++ )
+	{
+		InsertUnique( prevBrushes, oldBrushes[i].hash, i );
+	}
+
+	for ( int i = 0; i < s_Brushes.Count(); i++ )
+	{
+		if ( !prevBrushes.IsValidIndex( prevBrushes.Find( s_Brushes[i].hash ) ) )
+			MarkBoxClusters_r( dmodels[0].headnode, s_Brushes[i], dirtyClusters );
+	}
+
+	for ( int i = 0; i < oldBrushes.Count(); i++ )
+	{
+		if ( !curBrushes.IsValidIndex( curBrushes.Find( oldBrushes[i].hash ) ) )
+			MarkBoxClusters_r( dmodels[0].headnode, oldBrushes[i], dirtyClusters );
+	}
+
+	byte affectedClusters[MAX_MAP_CLUSTERS/8];
+	memset( affectedClusters, 0, sizeof( affectedClusters ) );
+
+	int nDirtyClusters = 0;
+	for ( int i = 0; i < dvis->numclusters; i++ )
+	{
+		if ( dirtyClusters[i >> 3] & ( 1 << ( i & 7 ) ) )
+		{
+			MergeClusterPVS( i, affectedClusters );
+			nDirtyClusters++;
+		}
+	}
+
+	//
+	// changed lights dirty everything they could reach, at both their old and new positions
+	//
+	CUtlVector<int> newLights;
+	CUtlVector<int> removedLights;
+	FindUnmatchedLights( s_Lights, oldLights, newLights );
+	FindUnmatchedLights( oldLights, s_Lights, removedLights );
+
+	CUtlVector<LightCacheLight_t> changedLights;
+	for ( int i = 0; i < newLights.Count(); i++ )
+	{
+		changedLights.AddToTail( s_Lights[newLights[i]] );
+	}
+	for ( int i = 0; i < removedLights.Count(); i++ )
+	{
+		changedLights.AddToTail( oldLights[removedLights[i]] );
+	}
+
+	for ( int i = 0; i < changedLights.Count(); i++ )
+	{
+		if ( changedLights[i].type == emit_skylight || changedLights[i].type == emit_skyambient )
+		{
+			Msg( "Sky lighting changed, relighting every face\n" );
+			return;
+		}
+
+		MergeClusterPVS( ClusterFromPoint( changedLights[i].origin ), affectedClusters );
+	}
+
+	int nReused = 0;
+	for ( int i = 0; i < s_Faces.Count(); i++ )
+	{
+		// faces that aren't unique can't be matched up
+		int iOld = oldFaces.Find( s_Faces[i].hash );
+		if ( !oldFaces.IsValidIndex( iOld ) || oldFaces[iOld] < 0 || curFaces[curFaces.Find( s_Faces[i].hash )] < 0 )
+			continue;
+
+		if ( BoxTouchesClusters_r( dmodels[0].headnode, s_Faces[i], affectedClusters ) )
+			continue;
+
+		s_FaceReuse[i] = oldFaces[iOld];
+		nReused++;
+	}
+
+	Msg( "Light cache: %d dirty clusters, %d changed lights, reusing direct lighting on %d of %d faces%s\n",
+		nDirtyClusters, changedLights.Count(), nReused, numfaces, ( s_nTransferOffset >= 0 ) ? " and all transfers" : "" );
+}
+
+
+//-----------------------------------------------------------------------------
+// Restoring
+//-----------------------------------------------------------------------------
+bool RestoreCachedFaceLight( int facenum, facelight_t *fl, int nNormalCount )
+{
+	if ( !s_FaceReuse.IsValidIndex( facenum ) || s_FaceReuse[facenum] < 0 )
+		return false;
+
+	const byte *pData = (const byte *)s_CacheFile.Base() + s_FaceReuse[facenum];
+
+	LightCacheFace_t face;
+	memcpy( &face, pData, sizeof( face ) );
+	pData += sizeof( face );
+
+	// the sample layout has to match exactly, otherwise the face gets relit
+	if ( face.numsamples != fl->numsamples || face.normalCount != nNormalCount )
+		return false;
+
+	dface_t *f = &g_pFaces[facenum];
+	int nBytes = fl->numsamples * sizeof( LightingValue_t );
+	for ( int k = 0; k < MAXLIGHTMAPS; k++ )
+	{
+		f->styles[k] = face.styles[k];
+		if ( f->styles[k] == 255 )
+			continue;
+
+		for ( int n = 0; n < nNormalCount; n++ )
+		{
+			fl->light[k][n] = ( LightingValue_t* )malloc( nBytes );
+			memcpy( fl->light[k][n], pData, nBytes );
+			pData += nBytes;
+		}
+	}
+
+	return true;
+}
+
+bool RestoreCachedTransfers()
+{
+	if ( s_nTransferOffset < 0 )
+		return false;
+
+	s_CacheFile.SeekGet( CUtlBuffer::SEEK_HEAD, s_nTransferOffset );
+
+	CUtlVector<transfer_t> transfers;
+	for ( int i = 0; i < g_Patches.Count(); i++ )
+	{
+		CPatch *patch = &g_Patches[i];
+		patch->numtransfers = s_CacheFile.GetInt();
+		if ( !patch->numtransfers )
+			continue;
+
+		if ( g_bPackTransfers )
+		{
+			transfers.SetCount( patch->numtransfers );
+			s_CacheFile.Get( transfers.Base(), patch->numtransfers * sizeof( transfer_t ) );
+			g_nPackedTransferBytes += PackPatchTransfers( THREADINDEX_MAIN, patch, transfers.Base(), patch->numtransfers );
+		}
+		else
+		{
+			patch->transfers = ( transfer_t* )calloc( 1, patch->numtransfers * sizeof( transfer_t ) );
+			if ( !patch->transfers )
+				Error ("Memory allocation failure");
+			s_CacheFile.Get( patch->transfers, patch->numtransfers * sizeof( transfer_t ) );
+		}
+
+		total_transfer += patch->numtransfers;
+		max_transfer = max( max_transfer, patch->numtransfers );
+	}
+
+	Msg( "Restored transfers from %s\n", s_szCacheFile );
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Saving
+//-----------------------------------------------------------------------------
+void SaveLightCache( bool bTransfers )
+{
+	CUtlBuffer buf;
+
+	LightCacheHeader_t header;
+	header.id = LIGHTCACHE_ID;
+	header.version = LIGHTCACHE_VERSION;
+	header.settingsHash = s_nSettingsHash;
+	header.worldHash = s_nWorldHash;
+	header.numBrushes = s_Brushes.Count();
+	header.numFaces = s_Faces.Count();
+	header.numLights = s_Lights.Count();
+	header.numPatches = bTransfers ? g_Patches.Count() : 0;
+	buf.Put( &header, sizeof( header ) );
+
+	buf.Put( s_Brushes.Base(), s_Brushes.Count() * sizeof( LightCacheBounds_t ) );
+
+	for ( int i = 0; i < s_Faces.Count(); i++ )
+	{
+		facelight_t *fl = &facelight[i];
+
+		LightCacheFace_t face;
+		memset( &face, 0, sizeof( face ) );
+		face.bounds = s_Faces[i];
+		memset( face.styles, 255, sizeof( face.styles ) );
+
+		// style 0 is always allocated on faces that got lit
+		if ( fl->light[0][0] )
+		{
+			face.numsamples = fl->numsamples;
+			while ( face.normalCount < NUM_BUMP_VECTS+1 && fl->light[0][face.normalCount] )
+				face.normalCount++;
+			memcpy( face.styles, g_pFaces[i].styles, sizeof( face.styles ) );
+		}
+
+		buf.Put( &face, sizeof( face ) );
+
+		for ( int k = 0; k < MAXLIGHTMAPS && face.styles[k] != 255; k++ )
+		{
+			for ( int n = 0; n < face.normalCount; n++ )
+			{
+				buf.Put( fl->light[k][n], face.numsamples * sizeof( LightingValue_t ) );
+			}
+		}
+	}
+
+	buf.Put( s_Lights.Base(), s_Lights.Count() * sizeof( LightCacheLight_t ) );
+
+	if ( bTransfers )
+	{
+		for ( int i = 0; i < g_Patches.Count(); i++ )
+		{
+			CPatch *patch = &g_Patches[i];
+			buf.PutInt( patch->numtransfers );
+
+			CTransferBlockIterator it( patch );
+			const transfer_t *pTransfers;
+			int nTransfers;
+			while ( ( nTransfers = it.Next( pTransfers ) ) != 0 )
+			{
+				buf.Put( pTransfers, nTransfers * sizeof( transfer_t ) );
+			}
+		}
+	}
+
+	if ( !g_pFileSystem->WriteFile( s_szCacheFile, NULL, buf ) )
+	{
+		Warning( "Unable to write light cache %s\n", s_szCacheFile );
+		return;
+	}
+
+	Msg( "Wrote light cache %s (%.1f megs)\n", s_szCacheFile, (float)buf.TellPut() / (1024*1024) );
+}
+
+void FreeLightCache()
+{
+	s_CacheFile.Purge();
+	s_FaceReuse.Purge();
+	s_Brushes.Purge();
+	s_Faces.Purge();
+	s_Lights.Purge();
+	s_nTransferOffset = -1;
+}
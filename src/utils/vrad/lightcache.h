@@ -0,0 +1,35 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Sidecar cache for incremental relighting. Direct lighting is kept
+//			per face, keyed by a hash of the face's geometry, and transfers are
+//			kept when the world hasn't changed at all. On the next compile only
+//			faces that can see changed geometry or changed lights are relit.
+//
+//=============================================================================//
+
+#ifndef LIGHTCACHE_H
+#define LIGHTCACHE_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+
+extern bool g_bLightCache;
+
+// Call after RadWorld_Start, while the direct lights still exist.
+// nSettingsHash covers every option that changes lighting; a mismatch throws away the whole cache.
+void LoadLightCache( const char *pFilename, uint64 nSettingsHash );
+
+// Thread safe. Fills in the face's styles and direct lighting if it can be reused.
+bool RestoreCachedFaceLight( int facenum, facelight_t *fl, int nNormalCount );
+
+// Returns true if every patch got its transfers back, in which case the vis matrix doesn't need building.
+bool RestoreCachedTransfers();
+
+// Call once direct lighting is done, and after MakeAllScales if there are transfers to keep.
+void SaveLightCache( bool bTransfers );
+
+void FreeLightCache();
+
+
+#endif // LIGHTCACHE_H
@@ -16,6 +16,7 @@
 #include "map_utils.h"
 #include "mathlib/halton.h"
 #include "imagepacker.h"
+#include "lightcache.h"
 #include "tier1/utlrbtree.h"
 #include "tier1/utlbuffer.h"
 #include "bitmap/tgawriter.h"
@@ -3109,9 +3110,14 @@ void BuildFacelights (int iThread, int facenum)
 	// Allocate sample positions/normals to SSE
 	int numGroups = ( fl->numsamples & 0x3) ? ( fl->numsamples / 4 ) + 1 : ( fl->numsamples / 4 );
 
-	// always allocate style 0 lightmap
-	f->styles[0] = 0;
-	AllocateLightstyleSamples( fl, 0, sampleInfo.m_NormalCount );
+	// faces nothing has changed around keep their lighting from the last compile
+	bool bCached = g_bLightCache && RestoreCachedFaceLight( facenum, fl, sampleInfo.m_NormalCount );
+	if ( !bCached )
+	{
+		// always allocate style 0 lightmap
+		f->styles[0] = 0;
+		AllocateLightstyleSamples( fl, 0, sampleInfo.m_NormalCount );
+	}
 
 	// sample the lights at each sample location
 	for ( int grp = 0; grp < numGroups; ++grp )
@@ -3142,7 +3148,10 @@ void BuildFacelights (int iThread, int facenum)
 		}
 
 		// Iterate over all the lights and add their contribution to this group of spots
-		GatherSampleLightAt4Points( sampleInfo, nSample, numSamples );
+		if ( !bCached )
+		{
+			GatherSampleLightAt4Points( sampleInfo, nSample, numSamples );
+		}
 	}
 	
 	// Tell the incremental light manager that we're done with this face.
@@ -3161,7 +3170,7 @@ void BuildFacelights (int iThread, int facenum)
 	}
 
 	// get rid of the -extra functionality on displacement surfaces
-	if (do_extra && !sampleInfo.m_IsDispFace)
+	if (do_extra && !sampleInfo.m_IsDispFace && !bCached)
 	{
 		// For each lightstyle, perform a supersampling pass
 		for ( i = 0; i < MAXLIGHTMAPS; ++i )
@@ -22,6 +22,7 @@
 #include "bsplib.h"
 #include "consolewnd.h"
 #include "vismat.h"
+#include "packed_transfers.h"
 #include "vmpi_filesystem.h"
 #include "vmpi_dispatch.h"
 #include "utllinkedlist.h"
@@ -295,7 +296,16 @@ void MPI_ReceiveVisLeafsResults( uint64 iWorkUnit, MessageBuffer *pBuf, int iWor
 		int numtransfers;
 		pBuf->read( &numtransfers, sizeof(numtransfers) );
 		patch->numtransfers = numtransfers;
-		if (numtransfers) 
+		if (numtransfers && g_bPackTransfers)
+		{
+			// the worker already packed them, results are received on the main thread
+			int nPackedBytes;
+			pBuf->read( &nPackedBytes, sizeof(nPackedBytes) );
+			patch->packedtransfers = AllocPackedTransfers( THREADINDEX_MAIN, nPackedBytes );
+			pBuf->read( patch->packedtransfers, nPackedBytes );
+			g_nPackedTransferBytes += nPackedBytes;
+		}
+		else if (numtransfers) 
 		{
 			patch->transfers = new transfer_t[numtransfers];
 			pBuf->read(patch->transfers, numtransfers * sizeof(transfer_t));
@@ -333,7 +343,16 @@ void MPI_AddPatchData( int iThread, int patchnum, CPatch *patch )
 		++pData->m_nPatchesInCluster;
 		pData->m_pVisLeafsMB->write(&patchnum, sizeof(patchnum));
 		pData->m_pVisLeafsMB->write(&patch->numtransfers, sizeof(patch->numtransfers));
-		pData->m_pVisLeafsMB->write( patch->transfers, patch->numtransfers * sizeof(transfer_t) );
+		if ( patch->packedtransfers )
+		{
+			int nPackedBytes = GetPackedTransfersSize( patch->packedtransfers, patch->numtransfers );
+			pData->m_pVisLeafsMB->write( &nPackedBytes, sizeof(nPackedBytes) );
+			pData->m_pVisLeafsMB->write( patch->packedtransfers, nPackedBytes );
+		}
+		else
+		{
+			pData->m_pVisLeafsMB->write( patch->transfers, patch->numtransfers * sizeof(transfer_t) );
+		}
 	}
 }
 
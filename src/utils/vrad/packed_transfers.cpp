@@ -0,0 +1,181 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compact transfer lists for large maps.
+//
+//=============================================================================//
+
+#include "vrad.h"
+#include "packed_transfers.h"
+
+bool	g_bPackTransfers = false;
+size_t	g_nPackedTransferBytes = 0;
+
+#define PACKED_TRANSFER_CHUNK_SIZE	( 1024 * 1024 )
+
+// Each thread allocates from its own chunks. A thread builds every patch in a
+// cluster before moving on, so the transfers of a cluster end up next to each other.
+struct PackedTransferArena_t
+{
+	CUtlVector<byte *>	m_Chunks;
+	byte				*m_pCursor;
+	int					m_nRemaining;
+};
+
+static PackedTransferArena_t g_PackedTransferArenas[MAX_TOOL_THREADS+1];
+
+
+byte *AllocPackedTransfers( int iThread, int nBytes )
+{
+	PackedTransferArena_t &arena = g_PackedTransferArenas[iThread];
+
+	if ( nBytes > PACKED_TRANSFER_CHUNK_SIZE / 4 )
+	{
+		// big lists get their own allocation so they don't waste the rest of a chunk
+		byte *pData = (byte *)malloc( nBytes );
+		if ( !pData )
+			Error ("Memory allocation failure");
+		arena.m_Chunks.AddToTail( pData );
+		return pData;
+	}
+
+	if ( nBytes > arena.m_nRemaining )
+	{
+		arena.m_pCursor = (byte *)malloc( PACKED_TRANSFER_CHUNK_SIZE );
+		if ( !arena.m_pCursor )
+			Error ("Memory allocation failure");
+		arena.m_Chunks.AddToTail( arena.m_pCursor );
+		arena.m_nRemaining = PACKED_TRANSFER_CHUNK_SIZE;
+	}
+
+	byte *pData = arena.m_pCursor;
+	arena.m_pCursor += nBytes;
+	arena.m_nRemaining -= nBytes;
+	return pData;
+}
+
+
+void FreePackedTransfers()
+{
+	for ( int i = 0; i < ARRAYSIZE( g_PackedTransferArenas ); i++ )
+	{
+		PackedTransferArena_t &arena = g_PackedTransferArenas[i];
+		for ( int j = 0; j < arena.m_Chunks.Count(); j++ )
+		{
+			free( arena.m_Chunks[j] );
+		}
+		arena.m_Chunks.Purge();
+		arena.m_pCursor = NULL;
+		arena.m_nRemaining = 0;
+	}
+
+	unsigned int uiPatchCount = g_Patches.Size();
+	for ( unsigned int i = 0; i < uiPatchCount; i++ )
+	{
+		g_Patches[i].packedtransfers = NULL;
+	}
+}
+
+
+static int VarIntSize( unsigned int n )
+{
+	int nSize = 1;
+	while ( n >= 0x80 )
+	{
+		n >>= 7;
+		nSize++;
+	}
+	return nSize;
+}
+
+
+static int __cdecl CompareTransferPatch( const void *p1, const void *p2 )
+{
+	return ((const transfer_t *)p1)->patch - ((const transfer_t *)p2)->patch;
+}
+
+
+int PackPatchTransfers( int iThread, CPatch *patch, transfer_t *pTransfers, int nTransfers )
+{
+	patch->transfers = NULL;
+	patch->packedtransfers = NULL;
+	if ( !nTransfers )
+		return 0;
+
+	// sorted indices keep the deltas small
+	qsort( pTransfers, nTransfers, sizeof( transfer_t ), CompareTransferPatch );
+
+	int nBytes = 0;
+	for ( int iBlock = 0; iBlock < nTransfers; iBlock += PACKED_TRANSFER_BLOCK_SIZE )
+	{
+		int nCount = MIN( nTransfers - iBlock, PACKED_TRANSFER_BLOCK_SIZE );
+		nBytes += PACKED_TRANSFER_HEADER_SIZE + nCount * 2;
+		for ( int i = 1; i < nCount; i++ )
+		{
+			nBytes += VarIntSize( pTransfers[iBlock+i].patch - pTransfers[iBlock+i-1].patch );
+		}
+	}
+
+	byte *p = AllocPackedTransfers( iThread, nBytes );
+	patch->packedtransfers = p;
+
+	for ( int iBlock = 0; iBlock < nTransfers; iBlock += PACKED_TRANSFER_BLOCK_SIZE )
+	{
+		const transfer_t *pBlock = pTransfers + iBlock;
+		int nCount = MIN( nTransfers - iBlock, PACKED_TRANSFER_BLOCK_SIZE );
+
+		float flScale = 0.0f;
+		for ( int i = 0; i < nCount; i++ )
+		{
+			if ( pBlock[i].transfer > flScale )
+			{
+				flScale = pBlock[i].transfer;
+			}
+		}
+
+		memcpy( p, &pBlock[0].patch, sizeof( int ) );
+		memcpy( p + sizeof( int ), &flScale, sizeof( float ) );
+		p += sizeof( int ) + sizeof( float );
+		*p++ = (byte)nCount;
+
+		for ( int i = 1; i < nCount; i++ )
+		{
+			unsigned int nDelta = pBlock[i].patch - pBlock[i-1].patch;
+			while ( nDelta >= 0x80 )
+			{
+				*p++ = (byte)( nDelta | 0x80 );
+				nDelta >>= 7;
+			}
+			*p++ = (byte)nDelta;
+		}
+
+		float flQuantize = flScale > 0.0f ? 65535.0f / flScale : 0.0f;
+		for ( int i = 0; i < nCount; i++ )
+		{
+			int nQuantized = clamp( (int)( pBlock[i].transfer * flQuantize + 0.5f ), 0, 65535 );
+			*p++ = (byte)( nQuantized & 0xFF );
+			*p++ = (byte)( nQuantized >> 8 );
+		}
+	}
+
+	Assert( p == patch->packedtransfers + nBytes );
+	return nBytes;
+}
+
+
+int GetPackedTransfersSize( const byte *pPacked, int nTransfers )
+{
+	const byte *p = pPacked;
+	while ( nTransfers > 0 )
+	{
+		p += sizeof( int ) + sizeof( float );
+		int nCount = *p++;
+		for ( int i = 1; i < nCount; i++ )
+		{
+			while ( *p++ & 0x80 )
+				;
+		}
+		p += nCount * 2;
+		nTransfers -= nCount;
+	}
+	return p - pPacked;
+}
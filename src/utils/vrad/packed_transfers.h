@@ -0,0 +1,111 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Compact transfer lists for large maps. Each patch's transfers are
+//			sorted by patch index and stored as blocks of delta coded indices
+//			and 16 bit transfers relative to the largest transfer in the block.
+//
+//=============================================================================//
+
+#ifndef PACKED_TRANSFERS_H
+#define PACKED_TRANSFERS_H
+#ifdef _WIN32
+#pragma once
+#endif
+
+
+#define PACKED_TRANSFER_BLOCK_SIZE	64
+
+// Block layout:
+//		int		first patch index
+//		float	largest transfer in the block
+//		byte	transfer count
+//		varint	patch index deltas, count - 1 of them
+//		ushort	transfers, count of them, scaled to the largest transfer
+#define PACKED_TRANSFER_HEADER_SIZE	( sizeof( int ) + sizeof( float ) + 1 )
+
+extern bool		g_bPackTransfers;
+extern size_t	g_nPackedTransferBytes;
+
+// Sorts pTransfers in place and stores them on the patch, allocated from the thread's arena.
+// Returns the number of bytes used.
+int PackPatchTransfers( int iThread, CPatch *patch, transfer_t *pTransfers, int nTransfers );
+
+// Used by MPI to move packed transfers around without repacking them.
+byte *AllocPackedTransfers( int iThread, int nBytes );
+int GetPackedTransfersSize( const byte *pPacked, int nTransfers );
+
+void FreePackedTransfers();
+
+
+//-----------------------------------------------------------------------------
+// Walks a patch's transfers a block at a time, unpacking them if they are packed.
+// Unpacked patches come back as a single block.
+//-----------------------------------------------------------------------------
+class CTransferBlockIterator
+{
+public:
+	CTransferBlockIterator( const CPatch *patch ) :
+		m_pPacked( patch->packedtransfers ), m_pTransfers( patch->transfers ), m_nRemaining( patch->numtransfers )
+	{
+	}
+
+	// Returns the number of transfers in pTransfers, 0 when there are no more.
+	int Next( const transfer_t *&pTransfers )
+	{
+		if ( m_nRemaining <= 0 )
+			return 0;
+
+		if ( !m_pPacked )
+		{
+			pTransfers = m_pTransfers;
+			int nCount = m_nRemaining;
+			m_nRemaining = 0;
+			return nCount;
+		}
+
+		const byte *p = m_pPacked;
+		int nPatch;
+		float flScale;
+		memcpy( &nPatch, p, sizeof( nPatch ) );
+		memcpy( &flScale, p + sizeof( nPatch ), sizeof( flScale ) );
+		p += sizeof( nPatch ) + sizeof( flScale );
+		int nCount = *p++;
+
+		m_Block[0].patch = nPatch;
+		for ( int i = 1; i < nCount; i++ )
+		{
+			int nDelta = 0;
+			int nShift = 0;
+			byte b;
+			do
+			{
+				b = *p++;
+				nDelta |= ( b & 0x7F ) << nShift;
+				nShift += 7;
+			} while ( b & 0x80 );
+
+			nPatch += nDelta;
+			m_Block[i].patch = nPatch;
+		}
+
+		float flDequantize = flScale * ( 1.0f / 65535.0f );
+		for ( int i = 0; i < nCount; i++, p += 2 )
+		{
+			m_Block[i].transfer = (float)( p[0] | ( p[1] << 8 ) ) * flDequantize;
+		}
+
+		m_pPacked = p;
+		m_nRemaining -= nCount;
+		pTransfers = m_Block;
+		return nCount;
+	}
+
+private:
+	const byte			*m_pPacked;
+	const transfer_t	*m_pTransfers;
+	int					m_nRemaining;
+	transfer_t			m_Block[PACKED_TRANSFER_BLOCK_SIZE];
+};
+
+
+#endif // PACKED_TRANSFERS_H
@@ -19,6 +19,13 @@
 #include "tools_minidump.h"
 #include "loadcmdline.h"
 #include "byteswap.h"
+#include "packed_transfers.h"
+#include "lightcache.h"
+#include "gamebspfile.h"
+#include "tier1/generichash.h"
+#include "tier1/utlbuffer.h"
+#include "mathlib/ssemath.h"
+#include "mathlib/compressed_vector.h"
 
 #define ALLOWDEBUGOPTIONS (0 || _DEBUG)
 
@@ -57,9 +64,12 @@ float		g_MaxDispPatchRadius = 1500.0f;			// Maximum radius allowed for displacem
 qboolean	g_bDumpPatches;
 bool	    bDumpNormals = false;
 bool		g_bDumpRtEnv = false;
+bool		g_bRayTraceCache = false;
+bool		g_bTestBVH = false;
 bool		bRed2Black = true;
 bool		g_bFastAmbient = false;
 bool        g_bNoSkyRecurse = false;
+bool		g_bFastBounce = false;
 bool		g_bDumpPropLightmaps = false;
 
 
@@ -1199,11 +1209,12 @@ void MakeTransfer( int ndxPatch1, int ndxPatch2, transfer_t *all_transfers )
 }
 
 
-void MakeScales ( int ndxPatch, transfer_t *all_transfers )
+void MakeScales ( int ndxPatch, transfer_t *all_transfers, int iThread )
 {
 	int		j;
 	float	total;
 	transfer_t	*t, *t2;
+	int		nPackedBytes = 0;
 	total = 0;
 
 	if( ndxPatch == g_Patches.InvalidIndex() )
@@ -1218,11 +1229,6 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 			max_transfer = patch->numtransfers;
 		}
 
-
-		patch->transfers = ( transfer_t* )calloc (1, patch->numtransfers * sizeof(transfer_t));
-		if (!patch->transfers)
-			Error ("Memory allocation failure");
-
 		// get total transfer energy
 		t2 = all_transfers;
 
@@ -1238,12 +1244,29 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 		else	
 			total = 1.0f/M_PI;
 
-		t = patch->transfers;
-		t2 = all_transfers;
-		for (j=0 ; j<patch->numtransfers ; j++, t++, t2++)
+		if ( g_bPackTransfers )
+		{
+			// scale in the thread's scratch list, then pack straight from it
+			t2 = all_transfers;
+			for (j=0 ; j<patch->numtransfers ; j++, t2++)
+			{
+				t2->transfer *= total;
+			}
+			nPackedBytes = PackPatchTransfers( iThread, patch, all_transfers, patch->numtransfers );
+		}
+		else
 		{
-			t->transfer = t2->transfer*total;
-			t->patch = t2->patch;
+			patch->transfers = ( transfer_t* )calloc (1, patch->numtransfers * sizeof(transfer_t));
+			if (!patch->transfers)
+				Error ("Memory allocation failure");
+
+			t = patch->transfers;
+			t2 = all_transfers;
+			for (j=0 ; j<patch->numtransfers ; j++, t++, t2++)
+			{
+				t->transfer = t2->transfer*total;
+				t->patch = t2->patch;
+			}
 		}
 		if (patch->numtransfers > max_transfer)
 		{
@@ -1258,6 +1281,7 @@ void MakeScales ( int ndxPatch, transfer_t *all_transfers )
 
 	ThreadLock ();
 	total_transfer += patch->numtransfers;
+	g_nPackedTransferBytes += nPackedBytes;
 	ThreadUnlock ();
 }
 
@@ -1532,10 +1556,43 @@ void PreGetBumpNormalsForDisp( texinfo_t *pTexinfo, Vector &vecU, Vector &vecV,
 	vecV = vecTexV;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Builds the flat normal plus the bump basis a patch gathers light into
+//-----------------------------------------------------------------------------
+static void GetPatchBumpNormals( CPatch *patch, Vector normals[NUM_BUMP_VECTS+1] )
+{
+	// Disps
+	bool bDisp = ( g_pFaces[patch->faceNumber].dispinfo != -1 ); 
+	if ( bDisp )
+	{
+		normals[0] = patch->normal;
+		texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
+		Vector vecTexU, vecTexV;
+		PreGetBumpNormalsForDisp( pTexinfo, vecTexU, vecTexV, normals[0] );
+
+		// use facenormal along with the smooth normal to build the three bump map vectors
+		GetBumpNormals( vecTexU, vecTexV, normals[0], normals[0], &normals[1] ); 
+	}
+	else
+	{
+		GetPhongNormal( patch->faceNumber, patch->origin, normals[0] );
+
+		texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
+		// use facenormal along with the smooth normal to build the three bump map vectors
+		GetBumpNormals( pTexinfo->textureVecsTexelsPerWorldUnits[0], 
+			pTexinfo->textureVecsTexelsPerWorldUnits[1], patch->normal, 
+			normals[0], &normals[1] );
+	}
+
+	// force the base lightmap to use the flat normal instead of the phong normal
+	// FIXME: why does the patch not use the phong normal?
+	normals[0] = patch->normal;
+}
+
 void GatherLight (int threadnum, void *pUserData)
 {
 	int			i, j, k;
-	transfer_t	*trans;
+	const transfer_t	*trans;
 	int			num;
 	CPatch		*patch;
 	Vector		sum, v;
@@ -1548,40 +1605,14 @@ void GatherLight (int threadnum, void *pUserData)
 
 		patch = &g_Patches[j];
 
-		trans = patch->transfers;
-		num = patch->numtransfers;
+		CTransferBlockIterator blocks( patch );
 		if ( patch->needsBumpmap )
 		{
 			Vector delta;
 			Vector bumpSum[NUM_BUMP_VECTS+1];
 			Vector normals[NUM_BUMP_VECTS+1];
 
-			// Disps
-			bool bDisp = ( g_pFaces[patch->faceNumber].dispinfo != -1 ); 
-			if ( bDisp )
-			{
-				normals[0] = patch->normal;
-				texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
-				Vector vecTexU, vecTexV;
-				PreGetBumpNormalsForDisp( pTexinfo, vecTexU, vecTexV, normals[0] );
-
-				// use facenormal along with the smooth normal to build the three bump map vectors
-				GetBumpNormals( vecTexU, vecTexV, normals[0], normals[0], &normals[1] ); 
-			}
-			else
-			{
-				GetPhongNormal( patch->faceNumber, patch->origin, normals[0] );
-
-				texinfo_t *pTexinfo = &texinfo[g_pFaces[patch->faceNumber].texinfo];
-				// use facenormal along with the smooth normal to build the three bump map vectors
-				GetBumpNormals( pTexinfo->textureVecsTexelsPerWorldUnits[0], 
-					pTexinfo->textureVecsTexelsPerWorldUnits[1], patch->normal, 
-					normals[0], &normals[1] );
-			}
-
-			// force the base lightmap to use the flat normal instead of the phong normal
-			// FIXME: why does the patch not use the phong normal?
-			normals[0] = patch->normal;
+			GetPatchBumpNormals( patch, normals );
 
 			for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
 			{
@@ -1589,33 +1620,36 @@ void GatherLight (int threadnum, void *pUserData)
 			}
 
 			float dot;
-			for (k=0 ; k<num ; k++, trans++)
+			while ( ( num = blocks.Next( trans ) ) > 0 )
 			{
-				CPatch *patch2 = &g_Patches[trans->patch];
-
-				// get vector to other patch
-				VectorSubtract (patch2->origin, patch->origin, delta);
-				VectorNormalize (delta);
-				// find light emitted from other patch
-				for(i=0; i<3; i++)
+				for (k=0 ; k<num ; k++, trans++)
 				{
-					v[i] = emitlight[trans->patch][i] * patch2->reflectivity[i];
-				}
-				// remove normal already factored into transfer steradian
-				float scale = 1.0f / DotProduct (delta, patch->normal);
-				VectorScale( v, trans->transfer * scale, v );
+					CPatch *patch2 = &g_Patches[trans->patch];
+
+					// get vector to other patch
+					VectorSubtract (patch2->origin, patch->origin, delta);
+					VectorNormalize (delta);
+					// find light emitted from other patch
+					for(i=0; i<3; i++)
+					{
+						v[i] = emitlight[trans->patch][i] * patch2->reflectivity[i];
+					}
+					// remove normal already factored into transfer steradian
+					float scale = 1.0f / DotProduct (delta, patch->normal);
+					VectorScale( v, trans->transfer * scale, v );
 				
-				Vector bumpTransfer;
-				for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
-				{
-					dot = DotProduct( delta, normals[i] );
-					if ( dot <= 0 )
+					Vector bumpTransfer;
+					for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
 					{
-//						Assert( i > 0 ); // if this hits, then the transfer shouldn't be here.  It doesn't face the flat normal of this face!
-						continue;
+						dot = DotProduct( delta, normals[i] );
+						if ( dot <= 0 )
+						{
+//							Assert( i > 0 ); // if this hits, then the transfer shouldn't be here.  It doesn't face the flat normal of this face!
+							continue;
+						}
+						bumpTransfer = v * dot;
+						VectorAdd( bumpSum[i], bumpTransfer, bumpSum[i] );
 					}
-					bumpTransfer = v * dot;
-					VectorAdd( bumpSum[i], bumpTransfer, bumpSum[i] );
 				}
 			}
 			for ( i = 0; i < NUM_BUMP_VECTS+1; i++ )
@@ -1626,14 +1660,17 @@ void GatherLight (int threadnum, void *pUserData)
 		else
 		{
 			VectorFill( sum, 0 );
-			for (k=0 ; k<num ; k++, trans++)
+			while ( ( num = blocks.Next( trans ) ) > 0 )
 			{
-				for(i=0; i<3; i++)
+				for (k=0 ; k<num ; k++, trans++)
 				{
-					v[i] = emitlight[trans->patch][i] * g_Patches[trans->patch].reflectivity[i];
+					for(i=0; i<3; i++)
+					{
+						v[i] = emitlight[trans->patch][i] * g_Patches[trans->patch].reflectivity[i];
+					}
+					VectorScale( v, trans->transfer, v );
+					VectorAdd( sum, v, sum );
 				}
-				VectorScale( v, trans->transfer, v );
-				VectorAdd( sum, v, sum );
 			}
 			VectorCopy( sum, addlight[j].light[0] );
 		}
@@ -1645,6 +1682,211 @@ void GatherLight (int threadnum, void *pUserData)
 #endif
 
 
+/*
+=============
+Bump transfer tables
+
+With -fastbounce the per-transfer bump weights, which don't change between
+bounces, are baked once after the transfers are made. Each table holds the
+shooter indices and one row of fp16 weights per bump vector, relative to a
+per-patch scale, padded to a multiple of 4 so GatherLightFromTables can
+stream them four transfers at a time.
+=============
+*/
+struct PatchBumpTable_t
+{
+	int			m_nCount;		// padded to a multiple of 4
+	int			m_nBumps;		// 1 for flat patches, NUM_BUMP_VECTS+1 for bumped ones
+	float		m_flScale;		// weights are stored relative to this
+	int			*m_pPatch;		// m_nCount shooter patch indices
+	float16		*m_pWeights;	// m_nBumps rows of m_nCount weights
+};
+
+static CUtlVector<PatchBumpTable_t>	g_PatchBumpTables;
+static CUtlVector<Vector>			g_ShootLight;		// emitlight * reflectivity for the current bounce
+static float						g_Float16ToFloat[65536];
+
+static void InitFloat16Table( void )
+{
+	for ( int i = 0; i < 65536; i++ )
+	{
+		unsigned short bits = (unsigned short)i;
+		float16 f;
+		memcpy( &f, &bits, sizeof( f ) );
+		g_Float16ToFloat[i] = f.GetFloat();
+	}
+}
+
+static void BuildPatchBumpTable( int iThread, int ndxPatch )
+{
+	CPatch *patch = &g_Patches[ndxPatch];
+	PatchBumpTable_t &table = g_PatchBumpTables[ndxPatch];
+
+	int num = patch->numtransfers;
+	table.m_nCount = ( num + 3 ) & ~3;
+	table.m_nBumps = patch->needsBumpmap ? NUM_BUMP_VECTS+1 : 1;
+	table.m_flScale = 0.0f;
+	table.m_pPatch = NULL;
+	table.m_pWeights = NULL;
+	if ( !num )
+		return;
+
+	table.m_pPatch = (int *)malloc( table.m_nCount * ( sizeof( int ) + table.m_nBumps * sizeof( float16 ) ) );
+	if ( !table.m_pPatch )
+		Error ("Memory allocation failure");
+	table.m_pWeights = (float16 *)( table.m_pPatch + table.m_nCount );
+
+	float *pWeights = (float *)calloc( table.m_nCount * table.m_nBumps, sizeof( float ) );
+	if ( !pWeights )
+		Error ("Memory allocation failure");
+
+	CTransferBlockIterator blocks( patch );
+	const transfer_t *trans;
+	int nBlock;
+	int k = 0;
+	if ( patch->needsBumpmap )
+	{
+		Vector normals[NUM_BUMP_VECTS+1];
+		GetPatchBumpNormals( patch, normals );
+
+		// same weights GatherLight computes on every bounce
+		while ( ( nBlock = blocks.Next( trans ) ) > 0 )
+		{
+			for ( int b = 0; b < nBlock; b++, k++, trans++ )
+			{
+				Vector delta;
+				VectorSubtract( g_Patches[trans->patch].origin, patch->origin, delta );
+				VectorNormalize( delta );
+
+				// remove normal already factored into transfer steradian
+				float scale = trans->transfer / DotProduct( delta, patch->normal );
+				for ( int i = 0; i < NUM_BUMP_VECTS+1; i++ )
+				{
+					float dot = DotProduct( delta, normals[i] );
+					if ( dot > 0 )
+					{
+						pWeights[i * table.m_nCount + k] = scale * dot;
+					}
+				}
+				table.m_pPatch[k] = trans->patch;
+			}
+		}
+	}
+	else
+	{
+		while ( ( nBlock = blocks.Next( trans ) ) > 0 )
+		{
+			for ( int b = 0; b < nBlock; b++, k++, trans++ )
+			{
+				pWeights[k] = trans->transfer;
+				table.m_pPatch[k] = trans->patch;
+			}
+		}
+	}
+
+	// padding reads patch 0 with a zero weight
+	for ( int k = num; k < table.m_nCount; k++ )
+	{
+		table.m_pPatch[k] = 0;
+	}
+
+	// quantize relative to the largest magnitude so small transfers keep their precision
+	for ( int k = 0; k < table.m_nCount * table.m_nBumps; k++ )
+	{
+		if ( fabs( pWeights[k] ) > table.m_flScale )
+		{
+			table.m_flScale = fabs( pWeights[k] );
+		}
+	}
+	float flInvScale = table.m_flScale > 0.0f ? 1.0f / table.m_flScale : 0.0f;
+	for ( int k = 0; k < table.m_nCount * table.m_nBumps; k++ )
+	{
+		table.m_pWeights[k].SetFloat( pWeights[k] * flInvScale );
+	}
+
+	free( pWeights );
+}
+
+void BuildBumpTransferTables( void )
+{
+	unsigned int uiPatchCount = g_Patches.Size();
+
+	InitFloat16Table();
+
+	g_PatchBumpTables.SetSize( uiPatchCount );
+	RunThreadsOnIndividual( uiPatchCount, true, BuildPatchBumpTable );
+
+	// LoadAndSwizzle reads 4 floats per vector, pad one past the end
+	g_ShootLight.SetSize( uiPatchCount + 1 );
+	memset( g_ShootLight.Base(), 0, g_ShootLight.Count() * sizeof( Vector ) );
+
+	size_t nBytes = 0;
+	for ( unsigned int i = 0; i < uiPatchCount; i++ )
+	{
+		PatchBumpTable_t &table = g_PatchBumpTables[i];
+		if ( table.m_pPatch )
+		{
+			nBytes += table.m_nCount * ( sizeof( int ) + table.m_nBumps * sizeof( float16 ) );
+		}
+	}
+	qprintf ("bump transfer tables: %5.1f megs\n", (float)nBytes / (1024*1024));
+}
+
+void FreeBumpTransferTables( void )
+{
+	for ( int i = 0; i < g_PatchBumpTables.Count(); i++ )
+	{
+		free( g_PatchBumpTables[i].m_pPatch );
+	}
+	g_PatchBumpTables.Purge();
+	g_ShootLight.Purge();
+}
+
+void GatherLightFromTables (int threadnum, void *pUserData)
+{
+	while (1)
+	{
+		int j = GetThreadWork ();
+		if (j == -1)
+			break;
+
+		PatchBumpTable_t &table = g_PatchBumpTables[j];
+
+		FourVectors sums[NUM_BUMP_VECTS+1];
+		for ( int i = 0; i < table.m_nBumps; i++ )
+		{
+			sums[i].x = sums[i].y = sums[i].z = Four_Zeros;
+		}
+
+		const int *pPatch = table.m_pPatch;
+		for ( int k = 0; k < table.m_nCount; k += 4 )
+		{
+			FourVectors shoot;
+			shoot.LoadAndSwizzle( g_ShootLight[pPatch[k]], g_ShootLight[pPatch[k+1]],
+				g_ShootLight[pPatch[k+2]], g_ShootLight[pPatch[k+3]] );
+
+			for ( int i = 0; i < table.m_nBumps; i++ )
+			{
+				const float16 *pWeights = table.m_pWeights + i * table.m_nCount + k;
+				float flWeights[4] = { g_Float16ToFloat[pWeights[0].GetBits()], g_Float16ToFloat[pWeights[1].GetBits()],
+					g_Float16ToFloat[pWeights[2].GetBits()], g_Float16ToFloat[pWeights[3].GetBits()] };
+				fltx4 weight = LoadUnalignedSIMD( flWeights );
+
+				sums[i].x = MaddSIMD( shoot.x, weight, sums[i].x );
+				sums[i].y = MaddSIMD( shoot.y, weight, sums[i].y );
+				sums[i].z = MaddSIMD( shoot.z, weight, sums[i].z );
+			}
+		}
+
+		for ( int i = 0; i < table.m_nBumps; i++ )
+		{
+			Vector sum = sums[i].Vec( 0 ) + sums[i].Vec( 1 ) + sums[i].Vec( 2 ) + sums[i].Vec( 3 );
+			VectorScale( sum, table.m_flScale, addlight[j].light[i] );
+		}
+	}
+}
+
+
 /*
 =============
 BounceLight
@@ -1706,7 +1948,19 @@ void BounceLight (void)
 		// transfer light from to the leaf patches from other patches via transfers
 		// this moves shooter->emitlight to receiver->addlight
 		unsigned int uiPatchCount = g_Patches.Size();
-		RunThreadsOn (uiPatchCount, true, GatherLight);
+		if ( g_bFastBounce )
+		{
+			// reflectivity is folded in once per shooter instead of once per transfer
+			for ( unsigned int j = 0; j < uiPatchCount; j++ )
+			{
+				g_ShootLight[j] = emitlight[j] * g_Patches[j].reflectivity;
+			}
+			RunThreadsOn (uiPatchCount, true, GatherLightFromTables);
+		}
+		else
+		{
+			RunThreadsOn (uiPatchCount, true, GatherLight);
+		}
 		// move newly received light (addlight) to light to be sent out (emitlight)
 		// start at children and pull light up to parents
 		// light is always received to leaf patches
@@ -1924,16 +2178,29 @@ void BuildFacesVisibleToLights( bool bAllVisible )
 
 void MakeAllScales (void)
 {
-	// determine visibility between patches
-	BuildVisMatrix ();
-	
-	// release visibility matrix
-	FreeVisMatrix ();
+	// an unchanged world gets its transfers back from the light cache
+	if ( !g_bLightCache || !RestoreCachedTransfers() )
+	{
+		// determine visibility between patches
+		BuildVisMatrix ();
+
+		// release visibility matrix
+		FreeVisMatrix ();
+	}
 
 	Msg("transfers %d, max %d\n", total_transfer, max_transfer );
 
-	qprintf ("transfer lists: %5.1f megs\n"
-		, (float)total_transfer * sizeof(transfer_t) / (1024*1024));
+	float flUnpackedMegs = (float)total_transfer * sizeof(transfer_t) / (1024*1024);
+	if ( g_bPackTransfers )
+	{
+		float flPackedMegs = (float)g_nPackedTransferBytes / (1024*1024);
+		Msg("packed transfer lists: %5.1f megs, %5.1f megs unpacked (%.0f%% saved)\n"
+			, flPackedMegs, flUnpackedMegs, flUnpackedMegs > 0 ? 100.0f * ( 1.0f - flPackedMegs / flUnpackedMegs ) : 0.0f );
+	}
+	else
+	{
+		qprintf ("transfer lists: %5.1f megs\n", flUnpackedMegs);
+	}
 }
 
 
@@ -2038,6 +2305,11 @@ bool RadWorld_Go()
 
 	// Figure out the offset into lightmap data for each face.
 	PrecompLightmapOffsets();
+
+	if ( g_bLightCache && numbounce == 0 )
+	{
+		SaveLightCache( false );
+	}
 	
 	// If we're doing incremental lighting, stop here.
 	if( g_pIncremental )
@@ -2069,8 +2341,28 @@ bool RadWorld_Go()
 
 			MakeAllScales ();
 
+			if ( g_bLightCache )
+			{
+				SaveLightCache( true );
+			}
+
+			if ( g_bFastBounce )
+			{
+				BuildBumpTransferTables ();
+			}
+
 			// spread light around
 			BounceLight ();
+
+			if ( g_bFastBounce )
+			{
+				FreeBumpTransferTables ();
+			}
+
+			if ( g_bPackTransfers )
+			{
+				FreePackedTransfers ();
+			}
 		}
 
 		//
@@ -2098,9 +2390,67 @@ bool RadWorld_Go()
 		Msg("FinalLightFace Done\n"); fflush(stdout);
 	}
 
+	if ( g_bLightCache )
+	{
+		FreeLightCache();
+	}
+
 	return true;
 }
 
+
+//-----------------------------------------------------------------------------
+// Everything besides the world and lights that changes direct lighting or
+// transfers. If any of it changes the light cache can't be used at all.
+//-----------------------------------------------------------------------------
+static uint64 HashLightCacheSettings()
+{
+	CUtlBuffer buf;
+	buf.PutInt( g_bHDR );
+	buf.PutInt( do_extra );
+	buf.PutInt( extrapasses );
+	buf.PutInt( do_fast );
+	buf.PutInt( do_centersamples );
+	buf.PutFloat( lightscale );
+	buf.PutFloat( dlight_threshold );
+	buf.PutFloat( coring );
+	buf.PutFloat( smoothing_threshold );
+	buf.PutFloat( luxeldensity );
+	buf.PutFloat( indirect_sun );
+	buf.PutFloat( g_flSkySampleScale );
+	buf.PutFloat( g_SunAngularExtent );
+	buf.PutFloat( g_flMaxDispSampleSize );
+	buf.PutInt( g_bLargeDispSampleRadius );
+	buf.PutInt( g_bNoSkyRecurse );
+	buf.PutInt( g_bTextureShadows );
+	buf.PutInt( g_bStaticPropPolys );
+	buf.PutInt( g_bDisablePropSelfShadowing );
+	buf.PutFloat( maxchop );
+	buf.PutFloat( minchop );
+	buf.PutFloat( dispchop );
+	buf.PutFloat( g_MaxDispPatchRadius );
+
+	// static props cast shadows but aren't tracked per face
+	GameLumpHandle_t handle = g_GameLumps.GetGameLumpHandle( GAMELUMP_STATIC_PROPS );
+	if ( handle != g_GameLumps.InvalidGameLump() && g_GameLumps.GetGameLump( handle ) )
+	{
+		buf.Put( g_GameLumps.GetGameLump( handle ), g_GameLumps.GameLumpSize( handle ) );
+	}
+
+	// neither are brush entities that cast shadows
+	for ( int i = 0; i < num_entities; i++ )
+	{
+		if ( IntForKey( &entities[i], "vrad_brush_cast_shadows" ) != 0 )
+		{
+			buf.PutString( ValueForKey( &entities[i], "model" ) );
+			buf.PutString( ValueForKey( &entities[i], "origin" ) );
+			buf.PutString( ValueForKey( &entities[i], "angles" ) );
+		}
+	}
+
+	return MurmurHash64( buf.Base(), buf.TellPut(), 0 );
+}
+
 // declare the sample file pointer -- the whole debug print system should
 // be reworked at some point!!
 FileHandle_t pFileSamples[4][4];
@@ -2130,6 +2480,40 @@ void InitDumpPatchesFiles()
 
 extern IFileSystem *g_pOriginalPassThruFileSystem;
 
+//-----------------------------------------------------------------------------
+// Restores the ray tracer's acceleration structure from <mapname>.vradrt when
+// the geometry hasn't changed, otherwise builds it and saves it there.
+//-----------------------------------------------------------------------------
+static void SetupAccelerationStructureFromCache()
+{
+	char szCacheFile[MAX_PATH];
+	Q_StripExtension( source, szCacheFile, sizeof( szCacheFile ) );
+	Q_strncat( szCacheFile, ".vradrt", sizeof( szCacheFile ), COPY_ALL_CHARACTERS );
+
+	uint64 nGeometryHash = g_RtEnv.CalculateGeometryHash();
+
+	CUtlBuffer buf;
+	if ( g_pFileSystem->ReadFile( szCacheFile, NULL, buf ) && g_RtEnv.LoadAccelerationStructure( buf, nGeometryHash ) )
+	{
+		printf( "loaded from %s... ", szCacheFile );
+		return;
+	}
+
+	g_RtEnv.SetupAccelerationStructure();
+
+#ifdef MPI
+	// the workers load the same geometry, leave writing it to the master
+	if ( g_bUseMPI && !g_bMPIMaster )
+		return;
+#endif
+	buf.Purge();
+	g_RtEnv.SaveAccelerationStructure( buf, nGeometryHash );
+	if ( !g_pFileSystem->WriteFile( szCacheFile, NULL, buf ) )
+	{
+		Warning( "Unable to write ray-trace cache %s\n", szCacheFile );
+	}
+}
+
 void VRAD_LoadBSP( char const *pFilename )
 {
 	ThreadSetDefault ();
@@ -2285,16 +2669,61 @@ void VRAD_LoadBSP( char const *pFilename )
 	// Build acceleration structure
 	printf ( "Setting up ray-trace acceleration structure... ");
 	float start = Plat_FloatTime();
-	g_RtEnv.SetupAccelerationStructure();
+	const int nBVHTestRays = 1000000;
+	int nBVHMismatches = 0;
+	if ( g_bTestBVH )
+	{
+		nBVHMismatches = g_RtEnv.SetupAccelerationStructureAndTestBVH( nBVHTestRays );
+	}
+	else if ( g_bRayTraceCache )
+	{
+		SetupAccelerationStructureFromCache();
+	}
+	else
+	{
+		g_RtEnv.SetupAccelerationStructure();
+	}
 	float end = Plat_FloatTime();
 	printf ( "Done (%.2f seconds)\n", end-start );
 
+	if ( g_bTestBVH )
+	{
+		if ( nBVHMismatches )
+		{
+			Warning( "bvh test: %d of %d rays hit differently than in the kd-tree\n", nBVHMismatches, nBVHTestRays );
+		}
+		else
+		{
+			printf( "bvh test: %d rays hit the same as in the kd-tree\n", nBVHTestRays );
+		}
+	}
+
 #if 0  // To test only k-d build
 	exit(0);
 #endif
 
 	RadWorld_Start();
 
+	// the cache only knows about a single process lighting everything
+#ifdef MPI
+	if ( g_bUseMPI )
+	{
+		g_bLightCache = false;
+	}
+#endif
+	if ( g_pIncremental )
+	{
+		g_bLightCache = false;
+	}
+
+	if ( g_bLightCache )
+	{
+		char szCacheFile[MAX_PATH];
+		Q_StripExtension( source, szCacheFile, sizeof( szCacheFile ) );
+		Q_strncat( szCacheFile, g_bHDR ? "_hdr.vradcache" : ".vradcache", sizeof( szCacheFile ), COPY_ALL_CHARACTERS );
+		LoadLightCache( szCacheFile, HashLightCacheSettings() );
+	}
+
 	// Setup incremental lighting.
 	if( g_pIncremental )
 	{
@@ -2382,6 +2811,8 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 	*onlydetail = false;
 
 	int mapArg = -1;
+	bool bPakDeduplicate = false;
+	unsigned int nPakAlignment = 0;
 
 	// default to LDR
 	SetHDRMode( false );
@@ -2507,10 +2938,50 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			do_fast = true;
 		}
+		else if (!Q_stricmp(argv[i],"-fastbounce"))
+		{
+			g_bFastBounce = true;
+		}
+		else if (!Q_stricmp(argv[i],"-packtransfers"))
+		{
+			g_bPackTransfers = true;
+		}
+		else if (!Q_stricmp(argv[i],"-bvh"))
+		{
+			g_RtEnv.Flags |= RTE_FLAGS_BVH;
+		}
+		else if (!Q_stricmp(argv[i],"-testbvh"))
+		{
+			g_bTestBVH = true;
+		}
+		else if (!Q_stricmp(argv[i],"-rtcache"))
+		{
+			g_bRayTraceCache = true;
+		}
+		else if (!Q_stricmp(argv[i],"-lightcache"))
+		{
+			g_bLightCache = true;
+		}
 		else if (!Q_stricmp(argv[i],"-noskyboxrecurse"))
 		{
 			g_bNoSkyRecurse = true;
 		}
+		else if (!Q_stricmp(argv[i],"-pakdedup"))
+		{
+			bPakDeduplicate = true;
+		}
+		else if (!Q_stricmp(argv[i],"-pakalign"))
+		{
+			if ( ++i < argc && *argv[i] )
+			{
+				nPakAlignment = atoi( argv[i] );
+			}
+			else
+			{
+				Warning("Error: expected an alignment in bytes after '-pakalign'\n" );
+				return -1;
+			}
+		}
 		else if (!Q_stricmp(argv[i],"-final"))
 		{
 			g_flSkySampleScale = 16.0;
@@ -2565,6 +3036,10 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			g_bLowPriority = true;
 		}
+		else if( !Q_stricmp( argv[i], "-noaffinity" ) )
+		{
+			g_bThreadAffinity = false;
+		}
 		else if( !Q_stricmp( argv[i], "-loghash" ) )
 		{
 			g_bLogHashData = true;
@@ -2791,6 +3266,8 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		}
 	}
 
+	SetPakFileLayout( bPakDeduplicate, nPakAlignment );
+
 	return mapArg;
 }
 
@@ -2820,6 +3297,8 @@ void PrintUsage( int argc, char **argv )
 		"  -bounce #       : Set max number of bounces (default: 100).\n"
 		"  -fast           : Quick and dirty lighting.\n"
 		"  -fastambient    : Per-leaf ambient sampling is lower quality to save compute time.\n"
+		"  -fastbounce     : Precompute fp16 bump transfer weights once so each bounce\n"
+		"                    pass is a streaming multiply-add.\n"
 		"  -final          : High quality processing. equivalent to -extrasky 16.\n"
 		"  -extrasky n     : trace N times as many rays for indirect light and sky ambient.\n"
 		"  -low            : Run as an idle-priority process.\n"
@@ -2838,9 +3317,25 @@ void PrintUsage( int argc, char **argv )
 		"  -dumptrace      : Write ray-tracing environment to debug files.\n"
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
+		"  -noaffinity     : Don't pin threads to processors when using every processor.\n"
 		"  -lights <file>  : Load a lights file in addition to lights.rad and the\n"
 		"                    level lights file.\n"
+		"  -lightcache     : Keep direct lighting and transfers in <mapname>.vradcache\n"
+		"                    and only relight faces that can see changed geometry or\n"
+		"                    lights on the next compile.\n"
 		"  -noextra        : Disable supersampling.\n"
+		"  -packtransfers  : Store bounce transfers delta coded and quantized to 16 bits.\n"
+		"                    Uses much less memory on large maps.\n"
+		"  -bvh            : Trace rays against a bounding volume hierarchy instead of a\n"
+		"                    kd-tree. Builds on all threads and is faster on large maps.\n"
+		"  -testbvh        : Build both a kd-tree and a bounding volume hierarchy, report\n"
+		"                    any random rays that hit differently in the two, then light\n"
+		"                    with the bvh.\n"
+		"  -rtcache        : Save the ray-trace acceleration structure in <mapname>.vradrt\n"
+		"                    and reuse it on the next compile if the geometry is unchanged.\n"
+		"  -pakdedup       : Store files with identical contents once in the pakfile.\n"
+		"  -pakalign #     : Store pakfile files uncompressed and aligned to # bytes so\n"
+		"                    they can be mapped in place.\n"
 		"  -debugextra     : Places debugging data in lightmaps to visualize\n"
 		"                    supersampling.\n"
 		"  -smooth #       : Set the threshold for smoothing groups, in degrees\n"
@@ -238,6 +238,7 @@ struct CPatch
 
 	int			numtransfers;
 	transfer_t	*transfers;
+	byte		*packedtransfers;		// used instead of transfers with -packtransfers, see packed_transfers.h
 
 	short		indices[3];				// displacement use these for subdivision
 };
@@ -399,7 +400,7 @@ void CreateDirectLights (void);
 void GetPhongNormal( int facenum, Vector const& spot, Vector& phongnormal );
 int LightForString( char *pLight, Vector& intensity );
 void MakeTransfer( int ndxPatch1, int ndxPatch2, transfer_t *all_transfers );
-void MakeScales( int ndxPatch, transfer_t *all_transfers );
+void MakeScales( int ndxPatch, transfer_t *all_transfers, int iThread );
 
 // Run startup code like initialize mathlib.
 void VRAD_Init();
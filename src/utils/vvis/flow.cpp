@@ -7,6 +7,11 @@
 //=============================================================================//
 #include "vis.h"
 #include "vmpi.h"
+#include "threads.h"
+#if defined( _M_IX86 ) || defined( _M_X64 ) || defined( __SSE2__ )
+#include <emmintrin.h>
+#define VIS_SSE2_BITS
+#endif
 
 int g_TraceClusterStart = -1;
 int g_TraceClusterStop = -1;
@@ -35,13 +40,52 @@ int CountBits (byte *bits, int numbits)
 	int		c;
 
 	c = 0;
-	for (i=0 ; i<numbits ; i++)
+	// whole bytes a word at a time, then the leftover bits
+	for (i=0 ; i+32<=numbits ; i+=32)
+	{
+		unsigned int v;
+		memcpy( &v, bits + (i>>3), sizeof( v ) );
+		v = v - ((v >> 1) & 0x55555555);
+		v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+		c += (((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+	}
+	for ( ; i<numbits ; i++)
 		if ( CheckBit( bits, i ) )
 			c++;
 
 	return c;
 }
 
+/*
+==============
+AndBitsTestNew
+
+out = a & b over the portal bit strings, returns true if out has any bits
+that aren't already set in vis. portalbytes is a multiple of 16.
+==============
+*/
+static inline bool AndBitsTestNew( byte *out, const byte *a, const byte *b, const byte *vis )
+{
+#ifdef VIS_SSE2_BITS
+	__m128i more = _mm_setzero_si128();
+	for ( int j = 0; j < portalbytes; j += 16 )
+	{
+		__m128i might = _mm_and_si128( _mm_loadu_si128( (const __m128i *)( a + j ) ), _mm_loadu_si128( (const __m128i *)( b + j ) ) );
+		_mm_storeu_si128( (__m128i *)( out + j ), might );
+		more = _mm_or_si128( more, _mm_andnot_si128( _mm_loadu_si128( (const __m128i *)( vis + j ) ), might ) );
+	}
+	return _mm_movemask_epi8( _mm_cmpeq_epi8( more, _mm_setzero_si128() ) ) != 0xFFFF;
+#else
+	long more = 0;
+	for ( int j = 0; j < portallongs; j++ )
+	{
+		((long *)out)[j] = ((const long *)a)[j] & ((const long *)b)[j];
+		more |= ((long *)out)[j] & ~((const long *)vis)[j];
+	}
+	return more != 0;
+#endif
+}
+
 int		c_fullskip;
 int		c_portalskip, c_leafskip;
 int		c_vistest, c_mighttest;
@@ -72,6 +116,48 @@ void CheckStack (leaf_t *leaf, threaddata_t *thread)
 }
 
 
+/*
+==============
+GetStackFrame
+
+RecursiveLeafFlow frames, one list per thread indexed by recursion depth.
+They are kept between portals so the flow never touches the allocator once
+a thread has been as deep as it needs to go, and the mightsee bits are only
+as big as the map needs instead of MAX_PORTALS on the call stack.
+==============
+*/
+static CUtlVector<pstack_t *> g_StackArenas[MAX_TOOL_THREADS+1];
+
+static pstack_t *GetStackFrame (int iThread, int depth)
+{
+	Assert( iThread >= 0 && iThread <= MAX_TOOL_THREADS );
+	CUtlVector<pstack_t *> &arena = g_StackArenas[iThread];
+	while ( arena.Count() <= depth )
+	{
+		pstack_t *frame = (pstack_t *)malloc( sizeof( pstack_t ) + portalbytes );
+		if ( !frame )
+			Error ("Out of memory. GetStackFrame: failed");
+		memset( frame, 0, sizeof( pstack_t ) );
+		frame->mightsee = (byte *)( frame + 1 );
+		frame->depth = arena.Count();
+		arena.AddToTail( frame );
+	}
+	return arena[depth];
+}
+
+void FreeStackFrames (void)
+{
+	for ( int i = 0; i < ARRAYSIZE( g_StackArenas ); i++ )
+	{
+		for ( int j = 0; j < g_StackArenas[i].Count(); j++ )
+		{
+			free( g_StackArenas[i][j] );
+		}
+		g_StackArenas[i].Purge();
+	}
+}
+
+
 winding_t *AllocStackWinding (pstack_t *stack)
 {
 	int		i;
@@ -479,12 +565,12 @@ If src_portal is NULL, this is the originating leaf
 */
 void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 {
-	pstack_t	stack;
+	pstack_t	*stack;
 	portal_t	*p;
 	plane_t		backplane;
 	leaf_t 		*leaf;
-	int			i, j;
-	long		*test, *might, *vis, more;
+	int			i;
+	byte		*test;
 	int			pnum;
 
 #ifdef MPI
@@ -504,14 +590,12 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 
 	leaf = &leafs[leafnum];
 
-	prevstack->next = &stack;
-
-	stack.next = NULL;
-	stack.leaf = leaf;
-	stack.portal = NULL;
+	stack = GetStackFrame( thread->thread, prevstack->depth + 1 );
+	prevstack->next = stack;
 
-	might = (long *)stack.mightsee;
-	vis = (long *)thread->base->portalvis;
+	stack->next = NULL;
+	stack->leaf = leaf;
+	stack->portal = NULL;
 	
 	// check all portals for flowing into other leafs	
 	for (i=0 ; i<leaf->portals.Count() ; i++)
@@ -528,19 +612,14 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		// if the portal can't see anything we haven't allready seen, skip it
 		if (p->status == stat_done)
 		{
-			test = (long *)p->portalvis;
+			test = p->portalvis;
 		}
 		else
 		{
-			test = (long *)p->portalflood;
+			test = p->portalflood;
 		}
 
-		more = 0;
-		for (j=0 ; j<portallongs ; j++)
-		{
-			might[j] = ((long *)prevstack->mightsee)[j] & test[j];
-			more |= (might[j] & ~vis[j]);
-		}
+		bool more = AndBitsTestNew( stack->mightsee, prevstack->mightsee, test, thread->base->portalvis );
 		
 		if ( !more && CheckBit( thread->base->portalvis, pnum ) )
 		{	// can't see anything new
@@ -548,15 +627,15 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		}
 
 		// get plane of portal, point normal into the neighbor leaf
-		stack.portalplane = p->plane;
+		stack->portalplane = p->plane;
 		VectorSubtract (vec3_origin, p->plane.normal, backplane.normal);
 		backplane.dist = -p->plane.dist;
 		
-		stack.portal = p;
-		stack.next = NULL;
-		stack.freewindings[0] = 1;
-		stack.freewindings[1] = 1;
-		stack.freewindings[2] = 1;
+		stack->portal = p;
+		stack->next = NULL;
+		stack->freewindings[0] = 1;
+		stack->freewindings[1] = 1;
+		stack->freewindings[2] = 1;
 		
 		float d = DotProduct (p->origin, thread->pstack_head.portalplane.normal);
 		d -= thread->pstack_head.portalplane.dist;
@@ -566,12 +645,12 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		}
 		else if (d > p->radius)
 		{
-			stack.pass = p->winding;
+			stack->pass = p->winding;
 		}
 		else	
 		{
-			stack.pass = ChopWinding (p->winding, &stack, &thread->pstack_head.portalplane);
-			if (!stack.pass)
+			stack->pass = ChopWinding (p->winding, stack, &thread->pstack_head.portalplane);
+			if (!stack->pass)
 				continue;
 		}
 
@@ -584,12 +663,12 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 		}
 		else if (d < -thread->base->radius)
 		{
-			stack.source = prevstack->source;
+			stack->source = prevstack->source;
 		}
 		else	
 		{
-			stack.source = ChopWinding (prevstack->source, &stack, &backplane);
-			if (!stack.source)
+			stack->source = ChopWinding (prevstack->source, stack, &backplane);
+			if (!stack->source)
 				continue;
 		}
 
@@ -600,23 +679,23 @@ void RecursiveLeafFlow (int leafnum, threaddata_t *thread, pstack_t *prevstack)
 			// mark the portal as visible
 			SetBit( thread->base->portalvis, pnum );
 
-			RecursiveLeafFlow (p->leaf, thread, &stack);
+			RecursiveLeafFlow (p->leaf, thread, stack);
 			continue;
 		}
 
-		stack.pass = ClipToSeperators (stack.source, prevstack->pass, stack.pass, false, &stack);
-		if (!stack.pass)
+		stack->pass = ClipToSeperators (stack->source, prevstack->pass, stack->pass, false, stack);
+		if (!stack->pass)
 			continue;
 		
-		stack.pass = ClipToSeperators (prevstack->pass, stack.source, stack.pass, true, &stack);
-		if (!stack.pass)
+		stack->pass = ClipToSeperators (prevstack->pass, stack->source, stack->pass, true, stack);
+		if (!stack->pass)
 			continue;
 
 		// mark the portal as visible
 		SetBit( thread->base->portalvis, pnum );
 
 		// flow through it for real
-		RecursiveLeafFlow (p->leaf, thread, &stack);
+		RecursiveLeafFlow (p->leaf, thread, stack);
 	}	
 }
 
@@ -631,7 +710,6 @@ generates the portalvis bit vector
 void PortalFlow (int iThread, int portalnum)
 {
 	threaddata_t	data;
-	int				i;
 	portal_t		*p;
 	int				c_might, c_can;
 
@@ -641,13 +719,14 @@ void PortalFlow (int iThread, int portalnum)
 	c_might = CountBits (p->portalflood, g_numportals*2);
 
 	memset (&data, 0, sizeof(data));
+	data.thread = iThread;
 	data.base = p;
 	
 	data.pstack_head.portal = p;
 	data.pstack_head.source = p->winding;
 	data.pstack_head.portalplane = p->plane;
-	for (i=0 ; i<portallongs ; i++)
-		((long *)data.pstack_head.mightsee)[i] = ((long *)p->portalflood)[i];
+	data.pstack_head.mightsee = GetStackFrame( iThread, 0 )->mightsee;
+	memcpy( data.pstack_head.mightsee, p->portalflood, portalbytes );
 
 	RecursiveLeafFlow (p->leaf, &data, &data.pstack_head);
 
@@ -829,8 +908,7 @@ void RecursiveLeafBitFlow (int leafnum, byte *mightsee, byte *cansee)
 {
 	portal_t	*p;
 	leaf_t 		*leaf;
-	int			i, j;
-	long		more;
+	int			i;
 	int			pnum;
 	byte		newmight[MAX_PORTALS/8];
 
@@ -847,15 +925,7 @@ void RecursiveLeafBitFlow (int leafnum, byte *mightsee, byte *cansee)
 			continue;
 
 		// if this portal can see some portals we mightsee, recurse
-		more = 0;
-		for (j=0 ; j<portallongs ; j++)
-		{
-			((long *)newmight)[j] = ((long *)mightsee)[j] 
-				& ((long *)p->portalflood)[j];
-			more |= ((long *)newmight)[j] & ~((long *)cansee)[j];
-		}
-
-		if (!more)
+		if (!AndBitsTestNew( newmight, mightsee, p->portalflood, cansee ))
 			continue;	// can't see anything new
 
 		SetBit( cansee, pnum );
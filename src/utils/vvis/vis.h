@@ -66,7 +66,8 @@ struct leaf_t
 	
 struct pstack_t
 {
-	byte		mightsee[MAX_PORTALS/8];		// bit string
+	byte		*mightsee;		// [portalbytes] bit string, stored right after the frame
+	int			depth;			// index into the thread's stack arena
 	pstack_t	*next;
 	leaf_t		*leaf;
 	portal_t	*portal;	// portal exiting
@@ -81,6 +82,7 @@ struct pstack_t
 
 struct threaddata_t
 {
+	int			thread;
 	portal_t	*base;
 	int			c_chains;
 	pstack_t	pstack_head;
@@ -113,6 +115,7 @@ void LeafFlow (int leafnum);
 void BasePortalVis (int iThread, int portalnum);
 void BetterPortalVis (int portalnum);
 void PortalFlow (int iThread, int portalnum);
+void FreeStackFrames (void);
 void WritePortalTrace( const char *source );
 
 extern	portal_t	*sorted_portals[MAX_MAP_PORTALS*2];
@@ -154,6 +154,40 @@ void SortPortals (void)
 	if (nosort)
 		return;
 	qsort (sorted_portals, g_numportals*2, sizeof(sorted_portals[0]), PComp);
+
+	// RunThreadsOnIndividual starts every thread on an equal contiguous slice of
+	// the work, so the plain sorted order would leave the last thread with all of
+	// the most expensive portals. Deal the portals out round robin instead, so
+	// every slice gets the same mix of cheap and expensive ones and still runs
+	// from least to most complex. VMPI hands out work units by their index into
+	// this order on the master and every worker, whatever their thread counts, so
+	// it has to stay in plain sorted order there.
+	if (numthreads > 1 && !g_bUseMPI)
+	{
+		int count = g_numportals*2;
+		portal_t **dealt = (portal_t **)malloc (count * sizeof(portal_t *));
+		int *filled = (int *)malloc (numthreads * sizeof(int));
+		memset (filled, 0, numthreads * sizeof(int));
+		int t = 0;
+		for (i=0 ; i<count ; i++)
+		{
+			// skip slices that are already full, they differ in size by at most one
+			int sliceStart, sliceEnd;
+			while (1)
+			{
+				sliceStart = (int)( (int64)count * t / numthreads );
+				sliceEnd = (int)( (int64)count * (t+1) / numthreads );
+				if (sliceStart + filled[t] < sliceEnd)
+					break;
+				t = (t+1) % numthreads;
+			}
+			dealt[sliceStart + filled[t]++] = sorted_portals[i];
+			t = (t+1) % numthreads;
+		}
+		free (filled);
+		memcpy (sorted_portals, dealt, count * sizeof(portal_t *));
+		free (dealt);
+	}
 }
 
 
@@ -312,6 +346,8 @@ void CalcPortalVis (void)
 	{
 		RunThreadsOnIndividual (g_numportals*2, true, PortalFlow);
 	}
+
+	FreeStackFrames ();
 }
 
 
@@ -322,6 +358,7 @@ void CalcVisTrace (void)
 	// NOTE: We only schedule the one-way portals out of the start cluster here
 	// so don't run g_numportals*2 in this case
 	RunThreadsOnIndividual (g_numportals, true, PortalFlow);
+	FreeStackFrames ();
 }
 
 /*
@@ -478,7 +515,8 @@ void LoadPortals (char *name)
 	leafbytes = ((portalclusters+63)&~63)>>3;
 	leaflongs = leafbytes/sizeof(long);
 	
-	portalbytes = ((g_numportals*2+63)&~63)>>3;
+	// padded to 128 bits for the SSE bit kernels in flow.cpp
+	portalbytes = ((g_numportals*2+127)&~127)>>3;
 	portallongs = portalbytes/sizeof(long);
 
 // each file portal is split into two memory portals
@@ -959,6 +997,10 @@ int ParseCommandLine( int argc, char **argv )
 		{
 			g_bLowPriority = true;
 		}
+		else if( !Q_stricmp( argv[i], "-noaffinity" ) )
+		{
+			g_bThreadAffinity = false;
+		}
 		else if ( !Q_stricmp( argv[i], "-FullMinidumps" ) )
 		{
 			EnableFullMinidumps( true );
@@ -1041,6 +1083,7 @@ void PrintUsage( int argc, char **argv )
 #endif
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
+		"  -noaffinity     : Don't pin threads to processors when using every processor.\n"
 		"  -nosort         : Don't sort portals (sorting is an optimization).\n"
 		"  -tmpin          : Make portals come from \\tmp\\<mapname>.\n"
 		"  -tmpout         : Make portals come from \\tmp\\<mapname>.\n"
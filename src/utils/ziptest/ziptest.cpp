@@ -0,0 +1,88 @@
+//========= Copyright Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Packs files into a pakfile in memory, reads it back and checks
+//			that every file comes out the way it went in.
+//
+// $NoKeywords: $
+//
+//=============================================================================//
+#include <stdio.h>
+#include <string.h>
+#include "tier0/platform.h"
+#include "tier1/utlbuffer.h"
+#include "zip_utils.h"
+
+#define TEST_FILE_SIZE 5000
+
+static int g_nFailures = 0;
+
+static void Check( bool bPassed, const char *pTest, int nAlignment, const char *pFileName )
+{
+	printf( "%s: %s (alignment %d, %s)\n", bPassed ? "ok" : "FAILED", pTest, nAlignment, pFileName );
+	if ( !bPassed )
+	{
+		g_nFailures++;
+	}
+}
+
+static const char *s_pFileNames[] = { "materials/a_much_longer_owner_name.vtf", "b.vtf" };
+
+static void PackIdenticalFiles( const char *pData, int nAlignment, bool bDeduplicate, CUtlBuffer &zipBuf )
+{
+	IZip *pZip = IZip::CreateZip( NULL );
+	if ( nAlignment )
+	{
+		pZip->ForceAlignment( true, true, nAlignment );
+	}
+	pZip->SetDeduplicateFiles( bDeduplicate );
+	for ( int i = 0; i < ARRAYSIZE( s_pFileNames ); i++ )
+	{
+		pZip->AddBufferToZip( s_pFileNames[i], pData, TEST_FILE_SIZE, false );
+	}
+	pZip->SaveToBuffer( zipBuf );
+	IZip::ReleaseZip( pZip );
+}
+
+//-----------------------------------------------------------------------------
+// Two identical files whose names differ in length are stored once, and the
+// shorter name is padded out to the longer one in both directory records.
+//-----------------------------------------------------------------------------
+static void TestDeduplicateNameLengths( int nAlignment )
+{
+	char data[TEST_FILE_SIZE];
+	for ( int i = 0; i < TEST_FILE_SIZE; i++ )
+	{
+		data[i] = (char)( i * 7 );
+	}
+
+	CUtlBuffer zipBuf, fullBuf;
+	PackIdenticalFiles( data, nAlignment, true, zipBuf );
+	PackIdenticalFiles( data, nAlignment, false, fullBuf );
+	Check( zipBuf.TellPut() < fullBuf.TellPut(), "identical data stored once", nAlignment, s_pFileNames[1] );
+
+	IZip *pRead = IZip::CreateZip( NULL );
+	pRead->ParseFromBuffer( zipBuf.Base(), zipBuf.TellPut() );
+	for ( int i = 0; i < ARRAYSIZE( s_pFileNames ); i++ )
+	{
+		CUtlBuffer fileBuf;
+		bool bRead = pRead->ReadFileFromZip( s_pFileNames[i], false, fileBuf );
+		Check( bRead && fileBuf.TellPut() == TEST_FILE_SIZE && !memcmp( fileBuf.Base(), data, TEST_FILE_SIZE ),
+			"deduplicated file reads back", nAlignment, s_pFileNames[i] );
+	}
+	IZip::ReleaseZip( pRead );
+}
+
+int main( int argc, char* argv[] )
+{
+	TestDeduplicateNameLengths( 0 );
+	TestDeduplicateNameLengths( 2048 );
+
+	if ( g_nFailures )
+	{
+		printf( "%d test(s) FAILED\n", g_nFailures );
+		return 1;
+	}
+
+	printf( "all tests passed\n" );
+	return 0;
+}